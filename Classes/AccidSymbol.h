@@ -15,6 +15,8 @@
 #import "MusicSymbol.h"
 #import "WhiteNote.h"
 
+@class MidiFileReader;
+
 /** Accidentals */
 enum {
     AccidNone, AccidSharp, AccidFlat, AccidNatural
@@ -34,6 +36,8 @@ enum {
 -(void)drawSharp:(int)ynote;
 -(void)drawFlat:(int)ynote;
 -(void)drawNatural:(int)ynote;
+-(id)initWithLayout:(MidiFileReader*)reader;
+-(void)appendLayout:(NSMutableData*)data;
 
 @end
 
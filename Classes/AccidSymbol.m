@@ -16,6 +16,9 @@
  */
 
 #import "AccidSymbol.h"
+#import "MidiFileReader.h"
+#import "MidiFileException.h"
+#import "ScoreCache.h"
 
 @implementation AccidSymbol
 
@@ -250,6 +253,28 @@
     [super dealloc];
 }
 
+/** Append the accidental, note, clef and width to the layout cache */
+- (void)appendLayout:(NSMutableData*)data {
+    appendInt(data, accid);
+    [whitenote appendLayout:data];
+    appendInt(data, clef);
+    appendInt(data, width);
+}
+
+/** Create an accidental from its layout (see appendLayout:) */
+- (id)initWithLayout:(MidiFileReader*)reader {
+    accid = [reader readInt];
+    whitenote = [[WhiteNote readLayout:reader] retain];
+    clef = [reader readInt];
+    width = [reader readInt];
+    if (accid < AccidSharp || accid > AccidNatural) {
+        MidiFileException *e = [MidiFileException init:@"Bad layout accidental"
+                                                offset:[reader offset]];
+        @throw e;
+    }
+    return self;
+}
+
 @end
 
 
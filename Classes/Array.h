@@ -11,8 +11,7 @@
  */
 
 #import <Foundation/NSArray.h>
-
-@class MidiNote;
+#include <stdint.h>
 
 @interface Array : NSObject {
     NSMutableArray *array;
@@ -23,11 +22,11 @@
 -(int)count;
 -(void)add:(id)object;
 -(id)get:(int)index;
--(MidiNote *)getNote:(int)index;
 -(void)set:(id)object index:(int)x;
 -(void)remove:(id)obj;
 -(void)clear;
 -(void)sort:(int(*)(void*, void*)) compare;
+-(void)sortByKeys:(const uint64_t*)keys;
 -(Array*)range:(int)start end:(int)n;
 -(Array*)filter:(BOOL(*)(id)) compare;
 -(void)addArray:(Array*)newarray;
@@ -15,6 +15,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #import "Array.h"
+#import "RadixSort.h"
 
 /* The Array class is just a convenience class, which has shorter
  * method names than NSMutableArray.
@@ -58,10 +59,6 @@
     return [array objectAtIndex:index];
 }
 
-- (MidiNote *)getNote:(int)index {
-    return (MidiNote *)[self get:index];
-}
-
 /* Set an object at the given index */
 - (void)set:(id)obj index:(int)x {
     assert(x >= 0 && x < [array count]);
@@ -79,7 +76,7 @@
 }
 
 /* Sort the array, using the given comparison function.
- * Use mergesort over quicksort In MidiFile.m, the MidiNote
+ * Use mergesort over quicksort In MidiFile.m, the MidiEvent
  * arrays are already mostly sorted, so quicksort won't work
  * well here.
  */
@@ -100,6 +97,35 @@
     free(temparray);
 } 
 
+/* Sort the array by the given keys, one per object in the current
+ * order.  This is a stable radix sort: objects with equal keys keep
+ * their order, and the objects are never compared or retained one
+ * at a time.
+ */
+- (void)sortByKeys:(const uint64_t*)keys {
+    int count = [array count];
+    if (count < 2) {
+        return;
+    }
+    int *order = (int*) malloc(sizeof(int) * count);
+    void *scratch = malloc(radixsort_scratch(count));
+    radixsort_order(keys, count, order, scratch);
+    free(scratch);
+
+    id *objects = (id*) malloc(sizeof(id) * count);
+    id *sorted = (id*) malloc(sizeof(id) * count);
+    [array getObjects:objects range:NSMakeRange(0, count)];
+    for (int i = 0; i < count; i++) {
+        sorted[i] = objects[order[i]];
+    }
+    NSMutableArray *newarray = [[NSMutableArray alloc] initWithObjects:sorted count:count];
+    [array release];
+    array = newarray;
+    free(sorted);
+    free(objects);
+    free(order);
+}
+
 
 /* Return a sub-range of the Array */
 - (Array*)range:(int)start end:(int)n {
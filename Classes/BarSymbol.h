@@ -12,12 +12,16 @@
 
 #import "MusicSymbol.h"
 
+@class MidiFileReader;
+
 @interface BarSymbol : NSObject <MusicSymbol> {
     int starttime;
     int width;
 }
 
 -(id)initWithTime:(int) starttime;
+-(id)initWithLayout:(MidiFileReader*)reader;
+-(void)appendLayout:(NSMutableData*)data;
 
 @end
 
@@ -10,6 +10,8 @@
  *  GNU General Public License for more details.
  */
 #import "BarSymbol.h"
+#import "MidiFileReader.h"
+#import "ScoreCache.h"
 
 
 /** @class BarSymbol 
@@ -86,6 +88,19 @@
     return s;
 }
 
+/** Append the start time and width to the layout cache */
+- (void)appendLayout:(NSMutableData*)data {
+    appendInt(data, starttime);
+    appendInt(data, width);
+}
+
+/** Create a bar from its layout (see appendLayout:) */
+- (id)initWithLayout:(MidiFileReader*)reader {
+    starttime = [reader readInt];
+    width = [reader readInt];
+    return self;
+}
+
 @end
 
 
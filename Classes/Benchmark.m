@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <malloc/malloc.h>
+#import <Foundation/NSAutoreleasePool.h>
+#import "MidiFile.h"
+
+/* Command-line program that measures the speed of the midi file code.
+ *
+ *   Benchmark [file.mid ...]
+ *
+ * Each benchmark runs on a large synthetic midi file, and then on each
+ * of the given files (for example, the sample songs in songs/).  The
+ * results are printed one per line, so a run before and after a change
+ * can be compared with diff.  The benchmarks take several seconds, so
+ * they are kept out of the unit tests.  Build the Benchmark target in
+ * the Release configuration before measuring.
+ */
+
+static const char *largefile = "/tmp/MidiSheetMusicBenchmark.mid";
+
+/* Return the current time, in milliseconds */
+static double now() {
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000.0 + t.tv_usec / 1000.0;
+}
+
+/* Write a single track midi file with the given number of notes, and
+ * a lyric every 8 notes, to largefile.
+ */
+static void writeLargeFile(int numnotes) {
+    int tracklen = numnotes * 8 + (numnotes / 8) * 8 + 4;
+    int len = 22 + tracklen;
+    u_char *data = (u_char*) malloc(len);
+    u_char header[] = {
+        77, 84, 104, 100, 0, 0, 0, 6, 0, 1, 0, 1, 0, 120,
+        77, 84, 114, 107,
+        (u_char)(tracklen >> 24), (u_char)(tracklen >> 16),
+        (u_char)(tracklen >> 8), (u_char)tracklen
+    };
+    memcpy(data, header, 22);
+    int offset = 22;
+    for (int i = 0; i < numnotes; i++) {
+        if (i % 8 == 0) {
+            u_char lyric[] = { 0, MetaEvent, MetaEventLyric, 4, 'l', 'a', 'l', 'a' };
+            memcpy(&data[offset], lyric, 8);
+            offset += 8;
+        }
+        u_char notes[] = { 0, EventNoteOn, 40 + i % 40, 80,
+                           10, EventNoteOff, 40 + i % 40, 0 };
+        memcpy(&data[offset], notes, 8);
+        offset += 8;
+    }
+    u_char endtrack[] = { 0, MetaEvent, MetaEventEndOfTrack, 0 };
+    memcpy(&data[offset], endtrack, 4);
+    offset += 4;
+    assert(offset == len);
+
+    int fd = open(largefile, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    assert(fd >= 0);
+    write(fd, data, len);
+    close(fd);
+    free(data);
+}
+
+/* Open and parse the file the given number of times, first with the
+ * file read into a malloc'ed buffer, then with the file memory mapped.
+ * Print the speed of each, in MB/s of midi data.
+ */
+static void benchReader(NSString *path, const char *name, int repeat) {
+    const char *modes[] = { "copy", "mmap" };
+    for (int map = 0; map < 2; map++) {
+        int len = 0;
+        double start = now();
+        for (int i = 0; i < repeat; i++) {
+            NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+            MidiFileReader *reader = [[MidiFileReader alloc] initWithFile:path
+                                                             andMap:(map == 1)];
+            len = [reader length];
+            MidiFile *midifile = [[MidiFile alloc] initWithReader:reader andFilename:path];
+            [midifile release];
+            [pool release];
+        }
+        double elapsed = now() - start;
+        double mb = (double)len * repeat / (1024.0 * 1024.0);
+        printf("read     %-40s %s %9.1f MB/s\n", name, modes[map],
+               mb / (elapsed / 1000.0));
+    }
+}
+
+/* Compare the memory used by the raw midi events, stored in the
+ * columns of a MidiEventTable, with the memory used by one MidiEvent
+ * object per event, plus a copy of each meta event value, which is
+ * how the events were stored before the MidiEventTable.  Also print
+ * the time to create the MidiEvent objects from the tables.
+ */
+static void benchEvents(NSString *path, const char *name) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    MidiFile *midifile = [[MidiFile alloc] initWithFile:path];
+    Array *tables = [midifile events];
+
+    int count = 0;
+    long tablebytes = 0;
+    for (int tracknum = 0; tracknum < [tables count]; tracknum++) {
+        MidiEventTable *table = [tables get:tracknum];
+        count += [table count];
+        tablebytes += [table memoryUsed];
+    }
+
+    long objectbytes = 0;
+    double start = now();
+    for (int tracknum = 0; tracknum < [tables count]; tracknum++) {
+        Array *events = [[tables get:tracknum] events];
+        for (int i = 0; i < [events count]; i++) {
+            MidiEvent *event = [events get:i];
+            objectbytes += malloc_size(event) + sizeof(id);
+            if (event.metalength > 0) {
+                objectbytes += malloc_good_size(event.metalength);
+            }
+        }
+    }
+    double elapsed = now() - start;
+    if (count == 0) {
+        count = 1;
+    }
+    printf("events   %-40s %8d events  table %6.1f bytes/event  "
+           "objects %6.1f bytes/event  create objects %8.2f ms\n", name, count,
+           (double)tablebytes / count, (double)objectbytes / count, elapsed);
+    [midifile release];
+    [pool release];
+}
+
+/* Create a track from a table of numnotes notes, where a tenth of the
+ * notes are held from the start until after all the other notes, and
+ * print the time per note.  Each NoteOff is matched in constant time,
+ * so the time per note should stay the same as the track grows.
+ */
+static void benchNoteOff(int numnotes) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    int held = numnotes / 10;
+    MidiEventTable *table = [MidiEventTable new:(numnotes * 2) withReader:nil];
+    for (int i = 0; i < held; i++) {
+        [table addEvent:0 status:(EventNoteOn + i % 16) data1:(i / 16) % 128
+                  data2:80 hasFlag:YES];
+    }
+    int time = 0;
+    for (int i = held; i < numnotes; i++) {
+        int channel = i % 16;
+        int notenum = (i / 16) % 128;
+        time++;
+        [table addEvent:time status:(EventNoteOn + channel) data1:notenum
+                  data2:80 hasFlag:YES];
+        [table addEvent:(time+1) status:(EventNoteOff + channel) data1:notenum
+                  data2:0 hasFlag:YES];
+    }
+    int endtime = time + 10;
+    for (int i = 0; i < held; i++) {
+        [table addEvent:endtime status:(EventNoteOff + i % 16) data1:(i / 16) % 128
+                  data2:0 hasFlag:YES];
+    }
+
+    double start = now();
+    MidiTrack *track = [[MidiTrack alloc] initWithEvents:table andTrack:0];
+    double elapsed = now() - start;
+
+    BOOL ok = ([track.notes count] == numnotes);
+    for (int i = held; ok && i < numnotes; i++) {
+        ok = ([track.notes duration:i] == 1);
+    }
+    printf("noteoff  %8d notes %7d held  %8.2f ms  %6.1f ns/note  %s\n",
+           numnotes, held, elapsed, elapsed * 1000000.0 / numnotes,
+           ok ? "ok" : "WRONG DURATIONS");
+    [track release];
+    [pool release];
+}
+
+/* A note stored as an object, the way MidiTrack stored its notes (as
+ * an Array of MidiNote) before the NoteArray.  It is only used to time
+ * the old representation against the new one.
+ */
+@interface ObjectNote : NSObject {
+    int startTime;
+    int channel;
+    int number;
+    int duration;
+}
+@property (nonatomic, assign) int startTime;
+@property (nonatomic, assign) int channel;
+@property (nonatomic, assign) int number;
+@property (nonatomic, assign) int duration;
+@end
+
+@implementation ObjectNote
+@synthesize startTime;
+@synthesize channel;
+@synthesize number;
+@synthesize duration;
+@end
+
+/* Compare two ObjectNotes by start time, then by number */
+static int sortnotes(void* v1, void* v2) {
+    ObjectNote *note1 = *(ObjectNote**) v1;
+    ObjectNote *note2 = *(ObjectNote**) v2;
+    if (note1.startTime == note2.startTime) {
+        return note1.number - note2.number;
+    }
+    return note1.startTime - note2.startTime;
+}
+
+/* Time the common operations on the notes of every track, stored as
+ * an Array of ObjectNote (before) and as a NoteArray (after):
+ * - copy: copy the notes, as MidiTrack copyWithZone does.
+ * - sort: sort the notes from reverse order by start time and number.
+ * - scan: read the start time, duration and number of every note.
+ * Each operation is repeated the given number of times.
+ */
+static void benchNotes(NSString *path, const char *name, int repeat) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    MidiFile *midifile = [[MidiFile alloc] initWithFile:path];
+    double before[3] = { 0, 0, 0 };
+    double after[3] = { 0, 0, 0 };
+    long sum = 0;
+    int total = 0;
+
+    for (int tracknum = 0; tracknum < [midifile.tracks count]; tracknum++) {
+        NoteArray *notes = [(MidiTrack*)[midifile.tracks get:tracknum] notes];
+        NoteView v = [notes view];
+        total += v.count;
+
+        /* Create both copies of the notes, in reverse order */
+        Array *objects = [Array new:v.count];
+        NoteArray *reversed = [NoteArray new:v.count];
+        for (int i = v.count - 1; i >= 0; i--) {
+            ObjectNote *note = [[ObjectNote alloc] init];
+            note.startTime = v.starttime[i];
+            note.channel = v.channel[i];
+            note.number = v.number[i];
+            note.duration = v.duration[i];
+            [objects add:note];
+            [note release];
+            [reversed addNote:i from:notes];
+        }
+
+        for (int r = 0; r < repeat; r++) {
+            NSAutoreleasePool *inner = [[NSAutoreleasePool alloc] init];
+            double start = now();
+            Array *copy1 = [Array new:[objects count]];
+            for (int i = 0; i < [objects count]; i++) {
+                ObjectNote *note = [objects get:i];
+                ObjectNote *n = [[ObjectNote alloc] init];
+                n.startTime = note.startTime;
+                n.channel = note.channel;
+                n.number = note.number;
+                n.duration = note.duration;
+                [copy1 add:n];
+                [n release];
+            }
+            double t1 = now();
+            [copy1 sort:sortnotes];
+            double t2 = now();
+            for (int i = 0; i < [copy1 count]; i++) {
+                ObjectNote *note = [copy1 get:i];
+                sum += note.startTime + note.duration + note.number;
+            }
+            double t3 = now();
+            before[0] += t1 - start;
+            before[1] += t2 - t1;
+            before[2] += t3 - t2;
+
+            start = now();
+            NoteArray *copy2 = [reversed copy];
+            t1 = now();
+            [copy2 sortByTime];
+            t2 = now();
+            NoteView c = [copy2 view];
+            for (int i = 0; i < c.count; i++) {
+                sum += c.starttime[i] + c.duration[i] + c.number[i];
+            }
+            t3 = now();
+            after[0] += t1 - start;
+            after[1] += t2 - t1;
+            after[2] += t3 - t2;
+            [inner release];
+        }
+    }
+
+    const char *ops[] = { "copy", "sort", "scan" };
+    for (int op = 0; op < 3; op++) {
+        printf("notes    %-40s %8d notes  %s  objects %9.3f ms  notearray %9.3f ms  %6.1fx\n",
+               name, total, ops[op], before[op] / repeat, after[op] / repeat,
+               (after[op] > 0) ? before[op] / after[op] : 0.0);
+    }
+    if (sum == 42) {
+        printf("\n");  /* Keep the scans from being optimized away */
+    }
+    [midifile release];
+    [pool release];
+}
+
+/* Run the benchmarks for a single midi file */
+static void benchFile(NSString *path, const char *name, int repeat) {
+    benchReader(path, name, repeat);
+    benchEvents(path, name);
+    benchNotes(path, name, repeat);
+}
+
+int main(int argc, char **argv) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+    writeLargeFile(200000);
+    NSString *large = [NSString stringWithCString:largefile
+                                encoding:NSUTF8StringEncoding];
+    benchFile(large, "synthetic-200000-notes", 10);
+    unlink(largefile);
+    for (int numnotes = 125000; numnotes <= 1000000; numnotes *= 2) {
+        benchNoteOff(numnotes);
+    }
+
+    for (int i = 1; i < argc; i++) {
+        NSString *path = [NSString stringWithCString:argv[i]
+                                   encoding:NSUTF8StringEncoding];
+        const char *name = [[path lastPathComponent] UTF8String];
+        @try {
+            benchFile(path, name, 100);
+        }
+        @catch (NSException *e) {
+            printf("%s: %s\n", name, [[e reason] UTF8String]);
+        }
+    }
+    [pool release];
+    return 0;
+}
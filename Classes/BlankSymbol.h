@@ -12,12 +12,16 @@
 
 #import "MusicSymbol.h"
 
+@class MidiFileReader;
+
 @interface BlankSymbol : NSObject <MusicSymbol> {
     int starttime; 
     int width;
 };
 
 -(id)initWithTime:(int)starttime andWidth:(int)width;
+-(id)initWithLayout:(MidiFileReader*)reader;
+-(void)appendLayout:(NSMutableData*)data;
 
 @end
 
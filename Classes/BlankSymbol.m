@@ -11,6 +11,8 @@
  */
 
 #import "BlankSymbol.h"
+#import "MidiFileReader.h"
+#import "ScoreCache.h"
 
 /** @class BlankSymbol 
  * The Blank symbol is a music symbol that doesn't draw anything.  This
@@ -79,5 +81,18 @@
     return s;
 }
 
+/** Append the start time and width to the layout cache */
+- (void)appendLayout:(NSMutableData*)data {
+    appendInt(data, starttime);
+    appendInt(data, width);
+}
+
+/** Create a blank symbol from its layout (see appendLayout:) */
+- (id)initWithLayout:(MidiFileReader*)reader {
+    starttime = [reader readInt];
+    width = [reader readInt];
+    return self;
+}
+
 @end
 
@@ -13,6 +13,7 @@
 #import "MusicSymbol.h"
 #import "WhiteNote.h"
 #import "TimeSignature.h"
+#import "MeasureMap.h"
 #import "KeySignature.h"
 #import "AccidSymbol.h"
 #import "Stem.h"
@@ -49,10 +50,16 @@ int sortChordSymbol(id chord1, id chord2, void *unused);
 @property (nonatomic, readonly) BOOL hasTwoStems;
 @property (nonatomic, readonly) Stem *stem;
 
--(id)initWithNotes:(Array*)notes andKey:(KeySignature*)key
+-(id)initWithNotes:(NoteView)notes andKey:(KeySignature*)key
      andTime: (TimeSignature*)time andClef:(int)c andSheet:(void*)s;
--(void) createNoteData:(Array*)notes withKey:(KeySignature*)key
-               andTime:(TimeSignature*)time;
+-(id)initWithNotes:(NoteView)notes andKey:(KeySignature*)key
+     andTime: (TimeSignature*)time andMeasure:(int)measure
+     andClef:(int)c andSheet:(void*)s;
+-(id)initWithNotes:(NoteView)notes whiteNotes:(WhiteNote**)whitenotes
+     accidentals:(int*)accids andTime:(TimeSignature*)time
+     andClef:(int)c andSheet:(void*)s;
+-(void) createNoteData:(NoteView)notes withWhiteNotes:(WhiteNote**)whitenotes
+               accidentals:(int*)accids andTime:(TimeSignature*)time;
 
 -(void)createAccidSymbols;
 +(int)stemDirection:(WhiteNote*)bottom withTop:(WhiteNote*)top andClef:(int)clef;
@@ -64,9 +71,13 @@ int sortChordSymbol(id chord1, id chord2, void *unused);
 
 +(BOOL)canCreateBeams:(Array*)chords withTime:(TimeSignature*)time 
        onBeat:(BOOL)startQuarter; 
++(BOOL)canCreateBeams:(Array*)chords withMeasures:(MeasureMap*)map 
+       onBeat:(BOOL)startQuarter; 
 +(void)createBeam:(Array*)chords withSpacing:(int)spacing; 
 +(void)bringStemsCloser:(Array*)chords;
 +(void)lineUpStemEnds:(Array*)chords;
+-(id)initWithLayout:(MidiFileReader*)reader andSheet:(void*)s;
+-(void)appendLayout:(NSMutableData*)data;
 
 @end
 
@@ -11,6 +11,9 @@
  */
 
 #import "ChordSymbol.h"
+#import "MidiFileReader.h"
+#import "MidiFileException.h"
+#import "ScoreCache.h"
 #import "ClefSymbol.h"
 #import "SheetMusic.h"
 
@@ -33,37 +36,73 @@ static const char* s2c(id obj) {
 @implementation ChordSymbol
 
 
-/** Create a new Chord Symbol from the given list of midi notes.
+/** Create a new Chord Symbol from the given view of midi notes.
  * All the midi notes will have the same start time.  Use the
  * key signature to get the white key and accidental symbol for
  * each note.  Use the time signature to calculate the duration
  * of the notes. Use the clef when drawing the chord.
  */
-- (id)initWithNotes:(Array*)midinotes andKey:(KeySignature*)key
+- (id)initWithNotes:(NoteView)midinotes andKey:(KeySignature*)key
      andTime:(TimeSignature*)time andClef:(int)c andSheet:(void*)s {
 
+    return [self initWithNotes:midinotes andKey:key andTime:time
+                 andMeasure:(midinotes.starttime[0] / time.measure)
+                 andClef:c andSheet:s];
+}
+
+/** Same as above, but the measure number of the chord is given,
+ * for songs where the measure length changes.  The measure is used
+ * to determine the accidentals.
+ */
+- (id)initWithNotes:(NoteView)midinotes andKey:(KeySignature*)key
+     andTime:(TimeSignature*)time andMeasure:(int)measure
+     andClef:(int)c andSheet:(void*)s {
+
+    WhiteNote *whitenotes[20];
+    int accids[20];
+    int count = midinotes.count;
+    if (count > 20) {
+        count = 20;
+    }
+    for (int i = 0; i < count; i++) {
+        whitenotes[i] = [key getWhiteNote:midinotes.number[i]];
+        accids[i] = [key getAccidentalForNote:midinotes.number[i] andMeasure:measure];
+    }
+    return [self initWithNotes:midinotes whiteNotes:whitenotes accidentals:accids
+                 andTime:time andClef:c andSheet:s];
+}
+
+/** Create a new Chord Symbol from notes that are already spelled:
+ * whitenotes[i] and accids[i] are the white note and accidental of
+ * the i-th note, as returned by KeySignature spellNotes.
+ */
+- (id)initWithNotes:(NoteView)midinotes whiteNotes:(WhiteNote**)whitenotes
+     accidentals:(int*)accids andTime:(TimeSignature*)time
+     andClef:(int)c andSheet:(void*)s {
+
     int i;
 
     hasTwoStems = NO;
     clef = c;
     sheetmusic = s;
 
-	MidiNote *midinote = [midinotes get:0];
-    starttime = midinote.startTime;
-    endtime = midinote.endTime;
-    for (i = 0; i < [midinotes count]; i++) {
+    assert(midinotes.count > 0);
+    starttime = midinotes.starttime[0];
+    endtime = starttime + midinotes.duration[0];
+    for (i = 0; i < midinotes.count; i++) {
         if (i > 1) {
             /* notes should already be sorted in increasing order (by number) */
-            assert([[midinotes get:i] number] >= [[midinotes get:i-1] number]);
+            assert(midinotes.number[i] >= midinotes.number[i-1]);
         }
-        endtime = max(endtime, [(MidiNote *)[midinotes get:i] endTime]);
+        endtime = max(endtime, midinotes.starttime[i] + midinotes.duration[i]);
     }
 
-    notedata_len = [midinotes count];
+    notedata_len = midinotes.count;
     if (notedata_len > 20) {
         notedata_len = 20;
     }
-    [self createNoteData:midinotes withKey:key andTime:time];
+    [self createNoteData:midinotes withWhiteNotes:whitenotes accidentals:accids
+                 andTime:time];
     [self createAccidSymbols];
 
     /* Find out how many stems we need (1 or 2) */
@@ -149,28 +188,27 @@ static const char* s2c(id obj) {
  * overlap (like A and B) you cannot draw the next note directly above it.
  * Instead you must shift one of the notes to the right.
  *
- * The KeySignature is used to determine the white key and accidental.
+ * The white keys and accidentals are given, from the KeySignature.
  * The TimeSignature is used to determine the duration.
  */
-- (void)createNoteData:(Array*)midinotes withKey:(KeySignature*)key
-       andTime:(TimeSignature*)time {
+- (void)createNoteData:(NoteView)midinotes withWhiteNotes:(WhiteNote**)whitenotes
+       accidentals:(int*)accids andTime:(TimeSignature*)time {
 
     memset(notedata, 0, sizeof(NoteData) * 20);
-    notedata_len = [midinotes count];
+    notedata_len = midinotes.count;
     if (notedata_len > 20) {
         notedata_len = 20;
     }
     NoteData *prev = NULL;
 
     for (int i = 0; i < notedata_len; i++) {
-        MidiNote *midi = [midinotes get:i];
+        int number = midinotes.number[i];
         NoteData *note = &(notedata[i]);
-        note->number = midi.number;
+        note->number = number;
         note->leftside = YES;
-        note->whitenote = [[key getWhiteNote:midi.number] retain];
-        note->duration = [time getNoteDuration:(midi.endTime - midi.startTime)];
-        note->accid = [key getAccidentalForNote:midi.number 
-                                 andMeasure:(midi.startTime / time.measure)];
+        note->whitenote = [whitenotes[i] retain];
+        note->duration = [time getNoteDuration:midinotes.duration[i]];
+        note->accid = accids[i];
 
         if (i > 0 && ( ( [note->whitenote dist:prev->whitenote]) == 1)) {
             /* This note overlaps with the previous note.
@@ -741,6 +779,17 @@ static const char* s2c(id obj) {
  * (only applies to 2-chord beams).
  */
 +(BOOL)canCreateBeams:(Array*)chords withTime:(TimeSignature*)time onBeat:(BOOL)startQuarter {
+    MeasureMap *map = [[MeasureMap alloc] initWithTime:time];
+    BOOL result = [ChordSymbol canCreateBeams:chords withMeasures:map onBeat:startQuarter];
+    [map release];
+    return result;
+}
+
+/** Same as above, but use the time signature of the measure the
+ * first chord is in.  The beats are counted from the start of that
+ * measure.
+ */
++(BOOL)canCreateBeams:(Array*)chords withMeasures:(MeasureMap*)map onBeat:(BOOL)startQuarter {
 
     int numChords = [chords count];
     ChordSymbol *chord0 = [chords get:0];
@@ -749,7 +798,9 @@ static const char* s2c(id obj) {
     if (firstStem == nil || lastStem == nil) {
         return NO;
     }
-    int measure = chord0.startTime / time.measure;
+    TimeSignature *time = [map timeAtTime:chord0.startTime];
+    int measure = [map measureForTime:chord0.startTime];
+    int offset = chord0.startTime - [map startOfMeasure:measure];
     NoteDuration dur = firstStem.duration;
     NoteDuration dur2 = lastStem.duration;
 
@@ -780,7 +831,7 @@ static const char* s2c(id obj) {
         if (time.numerator == 6 && time.denominator == 4) {
             /* first chord must start at 1st or 4th quarter note */
             int beat = time.quarter * 3;
-            if (( chord0.startTime % beat) > time.quarter/6) {
+            if ((offset % beat) > time.quarter/6) {
                 return NO;
             }
         }
@@ -806,7 +857,7 @@ static const char* s2c(id obj) {
             beat = time.quarter / 2;
         }
 
-        if ((chord0.startTime % beat) > time.quarter/6) {
+        if ((offset % beat) > time.quarter/6) {
             return NO;
         }
     }
@@ -824,14 +875,14 @@ static const char* s2c(id obj) {
             /* In 12/8 time, chord must start on 3*8th beat */
             beat = time.quarter/2 * 3;
         }
-        if ((chord0.startTime % beat) > time.quarter/6) {
+        if ((offset % beat) > time.quarter/6) {
             return NO;
         }
     }
     else if (numChords == 2) {
         if (startQuarter) {
             int beat = time.quarter;
-            if ((chord0.startTime % beat) > time.quarter/6) {
+            if ((offset % beat) > time.quarter/6) {
                 return NO;
             }
         }
@@ -839,7 +890,7 @@ static const char* s2c(id obj) {
 
     for (int i = 0; i < numChords; i++) {
         ChordSymbol *chord = [chords get:i];
-        if ((chord.startTime / time.measure) != measure) {
+        if ([map measureForTime:chord.startTime] != measure) {
             return NO;
         }
         if (chord.stem == nil) {
@@ -1114,6 +1165,69 @@ static const char* s2c(id obj) {
     [super dealloc];
 }
 
+/** Append this chord to the layout cache: the clef, times and width,
+ *  the note data, and the stems (without their pairs).  The
+ *  accidental symbols are created again from the note data.
+ */
+- (void)appendLayout:(NSMutableData*)data {
+    appendInt(data, clef);
+    appendInt(data, starttime);
+    appendInt(data, endtime);
+    appendInt(data, width);
+    appendInt(data, hasTwoStems);
+    appendInt(data, notedata_len);
+    for (int i = 0; i < notedata_len; i++) {
+        NoteData *note = &(notedata[i]);
+        appendInt(data, note->number);
+        [note->whitenote appendLayout:data];
+        appendInt(data, note->duration);
+        appendInt(data, note->leftside);
+        appendInt(data, note->accid);
+    }
+    appendInt(data, stem1 != nil);
+    [stem1 appendLayout:data];
+    appendInt(data, stem2 != nil);
+    [stem2 appendLayout:data];
+}
+
+/** Create a chord from its layout (see appendLayout:) */
+- (id)initWithLayout:(MidiFileReader*)reader andSheet:(void*)s {
+    sheetmusic = s;
+    clef = [reader readInt];
+    starttime = [reader readInt];
+    endtime = [reader readInt];
+    width = [reader readInt];
+    hasTwoStems = [reader readInt] != 0;
+    int len = [reader readInt];
+    if ((clef != Clef_Treble && clef != Clef_Bass) || len <= 0 || len > 20) {
+        MidiFileException *e = [MidiFileException init:@"Bad layout chord"
+                                                offset:[reader offset]];
+        @throw e;
+    }
+    memset(notedata, 0, sizeof(NoteData) * 20);
+    for (notedata_len = 0; notedata_len < len; notedata_len++) {
+        NoteData *note = &(notedata[notedata_len]);
+        note->number = [reader readInt];
+        note->whitenote = [[WhiteNote readLayout:reader] retain];
+        note->duration = [reader readInt];
+        note->leftside = [reader readInt] != 0;
+        note->accid = [reader readInt];
+        if (note->accid < AccidNone || note->accid > AccidNatural) {
+            MidiFileException *e = [MidiFileException init:@"Bad layout chord"
+                                                    offset:[reader offset]];
+            @throw e;
+        }
+    }
+    [self createAccidSymbols];
+    if ([reader readInt] != 0) {
+        stem1 = [[Stem alloc] initWithLayout:reader];
+    }
+    if ([reader readInt] != 0) {
+        stem2 = [[Stem alloc] initWithLayout:reader];
+    }
+    return self;
+}
+
 
 @end
 
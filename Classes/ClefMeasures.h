@@ -12,15 +12,18 @@
 #import <Foundation/NSObject.h>
 #import "Array.h"
 #import "IntArray.h"
+#import "NoteArray.h"
+#import "MeasureMap.h"
 
 @interface ClefMeasures : NSObject {
-    IntArray* clefs;  /** The clefs used for each measure (for a single track) */
-    int measure;      /** The length of a measure, in pulses */
+    IntArray* clefs;        /** The clefs used for each measure (for a single track) */
+    MeasureMap *measures;   /** The start time of each measure */
 }
 
--(id)initWithNotes:(Array*)notes andMeasure:(int)measurelen;
+-(id)initWithNotes:(NoteArray*)notes andMeasure:(int)measurelen;
+-(id)initWithNotes:(NoteArray*)notes andMeasures:(MeasureMap*)map;
 -(int)getClef:(int)starttime;
--(int)mainClef:(Array*)notes;
+-(int)mainClef:(NoteArray*)notes;
 -(void)dealloc;
 
 @end
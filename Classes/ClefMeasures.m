@@ -26,21 +26,32 @@
  * @param notes  The midi notes
  * @param measurelen The length of a measure, in pulses
  */
-- (id)initWithNotes:(Array*)notes andMeasure:(int)measurelen {
-    measure = measurelen;
-    int mainclef = [self mainClef:notes];
-    int nextmeasure = measurelen;
+- (id)initWithNotes:(NoteArray*)notes andMeasure:(int)measurelen {
+    MeasureMap *map = [[MeasureMap alloc] initWithMeasure:measurelen];
+    self = [self initWithNotes:notes andMeasures:map];
+    [map release];
+    return self;
+}
+
+/** Same as above, but the measures are given by the measure map,
+ *  so the measure length can change during the song.
+ */
+- (id)initWithNotes:(NoteArray*)notearray andMeasures:(MeasureMap*)map {
+    measures = [map retain];
+    int mainclef = [self mainClef:notearray];
+    int nextmeasure = [measures startOfMeasure:1];
     int pos = 0;
     int clef = mainclef;
+    NoteView notes = [notearray view];
 
-    clefs = [[IntArray new:([notes count] / 10) + 1] retain];
+    clefs = [[IntArray new:(notes.count / 10) + 1] retain];
 
-    while (pos < [notes count]) {
+    while (pos < notes.count) {
         /* Sum all the notes in the current measure */
         int sumnotes = 0;
         int notecount = 0;
-        while (pos < [notes count] && [(MidiNote*)[notes get:pos] startTime] < nextmeasure) {
-            sumnotes += [(MidiNote*)[notes get:pos] number];
+        while (pos < notes.count && notes.starttime[pos] < nextmeasure) {
+            sumnotes += notes.number[pos];
             notecount++;
             pos++;
         }
@@ -69,7 +80,7 @@
         }
 
         [clefs add:clef];
-        nextmeasure += measurelen;
+        nextmeasure = [measures startOfMeasure:[clefs count]+1];
     }
     [clefs add:clef];
     return self;
@@ -77,17 +88,19 @@
 
 - (void)dealloc {
     [clefs release];
+    [measures release];
     [super dealloc];
 }
 
 /** Given a time (in pulses), return the clef used for that measure. */
 - (int)getClef:(int)starttime {
     /* If the time exceeds the last measure, return the last measure */
-    if (starttime / measure >= [clefs count]) {
+    int measure = [measures measureForTime:starttime];
+    if (measure >= [clefs count]) {
         return [clefs get:([clefs count]-1) ];
     }
     else {
-        return [clefs get:(starttime / measure) ];
+        return [clefs get:measure];
     }
 }
 
@@ -95,16 +108,17 @@
  * average note is below Middle C, use a bass clef.  Else, use a treble
  * clef.
  */
-- (int)mainClef:(Array*)notes {
+- (int)mainClef:(NoteArray*)notearray {
+    NoteView notes = [notearray view];
     int middleC = [WhiteNote middleC].number;
     int total = 0;
-    for (int i = 0; i < [notes count]; i++) {
-        total += [(MidiNote*)[notes get:i] number];
+    for (int i = 0; i < notes.count; i++) {
+        total += notes.number[i];
     }
-    if ([notes count] == 0) {
+    if (notes.count == 0) {
         return Clef_Treble;
     }
-    else if (total/[notes count] >= middleC) {
+    else if (total/notes.count >= middleC) {
         return Clef_Treble;
     }
     else {
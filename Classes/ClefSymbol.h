@@ -13,6 +13,8 @@
 #import <Foundation/NSObject.h>
 #import "MusicSymbol.h"
 
+@class MidiFileReader;
+
 /** The possible clefs, Treble or Bass */
 enum {
     Clef_Treble, Clef_Bass
@@ -27,6 +29,8 @@ enum {
 
 -(id)initWithClef:(int)c andTime:(int)t isSmall:(BOOL)small;
 +(void)loadImages;
+-(id)initWithLayout:(MidiFileReader*)reader;
+-(void)appendLayout:(NSMutableData*)data;
 
 @end
 
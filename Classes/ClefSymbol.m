@@ -11,6 +11,9 @@
  */
 
 #import "ClefSymbol.h"
+#import "MidiFileReader.h"
+#import "MidiFileException.h"
+#import "ScoreCache.h"
 #import "WhiteNote.h"
 
 static NSImage* treble = nil;  /** The treble clef image */
@@ -160,6 +163,29 @@ static NSImage* bass = nil;    /** The bass clef image */
     return s;
 }
 
+/** Append the clef, start time, size and width to the layout cache */
+- (void)appendLayout:(NSMutableData*)data {
+    appendInt(data, clef);
+    appendInt(data, starttime);
+    appendInt(data, smallsize);
+    appendInt(data, width);
+}
+
+/** Create a clef from its layout (see appendLayout:) */
+- (id)initWithLayout:(MidiFileReader*)reader {
+    clef = [reader readInt];
+    if (clef != Clef_Treble && clef != Clef_Bass) {
+        MidiFileException *e = [MidiFileException init:@"Bad layout clef"
+                                                offset:[reader offset]];
+        @throw e;
+    }
+    starttime = [reader readInt];
+    smallsize = [reader readInt] != 0;
+    width = [reader readInt];
+    [ClefSymbol loadImages];
+    return self;
+}
+
 @end
 
 
@@ -15,6 +15,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #import "IntArray.h"
+#import "RadixSort.h"
 
 /* The IntArray class stores an array int */
 @implementation IntArray
@@ -108,20 +109,14 @@
     return size;
 }
 
-/* Comparison function for sorting the integer array. */
-static int intcmp(const void *v1, const void* v2) {
-    int *x1 = (int*) v1;
-    int *x2 = (int*) v2;
-    return (*x1) - (*x2);
-}
-
-/** Sort the int array using mergesort.
- *  Don't use quicksort. In MidiFile.m, we're sorting lots of 
- *  MidiNotes that are already mostly sorted, and quicksort
- *  performs badly on those.
+/** Sort the int array using a radix sort.
+ *  In MidiFile.m, we're sorting the start times of all the notes
+ *  in a song, and a radix sort takes linear time on those.
  */
 - (void)sort {
-    mergesort(values, size, sizeof(int), intcmp);
+    int *tmp = (int*)malloc(size * sizeof(int));
+    radixsort_int(values, size, tmp);
+    free(tmp);
 }
 
 /** Convert this IntArray to an NSArray of NSNumber */
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#import <Foundation/NSObject.h>
+#import "Array.h"
+#import "IntArray.h"
+#import "KeySignature.h"
+#import "MeasureMap.h"
+
+/* The number of measures used to guess the key at each measure */
+#define KeyWindow 8
+
+@interface KeyMeasures : NSObject {
+    MeasureMap *measures;     /** The start time of each measure */
+    IntArray *startmeasures;  /** The first measure of each key section */
+    Array *keys;              /** The KeySignature of each key section */
+}
+
+-(id)initWithTracks:(Array*)tracks andMeasures:(MeasureMap*)map;
+-(id)initWithKey:(KeySignature*)key andMeasures:(MeasureMap*)map;
+-(int)count;
+-(KeySignature*)keyAtSection:(int)index;
+-(int)startOfSection:(int)index;
+-(int)sectionForTime:(int)starttime;
+-(KeySignature*)getKey:(int)starttime;
+-(void)dealloc;
+
+@end
+
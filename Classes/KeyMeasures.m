@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#import "KeyMeasures.h"
+#import "MidiTrack.h"
+
+/* The number of candidate keys: C and 1 to 5 sharps, 1 to 6 flats,
+ * in the order KeySignature guessFromCounts tries them.
+ */
+#define NumKeys 12
+
+/* A new key must save at least this many accidentals in a window,
+ * and at least 1/KeyChangeRatio of the notes in the window.
+ */
+#define KeyChangeMinimum 4
+#define KeyChangeRatio 8
+
+/** Return the candidate key needing the fewest accidentals for the
+ *  given note counts.  Ties go to the earlier key, like guessFromCounts.
+ */
+static int bestKey(Array *candidates, int *notecount) {
+    int best = 0;
+    int bestcount = [[candidates get:0] countAccidentals:notecount];
+    for (int k = 1; k < NumKeys; k++) {
+        int count = [[candidates get:k] countAccidentals:notecount];
+        if (count < bestcount) {
+            best = k;
+            bestcount = count;
+        }
+    }
+    return best;
+}
+
+
+/** @class KeyMeasures
+ * The KeyMeasures class divides a song into sections, where each
+ * section starts at a measure and uses a single key signature.
+ * Songs that modulate then show the new key signature at the start
+ * of the measure, instead of an accidental on every note.
+ *
+ * The notes of every measure are counted into a 12-note histogram.
+ * A window of KeyWindow measures slides over the song, adding and
+ * removing one measure's histogram at a time, so finding the key
+ * sections takes O(notes + measures) time.
+ */
+@implementation KeyMeasures
+
+/** Find the key sections for the notes in all the given tracks.
+ *  The song starts in the key that best fits all the notes, which
+ *  is the same key as KeySignature guess.  When the notes in the
+ *  window fit another key much better, a new section starts at
+ *  the measure in the window where the change fits best.
+ */
+- (id)initWithTracks:(Array*)tracks andMeasures:(MeasureMap*)map {
+    measures = [map retain];
+    startmeasures = [[IntArray new:4] retain];
+    keys = [[Array new:4] retain];
+
+    int endtime = 0;
+    for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
+        MidiTrack *track = [tracks get:tracknum];
+        if ([track.notes count] > 0) {
+            int last = [track.notes startTime:([track.notes count] - 1)];
+            if (endtime < last) {
+                endtime = last;
+            }
+        }
+    }
+    int nummeasures = [measures measureForTime:endtime] + 1;
+    int *measurestart = (int*) malloc((nummeasures + 1) * sizeof(int));
+    for (int m = 0; m <= nummeasures; m++) {
+        measurestart[m] = [measures startOfMeasure:m];
+    }
+
+    /* Count the notes of each measure, and of the whole song */
+    int (*counts)[12] = calloc(nummeasures, sizeof(*counts));
+    int total[12];
+    memset(total, 0, sizeof(total));
+    for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
+        MidiTrack *track = [tracks get:tracknum];
+        NoteView notes = [track.notes view];
+        int m = 0;
+        for (int i = 0; i < notes.count; i++) {
+            while (m < nummeasures - 1 && notes.starttime[i] >= measurestart[m+1]) {
+                m++;
+            }
+            int notescale = (notes.number[i] + 3) % 12;
+            counts[m][notescale]++;
+            total[notescale]++;
+        }
+    }
+
+    Array *candidates = [Array new:NumKeys];
+    for (int k = 0; k < 6; k++) {
+        KeySignature *key = [[KeySignature alloc] initWithSharps:k andFlats:0];
+        [candidates add:key];
+        [key release];
+    }
+    for (int k = 1; k < 7; k++) {
+        KeySignature *key = [[KeySignature alloc] initWithSharps:0 andFlats:k];
+        [candidates add:key];
+        [key release];
+    }
+
+    int current = bestKey(candidates, total);
+    [startmeasures add:0];
+    [keys add:[candidates get:current]];
+
+    int window[12];
+    int windowstart = -1;
+    int windowend = 0;
+    for (int m = 0; m < nummeasures; m++) {
+        /* Slide the window to start at measure m */
+        if (windowstart != m - 1) {
+            memset(window, 0, sizeof(window));
+            windowend = m;
+        }
+        else {
+            for (int n = 0; n < 12; n++) {
+                window[n] -= counts[m-1][n];
+            }
+        }
+        windowstart = m;
+        while (windowend < nummeasures && windowend < m + KeyWindow) {
+            for (int n = 0; n < 12; n++) {
+                window[n] += counts[windowend][n];
+            }
+            windowend++;
+        }
+        int windownotes = 0;
+        for (int n = 0; n < 12; n++) {
+            windownotes += window[n];
+        }
+
+        int best = bestKey(candidates, window);
+        int savings = [[candidates get:current] countAccidentals:window] -
+                      [[candidates get:best] countAccidentals:window];
+        if (best == current || savings < KeyChangeMinimum ||
+            savings * KeyChangeRatio < windownotes) {
+            continue;
+        }
+
+        /* Start the new key at the measure in the window that needs
+         * the fewest accidentals: the current key before it, and the
+         * new key from it on.
+         */
+        KeySignature *oldkey = [candidates get:current];
+        KeySignature *newkey = [candidates get:best];
+        int cost = [newkey countAccidentals:window];
+        int bestcost = cost;
+        int change = m;
+        for (int p = m; p < windowend - 1; p++) {
+            cost += [oldkey countAccidentals:counts[p]] - [newkey countAccidentals:counts[p]];
+            if (cost < bestcost) {
+                bestcost = cost;
+                change = p + 1;
+            }
+        }
+
+        if (change == [startmeasures get:([startmeasures count] - 1)]) {
+            [keys set:newkey index:([keys count] - 1)];
+        }
+        else {
+            [startmeasures add:change];
+            [keys add:newkey];
+        }
+        current = best;
+        m = change;
+        windowstart = -1;
+    }
+
+    free(counts);
+    free(measurestart);
+    return self;
+}
+
+/** Use the given key signature for the whole song */
+- (id)initWithKey:(KeySignature*)key andMeasures:(MeasureMap*)map {
+    measures = [map retain];
+    startmeasures = [[IntArray new:1] retain];
+    keys = [[Array new:1] retain];
+    [startmeasures add:0];
+    [keys add:key];
+    return self;
+}
+
+- (void)dealloc {
+    [measures release];
+    [startmeasures release];
+    [keys release];
+    [super dealloc];
+}
+
+/** Return the number of key sections */
+- (int)count {
+    return [keys count];
+}
+
+/** Return the key signature of the given section */
+- (KeySignature*)keyAtSection:(int)index {
+    return [keys get:index];
+}
+
+/** Return the start time (in pulses) of the given section */
+- (int)startOfSection:(int)index {
+    return [measures startOfMeasure:[startmeasures get:index]];
+}
+
+/** Return the section that contains the given time (in pulses) */
+- (int)sectionForTime:(int)starttime {
+    if (starttime <= 0) {
+        return 0;
+    }
+    int measure = [measures measureForTime:starttime];
+    int low = 0;
+    int high = [startmeasures count] - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if ([startmeasures get:mid] <= measure) {
+            low = mid;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+/** Return the key signature used at the given time (in pulses) */
+- (KeySignature*)getKey:(int)starttime {
+    return [keys get:[self sectionForTime:starttime]];
+}
+
+@end
+
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#import <Foundation/NSObject.h>
+#import "MusicSymbol.h"
+#import "Array.h"
+#import "KeySignature.h"
+
+@class MidiFileReader;
+
+@interface KeySigSymbol : NSObject <MusicSymbol> {
+    Array *accids;      /** The AccidSymbols to draw, from left to right */
+    int starttime;      /** The start time of the measure with the new key */
+    int width;          /** The width in pixels */
+}
+
+-(id)initWithKey:(KeySignature*)key andPrevious:(KeySignature*)prev
+         andClef:(int)clef andTime:(int)t;
+-(void)dealloc;
+-(id)initWithLayout:(MidiFileReader*)reader;
+-(void)appendLayout:(NSMutableData*)data;
+
+@end
+
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#import "KeySigSymbol.h"
+#import "MidiFileReader.h"
+#import "MidiFileException.h"
+#import "ScoreCache.h"
+#import "AccidSymbol.h"
+
+/** @class KeySigSymbol
+ * A KeySigSymbol represents a change of key signature at the start
+ * of a measure.  It draws natural signs to cancel the accidentals of
+ * the previous key that are not in the new key, followed by the
+ * accidentals of the new key.
+ */
+@implementation KeySigSymbol
+
+/** Create a new KeySigSymbol for the change from the previous key
+ *  to the given key, at the given start time, in the given clef.
+ */
+- (id)initWithKey:(KeySignature*)key andPrevious:(KeySignature*)prev
+         andClef:(int)clef andTime:(int)t {
+    starttime = t;
+    Array *newsymbols = [key getSymbols:clef];
+    Array *oldsymbols = [prev getSymbols:clef];
+    accids = [[Array new:([newsymbols count] + [oldsymbols count] + 1)] retain];
+
+    /* If the new key uses the same kind of accidentals (sharps or
+     * flats), it shares the first accidentals of the previous key.
+     */
+    int keep = 0;
+    if (([key num_sharps] > 0 && [prev num_sharps] > 0) ||
+        ([key num_flats] > 0 && [prev num_flats] > 0)) {
+        keep = [newsymbols count];
+    }
+    for (int i = keep; i < [oldsymbols count]; i++) {
+        AccidSymbol *old = [oldsymbols get:i];
+        AccidSymbol *natural = [[AccidSymbol alloc] initWithAccid:AccidNatural
+                                 andNote:old.note andClef:clef];
+        [accids add:natural];
+        [natural release];
+    }
+    for (int i = 0; i < [newsymbols count]; i++) {
+        [accids add:[newsymbols get:i]];
+    }
+    width = self.minWidth;
+    return self;
+}
+
+- (void)dealloc {
+    [accids release];
+    [super dealloc];
+}
+
+/** Get the time (in pulses) this symbol occurs at.
+ * This is used to determine the measure this symbol belongs to.
+ */
+- (int)startTime {
+    return starttime;
+}
+
+/** Get the minimum width (in pixels) needed to draw this symbol */
+- (int)minWidth {
+    int result = 0;
+    for (int i = 0; i < [accids count]; i++) {
+        id <MusicSymbol> a = [accids get:i];
+        result += a.minWidth;
+    }
+    return result;
+}
+
+/** Get the width (in pixels) of this symbol. The width is set
+ * in SheetMusic:alignSymbols to vertically align symbols.
+ */
+- (int)width {
+    return width;
+}
+
+/** Set the width (in pixels) of this symbol. The width is set
+ * in SheetMusic:alignSymbols to vertically align symbols.
+ */
+- (void)setWidth:(int)w {
+    width = w;
+}
+
+/** Get the number of pixels this symbol extends above the staff. Used
+ *  to determine the minimum height needed for the staff (Staff:findBounds).
+ */
+- (int)aboveStaff {
+    int result = 0;
+    for (int i = 0; i < [accids count]; i++) {
+        id <MusicSymbol> a = [accids get:i];
+        if (result < a.aboveStaff) {
+            result = a.aboveStaff;
+        }
+    }
+    return result;
+}
+
+/** Get the number of pixels this symbol extends below the staff. Used
+ *  to determine the minimum height needed for the staff (Staff:findBounds).
+ */
+- (int)belowStaff {
+    int result = 0;
+    for (int i = 0; i < [accids count]; i++) {
+        id <MusicSymbol> a = [accids get:i];
+        if (result < a.belowStaff) {
+            result = a.belowStaff;
+        }
+    }
+    return result;
+}
+
+/** Draw the symbol.
+ * @param ytop The ylocation (in pixels) where the top of the staff starts.
+ */
+- (void)draw:(int)ytop {
+    /* Align the accidentals to the right */
+    int xpos = width - self.minWidth;
+    for (int i = 0; i < [accids count]; i++) {
+        id <MusicSymbol> a = [accids get:i];
+        NSAffineTransform *trans = [NSAffineTransform transform];
+        [trans translateXBy:xpos yBy:0.0];
+        [trans concat];
+        [a draw:ytop];
+        trans = [NSAffineTransform transform];
+        [trans translateXBy:-xpos yBy:0.0];
+        [trans concat];
+        xpos += a.width;
+    }
+}
+
+- (NSString*)description {
+    NSString *s = [NSString stringWithFormat:
+                    @"KeySigSymbol starttime=%d accids=%d",
+                     starttime, [accids count]];
+    return s;
+}
+
+/** Append the start time, width and accidentals to the layout cache */
+- (void)appendLayout:(NSMutableData*)data {
+    appendInt(data, starttime);
+    appendInt(data, width);
+    appendInt(data, [accids count]);
+    for (int i = 0; i < [accids count]; i++) {
+        [[accids get:i] appendLayout:data];
+    }
+}
+
+/** Create a key signature change from its layout (see appendLayout:) */
+- (id)initWithLayout:(MidiFileReader*)reader {
+    starttime = [reader readInt];
+    width = [reader readInt];
+    int count = [reader readInt];
+    if (count < 0 || count > 14) {
+        MidiFileException *e = [MidiFileException init:@"Bad layout key signature"
+                                                offset:[reader offset]];
+        @throw e;
+    }
+    accids = [[Array new:(count + 1)] retain];
+    for (int i = 0; i < count; i++) {
+        AccidSymbol *a = [[AccidSymbol alloc] initWithLayout:reader];
+        [accids add:a];
+        [a release];
+    }
+    return self;
+}
+
+@end
+
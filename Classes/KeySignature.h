@@ -13,6 +13,8 @@
 #import "Array.h"
 #import "IntArray.h"
 #import "WhiteNote.h"
+#import "NoteArray.h"
+#import "MeasureMap.h"
 
 
 @interface KeySignature : NSObject {
@@ -35,6 +37,8 @@
 }
 +(void)initAccidentalMaps;
 +(id)guess:(IntArray*)notes;
++(id)guessFromCounts:(int*)notecount total:(int)total;
+-(int)countAccidentals:(int*)notecount;
 -(id)initWithSharps:(int)s andFlats:(int)f;
 -(id)initWithNotescale:(int)n;
 -(void)dealloc;
@@ -45,6 +49,8 @@
 -(Array*)getSymbols:(int)clef;
 -(int)getAccidentalForNote:(int)notenumber andMeasure:(int)measure;
 -(WhiteNote*)getWhiteNote:(int)notenumber;
+-(void)spellNotes:(NoteView)notes withMeasures:(MeasureMap*)measures
+        whiteNotes:(WhiteNote**)whitenotes accidentals:(int*)accids;
 -(BOOL)equals:(KeySignature*)k;
 -(NSString*)description;
 -(int)notescale;
@@ -11,6 +11,7 @@
  */
 
 #include <assert.h>
+#include <string.h>
 #import "KeySignature.h"
 #import "AccidSymbol.h"
 #import "ClefSymbol.h"
@@ -30,9 +31,146 @@ enum { F=1, Bflat, Eflat, Aflat, Dflat, Gflat };
  */
 static int sharpkeys[8][12];
 static int flatkeys[8][12];
+
+/** The key maps above, expanded to every midi note number:
+ *
+ *   map[Key][notenumber] -> Accidental
+ *
+ * Resetting a keymap is then a single memcpy.
+ */
+static int sharpnotes[8][160];
+static int flatnotes[8][160];
 static int initmaps = 0;
 
 
+/** Return the accidental for the given note number, using and
+ * updating the given keymap (see getAccidentalForNote).
+ */
+static int accidentalForNote(int *keymap, int num_flats, int notenumber) {
+    int result = keymap[notenumber];
+    if (result == AccidSharp) {
+        keymap[notenumber] = AccidNone;
+        keymap[notenumber-1] = AccidNatural;
+    }
+    else if (result == AccidFlat) {
+        keymap[notenumber] = AccidNone;
+        keymap[notenumber+1] = AccidNatural;
+    }
+    else if (result == AccidNatural) {
+        keymap[notenumber] = AccidNone;
+        int nextkey = notescale_from_number(notenumber+1);
+        int prevkey = notescale_from_number(notenumber-1);
+
+        /* If we insert a natural, then either:
+         * - the next key must go back to sharp,
+         * - the previous key must go back to flat.
+         */
+        if (keymap[notenumber-1] == AccidNone && keymap[notenumber+1] == AccidNone &&
+            notescale_is_black_key(nextkey) && notescale_is_black_key(prevkey) ) {
+
+            if (num_flats == 0) {
+                keymap[notenumber+1] = AccidSharp;
+            }
+            else {
+                keymap[notenumber-1] = AccidFlat;
+            }
+        }
+        else if (keymap[notenumber-1] == AccidNone && notescale_is_black_key(prevkey)) {
+            keymap[notenumber-1] = AccidFlat;
+        }
+        else if (keymap[notenumber+1] == AccidNone && notescale_is_black_key(nextkey)) {
+            keymap[notenumber+1] = AccidSharp;
+        }
+        else {
+            /* Shouldn't get here */
+        }
+    }
+    return result;
+}
+
+/** Return the white note for the given note number, using the given
+ * keymap (see getWhiteNote).
+ */
+static WhiteNote* whiteNoteForNote(const int *keymap, int num_flats, int notenumber) {
+    int notescale = notescale_from_number(notenumber);
+    int octave = (notenumber + 3) / 12 - 1;
+    int letter = 0;
+
+    int whole_sharps[] = { 
+        WhiteNote_A, WhiteNote_A, 
+        WhiteNote_B, 
+        WhiteNote_C, WhiteNote_C,
+        WhiteNote_D, WhiteNote_D,
+        WhiteNote_E,
+        WhiteNote_F, WhiteNote_F,
+        WhiteNote_G, WhiteNote_G
+    };
+
+    int whole_flats[] = {
+        WhiteNote_A, 
+        WhiteNote_B, WhiteNote_B,
+        WhiteNote_C,
+        WhiteNote_D, WhiteNote_D,
+        WhiteNote_E, WhiteNote_E,
+        WhiteNote_F,
+        WhiteNote_G, WhiteNote_G,
+        WhiteNote_A
+    };
+
+    int accid = keymap[notenumber];
+    if (accid == AccidFlat) {
+        letter = whole_flats[notescale];
+    }
+    else if (accid == AccidSharp) {
+        letter = whole_sharps[notescale];
+    }
+    else if (accid == AccidNatural) {
+        letter = whole_sharps[notescale];
+    }
+    else if (accid == AccidNone) {
+        letter = whole_sharps[notescale];
+
+        /* If the note number is a sharp/flat, and there's no accidental,
+         * determine the white note by seeing whether the previous or next note
+         * is a natural.
+         */
+
+        if (notescale_is_black_key(notescale)) {
+            if (keymap[notenumber-1] == AccidNatural &&
+                keymap[notenumber+1] == AccidNatural) {
+
+                if (num_flats > 0) {
+                    letter = whole_flats[notescale];
+                }
+                else {
+                    letter = whole_sharps[notescale];
+                }
+            }
+            else if (keymap[notenumber-1] == AccidNatural) {
+                letter = whole_sharps[notescale];
+            }
+            else if (keymap[notenumber+1] == AccidNatural) {
+               letter = whole_flats[notescale];
+            }
+        }
+    }
+
+    /* The above algorithm doesn't quite work for G-flat major.
+     * Handle it here.
+     */
+    if (num_flats == Gflat && notescale == NoteScale_B) {
+        letter = WhiteNote_C;
+    }
+    if (num_flats == Gflat && notescale == NoteScale_Bflat) {
+        letter = WhiteNote_B;
+    }
+    if (num_flats > 0 && notescale == NoteScale_Aflat) {
+        octave++;
+    }
+    return [WhiteNote allocWithLetter:letter andOctave:octave];
+}
+
+
 /** @class KeySignature
  * The KeySignature class represents a key signature, like G Major
  * or B-flat Major.  For sheet music, we only care about the number
@@ -297,6 +435,14 @@ static int initmaps = 0;
     map[ NoteScale_Gflat ]  = AccidNone;
     map[ NoteScale_G ]      = AccidNatural;
     map[ NoteScale_Aflat ]  = AccidNone;
+
+    for (int key = 0; key < 8; key++) {
+        for (int notenumber = 0; notenumber < 160; notenumber++) {
+            int notescale = notescale_from_number(notenumber);
+            sharpnotes[key][notenumber] = sharpkeys[key][notescale];
+            flatnotes[key][notenumber] = flatkeys[key][notescale];
+        }
+    }
 }
 
 /** The keymap tells what accidental symbol is needed for each
@@ -304,16 +450,10 @@ static int initmaps = 0;
  *  key signature.
  */
 - (void)resetKeyMap {
-    int* key;
     if (num_flats > 0)
-        key = &flatkeys[num_flats][0];
+        memcpy(keymap, flatnotes[num_flats], sizeof(keymap));
     else
-        key = &sharpkeys[num_sharps][0];
-
-    for (int notenumber = 0; notenumber < 160; notenumber++) {
-        int notescale = notescale_from_number(notenumber);
-        keymap[notenumber] = key[notescale];
-    }
+        memcpy(keymap, sharpnotes[num_sharps], sizeof(keymap));
 }
 
 
@@ -416,46 +556,7 @@ static int initmaps = 0;
         [self resetKeyMap];
         prevmeasure = measure;
     }
-
-    int result = keymap[notenumber];
-    if (result == AccidSharp) {
-        keymap[notenumber] = AccidNone;
-        keymap[notenumber-1] = AccidNatural;
-    }
-    else if (result == AccidFlat) {
-        keymap[notenumber] = AccidNone;
-        keymap[notenumber+1] = AccidNatural;
-    }
-    else if (result == AccidNatural) {
-        keymap[notenumber] = AccidNone;
-        int nextkey = notescale_from_number(notenumber+1);
-        int prevkey = notescale_from_number(notenumber-1);
-
-        /* If we insert a natural, then either:
-         * - the next key must go back to sharp,
-         * - the previous key must go back to flat.
-         */
-        if (keymap[notenumber-1] == AccidNone && keymap[notenumber+1] == AccidNone &&
-            notescale_is_black_key(nextkey) && notescale_is_black_key(prevkey) ) {
-
-            if (num_flats == 0) {
-                keymap[notenumber+1] = AccidSharp;
-            }
-            else {
-                keymap[notenumber-1] = AccidFlat;
-            }
-        }
-        else if (keymap[notenumber-1] == AccidNone && notescale_is_black_key(prevkey)) {
-            keymap[notenumber-1] = AccidFlat;
-        }
-        else if (keymap[notenumber+1] == AccidNone && notescale_is_black_key(nextkey)) {
-            keymap[notenumber+1] = AccidSharp;
-        }
-        else {
-            /* Shouldn't get here */
-        }
-    }
-    return result;
+    return accidentalForNote(keymap, num_flats, notenumber);
 }
 
 
@@ -465,82 +566,37 @@ static int initmaps = 0;
  * before calling getAccidental.
  */
 - (WhiteNote*)getWhiteNote:(int)notenumber {
-    int notescale = notescale_from_number(notenumber);
-    int octave = (notenumber + 3) / 12 - 1;
-    int letter = 0;
-
-    int whole_sharps[] = { 
-        WhiteNote_A, WhiteNote_A, 
-        WhiteNote_B, 
-        WhiteNote_C, WhiteNote_C,
-        WhiteNote_D, WhiteNote_D,
-        WhiteNote_E,
-        WhiteNote_F, WhiteNote_F,
-        WhiteNote_G, WhiteNote_G
-    };
-
-    int whole_flats[] = {
-        WhiteNote_A, 
-        WhiteNote_B, WhiteNote_B,
-        WhiteNote_C,
-        WhiteNote_D, WhiteNote_D,
-        WhiteNote_E, WhiteNote_E,
-        WhiteNote_F,
-        WhiteNote_G, WhiteNote_G,
-        WhiteNote_A
-    };
-
-    int accid = keymap[notenumber];
-    if (accid == AccidFlat) {
-        letter = whole_flats[notescale];
-    }
-    else if (accid == AccidSharp) {
-        letter = whole_sharps[notescale];
-    }
-    else if (accid == AccidNatural) {
-        letter = whole_sharps[notescale];
-    }
-    else if (accid == AccidNone) {
-        letter = whole_sharps[notescale];
-
-        /* If the note number is a sharp/flat, and there's no accidental,
-         * determine the white note by seeing whether the previous or next note
-         * is a natural.
-         */
+    return whiteNoteForNote(keymap, num_flats, notenumber);
+}
 
-        if (notescale_is_black_key(notescale)) {
-            if (keymap[notenumber-1] == AccidNatural &&
-                keymap[notenumber+1] == AccidNatural) {
 
-                if (num_flats > 0) {
-                    letter = whole_flats[notescale];
-                }
-                else {
-                    letter = whole_sharps[notescale];
-                }
-            }
-            else if (keymap[notenumber-1] == AccidNatural) {
-                letter = whole_sharps[notescale];
-            }
-            else if (keymap[notenumber+1] == AccidNatural) {
-               letter = whole_flats[notescale];
-            }
+/** Find the white note and accidental of every note in the view,
+ * in a single pass.  The notes must be sorted by start time, and
+ * the accidentals carry over from note to note until the measure
+ * changes, the same as calling getWhiteNote and getAccidentalForNote
+ * for each note in order.  The white notes are shared (see WhiteNote),
+ * so the caller does not need to release them.
+ *
+ * The pass uses its own copy of the keymap, so several threads can
+ * spell notes with the same key signature at once.
+ */
+- (void)spellNotes:(NoteView)notes withMeasures:(MeasureMap*)measures
+        whiteNotes:(WhiteNote**)whitenotes accidentals:(int*)accids {
+
+    int *base = (num_flats > 0) ? flatnotes[num_flats] : sharpnotes[num_sharps];
+    int localmap[160];
+    int measure = -1;
+    int nextmeasure = 0;
+    for (int i = 0; i < notes.count; i++) {
+        if (measure == -1 || notes.starttime[i] >= nextmeasure) {
+            measure = [measures measureForTime:notes.starttime[i]];
+            nextmeasure = [measures startOfMeasure:(measure + 1)];
+            memcpy(localmap, base, sizeof(localmap));
         }
+        int number = notes.number[i];
+        whitenotes[i] = whiteNoteForNote(localmap, num_flats, number);
+        accids[i] = accidentalForNote(localmap, num_flats, number);
     }
-
-    /* The above algorithm doesn't quite work for G-flat major.
-     * Handle it here.
-     */
-    if (num_flats == Gflat && notescale == NoteScale_B) {
-        letter = WhiteNote_C;
-    }
-    if (num_flats == Gflat && notescale == NoteScale_Bflat) {
-        letter = WhiteNote_B;
-    }
-    if (num_flats > 0 && notescale == NoteScale_Aflat) {
-        octave++;
-    }
-    return [WhiteNote allocWithLetter:letter andOctave:octave];
 }
 
 
@@ -548,8 +604,6 @@ static int initmaps = 0;
  * the song.
  */
 + (id)guess:(IntArray*) notes {
-    [KeySignature initAccidentalMaps];
-
     int notecount[12];
     int i;
 
@@ -562,6 +616,16 @@ static int initmaps = 0;
         int notescale = (notenumber + 3) % 12;
         notecount[notescale] += 1;
     }
+    return [KeySignature guessFromCounts:notecount total:[notes count]];
+}
+
+/** Guess the key signature, given the frequency count of each note in
+ *  the 12-note scale (notecount[(notenumber + 3) % 12]), and the total
+ *  number of notes.  This lets callers count the notes as they go,
+ *  without keeping a list of all the notes.
+ */
++ (id)guessFromCounts:(int*)notecount total:(int)total {
+    [KeySignature initAccidentalMaps];
 
     /* For each key signature, count the total number of accidentals
      * needed to display all the notes.  Choose the key signature
@@ -569,7 +633,7 @@ static int initmaps = 0;
      */
     int bestkey = 0;
     BOOL is_best_sharp = YES;
-    int smallest_accid_count = [notes count];
+    int smallest_accid_count = total;
     int key;
 
     for (key = 0; key < 6; key++) {
@@ -607,6 +671,22 @@ static int initmaps = 0;
     }
 }
 
+/** Return the number of accidentals needed to display the notes in
+ *  this key signature, given the frequency count of each note in the
+ *  12-note scale (notecount[(notenumber + 3) % 12]).
+ */
+- (int)countAccidentals:(int*)notecount {
+    [KeySignature initAccidentalMaps];
+    int *map = (num_flats > 0) ? flatkeys[num_flats] : sharpkeys[num_sharps];
+    int result = 0;
+    for (int n = 0; n < 12; n++) {
+        if (map[n] != AccidNone) {
+            result += notecount[n];
+        }
+    }
+    return result;
+}
+
 /** Return true if this key signature is equal to key signature k */
 - (BOOL)equals:(KeySignature*)k{
     if ([k num_sharps] == num_sharps && [k num_flats] == num_flats)
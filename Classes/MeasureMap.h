@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#import <Foundation/NSObject.h>
+#import <Foundation/NSString.h>
+
+#import "Array.h"
+#import "TimeSignature.h"
+
+@interface MeasureMap : NSObject {
+    int count;            /** The number of time signature segments */
+    int *pulses;          /** The start time (in pulses) of each segment. pulses[0] is 0 */
+    int *measures;        /** The number of the first measure in each segment */
+    int *lengths;         /** The length of a measure (in pulses) in each segment */
+    Array *signatures;    /** The TimeSignature of each segment, or nil if unknown */
+}
+
+@property (nonatomic, readonly) int count;
+
+-(id)initWithTime:(TimeSignature*)time;
+-(id)initWithMeasure:(int)measurelen;
+-(id)initWithEvents:(Array*)events andTime:(TimeSignature*)time;
+-(id)initWithMap:(MeasureMap*)map shiftedBy:(int)amount;
+-(id)initWithCount:(int)n pulses:(int*)p signatures:(Array*)sigs;
+-(int)segmentForTime:(int)time;
+-(int)measureForTime:(int)time;
+-(int)startOfMeasure:(int)measure;
+-(int)lengthOfMeasure:(int)measure;
+-(TimeSignature*)timeAtTime:(int)time;
+-(int)pulseAtSegment:(int)index;
+-(TimeSignature*)timeAtSegment:(int)index;
+-(void)dealloc;
+
+@end
+
+
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#import "MidiFile.h"
+#import "MeasureMap.h"
+
+/** A time signature event found while building the map */
+typedef struct SignatureChange {
+    int pulse;        /** The start time of the event, in pulses */
+    int order;        /** The position of the event in track order */
+    int numerator;    /** The numerator of the new time signature */
+    int denominator;  /** The denominator of the new time signature */
+} SignatureChange;
+
+/** Sort time signature changes by start time, then by track order */
+static int sortchanges(const void* v1, const void* v2) {
+    const SignatureChange *c1 = (const SignatureChange*) v1;
+    const SignatureChange *c2 = (const SignatureChange*) v2;
+    if (c1->pulse != c2->pulse) {
+        return c1->pulse - c2->pulse;
+    }
+    return c1->order - c2->order;
+}
+
+
+/** @class MeasureMap
+ * The MeasureMap gives the start time and time signature of every
+ * measure in a song whose time signature changes.
+ *
+ * The song is divided into segments with a constant time signature.
+ * For each segment we store its start pulse, its measure length, and
+ * the number of its first measure.  Finding the measure for a time,
+ * or the start of a measure, is a binary search for the segment.
+ *
+ * If a time signature changes in the middle of a measure, that
+ * measure ends early, and a new measure starts at the change.
+ */
+@implementation MeasureMap
+
+@synthesize count;
+
+/** Allocate room for the given number of segments */
+- (void)allocSegments:(int)n {
+    pulses = (int*)malloc(n * sizeof(int));
+    measures = (int*)malloc(n * sizeof(int));
+    lengths = (int*)malloc(n * sizeof(int));
+}
+
+/** Compute the first measure number of each segment, from the
+ *  segment start times and measure lengths.
+ */
+- (void)computeMeasures {
+    measures[0] = 0;
+    for (int i = 1; i < count; i++) {
+        int span = pulses[i] - pulses[i-1];
+        measures[i] = measures[i-1] + (span + lengths[i-1] - 1) / lengths[i-1];
+    }
+}
+
+/** Create a map where every measure has the given time signature */
+- (id)initWithTime:(TimeSignature*)time {
+    count = 1;
+    [self allocSegments:1];
+    pulses[0] = 0;
+    measures[0] = 0;
+    lengths[0] = time.measure;
+    signatures = [[Array new:1] retain];
+    [signatures add:time];
+    return self;
+}
+
+/** Create a map where every measure has the given length, in pulses.
+ *  The time signature is unknown, so timeAtTime: returns nil.
+ */
+- (id)initWithMeasure:(int)measurelen {
+    assert(measurelen > 0);
+    count = 1;
+    [self allocSegments:1];
+    pulses[0] = 0;
+    measures[0] = 0;
+    lengths[0] = measurelen;
+    signatures = nil;
+    return self;
+}
+
+/** Create a map from the time signature events in the given tracks
+ *  (an Array of MidiEventTable).  The song starts with the given time
+ *  signature, which is the first one found in the file.  Changes at
+ *  pulse 0 are ignored, since the starting signature already covers
+ *  them.  Invalid time signatures are skipped.
+ */
+- (id)initWithEvents:(Array*)events andTime:(TimeSignature*)time {
+    int total = 0;
+    int capacity = 8;
+    SignatureChange *changes = (SignatureChange*)
+                               malloc(capacity * sizeof(SignatureChange));
+    for (int tracknum = 0; tracknum < [events count]; tracknum++) {
+        MidiEventTable *table = [events get:tracknum];
+        int n = [table count];
+        for (int i = 0; i < n; i++) {
+            if ([table metaevent:i] != MetaEventTimeSignature ||
+                [table metalength:i] < 2 || [table startTime:i] <= 0) {
+                continue;
+            }
+            u_char *value = [table metavalue:i];
+            if (value[0] == 0 || value[1] > 6) {
+                continue;
+            }
+            if (total == capacity) {
+                capacity *= 2;
+                changes = (SignatureChange*)
+                          realloc(changes, capacity * sizeof(SignatureChange));
+            }
+            changes[total].pulse = [table startTime:i];
+            changes[total].order = total;
+            changes[total].numerator = value[0];
+            changes[total].denominator = 1 << value[1];
+            total++;
+        }
+    }
+    qsort(changes, total, sizeof(SignatureChange), sortchanges);
+
+    [self allocSegments:(total + 1)];
+    signatures = [[Array new:(total + 1)] retain];
+    pulses[0] = 0;
+    lengths[0] = time.measure;
+    [signatures add:time];
+    count = 1;
+
+    for (int i = 0; i < total; i++) {
+        if (changes[i].pulse == pulses[count-1]) {
+            /* Only the first change at each pulse is used */
+            continue;
+        }
+        TimeSignature *sig = [[TimeSignature alloc]
+                               initWithNumerator:changes[i].numerator
+                               andDenominator:changes[i].denominator
+                               andQuarter:time.quarter
+                               andTempo:time.tempo];
+        TimeSignature *prev = [signatures get:(count-1)];
+        if (sig.measure <= 0 ||
+            (sig.numerator == prev.numerator && sig.denominator == prev.denominator)) {
+            [sig release];
+            continue;
+        }
+        pulses[count] = changes[i].pulse;
+        lengths[count] = sig.measure;
+        [signatures add:sig];
+        [sig release];
+        count++;
+    }
+    free(changes);
+    [self computeMeasures];
+    return self;
+}
+
+/** Create a copy of the given map, where the time signature changes
+ *  occur the given number of pulses later.  This is used when the notes
+ *  are shifted (MidiOptions shifttime), so the measures still line up
+ *  with the notes after the first change.  The first segment always
+ *  starts at pulse 0.
+ */
+- (id)initWithMap:(MeasureMap*)map shiftedBy:(int)amount {
+    [self allocSegments:map->count];
+    signatures = nil;
+    if (map->signatures != nil) {
+        signatures = [[Array new:map->count] retain];
+    }
+    count = 0;
+    for (int i = 0; i < map->count; i++) {
+        int start = (i == 0) ? 0 : map->pulses[i] + amount;
+        if (i > 0 && start <= pulses[count-1]) {
+            /* The change was shifted onto the previous one, so replace it */
+            count--;
+            start = pulses[count];
+        }
+        pulses[count] = start;
+        lengths[count] = map->lengths[i];
+        if (signatures != nil && count < [signatures count]) {
+            [signatures set:[map->signatures get:i] index:count];
+        }
+        else if (signatures != nil) {
+            [signatures add:[map->signatures get:i]];
+        }
+        count++;
+    }
+    [self computeMeasures];
+    return self;
+}
+
+/** Create a map from the given segments (start pulse and time
+ *  signature), which must be sorted by pulse, with the first at
+ *  pulse 0.  This is used to restore a map saved with
+ *  pulseAtSegment/timeAtSegment.
+ */
+- (id)initWithCount:(int)n pulses:(int*)p signatures:(Array*)sigs {
+    assert(n > 0 && p[0] == 0 && [sigs count] == n);
+    count = n;
+    [self allocSegments:n];
+    signatures = [sigs retain];
+    for (int i = 0; i < n; i++) {
+        pulses[i] = p[i];
+        lengths[i] = [(TimeSignature*)[sigs get:i] measure];
+    }
+    [self computeMeasures];
+    return self;
+}
+
+- (void)dealloc {
+    free(pulses);
+    free(measures);
+    free(lengths);
+    [signatures release];
+    [super dealloc];
+}
+
+/** Return the index of the segment containing the given time.
+ *  Times before the start of the song use the first segment.
+ */
+- (int)segmentForTime:(int)time {
+    int low = 0;
+    int high = count - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (pulses[mid] <= time) {
+            low = mid;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+/** Return the index of the segment containing the given measure */
+- (int)segmentForMeasure:(int)measure {
+    int low = 0;
+    int high = count - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (measures[mid] <= measure) {
+            low = mid;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+/** Return the measure number (starting at 0) for the given time */
+- (int)measureForTime:(int)time {
+    int i = [self segmentForTime:time];
+    return measures[i] + (time - pulses[i]) / lengths[i];
+}
+
+/** Return the start time (in pulses) of the given measure */
+- (int)startOfMeasure:(int)measure {
+    int i = [self segmentForMeasure:measure];
+    return pulses[i] + (measure - measures[i]) * lengths[i];
+}
+
+/** Return the length (in pulses) of the given measure.  This is
+ *  shorter than the time signature's measure if the time signature
+ *  changes in the middle of the measure.
+ */
+- (int)lengthOfMeasure:(int)measure {
+    int i = [self segmentForMeasure:measure];
+    int start = pulses[i] + (measure - measures[i]) * lengths[i];
+    if (i+1 < count && start + lengths[i] > pulses[i+1]) {
+        return pulses[i+1] - start;
+    }
+    return lengths[i];
+}
+
+/** Return the time signature in effect at the given time */
+- (TimeSignature*)timeAtTime:(int)time {
+    if (signatures == nil) {
+        return nil;
+    }
+    return [signatures get:[self segmentForTime:time]];
+}
+
+/** Return the start time (in pulses) of the given segment */
+- (int)pulseAtSegment:(int)index {
+    assert(index >= 0 && index < count);
+    return pulses[index];
+}
+
+/** Return the time signature of the given segment */
+- (TimeSignature*)timeAtSegment:(int)index {
+    assert(index >= 0 && index < count);
+    if (signatures == nil) {
+        return nil;
+    }
+    return [signatures get:index];
+}
+
+@end
+
+
@@ -41,7 +41,8 @@ int sortMidiEvent(void* v1, void* v2);
     int     tempo;         /** The tempo, for Tempo meta events */
     u_char  metaevent;     /** The metaevent, used if eventflag is MetaEvent */
     int     metalength;    /** The metaevent length  */
-    u_char* metavalue;     /** The raw byte value, for Sysex and meta events */
+    u_char* metavalue;     /** The raw byte value, for Sysex and meta events.
+                               Points into the MidiFileReader data. */
 }
 
 @property (nonatomic, assign) int deltaTime;
@@ -116,12 +116,11 @@ int sortMidiEvent(void* v1, void* v2) {
     return [mevent autorelease];
 }
 
+/** The metavalue is not freed. It points into the raw midi data,
+ *  which is owned by the MidiFileReader of the MidiFile.
+ */
 - (void)dealloc {
-    if (eventFlag == MetaEvent || eventFlag == SysexEvent1 ||
-        eventFlag == SysexEvent2) {
-        /* free(metavalue); */
-        metavalue = NULL;
-    }
+    metavalue = NULL;
     [super dealloc];
 }
 
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#import <Foundation/NSObject.h>
+#import <Foundation/NSString.h>
+
+#import "MidiFileReader.h"
+
+@class KeySignature;
+
+/** A single raw midi event, as decoded by readMidiEvent() */
+typedef struct MidiRawEvent {
+    int track;           /** The track number */
+    int deltaTime;       /** The time since the previous event in the track */
+    int startTime;       /** The absolute time of the event, in pulses */
+    BOOL hasEventflag;   /** False if the event used the previous event code */
+    u_char status;       /** The event code, including the channel (0x93) */
+    u_char eventFlag;    /** The event code, without the channel (EventNoteOn) */
+    u_char channel;      /** The channel, for channel events */
+    u_char data1;        /** Note number, controller, instrument, or meta type */
+    u_char data2;        /** Velocity, pressure, or controller value */
+    u_char metaevent;    /** The meta event type, for meta events */
+    int metaoffset;      /** The offset of the payload in the reader data */
+    int metalength;      /** The payload length, for sysex and meta events */
+    u_char *metavalue;   /** The payload bytes, for sysex and meta events */
+} MidiRawEvent;
+
+BOOL readMidiEvent(MidiFileReader *file, int *eventflag, int *starttime,
+                   MidiRawEvent *event);
+
+typedef void (^MidiEventBlock)(const MidiRawEvent *event, BOOL *stop);
+typedef void (^MidiNoteBlock)(int track, int channel, int number,
+                              int starttime, int duration, BOOL *stop);
+
+@interface MidiEventStream : NSObject {
+    MidiFileReader *reader;  /** The reader for the midi data */
+    int trackmode;           /** 0 (single track), 1 (simultaneous tracks) 2 (independent tracks) */
+    int numtracks;           /** The number of tracks in the MThd header */
+    int quarternote;         /** The number of pulses per quarter note */
+}
+
+@property (nonatomic, readonly) int trackmode;
+@property (nonatomic, readonly) int numtracks;
+@property (nonatomic, readonly) int quarternote;
+
+-(id)initWithFile:(NSString*)path;
+-(id)initWithReader:(MidiFileReader*)file;
+-(void)enumerateEvents:(MidiEventBlock)block;
+-(void)enumerateNotes:(MidiNoteBlock)block;
+-(KeySignature*)guessKey;
+-(void)dealloc;
+
+@end
+
+
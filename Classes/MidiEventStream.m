@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#import "MidiFile.h"
+#import "MidiEventStream.h"
+#import "KeySignature.h"
+
+/** Read the next event (delta time, event code, and event data) from
+ *  the given reader, and store it in event.  The eventflag is the
+ *  previous event code, and is updated if this event has a new one.
+ *  The starttime is the absolute time of the previous event, and is
+ *  incremented by the delta time.
+ *
+ *  Return NO if the data is truncated before the event starts. In
+ *  that case, the track can still be used up to this event.  Throw a
+ *  MidiFileException if the event itself is invalid.
+ */
+BOOL readMidiEvent(MidiFileReader *file, int *eventflag, int *starttime,
+                   MidiRawEvent *event) {
+    int deltatime;
+    u_char peekevent;
+    @try {
+        deltatime = [file readVarlen];
+        *starttime += deltatime;
+        peekevent = [file peek];
+    }
+    @catch (MidiFileException* e) {
+        return NO;
+    }
+
+    event->deltaTime = deltatime;
+    event->startTime = *starttime;
+    event->hasEventflag = NO;
+    event->channel = 0;
+    event->data1 = 0;
+    event->data2 = 0;
+    event->metaevent = 0;
+    event->metaoffset = 0;
+    event->metalength = 0;
+    event->metavalue = NULL;
+
+    if (peekevent >= EventNoteOff) {
+        event->hasEventflag = YES;
+        *eventflag = [file readByte];
+    }
+    int flag = *eventflag;
+    event->status = (u_char)flag;
+
+    if (flag >= EventNoteOff && flag < EventPitchBend + 16) {
+        /* Channel events. Program change and channel pressure
+         * have one data byte, the others have two.
+         */
+        event->eventFlag = (u_char)(flag & 0xF0);
+        event->channel = (u_char)(flag & 0x0F);
+        event->data1 = [file readByte];
+        if (flag < EventProgramChange || flag >= EventPitchBend) {
+            event->data2 = [file readByte];
+        }
+    }
+    else if (flag == SysexEvent1 || flag == SysexEvent2) {
+        event->eventFlag = (u_char)flag;
+        event->metalength = [file readVarlen];
+        event->metaoffset = [file offset];
+        event->metavalue = [file readBytesNoCopy:event->metalength];
+    }
+    else if (flag == MetaEvent) {
+        event->eventFlag = (u_char)flag;
+        event->metaevent = [file readByte];
+        event->data1 = event->metaevent;
+        event->metalength = [file readVarlen];
+        event->metaoffset = [file offset];
+        event->metavalue = [file readBytesNoCopy:event->metalength];
+
+        if (event->metaevent == MetaEventTimeSignature && event->metalength < 2) {
+            MidiFileException *e =
+            [MidiFileException init:@"Bad Meta Event Time Signature len"
+              offset:[file offset]];
+            @throw e;
+        }
+        else if (event->metaevent == MetaEventTempo && event->metalength != 3) {
+            MidiFileException *e =
+            [MidiFileException init:@"Bad Meta Event Tempo len"
+              offset:[file offset]];
+            @throw e;
+        }
+    }
+    else {
+        MidiFileException *e =
+            [MidiFileException init:@"Unknown event" offset:([file offset] -4)];
+        @throw e;
+    }
+    return YES;
+}
+
+
+/** @class MidiEventStream
+ * The MidiEventStream parses a midi file one event at a time, and
+ * passes each event to a block, instead of creating the list of
+ * events and notes for the whole file like MidiFile does.  Only the
+ * current event is kept in memory, so this can be used for very
+ * large files, and for tasks that only need a single pass over the
+ * events, such as counting events or guessing the key.
+ *
+ * The tracks are read in order, and the events of each track are
+ * read in order.
+ */
+@implementation MidiEventStream
+
+@synthesize trackmode;
+@synthesize numtracks;
+@synthesize quarternote;
+
+/** Create a stream for the given midi file.  The file is memory mapped */
+- (id)initWithFile:(NSString*)path {
+    MidiFileReader *file = [[MidiFileReader alloc] initWithFile:path];
+    self = [self initWithReader:file];
+    [file release];
+    return self;
+}
+
+/** Create a stream for the midi data in the given reader.  Parse the
+ *  MThd header, and throw a MidiFileException if it is invalid.
+ */
+- (id)initWithReader:(MidiFileReader*)file {
+    reader = [file retain];
+    const char *hdr = [file readAscii:4];
+    if (strncmp(hdr, "MThd", 4) != 0) {
+        MidiFileException *e =
+           [MidiFileException init:@"Bad MThd header" offset:0];
+        @throw e;
+    }
+    int len = [file readInt];
+    if (len != 6) {
+        MidiFileException *e =
+           [MidiFileException init:@"Bad MThd len" offset:4];
+        @throw e;
+    }
+    trackmode = [file readShort];
+    numtracks = [file readShort];
+    quarternote = [file readShort];
+    return self;
+}
+
+- (void)dealloc {
+    [reader release];
+    [super dealloc];
+}
+
+/** Call the block for each event in the file, in track order.  The
+ *  event is only valid during the call.  Set *stop to YES to stop
+ *  the enumeration.  As with MidiFile, a truncated track ends the
+ *  enumeration without an error.
+ */
+- (void)enumerateEvents:(MidiEventBlock)block {
+    MidiFileReader *file = [reader readerAtOffset:14];
+    MidiRawEvent event;
+    BOOL stop = NO;
+
+    for (int tracknum = 0; tracknum < numtracks && !stop; tracknum++) {
+        const char *hdr = [file readAscii:4];
+        if (strncmp(hdr, "MTrk", 4) != 0) {
+            MidiFileException *e =
+               [MidiFileException init:@"Bad MTrk header" offset:([file offset] -4)];
+            @throw e;
+        }
+        int tracklen = [file readInt];
+        int trackend = tracklen + [file offset];
+        int eventflag = 0;
+        int starttime = 0;
+
+        while ([file offset] < trackend) {
+            if (!readMidiEvent(file, &eventflag, &starttime, &event)) {
+                return;
+            }
+            event.track = tracknum;
+            block(&event, &stop);
+            if (stop || event.metaevent == MetaEventEndOfTrack) {
+                break;
+            }
+        }
+        if ([file offset] < trackend) {
+            if (trackend > [file length]) {
+                return;
+            }
+            [file skip:(trackend - [file offset])];
+        }
+    }
+}
+
+/** Call the block for each note in the file.  A note is reported when
+ *  its NoteOff event is read, so the notes of a track are not in start
+ *  time order.  NoteOffs are matched to NoteOns the same way MidiTrack
+ *  does. Notes that never end are reported at the end of the track,
+ *  with duration 0.
+ *
+ *  Only the notes that are currently playing are kept in memory.
+ */
+- (void)enumerateNotes:(MidiNoteBlock)block {
+    __block int pendingcount = 0;
+    __block int pendingcapacity = 16;
+    __block int *pendingkey = (int*)malloc(pendingcapacity * sizeof(int));
+    __block int *pendingstart = (int*)malloc(pendingcapacity * sizeof(int));
+    __block int currenttrack = 0;
+
+    /* Report the notes of the finished track that never ended */
+    void (^flush)(BOOL*) = ^(BOOL *stop) {
+        for (int i = 0; i < pendingcount && !(*stop); i++) {
+            block(currenttrack, pendingkey[i] / 128, pendingkey[i] % 128,
+                  pendingstart[i], 0, stop);
+        }
+        pendingcount = 0;
+    };
+
+    __block BOOL stopped = NO;
+    [self enumerateEvents:^(const MidiRawEvent *event, BOOL *stop) {
+        if (event->track != currenttrack) {
+            flush(stop);
+            currenttrack = event->track;
+        }
+        if (*stop) {
+            stopped = YES;
+            return;
+        }
+        if (event->eventFlag == EventNoteOn && event->data2 > 0) {
+            if (pendingcount == pendingcapacity) {
+                pendingcapacity *= 2;
+                pendingkey = (int*)realloc(pendingkey, pendingcapacity * sizeof(int));
+                pendingstart = (int*)realloc(pendingstart, pendingcapacity * sizeof(int));
+            }
+            pendingkey[pendingcount] = event->channel * 128 + event->data1;
+            pendingstart[pendingcount] = event->startTime;
+            pendingcount++;
+        }
+        else if (event->eventFlag == EventNoteOn || event->eventFlag == EventNoteOff) {
+            int key = event->channel * 128 + event->data1;
+            for (int i = pendingcount-1; i >= 0; i--) {
+                if (pendingkey[i] != key) {
+                    continue;
+                }
+                int start = pendingstart[i];
+                int duration = event->startTime - start;
+                if (duration == 0) {
+                    /* MidiTrack treats a zero duration note as still playing */
+                    break;
+                }
+                memmove(&pendingkey[i], &pendingkey[i+1], (pendingcount-i-1) * sizeof(int));
+                memmove(&pendingstart[i], &pendingstart[i+1], (pendingcount-i-1) * sizeof(int));
+                pendingcount--;
+                block(event->track, key / 128, key % 128, start, duration, stop);
+                break;
+            }
+        }
+        if (*stop) {
+            stopped = YES;
+        }
+    }];
+    if (!stopped) {
+        flush(&stopped);
+    }
+    free(pendingkey);
+    free(pendingstart);
+}
+
+/** Guess the key signature of the song, from the notes in all tracks.
+ *  Only the count of each note in the 12-note scale is kept.
+ */
+- (KeySignature*)guessKey {
+    int notecount[12];
+    int *counts = notecount;
+    __block int total = 0;
+    for (int i = 0; i < 12; i++) {
+        notecount[i] = 0;
+    }
+    [self enumerateEvents:^(const MidiRawEvent *event, BOOL *stop) {
+        if (event->eventFlag == EventNoteOn && event->data2 > 0) {
+            counts[(event->data1 + 3) % 12] += 1;
+            total++;
+        }
+    }];
+    return [KeySignature guessFromCounts:notecount total:total];
+}
+
+@end
+
+
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#import <Foundation/NSObject.h>
+#import <Foundation/NSArray.h>
+
+#import "Array.h"
+#import "MidiEvent.h"
+#import "MidiFileReader.h"
+#import "MidiEventStream.h"
+
+/* Bits in the MidiEventTable flags column */
+#define EventHasFlag     1   /* The event code was present (no running status) */
+#define EventHasPayload  2   /* The event has a sysex/meta payload */
+
+@interface MidiEventTable : NSObject {
+    int count;              /** The number of events */
+    int capacity;           /** The allocated length of each column */
+    int *starttime;         /** The absolute start time of each event, in pulses */
+    u_char *status;         /** The event code, including the channel (0x93) */
+    u_char *data1;          /** Note number, controller, instrument, or meta type */
+    u_char *data2;          /** Velocity, pressure, or controller value */
+    u_char *flags;          /** EventHasFlag and EventHasPayload bits */
+
+    int payloadcount;       /** The number of events with a payload */
+    int payloadcapacity;    /** The allocated length of the payload columns */
+    int *payloadindex;      /** The event index of each payload (sorted) */
+    int *payloadoffset;     /** The payload offset into the reader data */
+    int *payloadlength;     /** The payload length */
+    MidiFileReader *reader; /** The reader that owns the payload bytes */
+}
+
++(id)new:(int)capacity withReader:(MidiFileReader*)r;
+-(id)initWithCapacity:(int)capacity andReader:(MidiFileReader*)r;
+-(id)initWithTable:(MidiEventTable*)table andReader:(MidiFileReader*)r
+         shiftedBy:(int)delta;
+-(void)addEvent:(int)start status:(u_char)s data1:(u_char)d1
+          data2:(u_char)d2 hasFlag:(BOOL)hasflag;
+-(void)setPayloadOffset:(int)offset length:(int)len;
+-(int)count;
+-(int)startTime:(int)index;
+-(int)deltaTime:(int)index;
+-(u_char)eventFlag:(int)index;
+-(u_char)channel:(int)index;
+-(u_char)data1:(int)index;
+-(u_char)data2:(int)index;
+-(BOOL)hasEventflag:(int)index;
+-(u_char)metaevent:(int)index;
+-(int)metalength:(int)index;
+-(u_char*)metavalue:(int)index;
+-(int)tempo:(int)index;
+-(int)denominator:(int)index;
+-(MidiEvent*)get:(int)index;
+-(void)getRawEvent:(int)index into:(MidiRawEvent*)event;
+-(Array*)events;
+-(int)memoryUsed;
+-(void)dealloc;
+
+@end
+
+
@@ -0,0 +1,408 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <objc/runtime.h>
+#import "MidiFile.h"
+#import "MidiEventTable.h"
+
+/** @class MidiEventTable
+ * The MidiEventTable stores the raw midi events of a single track,
+ * as a set of parallel arrays (columns) instead of one MidiEvent
+ * object per event.  Each event takes 8 bytes:
+ *
+ * - starttime: The absolute time, in pulses.  The delta time is
+ *   the difference from the previous event's start time.
+ * - status:    The event code, including the channel (0x90 - 0xFF).
+ * - data1:     The note number, controller number, instrument, or
+ *              meta event type.  The high byte of a pitch bend.
+ * - data2:     The velocity, pressure, or controller value.
+ *              The low byte of a pitch bend.
+ * - flags:     Whether the event code was present (not running status),
+ *              and whether the event has a payload.
+ *
+ * Sysex and meta events are rare, so their payloads are kept in a
+ * separate, sorted list of (event index, offset, length).  The
+ * offset points into the data of the MidiFileReader, which this
+ * table retains, so the payload bytes are never copied.
+ *
+ * Code that needs a MidiEvent object can call get: to create one.
+ */
+@implementation MidiEventTable
+
+/** Create a new, empty event table with the given capacity */
++ (id)new:(int)newcapacity withReader:(MidiFileReader*)r {
+    MidiEventTable *table = [[MidiEventTable alloc]
+                              initWithCapacity:newcapacity andReader:r];
+    return [table autorelease];
+}
+
+- (id)initWithCapacity:(int)newcapacity andReader:(MidiFileReader*)r {
+    assert(newcapacity >= 0);
+    if (newcapacity == 0)
+        newcapacity = 1;
+    capacity = newcapacity;
+    count = 0;
+    starttime = (int*)malloc(capacity * sizeof(int));
+    status = (u_char*)malloc(capacity);
+    data1 = (u_char*)malloc(capacity);
+    data2 = (u_char*)malloc(capacity);
+    flags = (u_char*)malloc(capacity);
+
+    payloadcount = 0;
+    payloadcapacity = 0;
+    payloadindex = NULL;
+    payloadoffset = NULL;
+    payloadlength = NULL;
+    reader = [r retain];
+    return self;
+}
+
+/** Create a copy of the given table, whose payloads are in the given
+ *  reader, at the given number of bytes after their offset in the
+ *  original reader.  This is used when a track is unchanged in a new
+ *  version of the midi file, but has moved to a different offset.
+ */
+- (id)initWithTable:(MidiEventTable*)table andReader:(MidiFileReader*)r
+          shiftedBy:(int)delta {
+    count = table->count;
+    capacity = (count == 0) ? 1 : count;
+    starttime = (int*)malloc(capacity * sizeof(int));
+    status = (u_char*)malloc(capacity);
+    data1 = (u_char*)malloc(capacity);
+    data2 = (u_char*)malloc(capacity);
+    flags = (u_char*)malloc(capacity);
+    memcpy(starttime, table->starttime, count * sizeof(int));
+    memcpy(status, table->status, count);
+    memcpy(data1, table->data1, count);
+    memcpy(data2, table->data2, count);
+    memcpy(flags, table->flags, count);
+
+    payloadcount = table->payloadcount;
+    payloadcapacity = payloadcount;
+    payloadindex = NULL;
+    payloadoffset = NULL;
+    payloadlength = NULL;
+    if (payloadcount > 0) {
+        payloadindex = (int*)malloc(payloadcount * sizeof(int));
+        payloadoffset = (int*)malloc(payloadcount * sizeof(int));
+        payloadlength = (int*)malloc(payloadcount * sizeof(int));
+        memcpy(payloadindex, table->payloadindex, payloadcount * sizeof(int));
+        memcpy(payloadlength, table->payloadlength, payloadcount * sizeof(int));
+        for (int p = 0; p < payloadcount; p++) {
+            payloadoffset[p] = table->payloadoffset[p] + delta;
+        }
+    }
+    reader = [r retain];
+    return self;
+}
+
+- (void)dealloc {
+    free(starttime);
+    free(status);
+    free(data1);
+    free(data2);
+    free(flags);
+    free(payloadindex);
+    free(payloadoffset);
+    free(payloadlength);
+    [reader release];
+    [super dealloc];
+}
+
+/** Append an event to the end of the table.
+ *  If needed, increase the capacity of the columns.
+ */
+- (void)addEvent:(int)start status:(u_char)s data1:(u_char)d1
+           data2:(u_char)d2 hasFlag:(BOOL)hasflag {
+    if (count == capacity) {
+        capacity = 2*capacity;
+        starttime = (int*)realloc(starttime, capacity * sizeof(int));
+        status = (u_char*)realloc(status, capacity);
+        data1 = (u_char*)realloc(data1, capacity);
+        data2 = (u_char*)realloc(data2, capacity);
+        flags = (u_char*)realloc(flags, capacity);
+    }
+    starttime[count] = start;
+    status[count] = s;
+    data1[count] = d1;
+    data2[count] = d2;
+    flags[count] = hasflag ? EventHasFlag : 0;
+    count++;
+}
+
+/** Set the payload of the last event added.  The offset is
+ *  the position of the payload bytes in the reader data.
+ */
+- (void)setPayloadOffset:(int)offset length:(int)len {
+    assert(count > 0);
+    if (payloadcount == payloadcapacity) {
+        payloadcapacity = (payloadcapacity == 0) ? 8 : 2*payloadcapacity;
+        payloadindex = (int*)realloc(payloadindex, payloadcapacity * sizeof(int));
+        payloadoffset = (int*)realloc(payloadoffset, payloadcapacity * sizeof(int));
+        payloadlength = (int*)realloc(payloadlength, payloadcapacity * sizeof(int));
+    }
+    payloadindex[payloadcount] = count-1;
+    payloadoffset[payloadcount] = offset;
+    payloadlength[payloadcount] = len;
+    payloadcount++;
+    flags[count-1] |= EventHasPayload;
+}
+
+/** Return the position of the given event in the payload columns,
+ *  or -1 if the event has no payload.  Use a binary search, since
+ *  payloads are added in event order.
+ */
+- (int)findPayload:(int)index {
+    if ((flags[index] & EventHasPayload) == 0) {
+        return -1;
+    }
+    int low = 0;
+    int high = payloadcount - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (payloadindex[mid] == index) {
+            return mid;
+        }
+        else if (payloadindex[mid] < index) {
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return -1;
+}
+
+/** Return the number of events */
+- (int)count {
+    return count;
+}
+
+/** Return the absolute start time of the event, in pulses */
+- (int)startTime:(int)index {
+    assert(index >= 0 && index < count);
+    return starttime[index];
+}
+
+/** Return the time between the previous event and this one */
+- (int)deltaTime:(int)index {
+    assert(index >= 0 && index < count);
+    if (index == 0) {
+        return starttime[0];
+    }
+    return starttime[index] - starttime[index-1];
+}
+
+/** Return the event code, without the channel (EventNoteOn, MetaEvent, etc) */
+- (u_char)eventFlag:(int)index {
+    assert(index >= 0 && index < count);
+    u_char s = status[index];
+    if (s >= SysexEvent1) {
+        return s;
+    }
+    return (u_char)(s & 0xF0);
+}
+
+/** Return the channel, or 0 for sysex and meta events */
+- (u_char)channel:(int)index {
+    assert(index >= 0 && index < count);
+    u_char s = status[index];
+    if (s >= SysexEvent1) {
+        return 0;
+    }
+    return (u_char)(s & 0x0F);
+}
+
+- (u_char)data1:(int)index {
+    assert(index >= 0 && index < count);
+    return data1[index];
+}
+
+- (u_char)data2:(int)index {
+    assert(index >= 0 && index < count);
+    return data2[index];
+}
+
+/** Return true if the event code was present, false if the event
+ *  used the previous event code (running status).
+ */
+- (BOOL)hasEventflag:(int)index {
+    assert(index >= 0 && index < count);
+    return (flags[index] & EventHasFlag) != 0;
+}
+
+/** Return the meta event type, or 0 if this is not a meta event */
+- (u_char)metaevent:(int)index {
+    assert(index >= 0 && index < count);
+    if (status[index] == MetaEvent) {
+        return data1[index];
+    }
+    return 0;
+}
+
+/** Return the length of the sysex/meta payload, or 0 if none */
+- (int)metalength:(int)index {
+    assert(index >= 0 && index < count);
+    int p = [self findPayload:index];
+    if (p == -1) {
+        return 0;
+    }
+    return payloadlength[p];
+}
+
+/** Return a pointer to the sysex/meta payload, or NULL if none.
+ *  The pointer points into the reader data, and is valid as long
+ *  as this table is.
+ */
+- (u_char*)metavalue:(int)index {
+    assert(index >= 0 && index < count);
+    int p = [self findPayload:index];
+    if (p == -1) {
+        return NULL;
+    }
+    return [reader bytes] + payloadoffset[p];
+}
+
+/** Return the tempo of a Tempo meta event, or 0 otherwise */
+- (int)tempo:(int)index {
+    if ([self metaevent:index] != MetaEventTempo ||
+        [self metalength:index] != 3) {
+        return 0;
+    }
+    u_char *value = [self metavalue:index];
+    return ((value[0] << 16) | (value[1] << 8) | value[2]);
+}
+
+/** Return the denominator of a TimeSignature meta event, or 0 if
+ *  this isn't a TimeSignature event, or the denominator is invalid.
+ *  The event stores log2(denominator), which must fit in a u_char.
+ */
+- (int)denominator:(int)index {
+    if ([self metaevent:index] != MetaEventTimeSignature ||
+        [self metalength:index] < 2) {
+        return 0;
+    }
+    u_char log2 = [self metavalue:index][1];
+    if (log2 > 7) {
+        return 0;
+    }
+    return 1 << log2;
+}
+
+/** Create a MidiEvent object for the given event.  The fields
+ *  are filled in the same way readTrack used to fill them.
+ */
+- (MidiEvent*)get:(int)index {
+    assert(index >= 0 && index < count);
+    MidiEvent *mevent = [[MidiEvent alloc] init];
+    u_char eventflag = [self eventFlag:index];
+    u_char d1 = data1[index];
+    u_char d2 = data2[index];
+
+    mevent.deltaTime = [self deltaTime:index];
+    mevent.startTime = starttime[index];
+    mevent.hasEventflag = [self hasEventflag:index];
+    mevent.eventFlag = eventflag;
+    mevent.channel = [self channel:index];
+
+    if (eventflag == EventNoteOn || eventflag == EventNoteOff) {
+        mevent.notenumber = d1;
+        mevent.velocity = d2;
+    }
+    else if (eventflag == EventKeyPressure) {
+        mevent.notenumber = d1;
+        mevent.keyPressure = d2;
+    }
+    else if (eventflag == EventControlChange) {
+        mevent.controlNum = d1;
+        mevent.controlValue = d2;
+    }
+    else if (eventflag == EventProgramChange) {
+        mevent.instrument = d1;
+    }
+    else if (eventflag == EventChannelPressure) {
+        mevent.chanPressure = d1;
+    }
+    else if (eventflag == EventPitchBend) {
+        mevent.pitchBend = (u_short)((d1 << 8) | d2);
+    }
+    else if (eventflag == SysexEvent1 || eventflag == SysexEvent2) {
+        mevent.metalength = [self metalength:index];
+        mevent.metavalue = [self metavalue:index];
+    }
+    else if (eventflag == MetaEvent) {
+        mevent.metaevent = d1;
+        mevent.metalength = [self metalength:index];
+        mevent.metavalue = [self metavalue:index];
+        if (d1 == MetaEventTimeSignature && mevent.metalength >= 2) {
+            mevent.numerator = mevent.metavalue[0];
+            mevent.denominator = [self denominator:index];
+        }
+        else if (d1 == MetaEventTempo) {
+            mevent.tempo = [self tempo:index];
+        }
+    }
+    return [mevent autorelease];
+}
+
+/** Fill in the raw event for the given index, without creating a
+ *  MidiEvent object.  The metavalue points into the reader data.
+ */
+- (void)getRawEvent:(int)index into:(MidiRawEvent*)event {
+    assert(index >= 0 && index < count);
+    u_char s = status[index];
+    event->track = 0;
+    event->deltaTime = [self deltaTime:index];
+    event->startTime = starttime[index];
+    event->hasEventflag = (flags[index] & EventHasFlag) != 0;
+    event->status = s;
+    event->eventFlag = (s >= SysexEvent1) ? s : (u_char)(s & 0xF0);
+    event->channel = (s >= SysexEvent1) ? 0 : (u_char)(s & 0x0F);
+    event->data1 = data1[index];
+    event->data2 = data2[index];
+    event->metaevent = (s == MetaEvent) ? data1[index] : 0;
+    int p = [self findPayload:index];
+    if (p == -1) {
+        event->metaoffset = 0;
+        event->metalength = 0;
+        event->metavalue = NULL;
+    }
+    else {
+        event->metaoffset = payloadoffset[p];
+        event->metalength = payloadlength[p];
+        event->metavalue = [reader bytes] + payloadoffset[p];
+    }
+}
+
+/** Create an Array of MidiEvent objects, one for each event */
+- (Array*)events {
+    Array *result = [Array new:count];
+    for (int i = 0; i < count; i++) {
+        [result add:[self get:i]];
+    }
+    return result;
+}
+
+/** Return the number of bytes allocated for this table */
+- (int)memoryUsed {
+    return capacity * (sizeof(int) + 4) +
+           payloadcapacity * 3 * sizeof(int) +
+           (int)class_getInstanceSize([self class]);
+}
+
+@end
+
+
@@ -19,12 +19,18 @@
 #import "Array.h"
 #import "IntArray.h"
 #import "TimeSignature.h"
+#import "TempoMap.h"
+#import "MeasureMap.h"
 #import "MidiEvent.h"
-#import "MidiNote.h"
+#import "MidiEventTable.h"
+#import "MidiEventStream.h"
+#import "NoteArray.h"
 #import "MidiTrack.h"
 #import "MidiFileReader.h"
 #import "MidiOptions.h"
 #import "MidiFileException.h"
+#import "ScoreCache.h"
+#import "SeekCheckpoints.h"
 
 
 /* The list of Midi Events */
@@ -53,59 +59,90 @@
 #define MetaEventTimeSignature 0x58
 #define MetaEventKeySignature  0x59
 
+/* The number of measures between seek checkpoints */
+#define CheckpointMeasures     4
+
 
 @interface MidiFile : NSObject {
     NSString* filename;      /** The Midi file name */
-    Array* events;           /** Array< Array<MidiEvent>> : the raw midi events */
+    Array* events;           /** Array<MidiEventTable> : the raw midi events */
     Array *tracks;           /** The tracks (MidiTrack) of the midifile that have notes */
     u_short trackmode;       /** 0 (single track), 1 (simultaneous tracks) 2 (independent tracks) */
     TimeSignature* time;     /** The time signature */
+    TempoMap *tempomap;      /** Converts between pulses and microseconds */
+    MeasureMap *measuremap;  /** The start time and time signature of each measure */
     int quarternote;         /** The number of pulses per quarter note */
     int totalpulses;         /** The total length of the song, in pulses */
     BOOL trackPerChannel;    /** True if we've split each channel into a track */
+    MidiFileReader *reader;  /** The reader, which owns the raw midi data */
+    MidiFileReader *cachereader; /** The cache entry the lyrics point into, or nil */
+    Array *checkpoints;      /** The SeekCheckpoints of each track, created when needed */
+    Array *chunkkeys;        /** The hash (a ScoreCache key) of each MTrk chunk, or nil */
+    IntArray *chunkoffsets;  /** The file offset of each MTrk chunk */
+    NSString *notesKey;      /** The options fingerprint of notesResult */
+    Array *notesResult;      /** The tracks returned by the last changeMidiNotes */
+    ScoreCache *scorecache;  /** The cache this file was loaded with, or nil */
+    NSString *scorekey;      /** The cache key of the midi data, or nil */
 }
 
 @property (nonatomic, readonly) NSString *filename;
 @property (nonatomic, readonly) Array *tracks;
 @property (nonatomic, readonly) TimeSignature *time;
+@property (nonatomic, readonly) TempoMap *tempomap;
+@property (nonatomic, readonly) MeasureMap *measuremap;
 @property (nonatomic, readonly) int totalpulses;
+@property (nonatomic, readonly) ScoreCache *scorecache;
 
 -(id)initWithFile:(NSString*)path;
--(Array*)readTrack:(MidiFileReader*)file;
+-(id)initWithFile:(NSString*)path andMap:(BOOL)map;
+-(id)initWithData:(NSData*)data andFilename:(NSString*)path;
+-(id)initWithReader:(MidiFileReader*)file andFilename:(NSString*)path;
+-(id)initWithReader:(MidiFileReader*)file andFilename:(NSString*)path
+           andCache:(ScoreCache*)cache;
+-(id)initWithReader:(MidiFileReader*)file andFilename:(NSString*)path
+        andPrevious:(MidiFile*)prev;
+-(id)initWithReader:(MidiFileReader*)file andFilename:(NSString*)path
+           andCache:(ScoreCache*)cache andPrevious:(MidiFile*)prev;
+-(Array*)events;
+-(void)readTracks:(MidiFileReader*)file count:(int)num_tracks;
+-(void)readTracks:(MidiFileReader*)file count:(int)num_tracks createTracks:(BOOL)create;
+-(void)readTracks:(MidiFileReader*)file count:(int)num_tracks createTracks:(BOOL)create
+         previous:(MidiFile*)prev;
+-(NSData*)cacheData;
+-(BOOL)readCache:(MidiFileReader*)cached;
+-(MidiEventTable*)readTrack:(MidiFileReader*)file;
 -(IntArray*)guessMeasureLength;
+-(IntArray*)guessMeasureLengthWithConfidence:(IntArray*)confidence;
 -(BOOL)changeSound:(MidiOptions *)options toFile:(NSString*)filename;
--(Array*)applyOptionsToEvents:(MidiOptions *)options;
--(Array*)applyOptionsPerChannel:(MidiOptions *)options;
+-(NSData*)soundDataWithOptions:(MidiOptions *)options;
+-(SeekCheckpoints*)checkpointsForTrack:(int)tracknum;
 -(Array*)changeMidiNotes:(MidiOptions*)options;
+-(MeasureMap*)measuresForOptions:(MidiOptions*)options;
+-(NSString*)cacheKeyForOptions:(MidiOptions*)options;
 -(int)endTime;
 -(BOOL)hasLyrics;
 
-+(void)findHighLowNotes:(Array*)notes withMeasure:(int)measurelen startIndex:(int)startindex
-                        fromStart:(int)starttime toEnd:(int)endtime withHigh:(int*)high
-                        andLow:(int*)low;
-
-+(void)findExactHighLowNotes:(Array*)notes startIndex:(int)startindex
-                        withStart:(int)starttime withHigh:(int*)high
-                        andLow:(int*)low; 
-
 +(Array*)splitTrack:(MidiTrack *)track withMeasure:(int)measurelen;
-+(Array*)splitChannels:(MidiTrack *)track withEvents:(Array*)events;
++(Array*)splitChannels:(MidiTrack *)track withEvents:(MidiEventTable*)events;
 +(MidiTrack*) combineToSingleTrack:(Array *)tracks;
++(MidiTrack*) combineToSingleTrack:(Array *)tracks useTrackAsChannel:(BOOL)usetrack;
 
 +(Array*) combineToTwoTracks:(Array *)tracks withMeasure:(int)measurelen;
 +(void)checkStartTimes:(Array *)tracks;
 +(void)roundStartTimes:(Array *)tracks toInterval:(int)millisec  withTime:(TimeSignature*)time;
++(void)roundStartTimes:(Array *)tracks toInterval:(int)millisec  withTempoMap:(TempoMap*)map;
++(void)snapStartTimes:(Array *)tracks withQuarter:(int)quarter toGrid:(int)lines;
 +(void)roundDurations:(Array *)tracks withQuarter:(int)quarternote;
 +(void)shiftTime:(Array*)tracks byAmount:(int)amount;
 +(void)transpose:(Array*)tracks byAmount:(int)amount;
 +(BOOL)hasMultipleChannels:(MidiTrack*) track;
 +(NSArray*) instrumentNames;
 
-+(int)getTrackLength:(Array*)events;
 +(BOOL)writeToFile:(NSString*)filename withEvents:(Array*)events andMode:(int)mode andQuarter:(int)quarter;
-+(Array*)cloneMidiEvents:(Array*)origlist;
-+(void) addTempoEvent:(Array*)eventlist withTempo:(int)tempo;
-+(Array*)startAtPauseTime:(int)pauseTime withEvents:(Array*)list;
++(BOOL)writeToFile:(NSString*)filename withEvents:(Array*)events andMode:(int)mode
+       andQuarter:(int)quarter runningStatus:(BOOL)runningStatus;
++(NSData*)dataWithEvents:(Array*)events andMode:(int)mode
+       andQuarter:(int)quarter runningStatus:(BOOL)runningStatus;
 +(NSString*)titleName:(NSString*)filename;
 
 @end
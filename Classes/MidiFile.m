@@ -11,7 +11,10 @@
  */
 
 #import "MidiFile.h"
+#import "RadixSort.h"
 #import <Foundation/NSAutoreleasePool.h>
+#import <Foundation/NSDictionary.h>
+#import <Foundation/NSValue.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
@@ -21,6 +24,7 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <math.h>
+#include <dispatch/dispatch.h>
 
 /* This file contains the classes for parsing and modifying MIDI music files */
 
@@ -245,14 +249,876 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
     while (offset < len);
 }
 
+/** A growable byte buffer, used to encode a Midi file in memory */
+typedef struct MidiBuffer {
+    u_char *data;   /** The encoded bytes */
+    int len;        /** The number of bytes used */
+    int capacity;   /** The number of bytes allocated */
+} MidiBuffer;
+
+/** Make room for at least amount more bytes in the buffer */
+static void reserveBytes(MidiBuffer *buf, int amount) {
+    if (buf->len + amount > buf->capacity) {
+        int capacity = buf->capacity * 2;
+        if (capacity < buf->len + amount) {
+            capacity = buf->len + amount;
+        }
+        buf->data = (u_char*)realloc(buf->data, capacity);
+        buf->capacity = capacity;
+    }
+}
+
+/** Append the given bytes to the buffer */
+static void appendBytes(MidiBuffer *buf, const u_char *bytes, int len) {
+    reserveBytes(buf, len);
+    memcpy(&buf->data[buf->len], bytes, len);
+    buf->len += len;
+}
+
+/** Start a new buffer with the MThd header: len = 6, track mode,
+ * number of tracks, and quarter note.
+ */
+static void initBuffer(MidiBuffer *buf, int trackmode, int numtracks, int quarter) {
+    buf->capacity = 65536;
+    buf->data = (u_char*)malloc(buf->capacity);
+    buf->len = 0;
+    u_char header[14] = {
+        'M', 'T', 'h', 'd', 0, 0, 0, 6,
+        (u_char)(trackmode >> 8), (u_char)(trackmode & 0xFF),
+        (u_char)(numtracks >> 8), (u_char)(numtracks & 0xFF),
+        (u_char)(quarter >> 8), (u_char)(quarter & 0xFF)
+    };
+    appendBytes(buf, header, 14);
+}
+
+/** Write the data to the given file, with a single write() call.
+ * Return true on success, and false on error.
+ *
+ * Write to a temporary file, then rename it to the destination.
+ * The destination may be the file a MidiFile is memory mapped
+ * from, and truncating that file in place would invalidate the
+ * mapping (and the meta event values pointing into it).  The
+ * temporary file gets a unique name from mkstemp, so two writers to
+ * the same destination don't write into each other's file.
+ */
+static BOOL writeDataToFile(NSData *data, NSString *filename) {
+    NSString *tmpname = [filename stringByAppendingString:@".tmp.XXXXXX"];
+    const char *cfilename = [filename cStringUsingEncoding:NSUTF8StringEncoding];
+    char *ctmpname = strdup([tmpname cStringUsingEncoding:NSUTF8StringEncoding]);
+    int file = mkstemp(ctmpname);
+    if (file < 0) {
+        free(ctmpname);
+        return NO;
+    }
+    int error = 0;
+    fchmod(file, 0644);
+    dowrite(file, (u_char*)[data bytes], (int)[data length], &error);
+    close(file);
+    if (!error && rename(ctmpname, cfilename) != 0) {
+        error = 1;
+    }
+    if (error) {
+        unlink(ctmpname);
+    }
+    free(ctmpname);
+    return !error;
+}
+
+/** Append a single Midi event (delta time, event code, and data) to
+ * the buffer.  If runstatus is not NULL, it holds the event code of
+ * the previous channel event, and the event code is left out when
+ * it's the same (running status).  Any other event cancels the
+ * running status, since the parser keeps the last event code, even
+ * for meta events.
+ */
+static void encodeEvent(MidiBuffer *buf, const MidiRawEvent *event, int *runstatus) {
+    u_char flag = event->eventFlag;
+    int metalength = (flag >= SysexEvent1) ? event->metalength : 0;
+
+    /* At most 4 bytes delta time, 2 bytes event code (and meta event),
+     * 4 bytes length, and the meta value.
+     */
+    reserveBytes(buf, 10 + metalength);
+    u_char *out = buf->data;
+    int len = buf->len;
+
+    len += varlenToBytes(event->deltaTime, out, len);
+    if (flag == SysexEvent1 || flag == SysexEvent2 || flag == MetaEvent) {
+        out[len++] = flag;
+        if (runstatus != NULL) {
+            *runstatus = 0;
+        }
+    }
+    else {
+        u_char status = (u_char)(flag + event->channel);
+        BOOL channelEvent = (flag >= EventNoteOff && flag < SysexEvent1);
+        if (runstatus == NULL || !channelEvent || *runstatus != status) {
+            out[len++] = status;
+        }
+        if (runstatus != NULL) {
+            *runstatus = channelEvent ? status : 0;
+        }
+    }
+
+    switch (flag) {
+        case EventNoteOn:
+        case EventNoteOff:
+        case EventKeyPressure:
+        case EventControlChange:
+        case EventPitchBend:
+            out[len++] = event->data1;
+            out[len++] = event->data2;
+            break;
+        case EventProgramChange:
+        case EventChannelPressure:
+            out[len++] = event->data1;
+            break;
+        case SysexEvent1:
+        case SysexEvent2:
+            len += varlenToBytes(metalength, out, len);
+            memcpy(&out[len], event->metavalue, metalength);
+            len += metalength;
+            break;
+        case MetaEvent:
+            out[len++] = event->metaevent;
+            len += varlenToBytes(metalength, out, len);
+            memcpy(&out[len], event->metavalue, metalength);
+            len += metalength;
+            break;
+        default:
+            break;
+    }
+    buf->len = len;
+}
+
+/** Fill in the raw event for the given MidiEvent.  A MidiEvent keeps
+ * the tempo separately from its meta value, so the value of a tempo
+ * event is stored in tempobuf (3 bytes).
+ */
+static void getRawEvent(MidiEvent *mevent, MidiRawEvent *event, u_char *tempobuf) {
+    u_char flag = mevent.eventFlag;
+    event->deltaTime = mevent.deltaTime;
+    event->startTime = mevent.startTime;
+    event->eventFlag = flag;
+    event->channel = mevent.channel;
+    event->data1 = 0;
+    event->data2 = 0;
+    event->metaevent = mevent.metaevent;
+    event->metalength = mevent.metalength;
+    event->metavalue = mevent.metavalue;
+
+    if (flag == EventNoteOn || flag == EventNoteOff) {
+        event->data1 = mevent.notenumber;
+        event->data2 = mevent.velocity;
+    }
+    else if (flag == EventKeyPressure) {
+        event->data1 = mevent.notenumber;
+        event->data2 = mevent.keyPressure;
+    }
+    else if (flag == EventControlChange) {
+        event->data1 = mevent.controlNum;
+        event->data2 = mevent.controlValue;
+    }
+    else if (flag == EventProgramChange) {
+        event->data1 = mevent.instrument;
+    }
+    else if (flag == EventChannelPressure) {
+        event->data1 = mevent.chanPressure;
+    }
+    else if (flag == EventPitchBend) {
+        event->data1 = (u_char)(mevent.pitchBend >> 8);
+        event->data2 = (u_char)(mevent.pitchBend & 0xFF);
+    }
+    else if (flag == MetaEvent && mevent.metaevent == MetaEventTempo) {
+        tempobuf[0] = (u_char)((mevent.tempo >> 16) & 0xFF);
+        tempobuf[1] = (u_char)((mevent.tempo >> 8) & 0xFF);
+        tempobuf[2] = (u_char)(mevent.tempo & 0xFF);
+        event->metalength = 3;
+        event->metavalue = tempobuf;
+    }
+}
+
+/** Scale the tempo of a tempo event when the playback tempo is
+ *  changed from oldtempo to newtempo.  The result is clamped to
+ *  the 3 bytes of a tempo event.
+ */
+static int scaleTempo(int tempo, int newtempo, int oldtempo) {
+    long long scaled = (long long)tempo * newtempo / oldtempo;
+    if (scaled < 1)
+        scaled = 1;
+    if (scaled > 0xFFFFFF)
+        scaled = 0xFFFFFF;
+    return (int)scaled;
+}
+
+/** The sound options (MidiOptions) to apply to the events of a track
+ * while it's encoded for playback.  The events themselves are never
+ * copied or modified.
+ */
+typedef struct SoundOverlay {
+    int transpose;         /** The amount to transpose the notes by */
+    int newtempo;          /** The playback tempo (microseconds per quarter note) */
+    int oldtempo;          /** The starting tempo of the song */
+    int pauseTime;         /** Start playing at this time (in pulses), if not 0 */
+    int instruments[16];   /** The instrument for each channel, or -1 to keep it */
+    BOOL mute[16];         /** True if the notes of the channel are silent */
+} SoundOverlay;
+
+/** Apply the sound options to a single event:
+ * - Transpose the note number
+ * - Silence the notes of muted channels (velocity 0)
+ * - Change the instrument
+ * - Scale the tempo.  Each tempo change is scaled by the same amount,
+ *   so that songs with several tempos keep their relative speeds.
+ */
+static void applyOverlay(SoundOverlay *overlay, MidiRawEvent *event, u_char *tempobuf) {
+    u_char flag = event->eventFlag;
+    if (flag == EventNoteOn || flag == EventNoteOff || flag == EventKeyPressure) {
+        int num = event->data1 + overlay->transpose;
+        if (num < 0)
+            num = 0;
+        if (num > 127)
+            num = 127;
+        event->data1 = (u_char)num;
+    }
+    if ((flag == EventNoteOn || flag == EventNoteOff) && overlay->mute[event->channel]) {
+        event->data2 = 0;
+    }
+    if (flag == EventProgramChange && overlay->instruments[event->channel] >= 0) {
+        event->data1 = (u_char)overlay->instruments[event->channel];
+    }
+    if (flag == MetaEvent && event->metaevent == MetaEventTempo &&
+        event->metalength == 3) {
+        u_char *value = event->metavalue;
+        int tempo = (value[0] << 16) | (value[1] << 8) | value[2];
+        tempo = scaleTempo(tempo, overlay->newtempo, overlay->oldtempo);
+        tempobuf[0] = (u_char)((tempo >> 16) & 0xFF);
+        tempobuf[1] = (u_char)((tempo >> 8) & 0xFF);
+        tempobuf[2] = (u_char)(tempo & 0xFF);
+        event->metavalue = tempobuf;
+    }
+}
+
+/** Append a channel event (with delta time 0) to the buffer */
+static void encodeChannelEvent(MidiBuffer *buf, SoundOverlay *overlay, int *runstatus,
+                               u_char flag, int channel, int data1, int data2) {
+    MidiRawEvent event;
+    memset(&event, 0, sizeof(event));
+    event.eventFlag = flag;
+    event.channel = (u_char)channel;
+    event.data1 = (u_char)data1;
+    event.data2 = (u_char)data2;
+    applyOverlay(overlay, &event, NULL);
+    encodeEvent(buf, &event, runstatus);
+}
+
+/** Append a tempo event (with delta time 0) to the buffer */
+static void encodeTempoEvent(MidiBuffer *buf, int tempo, int *runstatus) {
+    u_char value[3];
+    value[0] = (u_char)((tempo >> 16) & 0xFF);
+    value[1] = (u_char)((tempo >> 8) & 0xFF);
+    value[2] = (u_char)(tempo & 0xFF);
+    MidiRawEvent event;
+    memset(&event, 0, sizeof(event));
+    event.eventFlag = MetaEvent;
+    event.metaevent = MetaEventTempo;
+    event.metalength = 3;
+    event.metavalue = value;
+    encodeEvent(buf, &event, runstatus);
+}
+
+/** Append the sound state of the track at the pause time, so that
+ * playback can start there.  Return the index of the first event at
+ * or after the pause time.  The state is written with delta time 0:
+ * - The last tempo
+ * - All the sysex events (since these may reset the synthesizer)
+ * - The controllers, instrument, channel pressure and pitch bend
+ *   of each channel
+ */
+static int encodeSeekState(MidiBuffer *buf, MidiEventTable *table, SeekCheckpoints *seek,
+                           SoundOverlay *overlay, int *runstatus) {
+    ChannelState channels[16];
+    int tempo = 0;
+    int first = [seek stateAtTime:overlay->pauseTime channels:channels tempo:&tempo];
+    if (tempo > 0) {
+        encodeTempoEvent(buf, scaleTempo(tempo, overlay->newtempo, overlay->oldtempo),
+                         runstatus);
+    }
+    MidiRawEvent event;
+    IntArray *sysex = seek.sysex;
+    for (int i = 0; i < [sysex count] && [sysex get:i] < first; i++) {
+        [table getRawEvent:[sysex get:i] into:&event];
+        event.deltaTime = 0;
+        encodeEvent(buf, &event, runstatus);
+    }
+    for (int ch = 0; ch < 16; ch++) {
+        ChannelState *state = &channels[ch];
+        for (int c = 0; c < 128; c++) {
+            if (state->controllers[c] != StateUnset) {
+                encodeChannelEvent(buf, overlay, runstatus, EventControlChange,
+                                   ch, c, state->controllers[c]);
+            }
+        }
+        if (state->program != StateUnset) {
+            encodeChannelEvent(buf, overlay, runstatus, EventProgramChange,
+                               ch, state->program, 0);
+        }
+        if (state->pressure != StateUnset) {
+            encodeChannelEvent(buf, overlay, runstatus, EventChannelPressure,
+                               ch, state->pressure, 0);
+        }
+        if (state->pitchbend != PitchBendUnset) {
+            encodeChannelEvent(buf, overlay, runstatus, EventPitchBend,
+                               ch, state->pitchbend >> 8, state->pitchbend & 0xFF);
+        }
+    }
+    return first;
+}
+
+/** Append the given track (an Array of MidiEvents, or a MidiEventTable)
+ * to the buffer, as an MTrk chunk.  The chunk length is filled in after
+ * the events are encoded.
+ *
+ * If overlay is not NULL, the track starts with a tempo event (the
+ * song's starting tempo), and the sound options are applied to each
+ * event as it's encoded.  If the overlay has a pause time, the song
+ * starts at the pause time instead.  The track must then be a
+ * MidiEventTable, and seek its checkpoints.  The sound state at the
+ * pause time is written first (see encodeSeekState), followed by the
+ * events after the pause time.  The first of these is moved up to
+ * the pause time.
+ */
+static void encodeTrack(MidiBuffer *buf, id events, SoundOverlay *overlay,
+                        SeekCheckpoints *seek, BOOL runningStatus) {
+    BOOL istable = [events isKindOfClass:[MidiEventTable class]];
+    int count = [events count];
+    int runstatus = 0;
+    int *rs = runningStatus ? &runstatus : NULL;
+    MidiRawEvent event;
+    u_char tempobuf[3];
+
+    /* Write the MTrk header, and leave room for the track length */
+    appendBytes(buf, (u_char*)"MTrk\0\0\0\0", 8);
+    int lenoffset = buf->len - 4;
+
+    int first = 0;
+    int pauseTime = 0;
+    if (overlay != NULL) {
+        encodeTempoEvent(buf, scaleTempo(overlay->oldtempo, overlay->newtempo,
+                                         overlay->oldtempo), rs);
+        if (overlay->pauseTime != 0) {
+            assert(istable && seek != nil);
+            pauseTime = overlay->pauseTime;
+            first = encodeSeekState(buf, events, seek, overlay, rs);
+        }
+    }
+
+    for (int i = first; i < count; i++) {
+        if (istable) {
+            [(MidiEventTable*)events getRawEvent:i into:&event];
+        }
+        else {
+            getRawEvent([events get:i], &event, tempobuf);
+        }
+        if (pauseTime != 0 && i == first) {
+            event.deltaTime = event.startTime - pauseTime;
+        }
+        if (overlay != NULL) {
+            applyOverlay(overlay, &event, tempobuf);
+        }
+        encodeEvent(buf, &event, rs);
+    }
+    intToBytes(buf->len - lenoffset - 4, buf->data, lenoffset);
+}
+
+/** Return the hash of the MTrk chunk (header and events) at the given
+ * offset.  If the chunk length is invalid, hash up to the end of the
+ * data, since that's how far readTrack will parse.
+ */
+static NSString* chunkKey(MidiFileReader *file, int offset) {
+    u_char *chunk = [file bytes] + offset;
+    int available = [file length] - offset;
+    int len = available;
+    if (available >= 8) {
+        len = 8 + ((chunk[4] << 24) | (chunk[5] << 16) | (chunk[6] << 8) | chunk[7]);
+        if (len < 8 || len > available) {
+            len = available;
+        }
+    }
+    return [ScoreCache keyForBytes:chunk length:len];
+}
+
+/** A k-way merge of the notes in several tracks, used by
+ *  combineToSingleTrack.  The heap holds the tracks that still have
+ *  notes, ordered by the start time and number of their next note.
+ *  Ties go to the lower track number, so the notes come out in the
+ *  same order as a scan of the tracks from first to last.
+ */
+typedef struct NoteMerge {
+    NoteView *views;   /** The notes in each track */
+    int *next;         /** The index of the next note in each track */
+    int *heap;         /** The tracks with notes left, as a binary min-heap */
+    int size;          /** The number of tracks in the heap */
+} NoteMerge;
+
+/** Return true if the next note in track a comes before the next
+ *  note in track b.
+ */
+static BOOL mergeBefore(NoteMerge *merge, int a, int b) {
+    int starta = merge->views[a].starttime[merge->next[a]];
+    int startb = merge->views[b].starttime[merge->next[b]];
+    if (starta != startb) {
+        return starta < startb;
+    }
+    int numbera = merge->views[a].number[merge->next[a]];
+    int numberb = merge->views[b].number[merge->next[b]];
+    if (numbera != numberb) {
+        return numbera < numberb;
+    }
+    return a < b;
+}
+
+/** Move the track at the given heap position down to its place */
+static void mergeSiftDown(NoteMerge *merge, int pos) {
+    int *heap = merge->heap;
+    int track = heap[pos];
+    while (1) {
+        int child = 2*pos + 1;
+        if (child >= merge->size) {
+            break;
+        }
+        if (child + 1 < merge->size && mergeBefore(merge, heap[child+1], heap[child])) {
+            child++;
+        }
+        if (!mergeBefore(merge, heap[child], track)) {
+            break;
+        }
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = track;
+}
+
+
+/** Add a note index to a heap of note indexes.  With sign 1, the
+ *  note with the highest number is on top, and with sign -1, the note
+ *  with the lowest number.
+ */
+static void heapPush(int *heap, int *size, int note, const int *number, int sign) {
+    int pos = (*size)++;
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (sign * number[heap[parent]] >= sign * number[note]) {
+            break;
+        }
+        heap[pos] = heap[parent];
+        pos = parent;
+    }
+    heap[pos] = note;
+}
+
+/** Remove the note on top of a heap made by heapPush */
+static void heapPop(int *heap, int *size, const int *number, int sign) {
+    int note = heap[--(*size)];
+    int pos = 0;
+    while (1) {
+        int child = 2*pos + 1;
+        if (child >= *size) {
+            break;
+        }
+        if (child + 1 < *size &&
+            sign * number[heap[child+1]] > sign * number[heap[child]]) {
+            child++;
+        }
+        if (sign * number[heap[child]] <= sign * number[note]) {
+            break;
+        }
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    if (*size > 0) {
+        heap[pos] = note;
+    }
+}
+
+/** Return the position in a stack of increasing note indexes of the
+ *  first index that is at least the given index.
+ */
+static int stackSearch(const int *stack, int size, int index) {
+    int left = 0;
+    int right = size - 1;
+    while (left < right) {
+        int mid = (left + right) / 2;
+        if (stack[mid] < index) {
+            left = mid + 1;
+        }
+        else {
+            right = mid;
+        }
+    }
+    return left;
+}
+
+/** For every note in a track (sorted by start time), find the high
+ *  and low notes near it that splitTrack uses to choose its staff,
+ *  without rescanning the nearby notes for each note.
+ *
+ *  The notes used for a note starting at time s with duration d are
+ *  the notes j with
+ *    s - measurelen <= start(j) < s + min(d, measurelen), end(j) >= s
+ *  which are
+ *  - The notes that started before s, within a measure, and are still
+ *    playing at s.  These are kept in a max-heap and a min-heap of
+ *    numbers; a note is removed from the top once s passes its end or
+ *    a measure after its start.
+ *  - The notes that start in [s, s + min(d, measurelen)), which are a
+ *    range of indexes.  The ranges are answered in order of their end,
+ *    with a stack of indexes with decreasing (increasing) numbers.
+ *
+ *  The exact high and low notes are the high and low of the notes
+ *  that start at s.
+ */
+static void findAllHighLowNotes(NoteView notes, int measurelen, int *high, int *low,
+                                int *highExact, int *lowExact) {
+    int n = notes.count;
+    const int *start = notes.starttime;
+    const int *number = notes.number;
+    int *maxheap = (int*) malloc(n * sizeof(int));
+    int *minheap = (int*) malloc(n * sizeof(int));
+    int *groupstart = (int*) malloc(n * sizeof(int));
+    int *rangehead = (int*) malloc((n+1) * sizeof(int));
+    int *rangenext = (int*) malloc(n * sizeof(int));
+    int maxsize = 0, minsize = 0;
+    int added = 0;
+
+    for (int i = 0; i <= n; i++) {
+        rangehead[i] = -1;
+    }
+
+    int group = 0;
+    for (int i = 0; i < n; i++) {
+        int s = start[i];
+        if (s != start[group]) {
+            group = i;
+        }
+        groupstart[i] = group;
+        high[i] = low[i] = number[i];
+
+        /* The notes that started before s, and are still playing */
+        while (added < n && start[added] < s) {
+            heapPush(maxheap, &maxsize, added, number, 1);
+            heapPush(minheap, &minsize, added, number, -1);
+            added++;
+        }
+        while (maxsize > 0) {
+            int j = maxheap[0];
+            if (start[j] + notes.duration[j] >= s && start[j] + measurelen >= s) {
+                break;
+            }
+            heapPop(maxheap, &maxsize, number, 1);
+        }
+        while (minsize > 0) {
+            int j = minheap[0];
+            if (start[j] + notes.duration[j] >= s && start[j] + measurelen >= s) {
+                break;
+            }
+            heapPop(minheap, &minsize, number, -1);
+        }
+        if (maxsize > 0 && high[i] < number[maxheap[0]]) {
+            high[i] = number[maxheap[0]];
+        }
+        if (minsize > 0 && low[i] > number[minheap[0]]) {
+            low[i] = number[minheap[0]];
+        }
+
+        /* The range of notes starting in [s, end) ends at the first
+         * note starting at or after end.
+         */
+        int end = s + notes.duration[i];
+        if (end > s + measurelen) {
+            end = s + measurelen;
+        }
+        if (end > s) {
+            int left = i + 1;
+            int right = n;
+            while (left < right) {
+                int mid = (left + right) / 2;
+                if (start[mid] < end) {
+                    left = mid + 1;
+                }
+                else {
+                    right = mid;
+                }
+            }
+            rangenext[i] = rangehead[left];
+            rangehead[left] = i;
+        }
+    }
+
+    /* Answer the ranges in order of their end.  The max stack holds
+     * the indexes up to the current one whose number is higher than
+     * every later number, so the highest number in a range is the
+     * first stack entry inside the range.
+     */
+    int *maxstack = maxheap;
+    int *minstack = minheap;
+    maxsize = minsize = 0;
+    for (int r = 0; r < n; r++) {
+        while (maxsize > 0 && number[maxstack[maxsize-1]] <= number[r]) {
+            maxsize--;
+        }
+        maxstack[maxsize++] = r;
+        while (minsize > 0 && number[minstack[minsize-1]] >= number[r]) {
+            minsize--;
+        }
+        minstack[minsize++] = r;
+
+        for (int i = rangehead[r+1]; i != -1; i = rangenext[i]) {
+            int g = groupstart[i];
+            int rangehigh = number[maxstack[stackSearch(maxstack, maxsize, g)]];
+            int rangelow = number[minstack[stackSearch(minstack, minsize, g)]];
+            if (high[i] < rangehigh) {
+                high[i] = rangehigh;
+            }
+            if (low[i] > rangelow) {
+                low[i] = rangelow;
+            }
+        }
+    }
+
+    /* The notes that start exactly at s */
+    for (int g = 0; g < n; ) {
+        int groupend = g;
+        int grouphigh = number[g];
+        int grouplow = number[g];
+        while (groupend < n && start[groupend] == start[g]) {
+            if (grouphigh < number[groupend]) {
+                grouphigh = number[groupend];
+            }
+            if (grouplow > number[groupend]) {
+                grouplow = number[groupend];
+            }
+            groupend++;
+        }
+        for (int i = g; i < groupend; i++) {
+            highExact[i] = grouphigh;
+            lowExact[i] = grouplow;
+        }
+        g = groupend;
+    }
+
+    free(maxheap);
+    free(minheap);
+    free(groupstart);
+    free(rangehead);
+    free(rangenext);
+}
+
+
+/** Combine the sorted start times that are close together.  If two
+ *  consecutive start times are within the interval of the tempo
+ *  segment of the first one, make them the same.  The segment is
+ *  found by walking the segments forward, since the start times are
+ *  sorted.
+ */
+static void combineStartTimes(int *starttimes, int n, const int *segmentpulses,
+                              const int *intervals, int segments) {
+    int segment = 0;
+    for (int i = 0; i < n - 1; i++) {
+        int start = starttimes[i];
+        while (segment + 1 < segments && segmentpulses[segment+1] <= start) {
+            segment++;
+        }
+        if (starttimes[i+1] - start <= intervals[segment]) {
+            starttimes[i+1] = start;
+        }
+    }
+}
+
+/** Change the start times of a track (sorted by start time) to the
+ *  combined start time that is at most an interval earlier, in a
+ *  single forward pass over the track and the combined start times.
+ */
+static void roundTrackStartTimes(int *starttime, int count, const int *combined, int n,
+                                 const int *segmentpulses, const int *intervals,
+                                 int segments) {
+    int segment = 0;
+    int i = 0;
+    for (int j = 0; j < count; j++) {
+        int start = starttime[j];
+        while (segment + 1 < segments && segmentpulses[segment+1] <= start) {
+            segment++;
+        }
+        int interval = intervals[segment];
+        while (i < n - 1 && start - interval > combined[i]) {
+            i++;
+        }
+        if (start > combined[i] && start - combined[i] <= interval) {
+            starttime[j] = combined[i];
+        }
+    }
+}
+
+/** Round each start time to the nearest of the grid points
+ *  round(k * quarter / lines).  Each point is rounded on its own, so
+ *  a grid that doesn't divide the quarter note (like triplets) doesn't
+ *  drift away from the beat.
+ */
+static void snapTrackStartTimes(int *starttime, int count, int quarter, int lines) {
+    long long q = quarter;
+    for (int j = 0; j < count; j++) {
+        long long k = (2 * (long long)starttime[j] * lines + q) / (2 * q);
+        starttime[j] = (int)((2 * k * q + lines) / (2 * lines));
+    }
+}
+
+/** Round the durations of a track (sorted by start time) up to the
+ *  next note, as described in roundDurations.  The next note with a
+ *  later start time only moves forward, so this is a single pass.
+ */
+static void roundTrackDurations(const int *starttime, int *duration, int count,
+                                int quarternote) {
+    int prev = -1;
+    int next = 0;
+    for (int i = 0; i < count - 1; i++) {
+        if (prev == -1) {
+            prev = i;
+        }
+
+        /* Get the next note that has a different start time */
+        if (next <= i) {
+            next = i + 1;
+        }
+        while (next < count - 1 && starttime[next] <= starttime[i]) {
+            next++;
+        }
+        int maxduration = starttime[next] - starttime[i];
+
+        int dur = 0;
+        if (quarternote <= maxduration)
+            dur = quarternote;
+        else if (quarternote/2 <= maxduration)
+            dur = quarternote/2;
+        else if (quarternote/3 <= maxduration)
+            dur = quarternote/3;
+        else if (quarternote/4 <= maxduration)
+            dur = quarternote/4;
+
+        if (dur < duration[i]) {
+            dur = duration[i];
+        }
+
+        /* Special case: If the previous note's duration
+         * matches this note's duration, we can make a notepair.
+         * So don't expand the duration in that case.
+         */
+        if (starttime[prev] + duration[prev] == starttime[i] &&
+            duration[prev] == duration[i]) {
+
+            dur = duration[i];
+        }
+        duration[i] = dur;
+        if (starttime[i+1] != starttime[i]) {
+            prev = i;
+        }
+    }
+}
+
+
+/** Return a string that identifies the options used by changeMidiNotes.
+ *  Two options with the same fingerprint give the same notes.
+ */
+static NSString* notesFingerprint(MidiOptions *options, TimeSignature *timesig) {
+    NSMutableString *key = [NSMutableString stringWithCapacity:64];
+    for (int track = 0; track < [options.tracks count]; track++) {
+        [key appendString:([options.tracks get:track] ? @"1" : @"0")];
+    }
+    [key appendFormat:@" %d %d %d %d %d %d %d", timesig.quarter, timesig.measure,
+        options.snapGrid, options.combineInterval, options.twoStaffs,
+        options.shifttime, options.transpose];
+    return key;
+}
+
+/** Shift the start times and transpose the numbers of the notes in a
+ *  single pass.  Notes transposed below 0 are clamped to 0.
+ */
+static void shiftAndTranspose(NoteView notes, int shift, int transpose) {
+    for (int j = 0; j < notes.count; j++) {
+        int number = notes.number[j] + transpose;
+        notes.starttime[j] += shift;
+        notes.number[j] = (number < 0) ? 0 : number;
+    }
+}
+
+
+/** A measure length guessed by guessMeasureLengthWithConfidence */
+typedef struct MeasureGuess {
+    int length;       /** The measure length, in pulses */
+    int confidence;   /** How well the note onsets repeat after this length, 0 to 100 */
+} MeasureGuess;
+
+/** Sort measure guesses by highest confidence, then by shortest length.
+ *  Twice the real measure length scores about the same as the measure
+ *  itself, so the shorter length should come first.
+ */
+static int sortguesses(const void* v1, const void* v2) {
+    const MeasureGuess *g1 = (const MeasureGuess*) v1;
+    const MeasureGuess *g2 = (const MeasureGuess*) v2;
+    if (g1->confidence != g2->confidence) {
+        return g2->confidence - g1->confidence;
+    }
+    return g1->length - g2->length;
+}
+
+/** An in-place radix-2 fast fourier transform of n complex values,
+ *  where n is a power of 2.  The inverse transform is not scaled.
+ */
+static void fft(double *re, double *im, int n, BOOL inverse) {
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            double t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+        double angle = 2 * M_PI / len * (inverse ? 1 : -1);
+        double wre = cos(angle);
+        double wim = sin(angle);
+        for (int i = 0; i < n; i += len) {
+            double ure = 1, uim = 0;
+            for (int j = 0; j < len/2; j++) {
+                int a = i + j;
+                int b = i + j + len/2;
+                double vre = re[b] * ure - im[b] * uim;
+                double vim = re[b] * uim + im[b] * ure;
+                re[b] = re[a] - vre;
+                im[b] = im[a] - vim;
+                re[a] += vre;
+                im[a] += vim;
+                double t = ure * wre - uim * wim;
+                uim = ure * wim + uim * wre;
+                ure = t;
+            }
+        }
+    }
+}
+
+
 /** @class MidiFile
  *
  * The MidiFile class contains the parsed data from the Midi File.
  * It contains:
- * - All the tracks in the midi file, including all MidiNotes per track.
+ * - All the tracks in the midi file, including all the notes per track.
  * - The time signature (e.g. 4/4, 3/4, 6/8)
  * - The number of pulses per quarter note.
  * - The tempo (number of microseconds per quarter note).
+ * - The tempo map, for songs whose tempo changes.
+ * - The measure map, for songs whose time signature changes.
  *
  * The constructor takes a filename as input, and upon returning,
  * contains the parsed data from the midi file.
@@ -275,19 +1141,23 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
  *     roundStartTimes()
  *     roundDurations()
  *
- * - changeSound()
- *   Apply the menu options to the MIDI music data, and save the modified midi data
- *   to a file, for playback.  This uses the helper functions:
- *     addTempoEvent()
- *     changeSoundPerChannel
+ * - soundDataWithOptions(), changeSound()
+ *   Apply the menu options to the MIDI music data, and return the modified
+ *   midi data (or save it to a file), for playback.  The options are applied
+ *   while the events are encoded, by the helper functions:
+ *     encodeTrack()
+ *     applyOverlay()
  */
 
 @implementation MidiFile
 
 @synthesize tracks;
 @synthesize time;
+@synthesize tempomap;
+@synthesize measuremap;
 @synthesize filename;
 @synthesize totalpulses;
+@synthesize scorecache;
 
 
 /** Parse the given Midi file, and return an instance of this MidiFile
@@ -298,24 +1168,81 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
  * - The number, starttime, and duration of each note.
  */
 - (id)initWithFile:(NSString*)path {
+    return [self initWithFile:path andMap:YES];
+}
+
+/** Parse the given Midi file, as above.  If map is false, the file is
+ * read into memory instead of being memory mapped.  A file that another
+ * program may rewrite while it's open must not be mapped, since the
+ * meta event values would change under us, and reading past the end
+ * of a truncated mapping raises SIGBUS.
+ */
+- (id)initWithFile:(NSString*)path andMap:(BOOL)map {
+    MidiFileReader *file = [[MidiFileReader alloc] initWithFile:path andMap:map];
+    return [self initWithReader:file andFilename:path];
+}
+
+/** Parse the given Midi data, which is already in memory. The data is
+ * retained, and the meta event values point directly into it.
+ */
+- (id)initWithData:(NSData*)data andFilename:(NSString*)path {
+    MidiFileReader *file = [[MidiFileReader alloc] initWithData:data];
+    return [self initWithReader:file andFilename:path];
+}
+
+/** Parse the Midi data from the given reader.  This MidiFile takes
+ * ownership of the reader, and keeps it alive for as long as the
+ * MidiEvents are, since their meta values point into the reader's data.
+ */
+- (id)initWithReader:(MidiFileReader*)file andFilename:(NSString*)path {
+    return [self initWithReader:file andFilename:path andCache:nil];
+}
+
+/** Parse the Midi data from the given reader, using the given cache
+ * (which may be nil).  If the cache has an entry for this data, the
+ * tracks, time signature, tempo map and measure map are loaded from
+ * the entry, and the raw midi events are only parsed if they are
+ * needed (see events).  Otherwise the data is parsed, and the result
+ * is stored in the cache.
+ */
+- (id)initWithReader:(MidiFileReader*)file andFilename:(NSString*)path
+            andCache:(ScoreCache*)cache {
+    return [self initWithReader:file andFilename:path andCache:cache andPrevious:nil];
+}
+
+/** Parse the Midi data from the given reader, which is a new version
+ * of the previous MidiFile (for example, after the file was saved by
+ * another program).  The tracks whose MTrk chunks are unchanged are
+ * copied from the previous MidiFile instead of being parsed again.
+ */
+- (id)initWithReader:(MidiFileReader*)file andFilename:(NSString*)path
+         andPrevious:(MidiFile*)prev {
+    return [self initWithReader:file andFilename:path andCache:nil andPrevious:prev];
+}
+
+/** Parse the Midi data from the given reader, using the given cache
+ * and previous MidiFile (either may be nil).
+ */
+- (id)initWithReader:(MidiFileReader*)file andFilename:(NSString*)path
+            andCache:(ScoreCache*)cache andPrevious:(MidiFile*)prev {
     const char *hdr;
     int len;
 
     filename = [path retain];
     tracks = [[Array new:5] retain];
     trackPerChannel = NO;
+    reader = file;
 
-    MidiFileReader *file = [[MidiFileReader alloc] initWithFile:filename];
     hdr = [file readAscii:4];
     if (strncmp(hdr, "MThd", 4) != 0) {
-        [file release];
+        [reader release]; reader = nil;
         MidiFileException *e =
            [MidiFileException init:@"Bad MThd header" offset:0];
         @throw e;
     }
     len = [file readInt];
     if (len !=  6) {
-        [file release];
+        [reader release]; reader = nil;
         MidiFileException *e =
            [MidiFileException init:@"Bad MThd len" offset:4];
         @throw e;
@@ -324,25 +1251,28 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
     int num_tracks = [file readShort];
     quarternote = [file readShort];
 
-    events = [[Array new:num_tracks] retain];
-    for (int tracknum = 0; tracknum < num_tracks; tracknum++) {
-        Array *trackevents = [self readTrack:file];
-        MidiTrack *track = 
-          [[MidiTrack alloc] initWithEvents:trackevents andTrack:tracknum];
-        [events add:trackevents];
-        track.number = tracknum;
-        if ([track.notes count] > 0) {
-            [tracks add:track];
+    NSString *key = nil;
+    if (cache != nil) {
+        key = [ScoreCache keyForBytes:[file bytes] length:[file length]];
+        scorecache = [cache retain];
+        scorekey = [key retain];
+        MidiFileReader *cached = [cache readerForKey:key];
+        if (cached != nil && [self readCache:cached]) {
+            cachereader = cached;
+            return self;
         }
-        [track release];
+        [cached release];
     }
 
+    events = [[Array new:num_tracks] retain];
+    [self readTracks:file count:num_tracks createTracks:YES previous:prev];
+
     /* Get the length of the song in pulses */
     for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
         MidiTrack *track = [tracks get:tracknum];
-        MidiNote *last = [track.notes get:([track.notes count] -1) ];
-        if (totalpulses < last.startTime + last.duration) {
-            totalpulses = last.startTime + last.duration;
+        int last = [track.notes endTime:([track.notes count] -1) ];
+        if (totalpulses < last) {
+            totalpulses = last;
         }
     }
 
@@ -351,7 +1281,7 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
      */
     if ([tracks count] == 1 && [MidiFile hasMultipleChannels:[tracks get:0]]) {
         MidiTrack *track = [tracks get:0];
-        Array *trackevents = [events get:track.number];
+        MidiEventTable *trackevents = [events get:track.number];
         Array* newtracks = [MidiFile splitChannels:track withEvents:trackevents];
         trackPerChannel = YES;
         [tracks release];
@@ -365,15 +1295,16 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
     int numer = 0;
     int denom = 0;
     for (int tracknum = 0; tracknum < [events count]; tracknum++) {
-        Array *eventlist = [events get:tracknum];
+        MidiEventTable *eventlist = [events get:tracknum];
         for (int i = 0; i < [eventlist count]; i++) {
-            MidiEvent *mevent = [eventlist get:i];
-            if (mevent.metaevent == MetaEventTempo && tempo == 0) {
-                tempo = mevent.tempo;
+            u_char metaevent = [eventlist metaevent:i];
+            if (metaevent == MetaEventTempo && tempo == 0) {
+                tempo = [eventlist tempo:i];
             }
-            if (mevent.metaevent == MetaEventTimeSignature && numer == 0) {
-                numer = mevent.numerator;
-                denom = mevent.denominator;
+            if (metaevent == MetaEventTimeSignature && numer == 0 &&
+                [eventlist metalength:i] >= 2) {
+                numer = [eventlist metavalue:i][0];
+                denom = [eventlist denominator:i];
             }
         }
     }
@@ -388,9 +1319,13 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
                      andDenominator:denom
                      andQuarter:quarternote
                      andTempo:tempo];
+    tempomap = [[TempoMap alloc] initWithEvents:events andTempo:tempo
+                                     andQuarter:quarternote];
+    measuremap = [[MeasureMap alloc] initWithEvents:events andTime:time];
 
-    
-    [file release];
+    if (cache != nil) {
+        [cache storeData:[self cacheData] forKey:key];
+    }
     return self;
 }
 
@@ -398,449 +1333,543 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
     [filename release];
     [tracks release];
     [time release];
+    [tempomap release];
+    [measuremap release];
     [events release];
+    [reader release];
+    [cachereader release];
+    [checkpoints release];
+    [chunkkeys release];
+    [chunkoffsets release];
+    [notesKey release];
+    [notesResult release];
+    [scorecache release];
+    [scorekey release];
     [super dealloc];
 }
 
-/** Parse a single track into a list of MidiEvents.
- * Entering this function, the file offset should be at the start of
- * the MTrk header.  Upon exiting, the file offset should be at the
- * start of the next MTrk header.
+/** Return the seek checkpoints of the given track (an index into
+ * events).  The checkpoints of all the tracks are created the first
+ * time they're needed, which is the first time playback is paused.
  */
-- (Array*)readTrack:(MidiFileReader*)file {
-    Array *result = [Array new:20];
-    int starttime = 0;
-    const char *hdr = [file readAscii:4];
+- (SeekCheckpoints*)checkpointsForTrack:(int)tracknum {
+    Array *eventlists = [self events];
+    if (checkpoints == nil) {
+        checkpoints = [[Array new:[eventlists count]] retain];
+        for (int i = 0; i < [eventlists count]; i++) {
+            SeekCheckpoints *seek = [[SeekCheckpoints alloc]
+                                     initWithEvents:[eventlists get:i]
+                                     andMeasures:measuremap
+                                     interval:CheckpointMeasures];
+            [checkpoints add:seek];
+            [seek release];
+        }
+    }
+    return [checkpoints get:tracknum];
+}
 
-    if (strncmp(hdr, "MTrk", 4) != 0) {
-        MidiFileException *e =
-           [MidiFileException init:@"Bad MTrk header" offset:([file offset] -4)];
-        @throw e;
-    }
-    int tracklen = [file readInt];
-    int trackend = tracklen + [file offset];
+/** Return the raw midi events (an Array of MidiEventTable).  When this
+ * MidiFile was loaded from the cache, the events haven't been parsed
+ * yet, so parse them now.  They're only needed to play the song.
+ */
+- (Array*)events {
+    if (events == nil) {
+        u_char *hdr = [reader bytes];
+        int num_tracks = (hdr[10] << 8) | hdr[11];
+        events = [[Array new:num_tracks] retain];
+        [self readTracks:[reader readerAtOffset:14] count:num_tracks
+              createTracks:NO];
+    }
+    return events;
+}
 
-    int eventflag = 0;
+/** Return the parsed contents of this MidiFile, in the format stored
+ * in the ScoreCache.  All values are 32-bit big endian ints, except
+ * where noted.
+ *
+ * - "MSMC", the cache version, and the length of the midi data
+ * - The track mode, quarter note, total pulses, and trackPerChannel
+ * - The time signature: numerator, denominator, tempo
+ * - The tempo map: count, then (pulse, tempo) per segment
+ * - The measure map: count, then (pulse, numerator, denominator) per segment
+ * - The number of tracks.  For each track:
+ *   - The number, instrument, number of notes, and number of lyrics
+ *   - The note start times, then durations
+ *   - The note channels, then numbers, one byte each
+ *   - For each lyric, the start time, length, and text bytes
+ */
+- (NSData*)cacheData {
+    NSMutableData *data = [NSMutableData dataWithCapacity:4096];
+    [data appendBytes:"MSMC" length:4];
+    appendInt(data, ScoreCacheVersion);
+    appendInt(data, [reader length]);
+    appendInt(data, trackmode);
+    appendInt(data, quarternote);
+    appendInt(data, totalpulses);
+    appendInt(data, trackPerChannel);
+    appendInt(data, time.numerator);
+    appendInt(data, time.denominator);
+    appendInt(data, time.tempo);
+
+    appendInt(data, tempomap.count);
+    for (int i = 0; i < tempomap.count; i++) {
+        appendInt(data, [tempomap pulseAtSegment:i]);
+        appendInt(data, [tempomap tempoAtSegment:i]);
+    }
+    appendInt(data, measuremap.count);
+    for (int i = 0; i < measuremap.count; i++) {
+        TimeSignature *t = [measuremap timeAtSegment:i];
+        appendInt(data, [measuremap pulseAtSegment:i]);
+        appendInt(data, t.numerator);
+        appendInt(data, t.denominator);
+    }
+
+    appendInt(data, [tracks count]);
+    for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
+        MidiTrack *track = [tracks get:tracknum];
+        NoteView notes = [track.notes view];
+        int numnotes = notes.count;
+        appendInt(data, track.number);
+        appendInt(data, track.instrument);
+        appendInt(data, numnotes);
+        appendInt(data, [track.lyrics count]);
+        for (int i = 0; i < numnotes; i++) {
+            appendInt(data, notes.starttime[i]);
+        }
+        for (int i = 0; i < numnotes; i++) {
+            appendInt(data, notes.duration[i]);
+        }
+        [data appendBytes:notes.channel length:numnotes];
+        for (int i = 0; i < numnotes; i++) {
+            u_char number = (u_char)notes.number[i];
+            [data appendBytes:&number length:1];
+        }
+        for (int i = 0; i < [track.lyrics count]; i++) {
+            MidiEvent *lyric = [track.lyrics get:i];
+            appendInt(data, lyric.startTime);
+            appendInt(data, lyric.metalength);
+            [data appendBytes:lyric.metavalue length:lyric.metalength];
+        }
+    }
+    return data;
+}
 
-    while ([file offset] < trackend) {
-        /* If the midi file is truncated here, we can still recover.
-         * Just return what we've parsed so far.
-         */
-        int startoffset, deltatime;
-        u_char peekevent;
-        @try {
-            startoffset = [file offset];
-            deltatime = [file readVarlen];
-            starttime += deltatime;
-            peekevent = [file peek];
-        }
-        @catch (MidiFileException* e) {
-            return result;
-        } 
-
-        MidiEvent *mevent = [[MidiEvent alloc] init];
-        [result add:mevent];
-        mevent.deltaTime = deltatime;
-        mevent.startTime = starttime;
-
-        if (peekevent >= EventNoteOff) {
-            mevent.hasEventflag = YES;
-            eventflag = [file readByte];
-            /* printf("Read new event %d %s\n", eventflag, eventName(eventflag)); */
-        }
-
-        /**
-        printf("offset %d:event %d %s delta %d\n",
-               startoffset, eventflag, eventName(eventflag), [mevent deltatime]);
-        **/
-
-        if (eventflag >= EventNoteOn && eventflag < EventNoteOn + 16) {
-            mevent.eventFlag = EventNoteOn;
-            mevent.channel = (u_char)(eventflag - EventNoteOn);
-            mevent.notenumber = [file readByte];
-            mevent.velocity = [file readByte];
-        }
-        else if (eventflag >= EventNoteOff && eventflag < EventNoteOff + 16) {
-            mevent.eventFlag = EventNoteOff;
-            mevent.channel = (u_char)(eventflag - EventNoteOff);
-            mevent.notenumber = [file readByte];
-            mevent.velocity = [file readByte];
-        }
-        else if (eventflag >= EventKeyPressure && 
-                 eventflag < EventKeyPressure + 16) {
-            mevent.eventFlag = EventKeyPressure;
-            mevent.channel = (u_char)(eventflag - EventKeyPressure);
-            mevent.notenumber = [file readByte];
-            mevent.keyPressure = [file readByte];
-        }
-        else if (eventflag >= EventControlChange && 
-                 eventflag < EventControlChange + 16) {
-            mevent.eventFlag = EventControlChange;
-            mevent.channel = (u_char)(eventflag - EventControlChange);
-            mevent.controlNum = [file readByte];
-            mevent.controlValue = [file readByte];
-        }
-        else if (eventflag >= EventProgramChange && 
-                 eventflag < EventProgramChange + 16) {
-            mevent.eventFlag = EventProgramChange;
-            mevent.channel = (u_char)(eventflag - EventProgramChange);
-            mevent.instrument = [file readByte];
-            
-        }
-        else if (eventflag >= EventChannelPressure && 
-                 eventflag < EventChannelPressure + 16) {
-            mevent.eventFlag = EventChannelPressure;
-            mevent.channel = (u_char)(eventflag - EventChannelPressure);
-            mevent.chanPressure = [file readByte];
-        }
-        else if (eventflag >= EventPitchBend && 
-                 eventflag < EventPitchBend + 16) {
-            mevent.eventFlag = EventPitchBend;
-            mevent.channel = (u_char)(eventflag - EventPitchBend);
-            mevent.pitchBend = [file readShort];
-        }
-        else if (eventflag == SysexEvent1) {
-            mevent.eventFlag = SysexEvent1;
-            mevent.metalength = [file readVarlen];
-            mevent.metavalue = [file readBytes:mevent.metalength] ;
-        }
-        else if (eventflag == SysexEvent2) {
-            mevent.eventFlag = SysexEvent2;
-            mevent.metalength = [file readVarlen];
-            mevent.metavalue = [file readBytes:mevent.metalength] ;
-        }
-        else if (eventflag == MetaEvent) {
-            mevent.eventFlag = MetaEvent;
-            mevent.metaevent = [file readByte];
-            mevent.metalength = [file readVarlen];
-            mevent.metavalue = [file readBytes:mevent.metalength] ;
-
-            if (mevent.metaevent == MetaEventTimeSignature) {
-                if (mevent.metalength < 2) {
-                    MidiFileException *e = 
-                    [MidiFileException init:@"Bad Meta Event Time Signature len" 
-                      offset:[file offset]];
-                    @throw e;
-                }
-                else if (mevent.metalength >= 2 && mevent.metalength < 4) {
-                    mevent.numerator = mevent.metavalue[0] ;
-                    u_char log2 = mevent.metavalue[1];
-                    mevent.denominator = (int)pow(2, log2);
-                }
-                else {
-                    mevent.numerator = mevent.metavalue[0] ;
-                    u_char log2 = mevent.metavalue[1];
-                    mevent.denominator = (int)pow(2, log2);
-                }
+/** Load the tracks, time signature, tempo map and measure map from
+ * the given cache entry (see cacheData).  The lyric values point into
+ * the entry's data, so the caller must keep the reader alive.  Return
+ * false, and leave this MidiFile unchanged, if the entry is invalid or
+ * doesn't match the midi data.
+ */
+- (BOOL)readCache:(MidiFileReader*)cached {
+    @try {
+        int limit = [cached length];
+        if (strncmp([cached readAscii:4], "MSMC", 4) != 0 ||
+            [cached readInt] != ScoreCacheVersion ||
+            [cached readInt] != [reader length] ||
+            [cached readInt] != trackmode ||
+            [cached readInt] != quarternote) {
+            return NO;
+        }
+        int pulses = [cached readInt];
+        BOOL perChannel = [cached readInt] != 0;
+        int numer = [cached readInt];
+        int denom = [cached readInt];
+        int tempo = [cached readInt];
+        if (tempo <= 0) {
+            return NO;
+        }
+        TimeSignature *newtime = [[[TimeSignature alloc] initWithNumerator:numer
+                                    andDenominator:denom andQuarter:quarternote
+                                    andTempo:tempo] autorelease];
+
+        int count = [cached readInt];
+        if (count <= 0 || count > limit / 8) {
+            return NO;
+        }
+        IntArray *starts = [IntArray new:count];
+        IntArray *tempos = [IntArray new:count];
+        for (int i = 0; i < count; i++) {
+            int start = [cached readInt];
+            int t = [cached readInt];
+            if (t <= 0 || (i == 0 && start != 0) ||
+                (i > 0 && start <= [starts get:i-1])) {
+                return NO;
             }
-            else if (mevent.metaevent == MetaEventTempo) {
-                if (mevent.metalength != 3) {
-                    MidiFileException *e = 
-                    [MidiFileException init:@"Bad Meta Event Tempo len" 
-                      offset:[file offset]];
-                    @throw e;
-                }
-                u_char *value = mevent.metavalue;
-                mevent.tempo = ((value[0] << 16) | (value[1] << 8) | value[2]);
+            [starts add:start];
+            [tempos add:t];
+        }
+        int *p = (int*)malloc(count * sizeof(int));
+        int *t = (int*)malloc(count * sizeof(int));
+        for (int i = 0; i < count; i++) {
+            p[i] = [starts get:i];
+            t[i] = [tempos get:i];
+        }
+        TempoMap *newtempomap = [[[TempoMap alloc] initWithCount:count pulses:p
+                                   tempos:t andQuarter:quarternote] autorelease];
+        free(p);
+        free(t);
+
+        count = [cached readInt];
+        if (count <= 0 || count > limit / 12) {
+            return NO;
+        }
+        starts = [IntArray new:count];
+        Array *signatures = [Array new:count];
+        for (int i = 0; i < count; i++) {
+            int start = [cached readInt];
+            int n = [cached readInt];
+            int d = [cached readInt];
+            if ((i == 0 && start != 0) || (i > 0 && start <= [starts get:i-1])) {
+                return NO;
             }
-            else if (mevent.metaevent == MetaEventEndOfTrack) {
-                [mevent release];
-                break; 
+            TimeSignature *sig = [[TimeSignature alloc] initWithNumerator:n
+                                   andDenominator:d andQuarter:quarternote
+                                   andTempo:tempo];
+            [starts add:start];
+            [signatures add:sig];
+            [sig release];
+            if (sig.measure <= 0) {
+                return NO;
             }
         }
-        else {
-            /* printf("Unknown eventflag %d offset %d\n", eventflag, [file offset]); */
-            MidiFileException *e =
-                [MidiFileException init:@"Unknown event" offset:([file offset] -4)];
-            @throw e;
+        p = (int*)malloc(count * sizeof(int));
+        for (int i = 0; i < count; i++) {
+            p[i] = [starts get:i];
+        }
+        MeasureMap *newmeasuremap = [[[MeasureMap alloc] initWithCount:count
+                                       pulses:p signatures:signatures] autorelease];
+        free(p);
+
+        int numtracks = [cached readInt];
+        if (numtracks < 0 || numtracks > limit / 16) {
+            return NO;
+        }
+        Array *newtracks = [Array new:numtracks];
+        for (int tracknum = 0; tracknum < numtracks; tracknum++) {
+            int number = [cached readInt];
+            int instrument = [cached readInt];
+            int numnotes = [cached readInt];
+            int numlyrics = [cached readInt];
+            if (numnotes < 0 || numnotes > limit / 10 ||
+                numlyrics < 0 || numlyrics > limit / 8) {
+                return NO;
+            }
+            MidiTrack *track = [[MidiTrack alloc] initWithTrack:number];
+            track.instrument = instrument;
+            [newtracks add:track];
+            [track release];
+
+            MidiFileReader *startreader = [cached readerAtOffset:[cached offset]];
+            [cached skip:4*numnotes];
+            MidiFileReader *durreader = [cached readerAtOffset:[cached offset]];
+            [cached skip:4*numnotes];
+            u_char *channels = [cached readBytesNoCopy:numnotes];
+            u_char *numbers = [cached readBytesNoCopy:numnotes];
+            for (int i = 0; i < numnotes; i++) {
+                int start = [startreader readInt];
+                int dur = [durreader readInt];
+                [track.notes addNote:start channel:channels[i]
+                              number:numbers[i] duration:dur];
+            }
+            for (int i = 0; i < numlyrics; i++) {
+                MidiEvent *lyric = [[MidiEvent alloc] init];
+                lyric.startTime = [cached readInt];
+                lyric.hasEventflag = YES;
+                lyric.eventFlag = MetaEvent;
+                lyric.metaevent = MetaEventLyric;
+                lyric.metalength = [cached readInt];
+                lyric.metavalue = [cached readBytesNoCopy:lyric.metalength];
+                [track addLyric:lyric];
+                [lyric release];
+            }
         }
-        [mevent release];
-    }
 
-    return result;
+        [tracks release];
+        tracks = [newtracks retain];
+        time = [newtime retain];
+        tempomap = [newtempomap retain];
+        measuremap = [newmeasuremap retain];
+        totalpulses = pulses;
+        trackPerChannel = perChannel;
+        return YES;
+    }
+    @catch (MidiFileException *e) {
+    }
+    return NO;
 }
 
-
-/** Return true if this track contains multiple channels.
- * If a MidiFile contains only one track, and it has multiple channels,
- * then we treat each channel as a separate track.
+/** Parse all the tracks, and add them to the events and tracks.
+ * Entering this function, the file offset should be at the start of
+ * the first MTrk header.
+ *
+ * Each MTrk chunk starts with its length, so first scan the chunk
+ * headers to find where each track starts.  Then parse the tracks
+ * in parallel, each with its own reader over the shared file data.
+ * The results are added in track order.  If any track fails to
+ * parse, the exception of the first failed track is thrown.
  */
-+(BOOL) hasMultipleChannels:(MidiTrack*) track {
-    Array *notes = track.notes;
-	MidiNote *note = [notes get:0];
-    int channel = note.channel;
-    for (int i =0; i < [notes count]; i++) {
-        note = [notes get:i];
-        if (note.channel != channel) {
-            return true;
-        }
-    }
-    return false;
+- (void)readTracks:(MidiFileReader*)file count:(int)num_tracks {
+    [self readTracks:file count:num_tracks createTracks:YES];
 }
 
+/** Parse all the tracks, and add them to the events.  If create is
+ * true, also create the MidiTracks, and add those with notes to the
+ * tracks.
+ */
+- (void)readTracks:(MidiFileReader*)file count:(int)num_tracks
+      createTracks:(BOOL)create {
+    [self readTracks:file count:num_tracks createTracks:create previous:nil];
+}
 
-/** Calculate the track length (in bytes) given a list of Midi events */
-+(int)getTrackLength:(Array*)events {
-    int len = 0;
-    u_char buf[1024];
-    for (int i = 0; i < [events count]; i++) {
-        MidiEvent *mevent = [events get:i];
-        len += varlenToBytes(mevent.deltaTime, buf, 0);
-        len += 1;  /* for eventflag */
-        switch (mevent.eventFlag) {
-            case EventNoteOn: len += 2; break;
-            case EventNoteOff: len += 2; break;
-            case EventKeyPressure: len += 2; break;
-            case EventControlChange: len += 2; break;
-            case EventProgramChange: len += 1; break;
-            case EventChannelPressure: len += 1; break;
-            case EventPitchBend: len += 2; break;
-
-            case SysexEvent1:
-            case SysexEvent2:
-                len += varlenToBytes(mevent.metalength, buf, 0);
-                len += mevent.metalength;
-                break;
-            case MetaEvent:
-                len += 1;
-                len += varlenToBytes(mevent.metalength, buf, 0);
-                len += mevent.metalength;
+/** Parse all the tracks, as above.  When creating the tracks, also
+ * save the hash of each MTrk chunk.  If a chunk has the same hash as
+ * a chunk of the previous MidiFile (which may be nil), copy that
+ * track's events and notes instead of parsing the chunk again.
+ */
+- (void)readTracks:(MidiFileReader*)file count:(int)num_tracks
+      createTracks:(BOOL)create previous:(MidiFile*)prev {
+    int *offsets = (int*)malloc((num_tracks + 1) * sizeof(int));
+    @try {
+        for (int tracknum = 0; tracknum < num_tracks; tracknum++) {
+            offsets[tracknum] = [file offset];
+            if (tracknum == num_tracks - 1) {
                 break;
-            default: break;
+            }
+            const char *hdr = [file readAscii:4];
+            if (strncmp(hdr, "MTrk", 4) != 0) {
+                MidiFileException *e =
+                   [MidiFileException init:@"Bad MTrk header" offset:([file offset] -4)];
+                @throw e;
+            }
+            int tracklen = [file readInt];
+            [file skip:tracklen];
         }
     }
-    return len;
-}
-
-/** Write the given list of Midi events into a valid Midi file. This
- *  method is used for sound playback, for creating new Midi files
- *  with the tempo, transpose, etc changed.
- *
- *  Return true on success, and false on error.
- */
-+(BOOL)writeToFile:(NSString*)filename withEvents:(Array*)eventlists
-                 andMode:(int)trackmode andQuarter:(int)quarter {
-    u_char buf[65536];
-    const char *cfilename;
-    int file, error;
-
-    cfilename = [filename cStringUsingEncoding:NSUTF8StringEncoding];
-    file = open(cfilename, O_CREAT|O_TRUNC|O_WRONLY, 0644);
-    if (file < 0) {
-        return NO;
+    @catch (MidiFileException *e) {
+        free(offsets);
+        @throw e;
     }
 
-    error = 0;
-    /* Write the MThd, len = 6, track mode, number tracks, quarter note */
-    dowrite(file, (u_char*)"MThd", 4, &error);
-    intToBytes(6, buf, 0);
-    dowrite(file, buf, 4, &error);
-    buf[0] = (u_char)(trackmode >> 8);
-    buf[1] = (u_char)(trackmode & 0xFF);
-    dowrite(file, buf, 2, &error);
-    buf[0] = 0;
-    buf[1] = (u_char)[eventlists count];
-    dowrite(file, buf, 2, &error);
-    buf[0] = (u_char)(quarter >> 8);
-    buf[1] = (u_char)(quarter & 0xFF);
-    dowrite(file, buf, 2, &error);
-
-    for (int tracknum = 0; tracknum < [eventlists count]; tracknum++) {
-        Array *events = [eventlists get:tracknum];
-
-        /* Write the MTrk header and track length */
-        dowrite(file, (u_char*)"MTrk", 4, &error);
-        int len = [MidiFile getTrackLength:events];
-        intToBytes(len, buf, 0);
-        dowrite(file, buf, 4, &error);
-
-        for (int i = 0; i < [events count]; i++) {
-            MidiEvent *mevent = [events get:i];
-            int varlen = varlenToBytes(mevent.deltaTime, buf, 0);
-            dowrite(file, buf, varlen, &error);
-
-            if (mevent.eventFlag == SysexEvent1 ||
-                mevent.eventFlag == SysexEvent2 ||
-                mevent.eventFlag == MetaEvent) {
-                buf[0] = mevent.eventFlag;
-            }
-            else {
-                buf[0] = (u_char)(mevent.eventFlag + mevent.channel);
-            }
-            dowrite(file, buf, 1, &error);
+    MidiEventTable **tables = (MidiEventTable**)calloc(num_tracks + 1, sizeof(id));
+    MidiTrack **newtracks = (MidiTrack**)calloc(num_tracks + 1, sizeof(id));
+    NSException **errors = (NSException**)calloc(num_tracks + 1, sizeof(id));
+    NSString **keys = (NSString**)calloc(num_tracks + 1, sizeof(id));
 
-            if (mevent.eventFlag == EventNoteOn) {
-                buf[0] = mevent.notenumber;
-                buf[1] = mevent.velocity;
-                dowrite(file, buf, 2, &error);
-            }
-            else if (mevent.eventFlag == EventNoteOff) {
-                buf[0] = mevent.notenumber;
-                buf[1] = mevent.velocity;
-                dowrite(file, buf, 2, &error);
-            }
-            else if (mevent.eventFlag == EventKeyPressure) {
-                buf[0] = mevent.notenumber;
-                buf[1] = mevent.keyPressure;
-                dowrite(file, buf, 2, &error);
-            }
-            else if (mevent.eventFlag == EventControlChange) {
-                buf[0] = mevent.controlNum;
-                buf[1] = mevent.controlValue;
-                dowrite(file, buf, 2, &error);
-            }
-            else if (mevent.eventFlag == EventProgramChange) {
-                buf[0] = mevent.instrument;
-                dowrite(file, buf, 1, &error);
-            }
-            else if (mevent.eventFlag == EventChannelPressure) {
-                buf[0] = mevent.chanPressure;
-                dowrite(file, buf, 1, &error);
-            }
-            else if (mevent.eventFlag == EventPitchBend) {
-                buf[0] = (u_char)(mevent.pitchBend >> 8);
-                buf[1] = (u_char)(mevent.pitchBend & 0xFF);
-                dowrite(file, buf, 2, &error);
+    /* Map each chunk hash of the previous MidiFile to its track number.
+     * The previous tracks can only be reused if the channels weren't
+     * split into separate tracks.
+     */
+    NSMutableDictionary *prevchunks = nil;
+    MidiTrack **prevtracks = NULL;
+    if (create && prev != nil && prev->chunkkeys != nil) {
+        int prevcount = [prev->chunkkeys count];
+        prevchunks = [NSMutableDictionary dictionaryWithCapacity:prevcount];
+        for (int i = 0; i < prevcount; i++) {
+            [prevchunks setObject:[NSNumber numberWithInt:i]
+                        forKey:[prev->chunkkeys get:i]];
+        }
+        prevtracks = (MidiTrack**)calloc(prevcount + 1, sizeof(id));
+        if (!prev->trackPerChannel) {
+            for (int i = 0; i < [prev->tracks count]; i++) {
+                MidiTrack *track = [prev->tracks get:i];
+                prevtracks[track.number] = track;
             }
-            else if (mevent.eventFlag == SysexEvent1) {
-                int offset = varlenToBytes(mevent.metalength, buf, 0);
-                memcpy(&(buf[offset]), mevent.metavalue, mevent.metalength);
-                dowrite(file, buf, offset + mevent.metalength, &error);
+        }
+    }
+
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_apply(num_tracks, queue, ^(size_t tracknum) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        @try {
+            MidiFileReader *trackreader = [file readerAtOffset:offsets[tracknum]];
+            MidiEventTable *trackevents = nil;
+            if (create) {
+                keys[tracknum] = [chunkKey(file, offsets[tracknum]) retain];
+                NSNumber *match = [prevchunks objectForKey:keys[tracknum]];
+                if (match != nil) {
+                    /* The chunk is unchanged, but may have moved, so
+                     * shift the payload offsets to the new position.
+                     */
+                    int prevnum = [match intValue];
+                    int shift = offsets[tracknum] - [prev->chunkoffsets get:prevnum];
+                    trackevents = [[[MidiEventTable alloc]
+                                     initWithTable:[prev->events get:prevnum]
+                                     andReader:trackreader shiftedBy:shift] autorelease];
+                    if (prevtracks[prevnum] != nil) {
+                        newtracks[tracknum] = [[MidiTrack alloc]
+                                                initWithNotesOf:prevtracks[prevnum]
+                                                andEvents:trackevents];
+                    }
+                }
             }
-            else if (mevent.eventFlag == SysexEvent2) {
-                int offset = varlenToBytes(mevent.metalength, buf, 0);
-                memcpy(&(buf[offset]), mevent.metavalue, mevent.metalength);
-                dowrite(file, buf, offset + mevent.metalength, &error);
+            if (trackevents == nil) {
+                trackevents = [self readTrack:trackreader];
             }
-            else if (mevent.eventFlag == MetaEvent &&
-                     mevent.metaevent == MetaEventTempo) {
-                buf[0] = mevent.metaevent;
-                buf[1] = 3;
-                buf[2] = (u_char)((mevent.tempo >> 16) & 0xFF);
-                buf[3] = (u_char)((mevent.tempo >> 8) & 0xFF);
-                buf[4] = (u_char)(mevent.tempo & 0xFF);
-                dowrite(file, buf, 5, &error);
+            tables[tracknum] = [trackevents retain];
+            if (create && newtracks[tracknum] == nil) {
+                newtracks[tracknum] = [[MidiTrack alloc] initWithEvents:trackevents
+                                                        andTrack:(int)tracknum];
             }
-            else if (mevent.eventFlag == MetaEvent) {
-                buf[0] = mevent.metaevent;
-                int offset = varlenToBytes(mevent.metalength, buf, 1) + 1;
-                memcpy(&(buf[offset]), mevent.metavalue, mevent.metalength);
-                dowrite(file, buf, offset + mevent.metalength, &error);
+        }
+        @catch (NSException *e) {
+            errors[tracknum] = [e retain];
+        }
+        [pool release];
+    });
+
+    NSException *error = nil;
+    for (int tracknum = 0; tracknum < num_tracks; tracknum++) {
+        if (error == nil && errors[tracknum] != nil) {
+            error = [errors[tracknum] autorelease];
+        }
+        else {
+            [errors[tracknum] release];
+        }
+        if (error == nil) {
+            [events add:tables[tracknum]];
+        }
+        if (error == nil && create) {
+            MidiTrack *track = newtracks[tracknum];
+            track.number = tracknum;
+            if ([track.notes count] > 0) {
+                [tracks add:track];
             }
         }
+        [tables[tracknum] release];
+        [newtracks[tracknum] release];
     }
-    close(file);
-    if (error)
-        return NO;
-    else
-        return YES;
-}
-
-
-/** Clone the list of MidiEvents */
-+(Array*)cloneMidiEvents:(Array*)origlist {
-    Array *newlist = [Array new:[origlist count]];
-    for (int tracknum = 0; tracknum < [origlist count]; tracknum++) {
-        Array *origevents = [origlist get:tracknum];
-        Array *newevents = [Array new:[origevents count]];
-        [newlist add:newevents];
-        for (int i = 0; i < [origevents count]; i++) {
-            MidiEvent *mevent = [origevents get:i];
-            MidiEvent *eventcopy = [mevent copy];
-            [newevents add:eventcopy];
+    if (error == nil && create) {
+        chunkkeys = [[Array new:num_tracks] retain];
+        chunkoffsets = [[IntArray new:num_tracks] retain];
+        for (int tracknum = 0; tracknum < num_tracks; tracknum++) {
+            [chunkkeys add:keys[tracknum]];
+            [chunkoffsets add:offsets[tracknum]];
         }
     }
-    return newlist;
+    for (int tracknum = 0; tracknum < num_tracks; tracknum++) {
+        [keys[tracknum] release];
+    }
+    free(offsets);
+    free(tables);
+    free(newtracks);
+    free(errors);
+    free(keys);
+    free(prevtracks);
+    if (error != nil) {
+        @throw error;
+    }
 }
 
+/** Parse a single track into a table of MidiEvents.
+ * Entering this function, the file offset should be at the start of
+ * the MTrk header.  Upon exiting, the file offset should be at the
+ * start of the next MTrk header.
+ */
+- (MidiEventTable*)readTrack:(MidiFileReader*)file {
+    int starttime = 0;
+    const char *hdr = [file readAscii:4];
 
-/** Add a tempo event to the beginning of each track */
-+(void) addTempoEvent:(Array*)eventlist withTempo:(int)tempo {
-    for (int tracknum = 0; tracknum < [eventlist count]; tracknum++) {
+    if (strncmp(hdr, "MTrk", 4) != 0) {
+        MidiFileException *e =
+           [MidiFileException init:@"Bad MTrk header" offset:([file offset] -4)];
+        @throw e;
+    }
+    int tracklen = [file readInt];
+    int trackend = tracklen + [file offset];
 
-        /* Create a new tempo event */
-        MidiEvent *tempoEvent = [[MidiEvent alloc] init];
-        tempoEvent.deltaTime = 0;
-        tempoEvent.startTime = 0;
-        tempoEvent.hasEventflag = YES;
-        tempoEvent.eventFlag = MetaEvent;
-        tempoEvent.metaevent = MetaEventTempo;
-        tempoEvent.metalength = 3;
-        tempoEvent.tempo = tempo;
+    /* Most events are 3 or 4 bytes long.  Don't trust the track
+     * length past the end of the file.
+     */
+    int available = [file length] - [file offset];
+    if (tracklen < 0 || tracklen > available) {
+        tracklen = available;
+    }
+    MidiEventTable *result = [MidiEventTable new:(tracklen/4 + 1) withReader:file];
+    int eventflag = 0;
+    MidiRawEvent event;
 
-        /* Insert the event at the beginning of the events array */
-        Array *events = [eventlist get:tracknum];
-        [events add:tempoEvent];
-        for (int i = [events count]-2; i >= 0; i--) {
-            MidiEvent *event = [events get:i];
-            [events set:event index:i+1];
+    while ([file offset] < trackend) {
+        /* If the midi file is truncated here, we can still recover.
+         * Just return what we've parsed so far.
+         */
+        if (!readMidiEvent(file, &eventflag, &starttime, &event)) {
+            return result;
+        }
+        [result addEvent:event.startTime status:event.status
+                data1:event.data1 data2:event.data2 hasFlag:event.hasEventflag];
+        if (event.eventFlag >= SysexEvent1) {
+            [result setPayloadOffset:event.metaoffset length:event.metalength];
+        }
+        if (event.metaevent == MetaEventEndOfTrack) {
+            break;
         }
-        [events set:tempoEvent index:0];
-        [tempoEvent release];
     }
+
+    return result;
 }
 
-/** Search the events for a ControlChange event with the same
- *  channel and control number.  If a matching event is found,
- *   update the control value.  Else, add a new ControlChange event.
- */
-+(void)updateControlChange:(Array*)newevents withEvent:(MidiEvent*)changeEvent {
-    for (int i = 0; i < [newevents count]; i++) {
-        MidiEvent *mevent = [newevents get:i];
-        if ((mevent.eventFlag == changeEvent.eventFlag) &&
-            (mevent.channel == changeEvent.channel) &&
-            (mevent.controlNum == changeEvent.controlNum)) {
 
-             mevent.controlValue =  changeEvent.controlValue;
-             return;
+/** Return true if this track contains multiple channels.
+ * If a MidiFile contains only one track, and it has multiple channels,
+ * then we treat each channel as a separate track.
+ */
++(BOOL) hasMultipleChannels:(MidiTrack*) track {
+    NoteView notes = [track.notes view];
+    int channel = notes.channel[0];
+    for (int i =0; i < notes.count; i++) {
+        if (notes.channel[i] != channel) {
+            return true;
         }
     }
-    [newevents add:changeEvent];
+    return false;
 }
 
 
-/** Start the Midi music at the given pause time (in pulses).
- *  Remove any NoteOn/NoteOff events that occur before the pause time.
- *  For other events, change the delta-time to 0 if they occur
- *  before the pause time.  Return the modified Midi Events.
+/** Write the given list of Midi events into a valid Midi file. This
+ *  method is used for sound playback, for creating new Midi files
+ *  with the tempo, transpose, etc changed.
+ *
+ *  Return true on success, and false on error.
  */
-+(Array*)startAtPauseTime:(int)pauseTime withEvents:(Array*)list {
-    Array *newlist = [Array new:[list count]];
-    for (int tracknum = 0; tracknum < [list count]; tracknum++) {
-        Array *events = [list get:tracknum];
-        Array *newevents = [Array new:[events count]];
-        [newlist add:newevents];
-
-        BOOL foundEventAfterPause = NO;
-        for (int i = 0; i < [events count]; i++) {
-            MidiEvent *mevent = [events get:i];
++(BOOL)writeToFile:(NSString*)filename withEvents:(Array*)eventlists
+                 andMode:(int)trackmode andQuarter:(int)quarter {
+    return [MidiFile writeToFile:filename withEvents:eventlists
+                     andMode:trackmode andQuarter:quarter runningStatus:NO];
+}
 
-            if (mevent.startTime < pauseTime) {
-                if (mevent.eventFlag == EventNoteOn ||
-                    mevent.eventFlag == EventNoteOff) {
+/** Write the given list of Midi events into a valid Midi file.  If
+ *  runningStatus is true, the event code of a channel event is left
+ *  out when it's the same as the previous event's, which makes the
+ *  file smaller.
+ *
+ *  Return true on success, and false on error.
+ */
++(BOOL)writeToFile:(NSString*)filename withEvents:(Array*)eventlists
+                 andMode:(int)trackmode andQuarter:(int)quarter
+                 runningStatus:(BOOL)runningStatus {
+    NSData *data = [MidiFile dataWithEvents:eventlists andMode:trackmode
+                             andQuarter:quarter runningStatus:runningStatus];
+    return writeDataToFile(data, filename);
+}
 
-                    /* Skip NoteOn/NoteOff event */
-                }
-                else if (mevent.eventFlag == EventControlChange) {
-                    mevent.deltaTime = 0;
-                    [MidiFile updateControlChange:newevents withEvent:mevent];
-                }
-                else {
-                    mevent.deltaTime = 0;
-                    [newevents add:mevent];
-                }
-            }
-            else if (!foundEventAfterPause) {
-                mevent.deltaTime = (mevent.startTime - pauseTime);
-                [newevents add:mevent];
-                foundEventAfterPause = YES;
-            }
-            else {
-                [newevents add:mevent];
-            }
-        }
-    }
-    return newlist;
+/** Return the contents of a valid Midi file with the given list of
+ *  Midi events.  See writeToFile:withEvents:andMode:andQuarter:runningStatus:
+ *
+ *  The whole file is encoded into one memory buffer in a single pass
+ *  over the events.  The length of each MTrk chunk is filled in after
+ *  its events are encoded.
+ */
++(NSData*)dataWithEvents:(Array*)eventlists andMode:(int)trackmode
+                 andQuarter:(int)quarter runningStatus:(BOOL)runningStatus {
+    int numtracks = [eventlists count];
+    MidiBuffer buf;
+    initBuffer(&buf, trackmode, numtracks, quarter);
+    for (int tracknum = 0; tracknum < numtracks; tracknum++) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        encodeTrack(&buf, [eventlists get:tracknum], NULL, nil, runningStatus);
+        [pool release];
+    }
+    return [NSData dataWithBytesNoCopy:buf.data length:buf.len freeWhenDone:YES];
 }
 
 
@@ -850,27 +1879,40 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
  * Return true if the file was saved successfully, else false.
  */
 - (BOOL)changeSound:(MidiOptions *)options toFile:(NSString*)destfile {
-    Array* newevents = events;
-    if (options != NULL) {
-        newevents = [self applyOptionsToEvents: options];
-    }
-    BOOL ret = [MidiFile writeToFile:destfile withEvents:newevents
-                     andMode:trackmode andQuarter:quarternote];
-    return ret;
+    return writeDataToFile([self soundDataWithOptions:options], destfile);
 }
 
 
-/** Apply the following sound options to the midi events.
+/** Return the contents of this Midi file, as a new midi file in
+ * memory.  If options is not null, apply the following options to
+ * the midi events:
  * - The tempo (the microseconds per pulse)
  * - The instruments per track
  * - The note number (transpose value)
  * - The tracks to include
- * Save the modified midi data to the given filename.
- * Return true if the file was saved successfully, else false.
+ * - The pause time to start playing at
+ *
+ * The options are applied while the events are encoded (see
+ * encodeTrack), so the events are never copied, and the tracks that
+ * aren't included are skipped entirely.  This is used for playback,
+ * so the sound doesn't need to be written to disk.
  */
-- (Array*)applyOptionsToEvents:(MidiOptions *)options {
-    if (trackPerChannel) {
-        return [self applyOptionsPerChannel:options];
+- (NSData*)soundDataWithOptions:(MidiOptions *)options {
+    Array *eventlists = [self events];
+    if (options == NULL) {
+        return [MidiFile dataWithEvents:eventlists andMode:trackmode
+                         andQuarter:quarternote runningStatus:YES];
+    }
+    int num_tracks = [eventlists count];
+
+    SoundOverlay overlay;
+    overlay.transpose = options.transpose;
+    overlay.newtempo = options.tempo;
+    overlay.oldtempo = time.tempo;
+    overlay.pauseTime = options.pauseTime;
+    for (int i = 0; i < 16; i++) {
+        overlay.instruments[i] = options.useDefaultInstruments ? -1 : 0;
+        overlay.mute[i] = NO;
     }
 
     /* A midifile can contain tracks with notes and tracks without notes.
@@ -878,141 +1920,84 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
      * So the track numbers in 'options' may not match correctly if the
      * midi file has tracks without notes. Re-compute the instruments, and
      * tracks to keep.
+     *
+     * If we've split a single track into one track per channel, then
+     * change the instrument per channel, and silence the notes of the
+     * excluded channels instead.
      */
-    int num_tracks = [events count];
     IntArray *instruments = [IntArray new:num_tracks];
     IntArray *keeptracks  = [IntArray new:num_tracks];
-
     for (int i = 0; i < num_tracks; i++) {
         [instruments add:0];
         [keeptracks add:YES];
     }
     for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
         MidiTrack *track = [tracks get:tracknum];
-        int realtrack = track.number;
-        [instruments set:[options.instruments get:tracknum] index:realtrack ];
-        if ([options.mute get:tracknum]) {
-            [keeptracks set:NO index:realtrack];
-        }
-    }
-
-    Array *newevents = [MidiFile cloneMidiEvents:events];
-    [MidiFile addTempoEvent:newevents withTempo:options.tempo];
-
-    /* Change the note number (transpose), instrument, and tempo */
-    for (int tracknum = 0; tracknum < [newevents count]; tracknum++) {
-        Array *eventlist = [newevents get:tracknum];
-        for (int i = 0; i < [eventlist count]; i++) {
-            MidiEvent *mevent = [eventlist get:i];
-            int num = mevent.notenumber + options.transpose;
-            if (num < 0)
-                num = 0;
-            if (num > 127)
-                num = 127;
-            mevent.notenumber = (u_char)num;
+        if (trackPerChannel) {
+            int channel = [track.notes channel:0];
             if (!options.useDefaultInstruments) {
-                mevent.instrument = (u_char)[instruments get:tracknum] ;
+                overlay.instruments[channel] = [options.instruments get:tracknum];
+            }
+            if ([options.mute get:tracknum]) {
+                overlay.mute[channel] = YES;
+            }
+        }
+        else {
+            int realtrack = track.number;
+            [instruments set:[options.instruments get:tracknum] index:realtrack];
+            if ([options.mute get:tracknum]) {
+                [keeptracks set:NO index:realtrack];
             }
-            mevent.tempo = options.tempo;
         }
     }
 
-    if (options.pauseTime != 0) {
-        newevents = [MidiFile startAtPauseTime:options.pauseTime withEvents:newevents]; 
-    }
-
-    /* Change the tracks to include */
     int count = 0;
-    for (int tracknum = 0; tracknum < [keeptracks count]; tracknum++) {
-         if ([keeptracks get:tracknum]) {
-             count++;
-         }
-    }
-
-    Array *result = [Array new:count];
-    for (int tracknum = 0; tracknum < [keeptracks count]; tracknum++) {
+    for (int tracknum = 0; tracknum < num_tracks; tracknum++) {
         if ([keeptracks get:tracknum]) {
-            [result add:[newevents get:tracknum]];
+            count++;
         }
     }
-    return result;
-}
-
-
-/** Apply the following sound options to the midi events:
- * - The tempo (the microseconds per pulse)
- * - The instruments per track
- * - The note number (transpose value)
- * - The tracks to include
- * Return the modified list of midi events.
- *
- * This Midi file only has one actual track, but we've split that
- * into multiple fake tracks, one per channel, and displayed that
- * to the end-user.  So changing the instrument, and tracks to
- * include, is implemented differently than the applyOptions() method:
- *
- * - We change the instrument based on the channel, not the track.
- * - We include/exclude channels, not tracks.
- * - We exclude a channel by setting the note volume/velocity to 0.
- */
-- (Array*)applyOptionsPerChannel:(MidiOptions *)options {
-    /* Determine which channels to include/exclude.
-     * Also, determine the instrument for each channel.
-     */
-    IntArray *instruments = [IntArray new:16];
-    IntArray *keepchannel  = [IntArray new:16];
-
-    for (int i = 0; i < 16; i++) {
-        [instruments add:0];
-        [keepchannel add:YES];
-    }
-    for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
-        MidiTrack *track = [tracks get:tracknum];
-        MidiNote *note = [track.notes get:0];
-        int channel = note.channel;
-        [instruments set:[options.instruments get:tracknum] index:channel ];
-        if ([options.mute get:tracknum]) {
-            [keepchannel set:NO index:channel];
+    MidiBuffer buf;
+    initBuffer(&buf, trackmode, count, quarternote);
+    for (int tracknum = 0; tracknum < num_tracks; tracknum++) {
+        if (![keeptracks get:tracknum]) {
+            continue;
         }
-    }
-
-    Array *newevents = [MidiFile cloneMidiEvents:events];
-    [MidiFile addTempoEvent:newevents withTempo:options.tempo];
-
-    /* Change the note number (transpose), instrument, and tempo */
-    for (int tracknum = 0; tracknum < [newevents count]; tracknum++) {
-        Array *eventlist = [newevents get:tracknum];
-        for (int i = 0; i < [eventlist count]; i++) {
-            MidiEvent *mevent = [eventlist get:i];
-            int num = mevent.notenumber + options.transpose;
-            if (num < 0)
-                num = 0;
-            if (num > 127)
-                num = 127;
-            mevent.notenumber = (u_char)num;
-            int channel = mevent.channel;
-            if (![keepchannel get:channel]) {
-                mevent.velocity = 0;
+        if (!trackPerChannel && !options.useDefaultInstruments) {
+            for (int i = 0; i < 16; i++) {
+                overlay.instruments[i] = [instruments get:tracknum];
             }
-            if (!options.useDefaultInstruments) {
-                u_char instr = [instruments get:channel];
-                mevent.instrument = instr;
-            }
-            mevent.tempo = options.tempo;
         }
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        SeekCheckpoints *seek = nil;
+        if (overlay.pauseTime != 0) {
+            seek = [self checkpointsForTrack:tracknum];
+        }
+        encodeTrack(&buf, [eventlists get:tracknum], &overlay, seek, YES);
+        [pool release];
     }
-    if (options.pauseTime != 0) {
-        newevents = [MidiFile startAtPauseTime:options.pauseTime withEvents:newevents];
-    }
-    return newevents;
+    return [NSData dataWithBytesNoCopy:buf.data length:buf.len freeWhenDone:YES];
 }
 
 
-
 /** Apply the given sheet music options to the MidiNotes.
  *  Return the midi tracks with the changes applied.
+ *
+ *  The result is kept until the options change, so the SheetMusic and
+ *  the Piano share the same tracks instead of each applying the
+ *  options.  The notes of the returned tracks are locked, so the
+ *  callers must copy a track before changing it.
  */
 - (Array*)changeMidiNotes:(MidiOptions*)options {
+    TimeSignature *timesig = self.time;
+    if (options.time != nil) {
+        timesig = options.time;
+    }
+    NSString *key = notesFingerprint(options, timesig);
+    if (notesResult != nil && [key isEqualToString:notesKey]) {
+        return [[notesResult retain] autorelease];
+    }
+
     Array* newtracks = [Array new:10];
 
     for (int track = 0; track < [tracks count]; track++) {
@@ -1027,40 +2012,93 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
      * so that notes close together appear as a single chord.  We
      * also extend the note durations, so that we have longer notes
      * and fewer rest symbols.
+     *
+     * The start times are rounded across all tracks.  The rest of the
+     * changes are done one track at a time, in a single pass over the
+     * note columns, while the track is still in the cache.
      */
-    TimeSignature *timesig = self.time;
-    if (options.time != nil) {
-        timesig = options.time;
+    if (options.snapGrid > 0) {
+        [MidiFile snapStartTimes:newtracks withQuarter:timesig.quarter toGrid:options.snapGrid];
     }
+    [MidiFile roundStartTimes:newtracks toInterval:options.combineInterval withTempoMap:tempomap];
 
-    [MidiFile roundStartTimes:newtracks toInterval:options.combineInterval withTime:self.time];
-    [MidiFile roundDurations:newtracks withQuarter:timesig.quarter];
-
+    /* Splitting the notes into two staffs looks at the note numbers,
+     * so in that case the notes are shifted and transposed afterwards.
+     */
+    for (int tracknum = 0; tracknum < [newtracks count]; tracknum++) {
+        MidiTrack *track = [newtracks get:tracknum];
+        NoteView notes = [track.notes view];
+        roundTrackDurations(notes.starttime, notes.duration, notes.count, timesig.quarter);
+        if (!options.twoStaffs) {
+            shiftAndTranspose(notes, options.shifttime, options.transpose);
+        }
+    }
     if (options.twoStaffs) {
         newtracks = [MidiFile combineToTwoTracks:newtracks withMeasure:timesig.measure];
-    }
-    if (options.shifttime != 0) {
-        [MidiFile shiftTime:newtracks byAmount:options.shifttime];
+        for (int tracknum = 0; tracknum < [newtracks count]; tracknum++) {
+            MidiTrack *track = [newtracks get:tracknum];
+            shiftAndTranspose([track.notes view], options.shifttime, options.transpose);
+        }
     }
 
-    if (options.transpose != 0) {
-        [MidiFile transpose:newtracks byAmount:options.transpose];
+    for (int tracknum = 0; tracknum < [newtracks count]; tracknum++) {
+        MidiTrack *track = [newtracks get:tracknum];
+        [track.notes lock];
     }
-
+    [notesKey release];
+    [notesResult release];
+    notesKey = [key retain];
+    notesResult = [newtracks retain];
     return newtracks;
 }
 
 
+/** Return the measures to use for the sheet music.  If the options
+ *  use the song's time signature, return the song's measure map, with
+ *  the time signature changes shifted along with the notes.  Otherwise
+ *  every measure uses the time signature in the options.
+ */
+- (MeasureMap*)measuresForOptions:(MidiOptions*)options {
+    TimeSignature *t = options.time;
+    if (t != nil && (t.numerator != time.numerator ||
+                     t.denominator != time.denominator ||
+                     t.quarter != time.quarter)) {
+        return [[[MeasureMap alloc] initWithTime:t] autorelease];
+    }
+    if (options.shifttime == 0) {
+        return measuremap;
+    }
+    return [[[MeasureMap alloc] initWithMap:measuremap
+                                  shiftedBy:options.shifttime] autorelease];
+}
+
+/** Return the cache key for data derived from the notes returned by
+ *  changeMidiNotes with the given options (such as the sheet music
+ *  layout), or nil if this file wasn't loaded with a ScoreCache.
+ */
+- (NSString*)cacheKeyForOptions:(MidiOptions*)options {
+    if (scorekey == nil) {
+        return nil;
+    }
+    TimeSignature *timesig = time;
+    if (options.time != nil) {
+        timesig = options.time;
+    }
+    NSString *s = [NSString stringWithFormat:@"%@ %@ %d %d", scorekey,
+                   notesFingerprint(options, timesig),
+                   timesig.numerator, timesig.denominator];
+    const char *bytes = [s UTF8String];
+    return [ScoreCache keyForBytes:(const u_char*)bytes length:(int)strlen(bytes)];
+}
+
+
 /** Shift the starttime of the notes by the given amount.
  * This is used by the Shift Notes menu to shift notes left/right.
  */
 +(void)shiftTime:(Array*)tracks byAmount:(int) amount {
     for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
         MidiTrack *track = [tracks get:tracknum];
-        for (int j = 0; j < [track.notes count]; j++) {
-            MidiNote *note = [track.notes get:j];
-            note.startTime = (note.startTime + amount);
-        }
+        shiftAndTranspose([track.notes view], amount, 0);
     }
 }
 
@@ -1068,82 +2106,7 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
 +(void)transpose:(Array*) tracks byAmount:(int) amount {
     for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
         MidiTrack *track = [tracks get:tracknum];
-        for (int j = 0; j < [track.notes count]; j++) {
-            MidiNote *note = [track.notes get:j];
-            note.number = (note.number + amount);
-            if (note.number < 0) {
-                note.number = 0;
-            }
-        }
-    }
-}
-
-
-/* Find the highest and lowest notes that overlap this interval (starttime to endtime).
- * This method is used by splitTrack to determine which staff (top or bottom) a note
- * should go to.
- *
- * For more accurate splitTrack() results, we limit the interval/duration of this note
- * (and other notes) to one measure. We care only about high/low notes that are
- * reasonably close to this note.
- */
-
-+(void)findHighLowNotes:(Array*)notes withMeasure:(int)measurelen startIndex:(int)startindex
-                        fromStart:(int)starttime toEnd:(int)endtime withHigh:(int*)high
-                        andLow:(int*)low {
-
-    int i = startindex;
-    if (starttime + measurelen < endtime) {
-        endtime = starttime + measurelen;
-    }
-
-    while (i < [notes count]) {
-        MidiNote *note = [notes get:i];
-        if (note.startTime >= endtime) {
-            break;
-        }
-        if (note.endTime < starttime) {
-            i++;
-            continue;
-        }
-        if (note.startTime + measurelen < starttime) {
-            i++;
-            continue;
-        }
-        if (*high < note.number) {
-            *high = note.number;
-        }
-        if (*low > note.number) {
-            *low = note.number;
-        }
-        i++;
-    }
-}
-
-/* Find the highest and lowest notes that start at this exact start time */
-+(void)findExactHighLowNotes:(Array*)notes startIndex:(int)startindex
-                        withStart:(int)starttime withHigh:(int*)high
-                        andLow:(int*)low {
-
-    int i = startindex;
-    MidiNote *note = [notes get:i];
-    while (note.startTime < starttime) {
-        i++;
-		note = [notes get:i];
-    }
-
-    while (i < [notes count]) {
-        note = [notes get:i];
-        if (note.startTime != starttime) {
-            break;
-        }
-        if (*high < note.number) {
-            *high = note.number;
-        }
-        if (*low > note.number) {
-            *low = note.number;
-        }
-        i++;
+        shiftAndTranspose([track.notes view], 0, amount);
     }
 }
 
@@ -1154,8 +2117,9 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
  * and right-hand (top) tracks.
  */
 +(Array*)splitTrack:(MidiTrack*) track withMeasure:(int)measurelen{
-    Array *notes = track.notes;
-    int notes_count = [notes count];
+    NoteArray *notes = track.notes;
+    NoteView v = [notes view];
+    int notes_count = v.count;
 
     MidiTrack *top = [[MidiTrack alloc] initWithTrack:1];
     MidiTrack *bottom = [[MidiTrack alloc] initWithTrack:2];
@@ -1168,76 +2132,74 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
 
     int prevhigh  = 76; /* E5, top of treble staff */
     int prevlow   = 45; /* A3, bottom of bass staff */
-    int startindex = 0;
+
+    /* I've tried several algorithms for splitting a track in two,
+     * and the one below seems to work the best:
+     * - If this note is more than an octave from the high/low notes
+     *   (that start exactly at this start time), choose the closest one.
+     * - If this note is more than an octave from the high/low notes
+     *   (in this note's time duration), choose the closest one.
+     * - If the high and low notes (that start exactly at this starttime)
+     *   are more than an octave apart, choose the closest note.
+     * - If the high and low notes (that overlap this starttime)
+     *   are more than an octave apart, choose the closest note.
+     * - Else, look at the previous high/low notes that were more than an
+     *   octave apart.  Choose the closeset note.
+     *
+     * The high/low notes are found for all the notes at once, in
+     * O(n log n) time instead of rescanning each measure.
+     */
+    int *highs = (int*) malloc(4 * notes_count * sizeof(int));
+    int *lows = highs + notes_count;
+    int *highExacts = lows + notes_count;
+    int *lowExacts = highExacts + notes_count;
+    findAllHighLowNotes(v, measurelen, highs, lows, highExacts, lowExacts);
 
     for (int i = 0; i < notes_count; i++) {
-        MidiNote *note = [notes get:i];
-        int number = note.number;
-
-        int high, low, highExact, lowExact;
-        high = low = highExact = lowExact = number;
-
-        while ([(MidiNote*)[notes get:startindex] endTime] < note.startTime) {
-            startindex++;
-        }
-
-        /* I've tried several algorithms for splitting a track in two,
-         * and the one below seems to work the best:
-         * - If this note is more than an octave from the high/low notes
-         *   (that start exactly at this start time), choose the closest one.
-         * - If this note is more than an octave from the high/low notes
-         *   (in this note's time duration), choose the closest one.
-         * - If the high and low notes (that start exactly at this starttime)
-         *   are more than an octave apart, choose the closest note.
-         * - If the high and low notes (that overlap this starttime)
-         *   are more than an octave apart, choose the closest note.
-         * - Else, look at the previous high/low notes that were more than an
-         *   octave apart.  Choose the closeset note.
-         */
-        [MidiFile findHighLowNotes:notes withMeasure:measurelen startIndex:startindex
-                  fromStart:note.startTime toEnd:note.endTime
-                  withHigh:&high andLow:&low];
-        [MidiFile findExactHighLowNotes:notes startIndex:startindex withStart:note.startTime
-                  withHigh:&highExact andLow:&lowExact];
+        int number = v.number[i];
+        int high = highs[i];
+        int low = lows[i];
+        int highExact = highExacts[i];
+        int lowExact = lowExacts[i];
 
         if (highExact - number > 12 || number - lowExact > 12) {
             if (highExact - number <= number - lowExact) {
-                [top addNote:note];
+                [top.notes addNote:i from:notes];
             }
             else {
-                [bottom addNote:note];
+                [bottom.notes addNote:i from:notes];
             }
         }
         else if (high - number > 12 || number - low > 12) {
             if (high - number <= number - low) {
-                [top addNote:note];
+                [top.notes addNote:i from:notes];
             }
             else {
-                [bottom addNote:note];
+                [bottom.notes addNote:i from:notes];
             }
         }
         else if (highExact - lowExact > 12) {
             if (highExact - number <= number - lowExact) {
-                [top addNote:note];
+                [top.notes addNote:i from:notes];
             }
             else {
-                [bottom addNote:note];
+                [bottom.notes addNote:i from:notes];
             }
         }
         else if (high - low > 12) {
             if (high - number <= number - low) {
-                [top addNote:note];
+                [top.notes addNote:i from:notes];
             }
             else {
-                [bottom addNote:note];
+                [bottom.notes addNote:i from:notes];
             }
         }
         else {
             if (prevhigh - number <= number - prevlow) {
-                [top addNote:note];
+                [top.notes addNote:i from:notes];
             }
             else {
-                [bottom addNote:note];
+                [bottom.notes addNote:i from:notes];
             }
         }
 
@@ -1249,9 +2211,10 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
             prevlow = low;
         }
     }
+    free(highs);
 
-    [top.notes sort:sortbytime];
-    [bottom.notes sort:sortbytime];
+    [top.notes sortByTime];
+    [bottom.notes sortByTime];
 
     [top release];
     [bottom release];
@@ -1262,9 +2225,18 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
 
 /** Combine the notes in the given tracks into a single MidiTrack.
  *  The individual tracks are already sorted.  To merge them, we
- *  use a mergesort-like algorithm.
+ *  use a heap of the tracks, ordered by their next note, so each
+ *  note costs O(log tracks).
  */
 +(MidiTrack*) combineToSingleTrack:(Array*)tracks {
+    return [MidiFile combineToSingleTrack:tracks useTrackAsChannel:NO];
+}
+
+/** Same as above, but if usetrack is true, set the channel of each
+ *  note to the index of the track it came from.  The Piano uses this
+ *  to know which hand plays each note.
+ */
++(MidiTrack*) combineToSingleTrack:(Array*)tracks useTrackAsChannel:(BOOL)usetrack {
     /* Add all notes into one track */
     MidiTrack *result = [[[MidiTrack alloc] initWithTrack:1] autorelease];
 
@@ -1273,62 +2245,67 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
     }
     else if ([tracks count] == 1) {
         MidiTrack *track = [tracks get:0];
-        for (int i = 0; i < [track.notes count]; i++) {
-            [result addNote:[track.notes get:i] ];
+        [result.notes addNotes:track.notes];
+        if (usetrack) {
+            NoteView v = [result.notes view];
+            memset(v.channel, 0, v.count);
         }
         return result;
     }
 
-    int noteindex[64];
-    int notecount[64];
-    for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
+    int numtracks = [tracks count];
+    NoteMerge merge;
+    merge.views = (NoteView*) malloc(numtracks * sizeof(NoteView));
+    merge.next = (int*) calloc(numtracks, sizeof(int));
+    merge.heap = (int*) malloc(numtracks * sizeof(int));
+    merge.size = 0;
+    for (int tracknum = 0; tracknum < numtracks; tracknum++) {
         MidiTrack *track = [tracks get:tracknum];
-        noteindex[tracknum] = 0;
-        notecount[tracknum] = [track.notes count];
+        merge.views[tracknum] = [track.notes view];
+        if (merge.views[tracknum].count > 0) {
+            merge.heap[merge.size++] = tracknum;
+        }
+    }
+    for (int pos = merge.size/2 - 1; pos >= 0; pos--) {
+        mergeSiftDown(&merge, pos);
     }
 
-    MidiNote *prevnote = nil;
-    while (1) {
-        MidiNote *lowestnote = nil;
-        int lowestTrack = -1;
-        for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
-            MidiTrack *track = [tracks get:tracknum];
-            if (noteindex[tracknum] >= notecount[tracknum]) {
-                continue;
-            }
-            MidiNote *note = [track.notes get:noteindex[tracknum]];
-            if (lowestnote == nil) {
-                lowestnote = note;
-                lowestTrack = tracknum;
-            }
-            else if (note.startTime < lowestnote.startTime) {
-                lowestnote = note;
-                lowestTrack = tracknum;
-            }
-            else if (note.startTime == lowestnote.startTime &&
-                     note.number < lowestnote.number) {
-                lowestnote = note;
-                lowestTrack = tracknum;
-            }
-        }
-        if (lowestnote == nil) {
-            /* We've finished the merge */
-            break;
-        }
-        noteindex[lowestTrack]++;
-        if ((prevnote != nil) && (prevnote.startTime == lowestnote.startTime) &&
-            (prevnote.number == lowestnote.number) ) {
+    NoteArray *notes = result.notes;
+    while (merge.size > 0) {
+        int lowestTrack = merge.heap[0];
+        int lowest = merge.next[lowestTrack];
+        NoteView v = merge.views[lowestTrack];
+        int lowestStart = v.starttime[lowest];
+        int lowestNumber = v.number[lowest];
+
+        int prev = [notes count] - 1;
+        if (prev >= 0 && [notes startTime:prev] == lowestStart &&
+            [notes number:prev] == lowestNumber) {
 
             /* Don't add duplicate notes, with the same start time and number */
-            if (lowestnote.duration > prevnote.duration) {
-                prevnote.duration = lowestnote.duration;
+            if (v.duration[lowest] > [notes duration:prev]) {
+                [notes setDuration:v.duration[lowest] index:prev];
             }
         }
         else {
-            [result addNote:lowestnote];
-            prevnote = lowestnote;
+            int channel = usetrack ? lowestTrack : v.channel[lowest];
+            [notes addNote:lowestStart channel:channel
+                    number:lowestNumber duration:v.duration[lowest]];
+        }
+
+        merge.next[lowestTrack]++;
+        if (merge.next[lowestTrack] == v.count) {
+            /* This track is done, so remove it from the heap */
+            merge.size--;
+            merge.heap[0] = merge.heap[merge.size];
+        }
+        if (merge.size > 0) {
+            mergeSiftDown(&merge, 0);
         }
     }
+    free(merge.views);
+    free(merge.next);
+    free(merge.heap);
 
     return result;
 }
@@ -1354,7 +2331,15 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
         }
     }
     if ([lyrics count] > 0) {
-        [lyrics sort:sortMidiEvent];
+        /* Sort by start time, then by event flag, like sortMidiEvent */
+        int count = [lyrics count];
+        uint64_t *keys = (uint64_t*) malloc(count * sizeof(uint64_t));
+        for (int i = 0; i < count; i++) {
+            MidiEvent *lyric = [lyrics get:i];
+            keys[i] = ((uint64_t)(uint32_t)lyric.startTime << 8) | lyric.eventFlag;
+        }
+        [lyrics sortByKeys:keys];
+        free(keys);
         MidiTrack *track = [result get:0];
         track.lyrics = lyrics;
     }
@@ -1362,17 +2347,17 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
 }
 
 
-/** Check that the MidiNote start times are in increasing order.
+/** Check that the note start times are in increasing order.
  * This is for debugging purposes.
  */
 +(void)checkStartTimes:(Array*) tracks {
     for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
         MidiTrack *track = [tracks get:tracknum];
+        NoteView notes = [track.notes view];
         int prevtime = -1;
-        for (int j = 0; j < [track.notes count]; j++) {
-            MidiNote *note = [track.notes get:j];
-            assert(note.startTime >= prevtime);
-            prevtime = note.startTime;
+        for (int j = 0; j < notes.count; j++) {
+            assert(notes.starttime[j] >= prevtime);
+            prevtime = notes.starttime[j];
         }
     }
 }
@@ -1393,54 +2378,77 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
  * that are close together (timewise).
  */
 +(void)roundStartTimes:(Array*)tracks toInterval:(int)millisec withTime:(TimeSignature*)time {
+    TempoMap *map = [[TempoMap alloc] initWithTempo:time.tempo andQuarter:time.quarter];
+    [MidiFile roundStartTimes:tracks toInterval:millisec withTempoMap:map];
+    [map release];
+}
+
+/** Same as above, but use the tempo map to convert millisec into
+ *  pulses, so that songs with several tempos are combined using the
+ *  tempo in effect at each note.
+ */
++(void)roundStartTimes:(Array*)tracks toInterval:(int)millisec withTempoMap:(TempoMap*)map {
     /* Get all the starttimes in all tracks, in sorted order */
-    int initsize = 1;
-    if ([tracks count] > 0) {
-		MidiTrack *track = [tracks get:0];
-        initsize = [track.notes count];
-        initsize = initsize * [tracks count]/2;
+    int total = 0;
+    for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
+        MidiTrack *track = [tracks get:tracknum];
+        total += [track.notes count];
+    }
+    if (total == 0) {
+        return;
     }
-    IntArray*  starttimes = [IntArray new:initsize];
+    int *starttimes = (int*) malloc(2 * total * sizeof(int));
+    int n = 0;
     for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
         MidiTrack *track = [tracks get:tracknum];
-        for (int j = 0; j < [track.notes count]; j++) {
-            MidiNote *note = [track.notes get:j];
-            [starttimes add:note.startTime];
-        }
+        NoteView notes = [track.notes view];
+        memcpy(starttimes + n, notes.starttime, notes.count * sizeof(int));
+        n += notes.count;
     }
-    [starttimes sort];
+    radixsort_int(starttimes, n, starttimes + n);
 
-    /* Notes within "millisec" milliseconds apart should be combined */
-    int interval = time.quarter * millisec * 1000 / time.tempo;
-
-    /* If two starttimes are within interval millisec, make them the same */
-    for (int i = 0; i < [starttimes count] - 1; i++) {
-        if ([starttimes get:(i+1)] - [starttimes get:i] <= interval) {
-            [starttimes set:[starttimes get:i] index:(i+1)];
-        }
+    /* Notes within "millisec" milliseconds apart should be combined.
+     * The interval in pulses depends on the tempo at each start time.
+     */
+    int segments = map.count;
+    int *segmentpulses = (int*) malloc(2 * segments * sizeof(int));
+    int *intervals = segmentpulses + segments;
+    for (int i = 0; i < segments; i++) {
+        segmentpulses[i] = [map pulseAtSegment:i];
+        intervals[i] = map.quarter * millisec * 1000 / [map tempoAtSegment:i];
     }
 
+    combineStartTimes(starttimes, n, segmentpulses, intervals, segments);
+
     [MidiFile checkStartTimes:tracks];
 
     /* Adjust the note starttimes, so that it matches one of the starttimes values */
     for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
         MidiTrack *track = [tracks get:tracknum];
-        int i = 0;
-
-        for (int j = 0; j < [track.notes count]; j++) {
-            MidiNote *note = [track.notes get:j];
-            while (i < [starttimes count] &&
-                   note.startTime - interval > [starttimes get:i]) {
-                i++;
-            }
-
-            if (note.startTime > [starttimes get:i] &&
-                note.startTime - [starttimes get:i] <= interval) {
+        NoteView notes = [track.notes view];
+        roundTrackStartTimes(notes.starttime, notes.count, starttimes, n,
+                             segmentpulses, intervals, segments);
+        [track.notes sortByTime];
+    }
+    free(starttimes);
+    free(segmentpulses);
+}
 
-                note.startTime = [starttimes get:i];
-            }
-        }
-        [track.notes sort:sortbytime];
+/** Snap the start time of every note to the nearest line of a grid
+ *  with the given number of lines per quarter note.  For example,
+ *  with 4 lines every note starts on a sixteenth note.  Notes with
+ *  the same number that snap to the same start time are merged.
+ */
++(void)snapStartTimes:(Array*)tracks withQuarter:(int)quarter toGrid:(int)lines {
+    if (lines <= 0 || quarter / lines <= 1) {
+        return;
+    }
+    for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
+        MidiTrack *track = [tracks get:tracknum];
+        NoteView notes = [track.notes view];
+        snapTrackStartTimes(notes.starttime, notes.count, quarter, lines);
+        [track.notes sortByTime];
+        [track.notes removeDuplicates];
     }
 }
 
@@ -1451,67 +2459,21 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
  * look as nice.  Having nice looking sheet music is more important
  * than faithfully representing the Midi File data.
  *
- * Therefore, this function rounds the duration of MidiNotes up to
+ * Therefore, this function rounds the duration of the notes up to
  * the next note where possible.
  */
 +(void)roundDurations:(Array*)tracks withQuarter:(int) quarternote {
     for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
         MidiTrack *track = [tracks get:tracknum];
-        MidiNote *prevNote = nil;
-
-        for (int i = 0; i < [track.notes count] - 1; i++) {
-            MidiNote *note1 = [track.notes get:i];
-            if (prevNote == nil) {
-                prevNote = note1;
-            }
-
-            /* Get the next note that has a different start time */
-            MidiNote *note2 = note1;
-            for (int j = i+1; j < [track.notes count]; j++) {
-                note2 = [track.notes get:j];
-                if (note1.startTime < note2.startTime) {
-                    break;
-                }
-            }
-            int maxduration = note2.startTime - note1.startTime;
-
-            int dur = 0;
-            if (quarternote <= maxduration)
-                dur = quarternote;
-            else if (quarternote/2 <= maxduration)
-                dur = quarternote/2;
-            else if (quarternote/3 <= maxduration)
-                dur = quarternote/3;
-            else if (quarternote/4 <= maxduration)
-                dur = quarternote/4;
-
-
-            if (dur < note1.duration) {
-                dur = note1.duration;
-            }
-
-            /* Special case: If the previous note's duration
-             * matches this note's duration, we can make a notepair.
-             * So don't expand the duration in that case.
-             */
-            if (prevNote.startTime + prevNote.duration == note1.startTime &&
-                prevNote.duration == note1.duration) {
-
-                dur = note1.duration;
-            }
-            note1.duration = dur;
-            MidiNote *nextNote = [track.notes get:i+1];
-            if (nextNote.startTime != note1.startTime) {
-                prevNote = note1;
-            }
-        }
+        NoteView notes = [track.notes view];
+        roundTrackDurations(notes.starttime, notes.duration, notes.count, quarternote);
     }
 }
 
 /** Split the given track into multiple tracks, separating each
  * channel into a separate track.
  */
-+(Array*) splitChannels:(MidiTrack*) origtrack withEvents:(Array*)events {
++(Array*) splitChannels:(MidiTrack*) origtrack withEvents:(MidiEventTable*)events {
 
     /* Find the instrument used for each channel */
     IntArray* channelInstruments = [IntArray new:16];
@@ -1519,29 +2481,28 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
         [channelInstruments add:0];
     }
     for (int i = 0; i < [events count]; i++) {
-        MidiEvent *mevent = [events get:i];
-        if (mevent.eventFlag == EventProgramChange) {
-            [channelInstruments set:mevent.instrument index:mevent.channel];
+        if ([events eventFlag:i] == EventProgramChange) {
+            [channelInstruments set:[events data1:i] index:[events channel:i]];
         }
     }
     [channelInstruments set:128 index:9]; /* Channel 9 = Percussion */
 
     Array *result = [Array new:2];
-    for (int i = 0; i < [origtrack.notes count]; i++) {
-        MidiNote *note = [origtrack.notes get:i];
+    NoteArray *notes = origtrack.notes;
+    for (int i = 0; i < [notes count]; i++) {
+        int channel = [notes channel:i];
         BOOL foundchannel = FALSE;
         for (int tracknum = 0; tracknum < [result count]; tracknum++) {
             MidiTrack *track = [result get:tracknum];
-			MidiNote *note2 = [track.notes get:0];
-            if (note.channel == note2.channel) {
+            if (channel == [track.notes channel:0]) {
                 foundchannel = TRUE;
-                [track addNote:note];
+                [track.notes addNote:i from:notes];
             }
         }
         if (!foundchannel) {
             MidiTrack* track = [[MidiTrack alloc] initWithTrack:([result count] + 1)];
-            [track addNote:note];
-            int instrument = [channelInstruments get:note.channel];
+            [track.notes addNote:i from:notes];
+            int instrument = [channelInstruments get:channel];
             track.instrument = instrument;
             [result add:track];
             [track release];
@@ -1552,8 +2513,7 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
             MidiEvent *lyricEvent = [origtrack.lyrics get:i];
             for (int j = 0; j < [result count]; j++) {
                 MidiTrack *track = [result get:j];
-			    MidiNote *note = [track.notes get:0];
-                if (lyricEvent.channel == note.channel) {
+                if (lyricEvent.channel == [track.notes channel:0]) {
                     [track addLyric:lyricEvent];
                 }
             }
@@ -1566,39 +2526,42 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
 /** Guess the measure length.  We assume that the measure
  * length must be between 0.5 seconds and 4 seconds.
  * Take all the note start times that fall between 0.5 and 
- * 4 seconds, and return the starttimes.
+ * 4 seconds, and return the starttimes, in sorted order.
  */
 - (IntArray*)guessMeasureLength {
     IntArray *result = [IntArray new:30];
-
-    int pulses_per_second = (int) (1000000.0 / time.tempo * time.quarter);
-    int minmeasure = pulses_per_second / 2; /* The minimum measure length in pulses */
-    int maxmeasure = pulses_per_second * 4; /* The maximum measure length in pulses *
+    IntArray *candidates = [IntArray new:30];
 
     /* Get the start time of the first note in the midi file. */
     int firstnote = time.measure * 5;
     for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
         MidiTrack *track = [tracks get:tracknum];
-		MidiNote *note = [track.notes get:0];
-        if (firstnote > note.startTime ) {
-            firstnote = note.startTime;
+        if (firstnote > [track.notes startTime:0] ) {
+            firstnote = [track.notes startTime:0];
         }
     }
 
+    /* The minimum and maximum measure length in pulses, measured
+     * from the first note using the tempo map.
+     */
+    double firstmicros = [tempomap microsForPulse:firstnote];
+    int minmeasure = (int)[tempomap pulseForMicros:(firstmicros + 500000)] - firstnote;
+    int maxmeasure = (int)[tempomap pulseForMicros:(firstmicros + 4000000)] - firstnote;
+
     /* interval = 0.06 seconds, converted into pulses */
-    int interval = time.quarter * 60000 / time.tempo;
+    int interval = time.quarter * 60000 / [tempomap tempoAtPulse:firstnote];
 
     for (int i = 0; i < [tracks count]; i++) {
         MidiTrack *track = [tracks get:i];
+        NoteView notes = [track.notes view];
         int prevtime = 0;
 
-        for (int j = 0; j < [track.notes count]; j++) {
-            MidiNote *note = [track.notes get:j];
-            if (note.startTime - prevtime <= interval)
+        for (int j = 0; j < notes.count; j++) {
+            if (notes.starttime[j] - prevtime <= interval)
                 continue;
 
-            prevtime = note.startTime;
-            int time_from_firstnote = note.startTime - firstnote;
+            prevtime = notes.starttime[j];
+            int time_from_firstnote = notes.starttime[j] - firstnote;
 
             /* Round the time down to a multiple of 4 */
             time_from_firstnote = time_from_firstnote / 4 * 4;
@@ -1607,12 +2570,101 @@ static void dowrite(int fd, u_char *buf, int len, int *error) {
             if (time_from_firstnote > maxmeasure)
                 break;
 
-            if (![result contains:time_from_firstnote]) {
-                [result add:time_from_firstnote];
+            [candidates add:time_from_firstnote];
+        }
+    }
+
+    /* Sort the candidates, and remove the duplicates */
+    [candidates sort];
+    for (int i = 0; i < [candidates count]; i++) {
+        int len = [candidates get:i];
+        if (i == 0 || len != [candidates get:(i-1)]) {
+            [result add:len];
+        }
+    }
+    return result;
+}
+
+/** Return the measure lengths from guessMeasureLength, ranked from the
+ *  most to the least likely, and add the confidence (0 to 100) of each
+ *  length to the given confidence array.
+ *
+ *  The note onsets of all the tracks are counted in a histogram, and
+ *  the autocorrelation of the histogram is computed with an FFT, in
+ *  O(n log n) time.  A good measure length is one where the onsets
+ *  line up with the onsets one measure later.  The confidence is the
+ *  autocorrelation at that length, relative to the autocorrelation
+ *  at 0, where every onset lines up with itself.
+ */
+- (IntArray*)guessMeasureLengthWithConfidence:(IntArray*)confidence {
+    IntArray *lengths = [self guessMeasureLength];
+    int count = [lengths count];
+    if (count == 0) {
+        return lengths;
+    }
+
+    /* Use bins of at least 4 pulses, like guessMeasureLength,
+     * and at most 65536 bins.
+     */
+    int end = [self endTime];
+    int bin = 4;
+    while (end / bin >= 65536) {
+        bin *= 2;
+    }
+    int numbins = end / bin + 1;
+    int n = 1;
+    while (n < 2 * numbins) {
+        n *= 2;
+    }
+    double *re = (double*) calloc(n, sizeof(double));
+    double *im = (double*) calloc(n, sizeof(double));
+    for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
+        MidiTrack *track = [tracks get:tracknum];
+        NoteView notes = [track.notes view];
+        for (int j = 0; j < notes.count; j++) {
+            re[notes.starttime[j] / bin] += 1;
+        }
+    }
+
+    /* The autocorrelation is the inverse transform of the power spectrum */
+    fft(re, im, n, NO);
+    for (int i = 0; i < n; i++) {
+        re[i] = re[i] * re[i] + im[i] * im[i];
+        im[i] = 0;
+    }
+    fft(re, im, n, YES);
+
+    /* Divide by the number of bins that overlap at each lag, so that
+     * longer lengths aren't penalized for overlapping less.
+     */
+    double base = re[0] / numbins;
+    MeasureGuess *guesses = (MeasureGuess*) malloc(count * sizeof(MeasureGuess));
+    for (int i = 0; i < count; i++) {
+        int len = [lengths get:i];
+        int lag = (len + bin/2) / bin;
+        double best = 0;
+        for (int k = lag - 1; k <= lag + 1; k++) {
+            if (k > 0 && k < numbins && best < re[k] / (numbins - k)) {
+                best = re[k] / (numbins - k);
             }
         }
+        int percent = (base > 0) ? (int)(best / base * 100 + 0.5) : 0;
+        if (percent > 100) {
+            percent = 100;
+        }
+        guesses[i].length = len;
+        guesses[i].confidence = percent;
+    }
+    qsort(guesses, count, sizeof(MeasureGuess), sortguesses);
+
+    IntArray *result = [IntArray new:count];
+    for (int i = 0; i < count; i++) {
+        [result add:guesses[i].length];
+        [confidence add:guesses[i].confidence];
     }
-    [result sort];
+    free(guesses);
+    free(re);
+    free(im);
     return result;
 }
 
@@ -1770,8 +2822,7 @@ static NSArray* instrNames = NULL;
             continue;
         }
         int lastindex = [track.notes count] - 1;
-		MidiNote *lastnote = [track.notes get:lastindex];
-        int last = lastnote.startTime;
+        int last = [track.notes startTime:lastindex];
         if (last > lastStart) {
             lastStart = last;
         }
@@ -15,22 +15,42 @@
 #import <Foundation/NSString.h>
 #import <Foundation/NSZone.h>
 #import <Foundation/NSException.h>
+#import <Foundation/NSData.h>
 
 #import "Array.h"
 #import "TimeSignature.h"
 
+/** Who owns the data buffer of a MidiFileReader */
+enum {
+    ReaderMalloc,     /** Malloc'ed and filled with read() */
+    ReaderMapped,     /** Memory mapped from the file with mmap() */
+    ReaderData,       /** The bytes of a retained NSData */
+    ReaderBorrowed    /** A buffer owned by the caller */
+};
+
 @interface MidiFileReader : NSObject {
     u_char *data;      /** The entire midi file data */
     int datalen;       /** The data length */
     int parse_offset;  /** The current offset while parsing */
+    int storage;       /** How the data is owned (ReaderMapped, etc) */
+    NSData *nsdata;    /** The NSData holding the bytes, for ReaderData */
+    MidiFileReader *parent; /** The reader that owns the data, for sub-readers */
 }
 -(id)initWithFile:(NSString*)filename;
+-(id)initWithFile:(NSString*)filename andMap:(BOOL)map;
+-(id)initWithData:(NSData*)d;
+-(id)initWithBytes:(const u_char*)bytes length:(int)len;
+-(MidiFileReader*)readerAtOffset:(int)offset;
+-(int)storage;
+-(int)length;
+-(u_char*)bytes;
 -(void)checkRead:(int)amount;
 -(u_char)peek;
 -(u_char)readByte;
 -(u_short)readShort;
 -(int)readInt;
 -(u_char*)readBytes:(int)len;
+-(u_char*)readBytesNoCopy:(int)len;
 -(char*)readAscii:(int)len;
 -(int)readVarlen;
 -(void)skip:(int)amount;
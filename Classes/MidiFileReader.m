@@ -21,14 +21,18 @@
 #include <assert.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <math.h>
 
 /** @class MidiFileReader
  * The MidiFileReader is used to read low-level binary data from a file.
+ * The data is memory mapped from the file, or comes from a buffer
+ * already in memory (NSData, or a caller-owned byte array).
  * This class can do the following:
  *
  * - Peek at the next byte in the file.
  * - Read a byte
+ * - Read a block of bytes, either copied or pointing into the data
  * - Read a 16-bit big endian short
  * - Read a 32-bit big endian int
  * - Read a fixed length ascii string (not null terminated)
@@ -39,8 +43,19 @@
  */
 @implementation MidiFileReader
 
-/** Create a new MidiFileReader for the given filename */
+/** Create a new MidiFileReader for the given filename.
+ *  The file is memory mapped, if possible.
+ */
 - (id)initWithFile:(NSString*)filename {
+    return [self initWithFile:filename andMap:YES];
+}
+
+/** Create a new MidiFileReader for the given filename.  If map is true,
+ *  the file is mapped into memory with mmap(), and no copy of the data
+ *  is made.  Otherwise, or if the mapping fails, the file is read into
+ *  a malloc'ed buffer.
+ */
+- (id)initWithFile:(NSString*)filename andMap:(BOOL)map {
     const char *name = [filename cStringUsingEncoding:NSUTF8StringEncoding];
     int fd = open(name, O_RDONLY);
     if (fd == -1) {
@@ -54,29 +69,95 @@
         @throw e;
     }
     struct stat info;
-    int ret = stat(name, &info);
-    if (info.st_size == 0) {
+    int ret = fstat(fd, &info);
+    if (ret == -1 || info.st_size == 0) {
+        close(fd);
         NSString *reason = @"File is empty:";
         reason = [reason stringByAppendingString:filename];
         MidiFileException *e = [MidiFileException init:reason offset:0];
         @throw e;
     }
     datalen = info.st_size;
-    data = (u_char*)malloc(datalen);
-    int offset = 0;
-    while (1) {
-        if (offset == datalen)
-            break;
-        int n = read(fd, &data[offset], datalen - offset);
-        if (n <= 0)
-            break;
-        offset += n;
+    data = NULL;
+    nsdata = nil;
+    if (map) {
+        void *addr = mmap(NULL, datalen, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            data = (u_char*)addr;
+            storage = ReaderMapped;
+        }
+    }
+    if (data == NULL) {
+        data = (u_char*)malloc(datalen);
+        storage = ReaderMalloc;
+        int offset = 0;
+        while (1) {
+            if (offset == datalen)
+                break;
+            int n = read(fd, &data[offset], datalen - offset);
+            if (n <= 0)
+                break;
+            offset += n;
+        }
+        datalen = offset;
     }
     close(fd);
     parse_offset = 0;
     return self;
 }
 
+/** Create a new MidiFileReader for midi data already in memory.
+ *  The data is retained, not copied.
+ */
+- (id)initWithData:(NSData*)d {
+    nsdata = [d retain];
+    data = (u_char*)[nsdata bytes];
+    datalen = (int)[nsdata length];
+    storage = ReaderData;
+    parse_offset = 0;
+    return self;
+}
+
+/** Create a new MidiFileReader over a buffer owned by the caller.
+ *  The buffer is not copied or freed, and must stay valid for as long
+ *  as this reader (and any pointers returned by readBytesNoCopy) is used.
+ */
+- (id)initWithBytes:(const u_char*)bytes length:(int)len {
+    data = (u_char*)bytes;
+    datalen = len;
+    nsdata = nil;
+    storage = ReaderBorrowed;
+    parse_offset = 0;
+    return self;
+}
+
+/** Return a new reader over the same data, starting at the given
+ *  offset.  The new reader has its own parse offset, so several
+ *  readers can parse different parts of the data at the same time.
+ *  The new reader keeps this reader (and its data) alive.
+ */
+- (MidiFileReader*)readerAtOffset:(int)offset {
+    MidiFileReader *r = [[MidiFileReader alloc] initWithBytes:data length:datalen];
+    r->parent = [self retain];
+    [r skip:offset];
+    return [r autorelease];
+}
+
+/** Return how the data is stored (ReaderMapped, ReaderMalloc, etc) */
+- (int)storage {
+    return storage;
+}
+
+/** Return the total length of the data */
+- (int)length {
+    return datalen;
+}
+
+/** Return the start of the data */
+- (u_char*)bytes {
+    return data;
+}
+
 /** Check that the given number of bytes doesn't exceed the file size */
 - (void)checkRead:(int)amount {
     if (parse_offset + amount > datalen) {
@@ -110,6 +191,17 @@
     return result;
 }
 
+/** Return a pointer to the given number of bytes, without copying them.
+ *  The pointer points directly into the reader's data, and is only
+ *  valid while this reader is alive.
+ */
+- (u_char*)readBytesNoCopy:(int) amount {
+    [self checkRead:amount];
+    u_char* result = &data[parse_offset];
+    parse_offset += amount;
+    return result;
+}
+
 /** Read a 16-bit short from the file */
 - (u_short)readShort {
     [self checkRead:2];
@@ -172,7 +264,17 @@
 
 
 - (void)dealloc {
-    free(data);
+    if (storage == ReaderMalloc) {
+        free(data);
+    }
+    else if (storage == ReaderMapped) {
+        munmap(data, datalen);
+    }
+    else if (storage == ReaderData) {
+        [nsdata release];
+    }
+    [parent release];
+    data = NULL;
     [super dealloc];
 }
 
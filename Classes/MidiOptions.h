@@ -56,6 +56,7 @@ enum {
     int key;                 /** Use the given KeySignature (notescale) */
     TimeSignature *time;     /** Use the given time signature */
     int combineInterval;     /** Combine notes within given time interval (msec) */
+    int snapGrid;            /** Snap notes to 1/snapGrid of a quarter note (0 = off) */
     Array* colors;           /** The note colors to use */
     NSColor* shadeColor;     /** The color to use for shading */
     NSColor* shade2Color;    /** The color to use for shading the left hand piano */
@@ -86,6 +87,7 @@ enum {
 @property (nonatomic, assign) int key;
 @property (nonatomic, retain) TimeSignature *time;
 @property (nonatomic, assign) int combineInterval;
+@property (nonatomic, assign) int snapGrid;
 @property (nonatomic, retain) Array* colors;
 @property (nonatomic, retain) NSColor* shadeColor;
 @property (nonatomic, retain) NSColor* shade2Color;
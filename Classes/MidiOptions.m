@@ -21,6 +21,7 @@
 @synthesize key;
 @synthesize time;
 @synthesize combineInterval;
+@synthesize snapGrid;
 @synthesize colors;
 @synthesize shadeColor;
 @synthesize shade2Color;
@@ -88,11 +89,12 @@
     self.shade2Color = [NSColor colorWithDeviceRed:150.0/255.0
                      green:190.0/255.0 blue:220.0/255.0 alpha:1.0];
     self.combineInterval = 40;
+    self.snapGrid = 0;
     self.tempo = time.tempo;
     self.pauseTime = 0;
     self.playMeasuresInLoop = NO;
     self.playMeasuresInLoopStart = NO;
-    self.playMeasuresInLoopEnd = midifile.endTime / midifile.time.measure;
+    self.playMeasuresInLoopEnd = [midifile.measuremap measureForTime:midifile.endTime];
     return self;
 }
 
@@ -113,6 +115,7 @@
     self.key = [dict intForKey:@"key"];
     // self.time = [dict objectForKey:@"time"];
     self.combineInterval = [dict intForKey:@"combineInterval"];
+    self.snapGrid = [dict intForKey:@"snapGrid"];
     self.colors = [dict colorsForKey:@"colors"];
     self.shadeColor = [dict colorForKey:@"shadeColor"];
     self.shade2Color = [dict colorForKey:@"shade2Color"];
@@ -148,6 +151,7 @@
     [dict setInt:key forKey:@"key"];
     // [dict setValue:time forKey:@"time"];
     [dict setInt:combineInterval forKey:@"combineInterval"];
+    [dict setInt:snapGrid forKey:@"snapGrid"];
     [dict setColors:colors forKey:@"colors"];
     [dict setColor:shadeColor forKey:@"shadeColor"];
     [dict setColor:shade2Color forKey:@"shade2Color"];
@@ -198,6 +202,7 @@
     transpose = saved.transpose;
     key = saved.key;
     combineInterval = saved.combineInterval;
+    snapGrid = saved.snapGrid;
     if (saved.shadeColor != nil) {
         self.shadeColor = saved.shadeColor;
     }
@@ -231,6 +236,7 @@
     options.key = key;
     //options.time = time;
     options.combineInterval = combineInterval;
+    options.snapGrid = snapGrid;
     options.colors = colors;
     options.shadeColor = shadeColor;
     options.shade2Color = shade2Color;
@@ -42,14 +42,16 @@ enum {
     int playstate;              /** The playing state of the Midi Player */
     MidiFile *midifile;         /** The midi file to play */
     MidiOptions *options;       /** The sound options for playing the midi file */
-    NSString *tempSoundFile;    /** The temporary midi file currently being played */
-    double pulsesPerMsec;       /** The number of pulses per millisec */
+    NSData *soundData;          /** The midi data currently being played */
+    double pulsesPerMsec;       /** The number of pulses per millisec, at the starting tempo */
+    double tempoScale;          /** The playback speed, relative to the song's tempo */
     SheetMusic *sheet;          /** The sheet music to highlight while playing */
     Piano *piano;               /** The piano to shade while playing */
     NSTimer *timer;             /** Timer used to update the sheet music while playing */
     NSSound *sound;             /** The sound player */
     struct timeval startTime;   /** Absolute time when music started playing */
     double startPulseTime;      /** Time (in pulses) when music started playing */
+    double startMicros;         /** Time (in song microseconds) when music started playing */
     double currentPulseTime;    /** Time (in pulses) music is currently at */
     double prevPulseTime;       /** Time (in pulses) music was last at */
 
@@ -57,6 +59,7 @@ enum {
 
 -(id)init;
 -(void)setMidiFile:(MidiFile*)file withOptions:(MidiOptions*)opt andSheet:(SheetMusic*)sheet;
+-(void)reloadMidiFile:(MidiFile*)file;
 -(void)setPiano:(Piano*)p;
 -(void)reshade:(NSTimer*)timer;
 -(IBAction)playPause:(id)sender;
@@ -65,10 +68,12 @@ enum {
 -(IBAction)fastForward:(id)sender;
 -(IBAction)changeVolume:(id)sender;
 -(void)timerCallback:(NSTimer*)timer;
+-(double)pulseAtMsec:(long)msec;
+-(int)measureLengthAt:(double)pulseTime;
 -(void)restartPlayMeasuresInLoop;
 -(void)replay:(NSTimer*)timer;
 -(BOOL)isFlipped;
--(void)deleteSoundFile;
+-(void)deleteSoundData;
 -(void)doStop;
 -(void)dealloc;
 
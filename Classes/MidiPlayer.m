@@ -50,8 +50,8 @@
  * - The tempo (from the Speed bar)
  * - The volume
  *
- * The MidiFile.changeSound() method is used to create a new midi file
- * with these options.  The NSSound class is used for
+ * The MidiFile.soundDataWithOptions() method is used to create new midi
+ * data in memory with these options.  The NSSound class is used for
  * playing, pausing, and stopping the sound.
  *
  * For shading the notes during playback, the method
@@ -285,6 +285,21 @@ static NSImage* volumeImage = NULL;  /** The volume image */
     }
 }
 
+/** The midi file was reloaded from disk.  If we're paused at a time
+ *  inside the new song, switch to the new file and stay paused, so the
+ *  next setMidiFile keeps the current time.  Otherwise, stop playing.
+ */
+- (void)reloadMidiFile:(MidiFile*)file {
+    if (midifile != nil && playstate == paused &&
+        currentPulseTime < file.totalpulses) {
+        [midifile release];
+        midifile = [file retain];
+    }
+    else {
+        [self stop:nil];
+    }
+}
+
 /** If we're paused, reshade the sheet music and piano. */
 - (void)reshade:(NSTimer*)arg {
     if (playstate == paused) {
@@ -301,18 +316,15 @@ static NSImage* volumeImage = NULL;  /** The volume image */
 }
 
 
-/** Delete the temporary midi sound file */
-- (void)deleteSoundFile {
-    if (tempSoundFile == nil) {
+/** Release the midi sound data */
+- (void)deleteSoundData {
+    if (soundData == nil) {
         return;
     }
     [self stop:nil];
-    const char *cfile = [tempSoundFile cStringUsingEncoding:NSUTF8StringEncoding];
-    unlink(cfile);
-    [tempSoundFile release];
-    tempSoundFile = nil;
-}
-    
+    [soundData release];
+    soundData = nil;
+}    
 
 /** Return the number of tracks selected in the MidiOptions.
  *  If the number of tracks is 0, there is no sound to play.
@@ -329,21 +341,19 @@ static NSImage* volumeImage = NULL;  /** The volume image */
 
 
 /** Create a new midi sound data with all the MidiOptions incorporated.
- *  Store the new midi sound into the file tempSoundFile.
+ *  Store the new midi sound in soundData.  The data is played from
+ *  memory, so nothing is written to disk.
  */
 - (void)createMidiFile {
-    [tempSoundFile release];
-    tempSoundFile = nil;
+    [soundData release];
+    soundData = nil;
     double inverse_tempo = 1.0 / midifile.time.tempo;
     double inverse_tempo_scaled = inverse_tempo * [speedBar doubleValue] / 100.0;
     options.tempo = (int)(1.0 / inverse_tempo_scaled);
     pulsesPerMsec = midifile.time.quarter * (1000.0 / options.tempo);
-    tempSoundFile = [midifile.filename stringByAppendingString:@".MSM.mid"];
-    tempSoundFile = [tempSoundFile retain];
-    if ([midifile changeSound:options toFile:tempSoundFile] == NO) {
-        /* Failed to write to tempSoundFile */
-        [tempSoundFile release]; tempSoundFile = nil;
-    }
+    tempoScale = midifile.time.tempo / (double)options.tempo;
+    startMicros = [midifile.tempomap microsForPulse:(startPulseTime - options.shifttime)];
+    soundData = [[midifile soundDataWithOptions:options] retain];
 }
 
 /** The callback for the play/pause button (a single button).
@@ -371,12 +381,12 @@ static NSImage* volumeImage = NULL;  /** The volume image */
              * currentPulseTime is somewhere inside the loop measures.
              */
             double nearEndTime = currentPulseTime + pulsesPerMsec*50;
-            int measure = (int)(nearEndTime / midifile.time.measure);
+            int measure = [midifile.measuremap measureForTime:(int)nearEndTime];
             if ((measure < options.playMeasuresInLoopStart) ||
                 (measure > options.playMeasuresInLoopEnd)) {
 
-                currentPulseTime = options.playMeasuresInLoopStart * 
-                                   midifile.time.measure;
+                currentPulseTime = [midifile.measuremap
+                                    startOfMeasure:options.playMeasuresInLoopStart];
             }
             startPulseTime = currentPulseTime;
             options.pauseTime = (int)(currentPulseTime - options.shifttime);
@@ -394,7 +404,7 @@ static NSImage* volumeImage = NULL;  /** The volume image */
         [self createMidiFile];
         playstate = playing;
         [sound release];
-        sound = [[NSSound alloc] initWithContentsOfFile:tempSoundFile byReference:NO];
+        sound = [[NSSound alloc] initWithData:soundData];
         if ([sound respondsToSelector:@selector(setVolume:)] ) {
             [sound setVolume:[volumeBar doubleValue] / 100.0];
         }
@@ -440,7 +450,7 @@ static NSImage* volumeImage = NULL;  /** The volume image */
     playstate = stopped;
     [sound stop];
     [sound release]; sound = nil;
-    [self deleteSoundFile];
+    [self deleteSoundData];
 
     /* Remove all shading by redrawing the music */
     [sheet display];
@@ -470,7 +480,7 @@ static NSImage* volumeImage = NULL;  /** The volume image */
     [piano shadeNotes:-10 withPrev:(int)currentPulseTime];
 
     prevPulseTime = currentPulseTime;
-    currentPulseTime -= midifile.time.measure;
+    currentPulseTime -= [self measureLengthAt:currentPulseTime];
     if (currentPulseTime < options.shifttime) {
         currentPulseTime = options.shifttime;
     }
@@ -498,9 +508,10 @@ static NSImage* volumeImage = NULL;  /** The volume image */
     [piano shadeNotes:-10 withPrev:(int)currentPulseTime];
 
     prevPulseTime = currentPulseTime;
-    currentPulseTime += midifile.time.measure;
+    int measurelen = [self measureLengthAt:currentPulseTime];
+    currentPulseTime += measurelen;
     if (currentPulseTime > midifile.totalpulses) {
-        currentPulseTime -= midifile.time.measure;
+        currentPulseTime -= measurelen;
     }
     [piano shadeNotes:(int)currentPulseTime withPrev:(int)prevPulseTime];
     [sheet shadeNotes:(int)currentPulseTime withPrev:(int)prevPulseTime gradualScroll:NO];
@@ -527,9 +538,10 @@ static NSImage* volumeImage = NULL;  /** The volume image */
 
     NSPoint point = [sheet convertPoint: [event locationInWindow] fromView:nil];
     currentPulseTime = [sheet pulseTimeForPoint:point];
-    prevPulseTime = currentPulseTime - midifile.time.measure;
+    int measurelen = [self measureLengthAt:currentPulseTime];
+    prevPulseTime = currentPulseTime - measurelen;
     if (currentPulseTime > midifile.totalpulses) {
-        currentPulseTime -= midifile.time.measure;
+        currentPulseTime -= measurelen;
     }
     [piano shadeNotes:(int)currentPulseTime withPrev:(int)prevPulseTime];
     [sheet shadeNotes:(int)currentPulseTime withPrev:(int)prevPulseTime gradualScroll:NO];
@@ -562,11 +574,11 @@ static NSImage* volumeImage = NULL;  /** The volume image */
         long msec = (now.tv_sec - startTime.tv_sec)*1000 +
                     (now.tv_usec - startTime.tv_usec)/1000;
         prevPulseTime = currentPulseTime;
-        currentPulseTime = startPulseTime + msec * pulsesPerMsec;
+        currentPulseTime = [self pulseAtMsec:msec];
 
         /* If we're playing in a loop, stop and restart */
         if (options.playMeasuresInLoop) {
-            int measure = (int)(currentPulseTime / midifile.time.measure);
+            int measure = [midifile.measuremap measureForTime:(int)currentPulseTime];
             if (measure > options.playMeasuresInLoopEnd) {
                 [self restartPlayMeasuresInLoop];
                 return;
@@ -594,10 +606,10 @@ static NSImage* volumeImage = NULL;  /** The volume image */
         [sound release]; sound = nil;
 
         prevPulseTime = currentPulseTime;
-        currentPulseTime = startPulseTime + msec * pulsesPerMsec;
+        currentPulseTime = [self pulseAtMsec:msec];
         [sheet shadeNotes:(int)currentPulseTime withPrev:(int)prevPulseTime gradualScroll:YES];
         [piano shadeNotes:(int)currentPulseTime withPrev:(int)prevPulseTime];
-        prevPulseTime = currentPulseTime - midifile.time.measure;
+        prevPulseTime = currentPulseTime - [self measureLengthAt:currentPulseTime];
         [playButton setImage:playImage];
         [playButton setToolTip:@"Play"];
         playstate = paused;
@@ -605,6 +617,23 @@ static NSImage* volumeImage = NULL;  /** The volume image */
     }
 }
 
+/** Return the pulse time being played msec milliseconds after the
+ *  music started playing.  Use the tempo map, so that the shading
+ *  follows any tempo changes in the song.
+ */
+- (double)pulseAtMsec:(long)msec {
+    double us = startMicros + msec * 1000.0 * tempoScale;
+    return [midifile.tempomap pulseForMicros:us] + options.shifttime;
+}
+
+/** Return the length (in pulses) of the measure containing the
+ *  given pulse time.
+ */
+- (int)measureLengthAt:(double)pulseTime {
+    MeasureMap *measures = midifile.measuremap;
+    return [measures lengthOfMeasure:[measures measureForTime:(int)pulseTime]];
+}
+
 /** The "Play Measures in a Loop" feature is enabled, and we've reached
  *  the last measure. Stop the sound, and then start playing again.
  */
@@ -637,7 +666,7 @@ static NSImage* volumeImage = NULL;  /** The volume image */
 }
 
 - (void)dealloc {
-    [self deleteSoundFile];
+    [self deleteSoundData];
     [playButton release]; 
     [stopButton release];
     [rewindButton release];
@@ -649,7 +678,7 @@ static NSImage* volumeImage = NULL;  /** The volume image */
     [sheet release]; 
     [piano release];
     [sound release];
-    [tempSoundFile release];
+    [soundData release];
     if (timer != nil) {
         [timer invalidate];
     }
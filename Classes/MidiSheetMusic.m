@@ -308,7 +308,12 @@ static SampleSongDialog *songDialog = NULL;
 - (void)openMidiFile:(NSString*)filepath {
     NSString *filename = [self getFileName:filepath];
     @try {
-        MidiFile *midifile = [[MidiFile alloc] initWithFile:filepath];
+        /* The window watches the file for changes, so don't map it.
+         * Use the score cache, so a song opened before loads quickly.
+         */
+        MidiFileReader *file = [[MidiFileReader alloc] initWithFile:filepath andMap:NO];
+        MidiFile *midifile = [[MidiFile alloc] initWithReader:file andFilename:filepath
+                                               andCache:[ScoreCache defaultCache]];
         SheetMusicWindow *window = [[SheetMusicWindow alloc]
                                      initWithMidiFile:midifile];
         [midifile release];
@@ -18,28 +18,37 @@
 
 #import "Array.h"
 #import "TimeSignature.h"
-#import "MidiNote.h"
-
-int sortbynote(void* note1, void* note2);
-int sortbytime(void* note1, void* note2);
+#import "NoteArray.h"
+#import "MidiEventTable.h"
 
 @interface MidiTrack : NSObject <NSCopying> {
     int number;            /** The track number */
-    Array* notes;          /** Array of Midi notes */
+    NoteArray* notes;      /** The midi notes, sorted by start time */
     int instrument;        /** Instrument for this track */
     Array* lyrics;         /** The lyrics in this track */
+
+    /* While the track is created from Midi events, the unmatched
+     * notes (duration 0) are kept in a stack per (channel, number),
+     * so each NoteOff finds its note without searching the notes.
+     */
+    int *pendinghead;      /** The latest unmatched note index per channel*128+number, or -1 */
+    int *pendingnext;      /** For each note index, the previous unmatched note index */
+    int pendingcapacity;   /** The allocated length of pendingnext */
 }
 
 @property (nonatomic, assign) int number;
-@property (nonatomic, readonly) Array *notes;
+@property (nonatomic, readonly) NoteArray *notes;
 @property (nonatomic, assign) int instrument;
 @property (nonatomic, retain) Array *lyrics;
 
 -(id)initWithTrack:(int)tracknum;
--(id)initWithEvents:(Array*)events andTrack:(int)tracknum;
+-(id)initWithEvents:(MidiEventTable*)events andTrack:(int)tracknum;
+-(id)initWithNotesOf:(MidiTrack*)track andEvents:(MidiEventTable*)events;
 -(NSString*)instrumentName;
--(void)addNote:(MidiNote *)m;
+-(void)addNote:(int)start channel:(int)channel number:(int)num duration:(int)dur;
 -(void)noteOffWithChannel:(int)channel andNumber:(int)num andTime:(int)endtime;
+-(void)startPendingNotes;
+-(void)endPendingNotes;
 -(void)addLyric:(MidiEvent *)mevent;
 -(id)copyWithZone:(NSZone *)zone;
 
@@ -23,35 +23,16 @@
 #include <sys/stat.h>
 #include <math.h>
 
-/** Compare two MidiNotes based on their start times.
- *  If the start times are equal, compare by their numbers.
- *  Used by the C mergesort function.
- */
-int sortbytime(void* v1, void* v2) {
-    MidiNote **m1 = (MidiNote**) v1;
-    MidiNote **m2 = (MidiNote**) v2;
-    MidiNote *note1 = *m1;
-    MidiNote *note2 = *m2;
-
-    if (note1.startTime == note2.startTime) {
-        return note1.number - note2.number;
-    }
-    else {
-        return note1.startTime - note2.startTime;
-    }
-}
-
-
 /** @class MidiTrack
  * The MidiTrack takes as input the raw MidiEvents for the track, and gets:
  * - The list of midi notes in the track.
  * - The first instrument used in the track.
  *
- * For each NoteOn event in the midi file, a new MidiNote is created
- * and added to the track, using the AddNote() method.
+ * For each NoteOn event in the midi file, a new note is added to
+ * the track's NoteArray, using the AddNote() method.
  * 
  * The NoteOff() method is called when a NoteOff event is encountered,
- * in order to update the duration of the MidiNote.
+ * in order to update the duration of the note.
  */ 
 @implementation MidiTrack
 
@@ -63,52 +44,85 @@ int sortbytime(void* v1, void* v2) {
 /** Create an empty MidiTrack. Used by the copy method */
 - (id)initWithTrack:(int)t {
     number = t;
-    notes = [[Array new:20] retain];
+    notes = [[NoteArray new:20] retain];
     instrument = 0;
     return self;
 }
 
 /** Create a MidiTrack based on the Midi events.  Extract the NoteOn/NoteOff
- *  events to gather the list of MidiNotes.
+ *  events to gather the list of notes.
  */
-- (id)initWithEvents:(Array*)list andTrack:(int)num {
+- (id)initWithEvents:(MidiEventTable*)list andTrack:(int)num {
     number = num;
-    notes = [[Array new:100] retain];
+    notes = [[NoteArray new:100] retain];
     instrument = 0;
+    [self startPendingNotes];
 
     for (int i= 0;i < [list count]; i++) {
-        MidiEvent *mevent = [list get:i];
-        if (mevent.eventFlag == EventNoteOn && mevent.velocity > 0) {
-            MidiNote *note = [[MidiNote alloc] init];
-            note.startTime = mevent.startTime;
-            note.channel = mevent.channel;
-            note.number = mevent.notenumber;
-            [self addNote:note];
-            [note release];
-        }
-        else if (mevent.eventFlag == EventNoteOn && mevent.velocity == 0) {
-            [self noteOffWithChannel:mevent.channel andNumber:mevent.notenumber
-                  andTime:mevent.startTime ];
+        u_char eventflag = [list eventFlag:i];
+        if (eventflag == EventNoteOn && [list data2:i] > 0) {
+            [self addNote:[list startTime:i] channel:[list channel:i]
+                   number:[list data1:i] duration:0];
         }
-        else if (mevent.eventFlag == EventNoteOff) {
-            [self noteOffWithChannel:mevent.channel andNumber:mevent.notenumber
-                  andTime:mevent.startTime ];
+        else if (eventflag == EventNoteOn || eventflag == EventNoteOff) {
+            [self noteOffWithChannel:[list channel:i] andNumber:[list data1:i]
+                  andTime:[list startTime:i] ];
         }
-        else if (mevent.eventFlag == EventProgramChange) {
-            instrument = mevent.instrument;
+        else if (eventflag == EventProgramChange) {
+            instrument = [list data1:i];
         }
-        else if (mevent.metaevent == MetaEventLyric) {
-            [self addLyric:mevent];
+        else if ([list metaevent:i] == MetaEventLyric) {
+            [self addLyric:[list get:i]];
         }
     }
-    if ([notes count] > 0 && [(MidiNote*)[notes get:0] channel] == 9) {
+    [self endPendingNotes];
+    if ([notes count] > 0 && [notes channel:0] == 9) {
         instrument = 128;  /* Percussion */
     }
     return self;
 }
 
+/** Create a MidiTrack with the notes and instrument of the given track,
+ *  and the lyrics in the given events.  The notes are shared, not copied.
+ *  This is used when a track is unchanged in a reloaded midi file: the
+ *  notes are the same, but the lyrics must point into the new data.
+ */
+- (id)initWithNotesOf:(MidiTrack*)track andEvents:(MidiEventTable*)list {
+    number = track->number;
+    notes = [track->notes retain];
+    instrument = track->instrument;
+    for (int i = 0; i < [list count]; i++) {
+        if ([list metaevent:i] == MetaEventLyric) {
+            [self addLyric:[list get:i]];
+        }
+    }
+    return self;
+}
+
+/** Start tracking the unmatched notes, for noteOffWithChannel */
+- (void)startPendingNotes {
+    pendinghead = (int*)malloc(16 * 128 * sizeof(int));
+    for (int i = 0; i < 16 * 128; i++) {
+        pendinghead[i] = -1;
+    }
+    pendingcapacity = 100;
+    pendingnext = (int*)malloc(pendingcapacity * sizeof(int));
+}
+
+/** Stop tracking the unmatched notes.  After this, the notes may be
+ *  modified, and noteOffWithChannel searches the notes instead.
+ */
+- (void)endPendingNotes {
+    free(pendinghead);
+    free(pendingnext);
+    pendinghead = NULL;
+    pendingnext = NULL;
+    pendingcapacity = 0;
+}
+
 
 - (void)dealloc {
+    [self endPendingNotes];
     [notes release]; notes = nil;
     [lyrics release]; lyrics = nil;
     [super dealloc];
@@ -123,20 +137,52 @@ int sortbytime(void* v1, void* v2) {
     }
 }
 
-/** Add a MidiNote to this track.  This is called for each NoteOn event */
-- (void)addNote:(MidiNote*)m {
-    [notes add:m];
+/** Add a note to this track.  This is called for each NoteOn event */
+- (void)addNote:(int)start channel:(int)channel number:(int)num duration:(int)dur {
+    [notes addNote:start channel:channel number:num duration:dur];
+    if (pendinghead != NULL && channel >= 0 && channel < 16 &&
+        num >= 0 && num < 128 && dur == 0) {
+
+        int index = [notes count] - 1;
+        if (index >= pendingcapacity) {
+            pendingcapacity = 2*pendingcapacity;
+            pendingnext = (int*)realloc(pendingnext, pendingcapacity * sizeof(int));
+        }
+        int key = channel * 128 + num;
+        pendingnext[index] = pendinghead[key];
+        pendinghead[key] = index;
+    }
 }
 
-/** A NoteOff event occured.  Find the MidiNote of the corresponding
- * NoteOn event, and update the duration of the MidiNote.
+/** A NoteOff event occured.  Find the note of the corresponding
+ * NoteOn event, and update the duration of the note. The note is
+ * the most recent one with the same channel and number that has not
+ * ended yet (duration 0).
  */
 - (void)noteOffWithChannel:(int)channel andNumber:(int)num andTime:(int)endtime {
-    for (int i = [notes count]-1; i >= 0; i--) {
-        MidiNote* note = [notes get:i];
-        if (note.channel == channel && note.number == num &&
-            note.duration == 0) {
-            [note noteOff:endtime];
+    if (pendinghead != NULL) {
+        if (channel < 0 || channel >= 16 || num < 0 || num >= 128) {
+            return;
+        }
+        int key = channel * 128 + num;
+        int index = pendinghead[key];
+        if (index == -1) {
+            return;
+        }
+        [notes setDuration:(endtime - [notes startTime:index]) index:index];
+        /* A note that ends when it starts still has duration 0,
+         * so it can still be matched by a later NoteOff.
+         */
+        if ([notes duration:index] != 0) {
+            pendinghead[key] = pendingnext[index];
+        }
+        return;
+    }
+    NoteView v = [notes view];
+    for (int i = v.count-1; i >= 0; i--) {
+        if (v.channel[i] == channel && v.number[i] == num &&
+            v.duration[i] == 0) {
+            v.duration[i] = endtime - v.starttime[i];
             return;
         }
     }
@@ -151,15 +197,13 @@ int sortbytime(void* v1, void* v2) {
 }
 
 
-/** Return a deep copy clone of this MidiTrack */
+/** Return a deep copy clone of this MidiTrack.  The notes are
+ *  copied column by column, without creating an object per note.
+ */
 - (id)copyWithZone:(NSZone*)zone {
     MidiTrack *track = [[MidiTrack alloc] initWithTrack:number];
     track.instrument = instrument;
-    for (int i = 0; i < [notes count]; i++) {
-        MidiNote *note = [notes get:i];
-        MidiNote *notecopy = [note copy];
-        [track.notes add:notecopy ];
-    }
+    [track.notes addNotes:notes];
     if (lyrics != nil) {
         Array *newlyrics = [Array new:[lyrics count]];
         for (int i = 0; i < [lyrics count]; i++) {
@@ -174,11 +218,7 @@ int sortbytime(void* v1, void* v2) {
 - (NSString*)description {
     NSString *s = [NSString stringWithFormat:
                       @"Track number=%d instrument=%d\n", number, instrument];
-    for (int i = 0; i < [notes count]; i++) {
-        MidiNote *m = [notes get:i];
-        s = [s stringByAppendingString:[m description]];
-        s = [s stringByAppendingString:@"\n"];
-    }
+    s = [s stringByAppendingString:[notes description]];
     s = [s stringByAppendingString:@"End Track\n"];
     return s;
 }
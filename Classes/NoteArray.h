@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#import <Foundation/NSObject.h>
+#import <Foundation/NSString.h>
+#import <Foundation/NSZone.h>
+
+/** A view of the columns of a NoteArray, or of a range of its notes.
+ *  Loops over the notes should read the columns directly through a
+ *  view.  The view is only valid until notes are added to the array,
+ *  and must not be used to change a locked array.
+ */
+typedef struct NoteView {
+    int count;          /** The number of notes */
+    int *starttime;     /** The start time of each note, in pulses */
+    int *duration;      /** The duration of each note, in pulses */
+    int *number;        /** The note number, from 0 to 127. Middle C is 60 */
+    u_char *channel;    /** The channel of each note */
+} NoteView;
+
+@interface NoteArray : NSObject <NSCopying> {
+    int count;          /** The number of notes */
+    int capacity;       /** The allocated length of each column */
+    int *starttime;     /** The start time of each note, in pulses */
+    int *duration;      /** The duration of each note, in pulses */
+    int *number;        /** The note number, from 0 to 127. Middle C is 60 */
+    u_char *channel;    /** The channel of each note */
+    void *scratch;      /** Memory reused by sortByTime */
+    size_t scratchlen;  /** The size of the scratch memory, in bytes */
+    BOOL locked;        /** True if the notes are shared and must not change */
+}
+
++(id)new:(int)capacity;
+-(id)initWithCapacity:(int)capacity;
+-(int)count;
+-(NoteView)view;
+-(NoteView)viewFrom:(int)start count:(int)n;
+-(void)addNote:(int)start channel:(int)c number:(int)num duration:(int)dur;
+-(void)addNote:(int)index from:(NoteArray*)notes;
+-(void)addNotes:(NoteArray*)notes;
+-(int)startTime:(int)index;
+-(int)endTime:(int)index;
+-(int)duration:(int)index;
+-(int)number:(int)index;
+-(int)channel:(int)index;
+-(void)setStartTime:(int)start index:(int)index;
+-(void)setDuration:(int)dur index:(int)index;
+-(void)setNumber:(int)num index:(int)index;
+-(void)setChannel:(int)c index:(int)index;
+-(void)sortByTime;
+-(void)removeDuplicates;
+-(void)lock;
+-(BOOL)locked;
+-(id)copyWithZone:(NSZone*)zone;
+-(NSString*)description;
+-(void)dealloc;
+
+@end
+
+
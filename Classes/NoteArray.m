@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#import "NoteArray.h"
+#import "RadixSort.h"
+
+/** Move the values of a column into sorted order, using the order
+ *  from radixsort_order.  The tmp array must hold count values.
+ */
+static void permuteColumn(int *column, const int *order, int count, int *tmp) {
+    for (int i = 0; i < count; i++) {
+        tmp[i] = column[order[i]];
+    }
+    memcpy(column, tmp, count * sizeof(int));
+}
+
+
+/** @class NoteArray
+ * The NoteArray stores the midi notes of a track as a struct of
+ * arrays: one contiguous column each for the start time, duration,
+ * note number and channel.  A note is identified by its index.
+ *
+ * Code that loops over every note should get a NoteView and read the
+ * columns directly, instead of calling a method per note.
+ */
+@implementation NoteArray
+
+/** Allocate a new, empty note array with the given capacity */
++ (id)new:(int)capacity {
+    NoteArray *arr = [[NoteArray alloc] initWithCapacity:capacity];
+    return [arr autorelease];
+}
+
+- (id)initWithCapacity:(int)newcapacity {
+    assert(newcapacity >= 0);
+    if (newcapacity == 0)
+        newcapacity = 1;
+    capacity = newcapacity;
+    count = 0;
+    starttime = (int*)malloc(capacity * sizeof(int));
+    duration = (int*)malloc(capacity * sizeof(int));
+    number = (int*)malloc(capacity * sizeof(int));
+    channel = (u_char*)malloc(capacity * sizeof(u_char));
+    scratch = NULL;
+    scratchlen = 0;
+    return self;
+}
+
+- (void)dealloc {
+    free(starttime);
+    free(duration);
+    free(number);
+    free(channel);
+    free(scratch);
+    [super dealloc];
+}
+
+/** Make room for at least n notes */
+- (void)reserve:(int)n {
+    assert(!locked);
+    if (n <= capacity) {
+        return;
+    }
+    int newcapacity = 2*capacity;
+    if (newcapacity < n) {
+        newcapacity = n;
+    }
+    starttime = (int*)realloc(starttime, newcapacity * sizeof(int));
+    duration = (int*)realloc(duration, newcapacity * sizeof(int));
+    number = (int*)realloc(number, newcapacity * sizeof(int));
+    channel = (u_char*)realloc(channel, newcapacity * sizeof(u_char));
+    capacity = newcapacity;
+}
+
+/** Return the number of notes */
+- (int)count {
+    return count;
+}
+
+/** Return a view of all the notes */
+- (NoteView)view {
+    return [self viewFrom:0 count:count];
+}
+
+/** Return a view of the n notes starting at the given index */
+- (NoteView)viewFrom:(int)start count:(int)n {
+    assert(start >= 0 && n >= 0 && start + n <= count);
+    NoteView v;
+    v.count = n;
+    v.starttime = starttime + start;
+    v.duration = duration + start;
+    v.number = number + start;
+    v.channel = channel + start;
+    return v;
+}
+
+/** Append a note to the end of the array */
+- (void)addNote:(int)start channel:(int)c number:(int)num duration:(int)dur {
+    [self reserve:(count + 1)];
+    starttime[count] = start;
+    duration[count] = dur;
+    number[count] = num;
+    channel[count] = (u_char)c;
+    count++;
+}
+
+/** Append a copy of the note at the given index of another array */
+- (void)addNote:(int)index from:(NoteArray*)notes {
+    assert(index >= 0 && index < notes->count);
+    [self addNote:notes->starttime[index] channel:notes->channel[index]
+           number:notes->number[index] duration:notes->duration[index]];
+}
+
+/** Append all the notes of another array */
+- (void)addNotes:(NoteArray*)notes {
+    int n = notes->count;
+    [self reserve:(count + n)];
+    memcpy(starttime + count, notes->starttime, n * sizeof(int));
+    memcpy(duration + count, notes->duration, n * sizeof(int));
+    memcpy(number + count, notes->number, n * sizeof(int));
+    memcpy(channel + count, notes->channel, n * sizeof(u_char));
+    count += n;
+}
+
+- (int)startTime:(int)index {
+    assert(index >= 0 && index < count);
+    return starttime[index];
+}
+
+- (int)endTime:(int)index {
+    assert(index >= 0 && index < count);
+    return starttime[index] + duration[index];
+}
+
+- (int)duration:(int)index {
+    assert(index >= 0 && index < count);
+    return duration[index];
+}
+
+- (int)number:(int)index {
+    assert(index >= 0 && index < count);
+    return number[index];
+}
+
+- (int)channel:(int)index {
+    assert(index >= 0 && index < count);
+    return channel[index];
+}
+
+- (void)setStartTime:(int)start index:(int)index {
+    assert(index >= 0 && index < count && !locked);
+    starttime[index] = start;
+}
+
+- (void)setDuration:(int)dur index:(int)index {
+    assert(index >= 0 && index < count && !locked);
+    duration[index] = dur;
+}
+
+- (void)setNumber:(int)num index:(int)index {
+    assert(index >= 0 && index < count && !locked);
+    number[index] = num;
+}
+
+- (void)setChannel:(int)c index:(int)index {
+    assert(index >= 0 && index < count && !locked);
+    channel[index] = (u_char)c;
+}
+
+/** Sort the notes by start time, then by note number.  The sort
+ *  is stable (notes with the same start time and number keep their
+ *  order), and takes linear time: a radix sort computes the sorted
+ *  order from integer keys, and then each column is moved into that
+ *  order.  The scratch memory is kept for the next sort.
+ */
+- (void)sortByTime {
+    assert(!locked);
+    if (count < 2) {
+        return;
+    }
+    int i;
+    int minstart = starttime[0];
+    int minnumber = number[0];
+    BOOL sorted = YES;
+    for (i = 1; i < count; i++) {
+        if (starttime[i-1] > starttime[i] ||
+            (starttime[i-1] == starttime[i] && number[i-1] > number[i])) {
+            sorted = NO;
+        }
+        if (minstart > starttime[i]) {
+            minstart = starttime[i];
+        }
+        if (minnumber > number[i]) {
+            minnumber = number[i];
+        }
+    }
+    if (sorted) {
+        return;
+    }
+
+    /* The scratch memory holds the keys, the memory used by
+     * radixsort_order, and the order.
+     */
+    size_t len = count * (sizeof(uint64_t) + sizeof(int)) + radixsort_scratch(count);
+    if (scratchlen < len) {
+        free(scratch);
+        scratch = malloc(len);
+        scratchlen = len;
+    }
+    uint64_t *keys = (uint64_t*)scratch;
+    void *sortscratch = keys + count;
+    int *order = (int*)((char*)sortscratch + radixsort_scratch(count));
+
+    for (i = 0; i < count; i++) {
+        keys[i] = ((uint64_t)(uint32_t)(starttime[i] - minstart) << 32) |
+                  (uint32_t)(number[i] - minnumber);
+    }
+    radixsort_order(keys, count, order, sortscratch);
+
+    /* The keys are no longer needed, so use them to move the columns */
+    int *tmp = (int*)keys;
+    permuteColumn(starttime, order, count, tmp);
+    permuteColumn(duration, order, count, tmp);
+    permuteColumn(number, order, count, tmp);
+    u_char *tmpchannel = (u_char*)tmp;
+    for (i = 0; i < count; i++) {
+        tmpchannel[i] = channel[order[i]];
+    }
+    memcpy(channel, tmpchannel, count * sizeof(u_char));
+}
+
+/** Remove the notes with the same start time and number as an earlier
+ *  note, keeping the longest duration of each.  The notes must be
+ *  sorted by time, so the duplicates are next to each other.
+ */
+- (void)removeDuplicates {
+    assert(!locked);
+    if (count < 2) {
+        return;
+    }
+    int n = 1;
+    for (int i = 1; i < count; i++) {
+        if (starttime[i] == starttime[n-1] && number[i] == number[n-1]) {
+            if (duration[n-1] < duration[i]) {
+                duration[n-1] = duration[i];
+            }
+            continue;
+        }
+        starttime[n] = starttime[i];
+        duration[n] = duration[i];
+        number[n] = number[i];
+        channel[n] = channel[i];
+        n++;
+    }
+    count = n;
+}
+
+/** Lock the array, so that it can be shared.  Adding, changing, or
+ *  sorting the notes of a locked array fails an assertion.  A copy of
+ *  a locked array is not locked.
+ */
+- (void)lock {
+    locked = YES;
+}
+
+/** Return true if the array is locked */
+- (BOOL)locked {
+    return locked;
+}
+
+/** Return a copy of this array.  The columns are copied with memcpy,
+ *  so this costs four allocations no matter how many notes there are.
+ */
+- (id)copyWithZone:(NSZone*)zone {
+    NoteArray *arr = [[NoteArray alloc] initWithCapacity:count];
+    [arr addNotes:self];
+    return [arr autorelease];
+}
+
+- (NSString*)description {
+    NSMutableString *s = [NSMutableString stringWithFormat:@"NoteArray count=%d\n", count];
+    for (int i = 0; i < count; i++) {
+        [s appendFormat:@"  channel=%d number=%d start=%d duration=%d\n",
+           channel[i], number[i], starttime[i], duration[i]];
+    }
+    return s;
+}
+
+@end
+
+
@@ -16,7 +16,7 @@
 #import <AppKit/NSColor.h>
 
 @interface Piano : NSView {
-    Array *notes;          /** The midi notes, for shading. */
+    NoteArray *notes;      /** The midi notes, for shading. */
     int maxShadeDuration;  /** The maximum duration we'll shade a note for */
     BOOL useTwoColors;     /** If true, use two colors for highlighting */
     int showNoteLetters;   /** Display the letter for each piano note */
@@ -112,19 +112,14 @@ static int blackKeyOffsets[10];  /** The x pixles of the black keys */
 
     maxShadeDuration = midifile.time.quarter * 2;
     Array *tracks = [midifile changeMidiNotes:options];
-    MidiTrack *track = [MidiFile combineToSingleTrack:tracks];
-    notes = [track.notes retain];
 
     /* We want to know which track the note came from.
-     * Use the 'channel' field to store the track.
+     * Use the 'channel' field to store the track.  The tracks are
+     * shared with the SheetMusic, so the channel is only set in the
+     * combined notes.
      */
-    for (int tracknum = 0; tracknum < [tracks count]; tracknum++) {
-        MidiTrack *t = [tracks get:tracknum];
-        for (int i = 0; i < [t.notes count]; i++) {
-            MidiNote *note = [t.notes get:i];
-            note.channel = tracknum;
-        }
-    }
+    MidiTrack *track = [MidiFile combineToSingleTrack:tracks useTrackAsChannel:YES];
+    notes = [track.notes retain];
 
     /* When we have exactly two tracks, we assume this is a piano song,
      * and we use different colors for highlighting the left hand and
@@ -503,40 +498,40 @@ static void drawLine(NSColor *color, int x1, int y1, int x2, int y2) {
  *  Return the index of the symbol.  Use a binary search method.
  */
 - (int)findClosestStartTime:(int)pulseTime {
+    NoteView v = [notes view];
     int left = 0;
-    int right = [notes count] - 1;
+    int right = v.count - 1;
 
     while (right - left > 1) {
         int i = (right + left)/2;
-        if ([[notes get:left] startTime] == pulseTime)
+        if (v.starttime[left] == pulseTime)
             break;
-        else if ([[notes get:i] startTime] <= pulseTime)
+        else if (v.starttime[i] <= pulseTime)
             left = i;
         else
             right = i;
     }
-    while (left >= 1 && ([[notes get:left-1] startTime] == [[notes get:left] startTime])) {
+    while (left >= 1 && (v.starttime[left-1] == v.starttime[left])) {
         left--;
     }
     return left;
 }
 
 
-/** Return the next startTime that occurs after the MidiNote
+/** Return the next startTime that occurs after the note
  *  at offset i.  If all the subsequent notes have the same
  *  startTime, then return the largest endTime.
  */
 - (int)nextStartTime:(int)i {
-	MidiNote *note = [notes get:i];
-    int start = note.startTime;
-    int end = note.endTime;
-
-    while (i < [notes count]) {
-		note = [notes get:i];
-        if (note.startTime > start) {
-            return note.startTime;
+    NoteView v = [notes view];
+    int start = v.starttime[i];
+    int end = start + v.duration[i];
+
+    while (i < v.count) {
+        if (v.starttime[i] > start) {
+            return v.starttime[i];
         }
-        int end2 = note.endTime;
+        int end2 = v.starttime[i] + v.duration[i];
         end = max(end, end2);
         i++;
     }
@@ -544,25 +539,24 @@ static void drawLine(NSColor *color, int x1, int y1, int x2, int y2) {
 }
 
 
-/** Return the next startTime that occurs after the MidiNote
+/** Return the next startTime that occurs after the note
  *  at offset i, that is also in the same track/channel.
  */
 - (int)nextStartTimeSameTrack:(int)i {
-	MidiNote *note = [notes get:i];
-    int start = note.startTime;
-    int end = note.endTime;
-    int track = note.channel;
-
-    while (i < [notes count]) {
-		note = [notes get:i];
-        if (note.channel != track) {
+    NoteView v = [notes view];
+    int start = v.starttime[i];
+    int end = start + v.duration[i];
+    int track = v.channel[i];
+
+    while (i < v.count) {
+        if (v.channel[i] != track) {
             i++;
             continue;
         }
-        if (note.startTime > start) {
-            return note.startTime;
+        if (v.starttime[i] > start) {
+            return v.starttime[i];
         }
-        int end2 = note.endTime;
+        int end2 = v.starttime[i] + v.duration[i];
         end = max(end, end2);
         i++;
     }
@@ -594,12 +588,12 @@ static void drawLine(NSColor *color, int x1, int y1, int x2, int y2) {
      * Unshade notes where startTime <= prevPulseTime < next startTime
      * Shade notes where startTime <= currentPulseTime < next startTime
      */
+    NoteView v = [notes view];
     int lastShadedIndex = [self findClosestStartTime:(prevPulseTime - maxShadeDuration*2)];
-    for (int i = lastShadedIndex; i < [notes count]; i++) {
-		MidiNote *note = [notes get:i];
-        int start = note.startTime;
-        int end = note.endTime;
-        int notenumber = note.number;
+    for (int i = lastShadedIndex; i < v.count; i++) {
+        int start = v.starttime[i];
+        int end = start + v.duration[i];
+        int notenumber = v.number[i];
 
         int nextStart = [self nextStartTime:i];
         int nextStartTrack = [self nextStartTimeSameTrack:i];
@@ -622,7 +616,7 @@ static void drawLine(NSColor *color, int x1, int y1, int x2, int y2) {
         /* If the note is in the current time, shade it */
         if ((start <= currentPulseTime) && (currentPulseTime < end)) {
             if (useTwoColors) {
-                if (note.channel == 1) {
+                if (v.channel[i] == 1) {
                     [self shadeOneNote:notenumber withColor:shade2Color];
                 }
                 else {
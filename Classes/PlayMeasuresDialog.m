@@ -33,7 +33,7 @@
  */
 - (id)initWithMidi:(MidiFile*)midifile {
     int lastStart = midifile.endTime;
-    int lastMeasure = 1 + lastStart / midifile.time.measure;
+    int lastMeasure = 1 + [midifile.measuremap measureForTime:lastStart];
 
     /* Create the dialog box */
     float labelheight = [[NSFont labelFontOfSize:[NSFont labelFontSize]] capHeight] * 4;
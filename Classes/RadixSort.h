@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+size_t radixsort_scratch(int n);
+void radixsort_order(const uint64_t *keys, int n, int *order, void *scratch);
+void radixsort_int(int *values, int n, int *tmp);
+
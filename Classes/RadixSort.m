@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <string.h>
+#include <assert.h>
+#include "RadixSort.h"
+
+/* The notes and events are sorted with a stable LSD radix sort, one
+ * byte of the key per pass.  A pass costs two linear scans, and the
+ * passes for bytes that are the same in every key are skipped, so a
+ * track whose start times fit in 3 bytes and whose note numbers fit
+ * in 1 byte takes at most 4 passes.
+ *
+ * The callers build the keys so that comparing the keys as unsigned
+ * integers gives the order they want.  For example, the notes use
+ * (starttime - minstart) << 32 | (number - minnumber).
+ */
+
+/** Return the size (in bytes) of the scratch memory needed by
+ *  radixsort_order for n keys.
+ */
+size_t radixsort_scratch(int n) {
+    return (size_t)n * (2 * sizeof(uint64_t) + sizeof(int));
+}
+
+/** Sort the n keys in increasing order, and store in order[] the
+ *  original index of each key in sorted order.  Equal keys keep their
+ *  original order.  The keys are not modified.  The scratch memory
+ *  must hold radixsort_scratch(n) bytes.
+ */
+void radixsort_order(const uint64_t *keys, int n, int *order, void *scratch) {
+    assert(n >= 0);
+    if (n == 0) {
+        return;
+    }
+    uint64_t *src = (uint64_t*)scratch;
+    uint64_t *dest = src + n;
+    int *srcorder = order;
+    int *destorder = (int*)(dest + n);
+
+    int counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for (int i = 0; i < n; i++) {
+        uint64_t key = keys[i];
+        src[i] = key;
+        srcorder[i] = i;
+        for (int digit = 0; digit < 8; digit++) {
+            counts[digit][(key >> (8*digit)) & 0xff]++;
+        }
+    }
+
+    for (int digit = 0; digit < 8; digit++) {
+        int shift = 8*digit;
+        int *count = counts[digit];
+        if (count[(src[0] >> shift) & 0xff] == n) {
+            /* Every key has the same byte here */
+            continue;
+        }
+        int total = 0;
+        for (int b = 0; b < 256; b++) {
+            int c = count[b];
+            count[b] = total;
+            total += c;
+        }
+        for (int i = 0; i < n; i++) {
+            int pos = count[(src[i] >> shift) & 0xff]++;
+            dest[pos] = src[i];
+            destorder[pos] = srcorder[i];
+        }
+        uint64_t *k = src; src = dest; dest = k;
+        int *o = srcorder; srcorder = destorder; destorder = o;
+    }
+    if (srcorder != order) {
+        memcpy(order, srcorder, n * sizeof(int));
+    }
+}
+
+/** Sort the n integers in increasing order.  The tmp array must
+ *  have room for n integers.
+ */
+void radixsort_int(int *values, int n, int *tmp) {
+    assert(n >= 0);
+    if (n == 0) {
+        return;
+    }
+    /* Flip the sign bit, so that negative values sort first when the
+     * values are compared as unsigned integers.
+     */
+    uint32_t *src = (uint32_t*)values;
+    uint32_t *dest = (uint32_t*)tmp;
+    int counts[4][256];
+    memset(counts, 0, sizeof(counts));
+    for (int i = 0; i < n; i++) {
+        uint32_t key = src[i] ^ 0x80000000u;
+        src[i] = key;
+        for (int digit = 0; digit < 4; digit++) {
+            counts[digit][(key >> (8*digit)) & 0xff]++;
+        }
+    }
+
+    for (int digit = 0; digit < 4; digit++) {
+        int shift = 8*digit;
+        int *count = counts[digit];
+        if (count[(src[0] >> shift) & 0xff] == n) {
+            continue;
+        }
+        int total = 0;
+        for (int b = 0; b < 256; b++) {
+            int c = count[b];
+            count[b] = total;
+            total += c;
+        }
+        for (int i = 0; i < n; i++) {
+            dest[count[(src[i] >> shift) & 0xff]++] = src[i];
+        }
+        uint32_t *k = src; src = dest; dest = k;
+    }
+    for (int i = 0; i < n; i++) {
+        values[i] = (int)(src[i] ^ 0x80000000u);
+    }
+}
+
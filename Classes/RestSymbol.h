@@ -13,6 +13,8 @@
 #import "MusicSymbol.h"
 #import "TimeSignature.h"
 
+@class MidiFileReader;
+
 @interface RestSymbol : NSObject <MusicSymbol> {
     int starttime;          /** The starttime of the rest */
     NoteDuration duration;  /** The rest duration (eighth, quarter, half, whole) */
@@ -24,6 +26,8 @@
 -(void)drawHalf:(int)ytop;
 -(void)drawQuarter:(int)ytop;
 -(void)drawEighth:(int)ytop;
+-(id)initWithLayout:(MidiFileReader*)reader;
+-(void)appendLayout:(NSMutableData*)data;
 
 @end
 
@@ -17,6 +17,8 @@
  * note.
  */
 #import "RestSymbol.h"
+#import "MidiFileReader.h"
+#import "ScoreCache.h"
 
 @implementation RestSymbol
 
@@ -211,6 +213,21 @@
     return s;
 }
 
+/** Append the start time, duration and width to the layout cache */
+- (void)appendLayout:(NSMutableData*)data {
+    appendInt(data, starttime);
+    appendInt(data, duration);
+    appendInt(data, width);
+}
+
+/** Create a rest from its layout (see appendLayout:) */
+- (id)initWithLayout:(MidiFileReader*)reader {
+    starttime = [reader readInt];
+    duration = [reader readInt];
+    width = [reader readInt];
+    return self;
+}
+
 
 @end
 
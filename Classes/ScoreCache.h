@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#import <Foundation/NSObject.h>
+#import <Foundation/NSString.h>
+#import <Foundation/NSData.h>
+
+#import "MidiFileReader.h"
+
+/* The version of the cache file format.  Increase this whenever the
+ * format, or the way a MidiFile is parsed or laid out, changes.
+ */
+#define ScoreCacheVersion 2
+
+void appendInt(NSMutableData *data, int value);
+
+@interface ScoreCache : NSObject {
+    NSString *directory;    /** The directory holding the cache files */
+}
+
+@property (nonatomic, readonly) NSString *directory;
+
++(ScoreCache*)defaultCache;
++(NSString*)keyForBytes:(const u_char*)bytes length:(int)len;
+-(id)initWithDirectory:(NSString*)dir;
+-(NSString*)pathForKey:(NSString*)key;
+-(MidiFileReader*)readerForKey:(NSString*)key;
+-(BOOL)storeData:(NSData*)data forKey:(NSString*)key;
+-(void)dealloc;
+
+@end
+
+
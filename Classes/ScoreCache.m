@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#import <Foundation/NSFileManager.h>
+#import <Foundation/NSPathUtilities.h>
+#import <CommonCrypto/CommonDigest.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <dispatch/dispatch.h>
+#import "MidiFileException.h"
+#import "ScoreCache.h"
+
+/** @class ScoreCache
+ * The ScoreCache stores parsed midi files on disk, so that reopening
+ * a song doesn't parse the whole file again.
+ *
+ * Each entry is a file named by its key, which is the SHA-1 hash of
+ * the midi file contents.  Since the key depends only on the contents,
+ * an entry never becomes stale: an edited midi file has a new key.
+ * The format of the entry is owned by MidiFile (see cacheData and
+ * readCache:).  The sheet music layout of a song is stored in a second
+ * entry, keyed by the song and the options that affect the layout, in
+ * a format owned by SheetMusic (see layoutData and readLayout:).  The
+ * ScoreCache only stores and maps the bytes.
+ *
+ * Entries are written to a temporary file and renamed into place, so
+ * a reader never sees a partially written entry, and an entry that
+ * is memory mapped is never modified.
+ */
+/** Append a 32-bit big endian int to the cache data */
+void appendInt(NSMutableData *data, int value) {
+    u_char buf[4];
+    buf[0] = (u_char)(value >> 24);
+    buf[1] = (u_char)(value >> 16);
+    buf[2] = (u_char)(value >> 8);
+    buf[3] = (u_char)value;
+    [data appendBytes:buf length:4];
+}
+
+@implementation ScoreCache
+
+@synthesize directory;
+
+/** Return the shared cache, in ~/Library/Caches/MidiSheetMusic */
++ (ScoreCache*)defaultCache {
+    static ScoreCache *cache = nil;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        NSArray *dirs = NSSearchPathForDirectoriesInDomains(NSCachesDirectory,
+                                                            NSUserDomainMask, YES);
+        if ([dirs count] > 0) {
+            NSString *dir = [[dirs objectAtIndex:0]
+                             stringByAppendingPathComponent:@"MidiSheetMusic"];
+            cache = [[ScoreCache alloc] initWithDirectory:dir];
+        }
+    });
+    return cache;
+}
+
+/** Return the cache key (a hex SHA-1 hash) of the given midi data */
++ (NSString*)keyForBytes:(const u_char*)bytes length:(int)len {
+    u_char digest[CC_SHA1_DIGEST_LENGTH];
+    char hex[2*CC_SHA1_DIGEST_LENGTH + 1];
+    CC_SHA1(bytes, (CC_LONG)len, digest);
+    for (int i = 0; i < CC_SHA1_DIGEST_LENGTH; i++) {
+        sprintf(&hex[2*i], "%02x", digest[i]);
+    }
+    return [NSString stringWithCString:hex encoding:NSASCIIStringEncoding];
+}
+
+/** Create a cache in the given directory.  The directory is created
+ *  when the first entry is stored.
+ */
+- (id)initWithDirectory:(NSString*)dir {
+    directory = [dir retain];
+    return self;
+}
+
+- (void)dealloc {
+    [directory release];
+    [super dealloc];
+}
+
+/** Return the path of the cache file for the given key */
+- (NSString*)pathForKey:(NSString*)key {
+    NSString *name = [NSString stringWithFormat:@"%@-%d.cache", key, ScoreCacheVersion];
+    return [directory stringByAppendingPathComponent:name];
+}
+
+/** Return a reader over the (memory mapped) cache entry for the given
+ *  key, or nil if there is no entry.  The caller owns the reader.
+ */
+- (MidiFileReader*)readerForKey:(NSString*)key {
+    NSString *path = [self pathForKey:key];
+    if (![[NSFileManager defaultManager] fileExistsAtPath:path]) {
+        return nil;
+    }
+    @try {
+        return [[MidiFileReader alloc] initWithFile:path];
+    }
+    @catch (MidiFileException *e) {
+    }
+    return nil;
+}
+
+/** Store the data as the cache entry for the given key.
+ *  Return true on success, and false on error.
+ */
+- (BOOL)storeData:(NSData*)data forKey:(NSString*)key {
+    NSFileManager *manager = [NSFileManager defaultManager];
+    if (![manager fileExistsAtPath:directory]) {
+        [manager createDirectoryAtPath:directory withIntermediateDirectories:YES
+                 attributes:nil error:NULL];
+    }
+    NSString *path = [self pathForKey:key];
+    NSString *tmpname = [NSString stringWithFormat:@"%@.%d.tmp", path, getpid()];
+    const char *cfilename = [path cStringUsingEncoding:NSUTF8StringEncoding];
+    const char *ctmpname = [tmpname cStringUsingEncoding:NSUTF8StringEncoding];
+    int file = open(ctmpname, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    if (file < 0) {
+        return NO;
+    }
+    const u_char *bytes = (const u_char*)[data bytes];
+    int len = (int)[data length];
+    int error = 0;
+    while (len > 0) {
+        ssize_t n = write(file, bytes, len);
+        if (n <= 0) {
+            error = 1;
+            break;
+        }
+        bytes += n;
+        len -= n;
+    }
+    close(file);
+    if (!error && rename(ctmpname, cfilename) != 0) {
+        error = 1;
+    }
+    if (error) {
+        unlink(ctmpname);
+        return NO;
+    }
+    return YES;
+}
+
+@end
+
+
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#import <Foundation/NSObject.h>
+
+#import "IntArray.h"
+#import "MidiEventTable.h"
+#import "MeasureMap.h"
+
+/* A value in a ChannelState that hasn't been set by any event */
+#define StateUnset 0xFF
+#define PitchBendUnset 0xFFFF
+
+/** The sound state of a single channel, at some point in a track */
+typedef struct ChannelState {
+    u_char controllers[128];   /** The value of each controller */
+    u_char program;            /** The instrument (program change) */
+    u_char pressure;           /** The channel pressure */
+    u_short pitchbend;         /** The pitch bend */
+} ChannelState;
+
+@interface SeekCheckpoints : NSObject {
+    MidiEventTable *events;   /** The events of the track */
+    int count;                /** The number of checkpoints */
+    int *pulses;              /** The time (in pulses) of each checkpoint */
+    int *indexes;             /** The first event at or after each checkpoint */
+    int *tempos;              /** The last tempo before each checkpoint, or 0 */
+    int numchannels;          /** The number of channels used by the track */
+    int channelmap[16];       /** The index of each channel in the states, or -1 */
+    ChannelState *states;     /** The state of each used channel, per checkpoint */
+    IntArray *sysex;          /** The index of every sysex event */
+}
+
+@property (nonatomic, readonly) int count;
+@property (nonatomic, readonly) IntArray *sysex;
+
+-(id)initWithEvents:(MidiEventTable*)table andMeasures:(MeasureMap*)map
+           interval:(int)measures;
+-(int)pulseAtCheckpoint:(int)index;
+-(int)stateAtTime:(int)pulse channels:(ChannelState*)channels tempo:(int*)tempo;
+-(void)dealloc;
+
+@end
+
+
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#import "MidiFile.h"
+#import "SeekCheckpoints.h"
+
+/** Clear the state of a channel */
+static void clearState(ChannelState *state) {
+    memset(state->controllers, StateUnset, 128);
+    state->program = StateUnset;
+    state->pressure = StateUnset;
+    state->pitchbend = PitchBendUnset;
+}
+
+/** Update the channel state and tempo with the given event */
+static void updateState(ChannelState *channels, int *tempo, MidiRawEvent *event) {
+    ChannelState *state = &channels[event->channel];
+    switch (event->eventFlag) {
+        case EventControlChange:
+            state->controllers[event->data1 & 0x7F] = event->data2;
+            break;
+        case EventProgramChange:
+            state->program = event->data1;
+            break;
+        case EventChannelPressure:
+            state->pressure = event->data1;
+            break;
+        case EventPitchBend:
+            state->pitchbend = (u_short)((event->data1 << 8) | event->data2);
+            break;
+        case MetaEvent:
+            if (event->metaevent == MetaEventTempo && event->metalength == 3) {
+                u_char *value = event->metavalue;
+                *tempo = (value[0] << 16) | (value[1] << 8) | value[2];
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+
+/** @class SeekCheckpoints
+ * The SeekCheckpoints let playback start in the middle of a track
+ * without replaying every event from the start of the song.
+ *
+ * Every few measures there is a checkpoint, which stores the state
+ * of each channel the track uses (controllers, instrument, channel
+ * pressure and pitch bend), and the tempo, just before that time.
+ * The state at any time is found by a binary search for the last
+ * checkpoint before it, and replaying only the events after the
+ * checkpoint.
+ *
+ * Sysex events can't be summarized as state, so the index of each
+ * one is kept, and they are all replayed.
+ */
+@implementation SeekCheckpoints
+
+@synthesize count;
+@synthesize sysex;
+
+/** Create the checkpoints for the given track events, one every
+ *  given number of measures.  The first checkpoint is at time 0.
+ */
+- (id)initWithEvents:(MidiEventTable*)table andMeasures:(MeasureMap*)map
+            interval:(int)measures {
+    assert(measures > 0);
+    events = [table retain];
+    int numevents = [table count];
+    int lasttime = (numevents > 0) ? [table startTime:(numevents-1)] : 0;
+
+    /* Find the channels used by the track */
+    for (int i = 0; i < 16; i++) {
+        channelmap[i] = -1;
+    }
+    numchannels = 0;
+    sysex = [[IntArray new:4] retain];
+    for (int i = 0; i < numevents; i++) {
+        u_char flag = [table eventFlag:i];
+        if (flag == SysexEvent1 || flag == SysexEvent2) {
+            [sysex add:i];
+        }
+        else if (flag >= EventNoteOff && flag < SysexEvent1) {
+            int channel = [table channel:i];
+            if (channelmap[channel] == -1) {
+                channelmap[channel] = numchannels;
+                numchannels++;
+            }
+        }
+    }
+
+    count = [map measureForTime:lasttime] / measures + 1;
+    pulses = (int*)malloc(count * sizeof(int));
+    indexes = (int*)malloc(count * sizeof(int));
+    tempos = (int*)malloc(count * sizeof(int));
+    states = (ChannelState*)malloc(count * numchannels * sizeof(ChannelState) + 1);
+    for (int k = 0; k < count; k++) {
+        pulses[k] = [map startOfMeasure:(k * measures)];
+    }
+
+    ChannelState current[16];
+    for (int i = 0; i < 16; i++) {
+        clearState(&current[i]);
+    }
+    int tempo = 0;
+    int k = 0;
+    MidiRawEvent event;
+    for (int i = 0; i <= numevents; i++) {
+        int start = (i < numevents) ? [table startTime:i] : lasttime + 1;
+        while (k < count && start >= pulses[k]) {
+            indexes[k] = i;
+            tempos[k] = tempo;
+            for (int ch = 0; ch < 16; ch++) {
+                if (channelmap[ch] >= 0) {
+                    states[k * numchannels + channelmap[ch]] = current[ch];
+                }
+            }
+            k++;
+        }
+        if (i < numevents) {
+            [table getRawEvent:i into:&event];
+            updateState(current, &tempo, &event);
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [events release];
+    [sysex release];
+    free(pulses);
+    free(indexes);
+    free(tempos);
+    free(states);
+    [super dealloc];
+}
+
+/** Return the time (in pulses) of the given checkpoint */
+- (int)pulseAtCheckpoint:(int)index {
+    assert(index >= 0 && index < count);
+    return pulses[index];
+}
+
+/** Find the state of every channel (an array of 16) and the tempo (0
+ *  if there was no tempo event) just before the given time.  Return
+ *  the index of the first event at or after the time.
+ */
+- (int)stateAtTime:(int)pulse channels:(ChannelState*)channels tempo:(int*)tempo {
+    int low = 0;
+    int high = count - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (pulses[mid] <= pulse) {
+            low = mid;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    for (int ch = 0; ch < 16; ch++) {
+        if (channelmap[ch] >= 0) {
+            channels[ch] = states[low * numchannels + channelmap[ch]];
+        }
+        else {
+            clearState(&channels[ch]);
+        }
+    }
+    *tempo = tempos[low];
+
+    int numevents = [events count];
+    int i = indexes[low];
+    MidiRawEvent event;
+    while (i < numevents && [events startTime:i] < pulse) {
+        [events getRawEvent:i into:&event];
+        updateState(channels, tempo, &event);
+        i++;
+    }
+    return i;
+}
+
+@end
+
+
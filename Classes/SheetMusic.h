@@ -14,6 +14,7 @@
 #import "IntArray.h"
 #import "TimeSignature.h"
 #import "KeySignature.h"
+#import "KeyMeasures.h"
 #import "ClefMeasures.h"
 #import "MidiFile.h"
 #import "SymbolWidths.h"
@@ -40,30 +41,31 @@ id<MusicSymbol> getSymbol(Array *symbols, int index);
 }
 
 -(id)initWithFile:(MidiFile*)file andOptions:(MidiOptions*)options;
--(KeySignature*) getKeySignature:(Array*)tracks;
--(Array*) createChords:(Array*)midinotes withKey:(KeySignature*)key
-          andTime:(TimeSignature*)time andClefs:(ClefMeasures*) clefs;
+-(NSData*)layoutData;
+-(BOOL)readLayout:(MidiFileReader*)cached withMeasures:(MeasureMap*)measures;
+-(KeyMeasures*) getKeyMeasures:(Array*)tracks withMeasures:(MeasureMap*)measures;
+-(Array*) createChords:(NoteArray*)midinotes withKeys:(KeyMeasures*)keys
+          andTime:(TimeSignature*)time andMeasures:(MeasureMap*)measures
+          andClefs:(ClefMeasures*) clefs;
 -(Array*) createSymbols:(Array*)chords withClefs:(ClefMeasures*)clefs
-          andTime:(TimeSignature*)time andLastTime:(int)lastStartTime;
--(Array*) addBars:(Array*)chords withTime:(TimeSignature*)time
+          andKeys:(KeyMeasures*)keys
+          andTime:(TimeSignature*)time andMeasures:(MeasureMap*)measures
           andLastTime:(int)lastStartTime;
--(Array*) addRests:(Array*)chords withTime:(TimeSignature*)time;
--(Array*) getRests:(TimeSignature*)time fromStart:(int)start toEnd:(int)end;
--(Array*) addClefChanges:(Array*)symbols withClefs:(ClefMeasures*)clefs 
-          andTime:(TimeSignature*) time;
 -(void) alignSymbols:(Array*)allsymbols withWidths:(SymbolWidths *)widths options:(MidiOptions *)options;
 +(int) keySignatureWidth:(KeySignature*)key;
--(Array*) createStaffsForTrack:(Array*)symbols withKey:(KeySignature*)key
-          andMeasure:(int) measurelen andOptions:(MidiOptions*)options
+-(Array*) createStaffsForTrack:(Array*)symbols withKeys:(KeyMeasures*)keys
+          andMeasures:(MeasureMap*)measures andOptions:(MidiOptions*)options
           andTrack:(int)track andTotalTracks:(int)totaltracks;
--(Array*) createStaffs:(Array*)allsymbols withKey:(KeySignature*)key 
-          andOptions:(MidiOptions*)options andMeasure:(int)measurelen;
+-(Array*) createStaffs:(Array*)allsymbols withKeys:(KeyMeasures*)keys 
+          andOptions:(MidiOptions*)options andMeasures:(MeasureMap*)measures;
 +(BOOL)findConsecutiveChords:(Array*)symbols andTime:(TimeSignature*) time
                      andStart:(int)startIndex andIndexes:(int*) chordIndexes
                      andNumChords:(int)numChords andHorizDistance:(int*)dist;
--(void)createBeamedChords:(Array*)allsymbols withTime:(TimeSignature*)time
+-(void)createBeamedChords:(Array*)allsymbols withMeasures:(MeasureMap*)measures
                    andNumChords:(int)numChords onBeat:(BOOL)startBeat;
--(void)createAllBeamedChords:(Array*)allsymbols withTime:(TimeSignature*)time;
+-(void)createBeamedChordsForTrack:(Array*)symbols withMeasures:(MeasureMap*)measures
+                   andNumChords:(int)numChords onBeat:(BOOL)startBeat;
+-(void)createAllBeamedChords:(Array*)allsymbols withMeasures:(MeasureMap*)measures;
 -(void) setZoom:(float)value;
 -(int) showNoteLetters;
 -(void)drawTitle;
@@ -15,6 +15,7 @@
 #import <AppKit/NSPrintOperation.h>
 #import <AppKit/AppKit.h>
 #import <AppKit/NSAttributedString.h>
+#include <dispatch/dispatch.h>
 
 #import "AccidSymbol.h"
 #import "Array.h"
@@ -23,11 +24,15 @@
 #import "ChordSymbol.h"
 #import "ClefMeasures.h"
 #import "ClefSymbol.h"
+#import "KeyMeasures.h"
 #import "KeySignature.h"
+#import "KeySigSymbol.h"
 #import "LyricSymbol.h"
 #import "MidiFile.h"
+#import "MidiFileException.h"
 #import "MusicSymbol.h"
 #import "RestSymbol.h"
+#import "ScoreCache.h"
 #import "Staff.h"
 #import "Stem.h"
 #import "SymbolWidths.h"
@@ -42,6 +47,8 @@
 
 /* Measurements used when drawing.  All measurements are in pixels.
  * The values depend on whether the menu 'Large Notes' or 'Small Notes' is selected.
+ * They are only set by setNoteSize, before the layout starts, so the
+ * layout tasks running on other threads only read them.
  */
 int LineWidth;    /** The width of a line, in pixels */
 int LeftMargin;   /** The left margin, in pixels */
@@ -58,6 +65,154 @@ id<MusicSymbol> getSymbol(Array *symbols, int index) {
     return result;
 }
 
+/** Add the rest symbols needed to fill the time interval between
+ * start and end to the result.  Return true if any rests were added.
+ */
+static BOOL addRestSymbols(Array *result, TimeSignature *time, int start, int end) {
+    RestSymbol *r1, *r2;
+
+    if (end - start < 0) {
+        return NO;
+    }
+
+    NoteDuration dur = [time getNoteDuration:(end - start)];
+    switch (dur) {
+        case Whole:
+        case Half:
+        case Quarter:
+        case Eighth:
+            r1 = [[RestSymbol alloc] initWithTime:start andDuration:dur];
+            [result add:r1];
+            [r1 release];
+            return YES;
+
+        case DottedHalf:
+            r1 = [[RestSymbol alloc] initWithTime:start andDuration:Half];
+            r2 = [[RestSymbol alloc] initWithTime:(start + time.quarter*2)
+                                      andDuration:Quarter];
+            [result add:r1]; [result add:r2];
+            [r1 release]; [r2 release];
+            return YES;
+
+        case DottedQuarter:
+            r1 = [[RestSymbol alloc] initWithTime:start andDuration:Quarter];
+            r2 = [[RestSymbol alloc] initWithTime:(start + time.quarter)
+                                      andDuration:Eighth];
+            [result add:r1]; [result add:r2];
+            [r1 release]; [r2 release];
+            return YES; 
+
+        case DottedEighth:
+            r1 = [[RestSymbol alloc] initWithTime:start andDuration:Eighth];
+            r2 = [[RestSymbol alloc] initWithTime:(start + time.quarter/2)
+                                      andDuration:Sixteenth];
+            [result add:r1]; [result add:r2];
+            [r1 release]; [r2 release];
+            return YES;
+
+        default:
+            return NO;
+    }
+}
+
+
+/** The state of the single pass in createSymbols, which adds the
+ * bars, time signatures, rests, clef changes and key changes
+ * between the chords of a track.
+ */
+typedef struct SymbolEmitter {
+    Array *result;          /** The symbols created so far */
+    TimeSignature *time;    /** The time signature, for the rest durations */
+    ClefMeasures *clefs;    /** The clef of each measure */
+    KeyMeasures *keys;      /** The key signature of each section */
+    int prevtime;           /** The end time of the previous symbol */
+    int prevclef;           /** The clef of the previous measure */
+    int section;            /** The next key section */
+} SymbolEmitter;
+
+/** Add a symbol to the result of the emitter.  First add the rests
+ * between the previous symbol and this one.  If the symbol is a bar,
+ * also add a clef symbol before it when the clef changes, and a key
+ * signature symbol after it when a new key section starts there.
+ */
+static void emitSymbol(SymbolEmitter *e, id<MusicSymbol> symbol, int endtime, BOOL isbar) {
+    int starttime = symbol.startTime;
+    addRestSymbols(e->result, e->time, e->prevtime, starttime);
+    e->prevtime = max(endtime, e->prevtime);
+    if (!isbar) {
+        [e->result add:symbol];
+        return;
+    }
+
+    int clef = [e->clefs getClef:starttime];
+    if (clef != e->prevclef) {
+        ClefSymbol *clefsym = [[ClefSymbol alloc] 
+                                initWithClef:clef andTime:starttime-1 isSmall:YES];
+        [e->result add:clefsym];
+        [clefsym release];
+    }
+    e->prevclef = clef;
+    [e->result add:symbol];
+
+    KeyMeasures *keys = e->keys;
+    if ([keys count] <= 1) {
+        return;
+    }
+    while (e->section < [keys count] && [keys startOfSection:e->section] < starttime) {
+        e->section++;
+    }
+    if (e->section < [keys count] && [keys startOfSection:e->section] == starttime) {
+        KeySigSymbol *keysym = [[KeySigSymbol alloc]
+                                 initWithKey:[keys keyAtSection:e->section]
+                                 andPrevious:[keys keyAtSection:(e->section - 1)]
+                                 andClef:clef andTime:starttime];
+        [e->result add:keysym];
+        [keysym release];
+        e->section++;
+    }
+}
+
+
+/* The kinds of music symbols stored in the layout cache */
+enum {
+    LayoutChord = 1, LayoutRest, LayoutBar, LayoutBlank,
+    LayoutClef, LayoutTimeSig, LayoutKeySig, LayoutAccid
+};
+
+/** Return the kind of the given music symbol in the layout cache,
+ * or 0 if the symbol can't be stored in the cache.
+ */
+static int layoutKind(id symbol) {
+    if ([symbol isKindOfClass:[ChordSymbol class]])   return LayoutChord;
+    if ([symbol isKindOfClass:[RestSymbol class]])    return LayoutRest;
+    if ([symbol isKindOfClass:[BarSymbol class]])     return LayoutBar;
+    if ([symbol isKindOfClass:[BlankSymbol class]])   return LayoutBlank;
+    if ([symbol isKindOfClass:[ClefSymbol class]])    return LayoutClef;
+    if ([symbol isKindOfClass:[TimeSigSymbol class]]) return LayoutTimeSig;
+    if ([symbol isKindOfClass:[KeySigSymbol class]])  return LayoutKeySig;
+    if ([symbol isKindOfClass:[AccidSymbol class]])   return LayoutAccid;
+    return 0;
+}
+
+/** Return the cache key of the sheet music layout of the given file
+ * with the given options, or nil if the file has no ScoreCache.  The
+ * key covers the options that change the notes, plus the options that
+ * only change the layout.  The colors only change the drawing.
+ */
+static NSString* layoutKey(MidiFile *file, MidiOptions *options) {
+    NSString *noteskey = [file cacheKeyForOptions:options];
+    if (noteskey == nil || file.scorecache == nil) {
+        return nil;
+    }
+    NSString *s = [NSString stringWithFormat:@"layout %@ %d %d %d %d %d %d",
+                   noteskey, options.key, options.largeNoteSize,
+                   options.scrollVert, options.showLyrics,
+                   options.showMeasures, options.showNoteLetters];
+    const char *bytes = [s UTF8String];
+    return [ScoreCache keyForBytes:(const u_char*)bytes length:(int)strlen(bytes)];
+}
+
+
 /** @class SheetMusic
  * The SheetMusic NSView is the main class for displaying the sheet music.
  * The SheetMusic class has the following public methods:
@@ -90,6 +245,11 @@ id<MusicSymbol> getSymbol(Array *symbols, int index) {
  * - For each track, create a list of MusicSymbols (notes, rests, bars, etc)
  * - Vertically align the music symbols in all the tracks
  * - Partition the music notes into horizontal staffs
+ *
+ * If the file was loaded with a ScoreCache, and the cache has the
+ * layout for these options, the staffs are loaded from the cache
+ * instead, and none of the steps above are needed.  Otherwise the
+ * new layout is stored in the cache.
  */
 - (id)initWithFile:(MidiFile*)file andOptions:(MidiOptions*)options {
     NSRect bounds = NSMakeRect(0, 0, PageWidth, PageHeight);
@@ -98,20 +258,37 @@ id<MusicSymbol> getSymbol(Array *symbols, int index) {
     zoom = 1.0f;
     filename = [file.filename retain];
     [self setColors:options.colors andShade:options.shadeColor andShade2:options.shade2Color];
-    Array* tracks = [file changeMidiNotes:options];
     [SheetMusic setNoteSize:options.largeNoteSize];
     scrollVert = options.scrollVert;
     showNoteLetters = options.showNoteLetters;
+    MeasureMap *measures = [file measuresForOptions:options];
+
+    NSString *layoutkey = layoutKey(file, options);
+    if (layoutkey != nil) {
+        MidiFileReader *cached = [file.scorecache readerForKey:layoutkey];
+        BOOL loaded = (cached != nil && [self readLayout:cached withMeasures:measures]);
+        [cached release];
+        if (loaded) {
+            [self setZoom:1.0f];
+            return self;
+        }
+    }
+
+    Array* tracks = [file changeMidiNotes:options];
     TimeSignature *time = file.time; 
     if (options.time != nil) {
         time = options.time;
     }
+    KeyMeasures *keys;
     if (options.key == -1) {
-        mainkey = [[self getKeySignature:tracks] retain];
+        keys = [self getKeyMeasures:tracks withMeasures:measures];
     }
     else {
-        mainkey = [[KeySignature alloc] initWithNotescale:options.key];
+        KeySignature *key = [[KeySignature alloc] initWithNotescale:options.key];
+        keys = [[[KeyMeasures alloc] initWithKey:key andMeasures:measures] autorelease];
+        [key release];
     }
+    mainkey = [[keys keyAtSection:0] retain];
     numtracks = [tracks count];
 
     int lastStarttime = file.endTime + options.shifttime;
@@ -126,17 +303,32 @@ id<MusicSymbol> getSymbol(Array *symbols, int index) {
     /* symbols = Array of MusicSymbol[] */
     Array *symbols = [Array new:numtracks];
 
-    for (int tracknum = 0; tracknum < numtracks; tracknum++) {
-        MidiTrack *track = [tracks get:tracknum];
+    /* The tracks are independent, so create their symbols in parallel.
+     * The symbol images are loaded lazily, so load them beforehand.
+     */
+    [ClefSymbol loadImages];
+    [TimeSigSymbol loadImages];
+    Array **tracksymbols = (Array**) calloc(numtracks + 1, sizeof(Array*));
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_apply(numtracks, queue, ^(size_t tracknum) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        MidiTrack *track = [tracks get:(int)tracknum];
         ClefMeasures *clefs = [[ClefMeasures alloc] initWithNotes:track.notes 
-                                andMeasure:time.measure];
+                                andMeasures:measures];
         /* chords = Array of ChordSymbol */
-        Array *chords = [self createChords:track.notes withKey:mainkey 
-                              andTime:time andClefs:clefs];
-        Array *sym = [self createSymbols:chords withClefs:clefs andTime:time andLastTime:lastStarttime];
-        [symbols add:sym];
+        Array *chords = [self createChords:track.notes withKeys:keys
+                              andTime:time andMeasures:measures andClefs:clefs];
+        Array *sym = [self createSymbols:chords withClefs:clefs andKeys:keys
+                           andTime:time andMeasures:measures andLastTime:lastStarttime];
+        tracksymbols[tracknum] = [sym retain];
         [clefs release];
+        [pool release];
+    });
+    for (int tracknum = 0; tracknum < numtracks; tracknum++) {
+        [symbols add:tracksymbols[tracknum]];
+        [tracksymbols[tracknum] release];
     }
+    free(tracksymbols);
 
     Array *lyrics = nil; 
     if (options.showLyrics) {
@@ -147,9 +339,9 @@ id<MusicSymbol> getSymbol(Array *symbols, int index) {
     SymbolWidths *widths = [[SymbolWidths alloc] initWithSymbols:symbols andLyrics:lyrics];
     [self alignSymbols:symbols withWidths:widths options:options];
 
-    staffs = [[self createStaffs:symbols withKey:mainkey andOptions:options andMeasure:time.measure] retain];
+    staffs = [[self createStaffs:symbols withKeys:keys andOptions:options andMeasures:measures] retain];
 
-    [self createAllBeamedChords:symbols withTime:time];
+    [self createAllBeamedChords:symbols withMeasures:measures];
     if (lyrics != nil) {
         [self addLyrics:lyrics toStaffs:staffs];
     }
@@ -162,251 +354,363 @@ id<MusicSymbol> getSymbol(Array *symbols, int index) {
         [staff calculateHeight];
     }
 
+    if (layoutkey != nil) {
+        NSData *data = [self layoutData];
+        if (data != nil) {
+            [file.scorecache storeData:data forKey:layoutkey];
+        }
+    }
+
     [self setZoom:1.0f];
     [widths release];
     return self;
 }
 
+/** Return the layout of the staffs, in the format stored in the
+ * ScoreCache, or nil if a staff has a symbol that can't be stored.
+ * All values are 32-bit big endian ints.
+ *
+ * - "MSML", the cache version, the number of tracks, and the sharps
+ *   and flats of the main key
+ * - The number of staffs.  For each staff:
+ *   - The number of symbols.  For each symbol, its kind (LayoutChord,
+ *     etc) and its layout (see the appendLayout: of each symbol).
+ *     After a chord, the number of chords ahead (in the same track)
+ *     of the chord its stem is paired with, or 0.
+ *   - The layout of the staff (see Staff appendLayout:)
+ */
+- (NSData*)layoutData {
+    /* The chords of each track, in order, to find the stem pairs */
+    Array *trackchords = [Array new:numtracks];
+    for (int tracknum = 0; tracknum < numtracks; tracknum++) {
+        [trackchords add:[Array new:64]];
+    }
+    for (int i = 0; i < [staffs count]; i++) {
+        Staff *staff = [staffs get:i];
+        if (staff.tracknum < 0 || staff.tracknum >= numtracks) {
+            return nil;
+        }
+        Array *symbols = [staff symbols];
+        for (int j = 0; j < [symbols count]; j++) {
+            if (layoutKind([symbols get:j]) == LayoutChord) {
+                [[trackchords get:staff.tracknum] add:[symbols get:j]];
+            }
+        }
+    }
 
+    NSMutableData *data = [NSMutableData dataWithCapacity:65536];
+    [data appendBytes:"MSML" length:4];
+    appendInt(data, ScoreCacheVersion);
+    appendInt(data, numtracks);
+    appendInt(data, [mainkey num_sharps]);
+    appendInt(data, [mainkey num_flats]);
+    appendInt(data, [staffs count]);
 
-/** Get the best key signature given the midi notes in all the tracks. */
-- (KeySignature*)getKeySignature:(Array*)tracks {
-    int initsize = 1;
-    if ([tracks count] > 0) {
-		MidiTrack *track = [tracks get:0];
-        initsize = [track.notes count];
-        initsize = initsize * [tracks count];
+    int *chordindex = (int*)calloc(numtracks, sizeof(int));
+    for (int i = 0; i < [staffs count]; i++) {
+        Staff *staff = [staffs get:i];
+        Array *symbols = [staff symbols];
+        Array *chords = [trackchords get:staff.tracknum];
+        appendInt(data, [symbols count]);
+        for (int j = 0; j < [symbols count]; j++) {
+            id symbol = [symbols get:j];
+            int kind = layoutKind(symbol);
+            if (kind == 0) {
+                free(chordindex);
+                return nil;
+            }
+            appendInt(data, kind);
+            [symbol appendLayout:data];
+            if (kind != LayoutChord) {
+                continue;
+            }
+            int index = chordindex[staff.tracknum]++;
+            Stem *pair = [[symbol stem] pair];
+            int ahead = 0;
+            for (int k = index + 1; pair != nil && k < [chords count]; k++) {
+                if ([[chords get:k] stem] == pair) {
+                    ahead = k - index;
+                    break;
+                }
+            }
+            appendInt(data, ahead);
+        }
+        [staff appendLayout:data];
     }
-    IntArray* notenums = [IntArray new:initsize];
-    int i, j;
+    free(chordindex);
+    return data;
+}
+
+/** Load the staffs from the given layout cache entry (see layoutData).
+ * Return false, and leave the staffs unset, if the entry is invalid.
+ */
+- (BOOL)readLayout:(MidiFileReader*)cached withMeasures:(MeasureMap*)measures {
+    @try {
+        int limit = [cached length];
+        if (strncmp([cached readAscii:4], "MSML", 4) != 0 ||
+            [cached readInt] != ScoreCacheVersion) {
+            return NO;
+        }
+        int ntracks = [cached readInt];
+        int sharps = [cached readInt];
+        int flats = [cached readInt];
+        int count = [cached readInt];
+        if (ntracks <= 0 || ntracks > limit / 4 ||
+            sharps < 0 || sharps > 7 || flats < 0 || flats > 7 ||
+            (sharps > 0 && flats > 0) || count < 0 || count > limit / 4) {
+            return NO;
+        }
+
+        /* The chords of each track, and the number of chords ahead
+         * of each chord that its stem is paired with.
+         */
+        Array *trackchords = [Array new:ntracks];
+        Array *trackpairs = [Array new:ntracks];
+        for (int tracknum = 0; tracknum < ntracks; tracknum++) {
+            [trackchords add:[Array new:64]];
+            [trackpairs add:[IntArray new:64]];
+        }
 
-    for (i = 0; i < [tracks count]; i++) {
-        MidiTrack *track = [tracks get:i];
-        for (j = 0; j < [track.notes count]; j++) {
-            MidiNote *note = [track.notes get:j];
-            [notenums add:note.number];
+        Array *newstaffs = [Array new:count];
+        for (int i = 0; i < count; i++) {
+            int numsymbols = [cached readInt];
+            if (numsymbols < 0 || numsymbols > limit / 8) {
+                return NO;
+            }
+            Array *symbols = [Array new:(numsymbols + 1)];
+            Array *chords = [Array new:16];
+            IntArray *pairs = [IntArray new:16];
+            for (int j = 0; j < numsymbols; j++) {
+                int kind = [cached readInt];
+                id symbol;
+                switch (kind) {
+                    case LayoutChord:
+                        symbol = [[ChordSymbol alloc] initWithLayout:cached andSheet:self];
+                        break;
+                    case LayoutRest:
+                        symbol = [[RestSymbol alloc] initWithLayout:cached];
+                        break;
+                    case LayoutBar:
+                        symbol = [[BarSymbol alloc] initWithLayout:cached];
+                        break;
+                    case LayoutBlank:
+                        symbol = [[BlankSymbol alloc] initWithLayout:cached];
+                        break;
+                    case LayoutClef:
+                        symbol = [[ClefSymbol alloc] initWithLayout:cached];
+                        break;
+                    case LayoutTimeSig:
+                        symbol = [[TimeSigSymbol alloc] initWithLayout:cached];
+                        break;
+                    case LayoutKeySig:
+                        symbol = [[KeySigSymbol alloc] initWithLayout:cached];
+                        break;
+                    case LayoutAccid:
+                        symbol = [[AccidSymbol alloc] initWithLayout:cached];
+                        break;
+                    default:
+                        return NO;
+                }
+                [symbols add:symbol];
+                [symbol release];
+                if (kind == LayoutChord) {
+                    [chords add:symbol];
+                    [pairs add:[cached readInt]];
+                }
+            }
+            Staff *staff = [[Staff alloc] initWithLayout:cached symbols:symbols
+                                         andMeasures:measures];
+            [newstaffs add:staff];
+            [staff release];
+            if (staff.tracknum < 0 || staff.tracknum >= ntracks) {
+                return NO;
+            }
+            for (int j = 0; j < [chords count]; j++) {
+                [[trackchords get:staff.tracknum] add:[chords get:j]];
+                [[trackpairs get:staff.tracknum] add:[pairs get:j]];
+            }
         }
+
+        /* Pair the stems joined by a horizontal beam */
+        for (int tracknum = 0; tracknum < ntracks; tracknum++) {
+            Array *chords = [trackchords get:tracknum];
+            IntArray *pairs = [trackpairs get:tracknum];
+            for (int i = 0; i < [chords count]; i++) {
+                int ahead = [pairs get:i];
+                if (ahead == 0) {
+                    continue;
+                }
+                if (ahead < 0 || i + ahead >= [chords count]) {
+                    return NO;
+                }
+                Stem *stem = [[chords get:i] stem];
+                Stem *pair = [[chords get:(i + ahead)] stem];
+                if (stem == nil || pair == nil) {
+                    return NO;
+                }
+                stem.pair = pair;
+            }
+        }
+
+        staffs = [newstaffs retain];
+        mainkey = [[KeySignature alloc] initWithSharps:sharps andFlats:flats];
+        numtracks = ntracks;
+        return YES;
     }
-    KeySignature* result = [KeySignature guess:notenums]; 
-    return result;
+    @catch (MidiFileException *e) {
+    }
+    return NO;
+}
+
+
+
+/** Get the best key signature for each section of the song, given
+ *  the midi notes in all the tracks.
+ */
+- (KeyMeasures*)getKeyMeasures:(Array*)tracks withMeasures:(MeasureMap*)measures {
+    KeyMeasures *result = [[KeyMeasures alloc] initWithTracks:tracks andMeasures:measures];
+    return [result autorelease];
 }
 
 
 /** Create the chord symbols for a single track.
- * @param midinotes  The Midinotes in the track.
- * @param key        The Key Signature, for determining sharps/flats.
- * @param time       The Time Signature, for determining the measures.
+ * @param midinotes  The midi notes in the track.
+ * @param keys       The Key Signature of each measure, for determining sharps/flats.
+ * @param time       The Time Signature, for determining the note durations.
+ * @param measures   The measures, for determining the accidentals.
  * @param clefs      The clefs to use for each measure.
  * @ret An array of ChordSymbols
  */
-- (Array *)createChords:(Array*)midinotes withKey:(KeySignature*)key
-          andTime:(TimeSignature*)time andClefs:(ClefMeasures*)clefs {
+- (Array *)createChords:(NoteArray*)midinotes withKeys:(KeyMeasures*)keys
+          andTime:(TimeSignature*)time andMeasures:(MeasureMap*)measures
+          andClefs:(ClefMeasures*)clefs {
 
     int i = 0;
-    int len = [midinotes count]; 
+    NoteView notes = [midinotes view];
+    int len = notes.count; 
     Array* chords = [Array new:len/4];
-    Array* notegroup = [Array new:12];
 
+    /* Spell the notes (find their white notes and accidentals) in a
+     * single pass over each key section, before creating the chords.
+     */
+    WhiteNote **whitenotes = (WhiteNote**) malloc((len + 1) * sizeof(WhiteNote*));
+    int *accids = (int*) malloc((len + 1) * sizeof(int));
+    while (i < len) {
+        int start = i;
+        int section = [keys sectionForTime:notes.starttime[i]];
+        BOOL lastsection = (section + 1 == [keys count]);
+        int end = lastsection ? 0 : [keys startOfSection:(section + 1)];
+        i++;
+        while (i < len && (lastsection || notes.starttime[i] < end)) {
+            i++;
+        }
+        [[keys keyAtSection:section] spellNotes:[midinotes viewFrom:start count:(i - start)]
+                                   withMeasures:measures
+                                   whiteNotes:(whitenotes + start)
+                                   accidentals:(accids + start)];
+    }
+
+    i = 0;
     while (i < len) {
-		MidiNote *note = [midinotes get:i];
-        int starttime = note.startTime;
+        int start = i;
+        int starttime = notes.starttime[i];
         int clef = [clefs getClef:starttime];
 
-        /* Group all the midi notes with the same start time
-         * into the notes list.
+        /* Group all the midi notes with the same start time.  The
+         * notes are sorted by start time, so the group is a range
+         * of the notes.
          */
-        [notegroup clear];
-        [notegroup add:[midinotes get:i]];
         i++;
-        while (i < len && [(MidiNote*)[midinotes get:i] startTime] == starttime) {
-            [notegroup add:[midinotes get:i]];
+        while (i < len && notes.starttime[i] == starttime) {
             i++;
         }
+        NoteView notegroup = [midinotes viewFrom:start count:(i - start)];
 
         /* Create a single chord from the group of midi notes with
          * the same start time.
          */
-        ChordSymbol *chord = [[ChordSymbol alloc] initWithNotes:notegroup andKey:key
+        ChordSymbol *chord = [[ChordSymbol alloc] initWithNotes:notegroup
+                              whiteNotes:(whitenotes + start)
+                              accidentals:(accids + start)
                               andTime:time andClef:clef andSheet:self];
         [chords add:chord];
         [chord release];
     }
 
+    free(whitenotes);
+    free(accids);
     return chords;
 }
 
 /* Given the chord symbols for a track, create a new symbol list
- * that contains the chord symbols, vertical bars, rests, and clef changes.
- * Return a list of symbols (ChordSymbol, BarSymbol, RestSymbol, ClefSymbol)
+ * that contains the chord symbols, vertical bars, rests, clef changes,
+ * time signature changes, and key changes.  Return a list of symbols
+ * (ChordSymbol, BarSymbol, RestSymbol, ClefSymbol, TimeSigSymbol,
+ * KeySigSymbol)
  */
 - (Array*) createSymbols:(Array*) chords withClefs:(ClefMeasures*)clefs
-          andTime:(TimeSignature*)time andLastTime:(int)lastStartTime {
-
-    Array* symbols;
-
-    symbols = [self addBars:chords withTime:time andLastTime:lastStartTime];
-    symbols = [self addRests:symbols withTime:time];
-    symbols = [self addClefChanges:symbols withClefs:clefs andTime:time];
-    return symbols;
-}
+          andKeys:(KeyMeasures*)keys
+          andTime:(TimeSignature*)time andMeasures:(MeasureMap*)measures
+          andLastTime:(int)lastStartTime {
+
+    /* This makes a single pass over the chords, adding the vertical
+     * bars and time signature changes at each measure.  Each chord and
+     * bar is passed to emitSymbol, which adds the rests, clef changes
+     * and key changes around it.
+     */
+    int nummeasures = [measures measureForTime:max(lastStartTime, 0)] + 2;
+    SymbolEmitter emitter;
+    emitter.result = [Array new:(2*[chords count] + 2*nummeasures)];
+    emitter.time = time;
+    emitter.clefs = clefs;
+    emitter.keys = keys;
+    emitter.prevtime = 0;
+    emitter.prevclef = [clefs getClef:0];
+    emitter.section = 1;
 
-/** Add in the vertical bars delimiting measures. 
- *  Also, add the time signature.
- */
-- (Array *)addBars:(Array*)chords withTime:(TimeSignature*)time andLastTime:(int)lastStartTime {
-    Array* symbols = [Array new:[chords count]];
     BarSymbol *bar;
-
+    TimeSignature *sig = [measures timeAtSegment:0];
     TimeSigSymbol* timesymbol = [[TimeSigSymbol alloc]
-                                 initWithNumer:time.numerator
-                                 andDenom:time.denominator];
-    [symbols add:timesymbol];
+                                 initWithNumer:sig.numerator
+                                 andDenom:sig.denominator];
+    emitSymbol(&emitter, timesymbol, timesymbol.startTime, NO);
     [timesymbol release];
 
     /* The starttime of the beginning of the measure */
+    int measure = 0;
     int measuretime = 0;
+    int segment = 1;
 
     int i = 0;
-    while (i < [chords count]) {
-        if (measuretime <= getSymbol(chords, i).startTime) {
-            bar = [[BarSymbol alloc] initWithTime:measuretime];
-            [symbols add:bar];
-            [bar release];
-            measuretime += time.measure;
-        }
-        else {
-            [symbols add:[chords get:i] ];
+    int numchords = [chords count];
+    while (i < numchords || measuretime < lastStartTime) {
+        if (i < numchords && measuretime > getSymbol(chords, i).startTime) {
+            ChordSymbol *chord = [chords get:i];
+            emitSymbol(&emitter, chord, chord.endTime, NO);
             i++;
+            continue;
         }
-    }
-
-    /* Keep adding bars until the last StartTime (the end of the song) */
-    while (measuretime < lastStartTime) {
         bar = [[BarSymbol alloc] initWithTime:measuretime];
-        [symbols add:bar];
+        emitSymbol(&emitter, bar, measuretime, YES);
         [bar release];
-        measuretime += time.measure;
+        if (segment < measures.count &&
+            [measures pulseAtSegment:segment] == measuretime) {
+            sig = [measures timeAtSegment:segment];
+            timesymbol = [[TimeSigSymbol alloc] initWithNumer:sig.numerator
+                             andDenom:sig.denominator andTime:measuretime];
+            emitSymbol(&emitter, timesymbol, measuretime, NO);
+            [timesymbol release];
+            segment++;
+        }
+        measure++;
+        measuretime = [measures startOfMeasure:measure];
     }
 
     /* Add the final vertical bar to the last measure */
     bar = [[BarSymbol alloc] initWithTime:measuretime];
-    [symbols add:bar];
+    emitSymbol(&emitter, bar, measuretime, YES);
     [bar release];
-    return symbols;
-}
-
-/** Add rest symbols between notes.  All times below are 
- * measured in pulses.
- */
-- (Array *)addRests:(Array*)symbols withTime:(TimeSignature*)time {
-    int prevtime = 0;
-
-    Array* result = [Array new:[symbols count]];
-
-    int i;
-    for (i = 0; i < [symbols count]; i++) {
-        id <MusicSymbol> symbol = [symbols get:i];
-        int starttime = symbol.startTime;
-        Array* rests = [self getRests:time fromStart:prevtime toEnd:starttime];
-        if (rests != nil) {
-            for (int j = 0; j < [rests count]; j++) {
-                [result add:[rests get:j]];
-            }
-        }
-        [result add:symbol];
-
-        /* Set prevtime to the end time of the last note/symbol. */
-        if ([symbol isKindOfClass:[ChordSymbol class]]) {
-            ChordSymbol *chord = (ChordSymbol*)symbol;
-            prevtime = max( chord.endTime, prevtime );
-        }
-        else {
-            prevtime = max(starttime, prevtime);
-        }
-    }
-    return result;
-}
-
-/** Return the rest symbols needed to fill the time interval between
- * start and end.  If no rests are needed, return null.
- */
-- (Array *)getRests:(TimeSignature*)time fromStart:(int)start toEnd:(int)end {
-    Array* result = [Array new:2];
-    RestSymbol *r1, *r2;
-
-    if (end - start < 0) {
-        return nil;
-    }
-
-    NoteDuration dur = [time getNoteDuration:(end - start)];
-    switch (dur) {
-        case Whole:
-        case Half:
-        case Quarter:
-        case Eighth:
-            r1 = [[RestSymbol alloc] initWithTime:start andDuration:dur];
-            [result add:r1];
-            [r1 release];
-            return result;
-
-        case DottedHalf:
-            r1 = [[RestSymbol alloc] initWithTime:start andDuration:Half];
-            r2 = [[RestSymbol alloc] initWithTime:(start + time.quarter*2)
-                                      andDuration:Quarter];
-            [result add:r1]; [result add:r2];
-            [r1 release]; [r2 release];
-            return result;
-
-        case DottedQuarter:
-            r1 = [[RestSymbol alloc] initWithTime:start andDuration:Quarter];
-            r2 = [[RestSymbol alloc] initWithTime:(start + time.quarter)
-                                      andDuration:Eighth];
-            [result add:r1]; [result add:r2];
-            [r1 release]; [r2 release];
-            return result; 
-
-        case DottedEighth:
-            r1 = [[RestSymbol alloc] initWithTime:start andDuration:Eighth];
-            r2 = [[RestSymbol alloc] initWithTime:(start + time.quarter/2)
-                                      andDuration:Sixteenth];
-            [result add:r1]; [result add:r2];
-            [r1 release]; [r2 release];
-            return result;
-
-        default:
-            return nil;
-    }
-}
-
-/** The current clef is always shown at the beginning of the staff, on
- * the left side.  However, the clef can also change from measure to 
- * measure. When it does, a Clef symbol must be shown to indicate the 
- * change in clef.  This function adds these Clef change symbols.
- * This function does not add the main Clef Symbol that begins each
- * staff.  That is done in the Staff() contructor.
- */
-- (Array *)addClefChanges:(Array*)symbols withClefs:(ClefMeasures*)clefs
-          andTime:(TimeSignature*)time {
-
-    Array* result = [Array new:[symbols count]];
-    int prevclef = [clefs getClef:0];
-    int i;
-    for (i = 0; i < [symbols count]; i++) {
-        id <MusicSymbol> symbol = [symbols get:i];
-        /* A BarSymbol indicates a new measure */
-        if ([symbol isKindOfClass:[BarSymbol class]]) {
-            int clef = [clefs getClef:symbol.startTime];
-            if (clef != prevclef) {
-                ClefSymbol *clefsym = [[ClefSymbol alloc] 
-                                 initWithClef:clef andTime:symbol.startTime-1 isSmall:YES];
-                [result add:clefsym];
-                [clefsym release];
-            }
-            prevclef = clef;
-        }
-        [result add:symbol];
-    }
-    return result;
+    return emitter.result;
 }
 
 
@@ -575,48 +879,58 @@ static BOOL isBlank(id x) {
 }
 
 
-/** Connect chords of the same duration with a horizontal beam.
+/** Connect chords of the same duration with a horizontal beam,
+ *  in every track.  See createBeamedChordsForTrack.
+ */
+-(void)createBeamedChords:(Array*)allsymbols withMeasures:(MeasureMap*)measures
+                   andNumChords:(int)numChords onBeat:(BOOL)startBeat {
+    for (int track = 0; track < [allsymbols count]; track++) {
+        [self createBeamedChordsForTrack:[allsymbols get:track] withMeasures:measures
+              andNumChords:numChords onBeat:startBeat];
+    }
+}
+
+/** Connect chords of the same duration with a horizontal beam, in the
+ *  symbols of a single track.
  *  numChords is the number of chords per beam (2, 3, 4, or 6).
  *  if startBeat is true, the first chord must start on a quarter note beat.
  */
--(void)createBeamedChords:(Array*)allsymbols withTime:(TimeSignature*)time
+-(void)createBeamedChordsForTrack:(Array*)symbols withMeasures:(MeasureMap*)measures
                    andNumChords:(int)numChords onBeat:(BOOL)startBeat {
+    TimeSignature *time = [measures timeAtSegment:0];
     int chordIndexes[6];
     Array* chords = [[Array alloc] initWithCapacity:numChords];
 
-    for (int track = 0; track < [allsymbols count]; track++) {
-        Array* symbols = [allsymbols get:track];
-        int startIndex = 0;
-        while (1) {
-            int horizDistance = 0;
-            BOOL found = [SheetMusic findConsecutiveChords:symbols
-                               andTime:time
-                               andStart:startIndex
-                               andIndexes:chordIndexes
-                               andNumChords:numChords
-                               andHorizDistance: &horizDistance];
-
-            if (!found) {
-                break;
-            }
-            [chords clear];
-            for (int i = 0; i < numChords; i++) {
-                [chords add: [symbols get:(chordIndexes[i])] ];
-            }
-
-            if ([ChordSymbol canCreateBeams:chords withTime:time onBeat:startBeat]) {
-                [ChordSymbol createBeam:chords withSpacing:horizDistance];
-                startIndex = chordIndexes[numChords-1] + 1;
-            }
-            else {
-                startIndex = chordIndexes[0] + 1;
-            }
+    int startIndex = 0;
+    while (1) {
+        int horizDistance = 0;
+        BOOL found = [SheetMusic findConsecutiveChords:symbols
+                           andTime:time
+                           andStart:startIndex
+                           andIndexes:chordIndexes
+                           andNumChords:numChords
+                           andHorizDistance: &horizDistance];
+
+        if (!found) {
+            break;
+        }
+        [chords clear];
+        for (int i = 0; i < numChords; i++) {
+            [chords add: [symbols get:(chordIndexes[i])] ];
+        }
 
-            /* What is the value of startIndex here?
-             * If we created a beam, we start after the last chord.
-             * If we failed to create a beam, we start after the first chord.
-             */
+        if ([ChordSymbol canCreateBeams:chords withMeasures:measures onBeat:startBeat]) {
+            [ChordSymbol createBeam:chords withSpacing:horizDistance];
+            startIndex = chordIndexes[numChords-1] + 1;
+        }
+        else {
+            startIndex = chordIndexes[0] + 1;
         }
+
+        /* What is the value of startIndex here?
+         * If we created a beam, we start after the last chord.
+         * If we failed to create a beam, we start after the first chord.
+         */
     }
     [chords clear];
     [chords release];
@@ -632,23 +946,37 @@ static BOOL isBlank(id x) {
  *  - 4 connected chords that start on quarter note beats (4/4 or 2/4 time only)
  *  - 2 connected chords that start on quarter note beats
  *  - 2 connected chords that start on any beat
+ *
+ *  Beams never cross tracks, so the tracks are done in parallel.
  */ 
--(void)createAllBeamedChords:(Array*)allsymbols withTime:(TimeSignature*)time {
-    if ((time.numerator == 3 && time.denominator == 4) ||
-        (time.numerator == 6 && time.denominator == 8) ||
-        (time.numerator == 6 && time.denominator == 4) ) {
-
-        [self createBeamedChords:allsymbols withTime:time
-              andNumChords:6 onBeat:YES];
+-(void)createAllBeamedChords:(Array*)allsymbols withMeasures:(MeasureMap*)measures {
+    BOOL sixChords = NO;
+    for (int i = 0; i < measures.count; i++) {
+        TimeSignature *time = [measures timeAtSegment:i];
+        if ((time.numerator == 3 && time.denominator == 4) ||
+            (time.numerator == 6 && time.denominator == 8) ||
+            (time.numerator == 6 && time.denominator == 4) ) {
+            sixChords = YES;
+        }
     }
-    [self createBeamedChords:allsymbols withTime:time
-          andNumChords:3 onBeat:YES];
-    [self createBeamedChords:allsymbols withTime:time
-          andNumChords:4 onBeat:YES];
-    [self createBeamedChords:allsymbols withTime:time
-          andNumChords:2 onBeat:YES];
-    [self createBeamedChords:allsymbols withTime:time
-          andNumChords:2 onBeat:NO];
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_apply([allsymbols count], queue, ^(size_t track) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        Array *symbols = [allsymbols get:(int)track];
+        if (sixChords) {
+            [self createBeamedChordsForTrack:symbols withMeasures:measures
+                  andNumChords:6 onBeat:YES];
+        }
+        [self createBeamedChordsForTrack:symbols withMeasures:measures
+              andNumChords:3 onBeat:YES];
+        [self createBeamedChordsForTrack:symbols withMeasures:measures
+              andNumChords:4 onBeat:YES];
+        [self createBeamedChordsForTrack:symbols withMeasures:measures
+              andNumChords:2 onBeat:YES];
+        [self createBeamedChordsForTrack:symbols withMeasures:measures
+              andNumChords:2 onBeat:NO];
+        [pool release];
+    });
 }
 
 
@@ -665,24 +993,51 @@ static BOOL isBlank(id x) {
     return result + LeftMargin + 5;
 }
 
+/** Return the KeySigSymbol among the bars, clefs and time signatures
+ *  that begin a staff, or nil if the staff doesn't begin with a key change.
+ */
+static id<MusicSymbol> leadingKeyChange(Array *symbols, int startindex) {
+    int i;
+    for (i = startindex; i < [symbols count]; i++) {
+        id<MusicSymbol> sym = getSymbol(symbols, i);
+        if ([sym isKindOfClass:[KeySigSymbol class]]) {
+            return sym;
+        }
+        if (![sym isKindOfClass:[BarSymbol class]] &&
+            ![sym isKindOfClass:[ClefSymbol class]] &&
+            ![sym isKindOfClass:[TimeSigSymbol class]]) {
+            break;
+        }
+    }
+    return nil;
+}
+
 /** Given MusicSymbols for a track, create the staffs for that track.
  *  Each Staff has a maxmimum width of PageWidth (800 pixels).
  *  Also, measures should not span multiple Staffs.
+ *  Each staff shows the key signature in effect where it begins.
  */
-- (Array*) createStaffsForTrack:(Array*)symbols withKey:(KeySignature*)key
-          andMeasure:(int) measurelen andOptions:(MidiOptions*)options
+- (Array*) createStaffsForTrack:(Array*)symbols withKeys:(KeyMeasures*)keys
+          andMeasures:(MeasureMap*)measures andOptions:(MidiOptions*)options
           andTrack:(int)track andTotalTracks:(int)totaltracks {
 
     Array *thestaffs = [Array new:10];
     int startindex = 0;
-    int keysigWidth = [SheetMusic keySignatureWidth:key];
 
     while (startindex < [symbols count]) {
         /* startindex is the index of the first symbol in the staff.
          * endindex is the index of the last symbol in the staff.
          */
+        id<MusicSymbol> keychange = leadingKeyChange(symbols, startindex);
+        KeySignature *key;
+        if (keychange != nil) {
+            key = [keys getKey:keychange.startTime];
+        }
+        else {
+            key = [keys getKey:getSymbol(symbols, startindex).startTime];
+        }
         int endindex = startindex;
-        int width = keysigWidth;
+        int width = [SheetMusic keySignatureWidth:key];
         int maxwidth;
 
         /* If we're scrolling vertically, the maximum width is PageWidth. */
@@ -719,22 +1074,25 @@ static BOOL isBlank(id x) {
         if (endindex == [symbols count] - 1) {
             /* endindex stays the same */
         }
-        else if (getSymbol(symbols, startindex).startTime / measurelen ==
-                 getSymbol(symbols, endindex).startTime / measurelen) {
+        else if ([measures measureForTime:getSymbol(symbols, startindex).startTime] ==
+                 [measures measureForTime:getSymbol(symbols, endindex).startTime]) {
             /* endindex stays the same */
         }
         else {
-            int endmeasure = getSymbol(symbols, endindex+1).startTime/measurelen;
-            while (getSymbol(symbols, endindex).startTime / measurelen == endmeasure) {
+            int endmeasure = [measures measureForTime:getSymbol(symbols, endindex+1).startTime];
+            while ([measures measureForTime:getSymbol(symbols, endindex).startTime] == endmeasure) {
                 endindex--;
             }
         }
         Array *staffsymbols = [symbols range:startindex end:endindex+1];
+        if (keychange != nil) {
+            [staffsymbols remove:keychange];
+        }
         if (scrollVert) {
             width = PageWidth;
         }
         Staff *staff = [[Staff alloc] initWithSymbols:staffsymbols 
-                          andKey:key andOptions:options
+                          andKey:key andOptions:options andMeasures:measures
                           andTrack:track andTotalTracks:totaltracks];
         [thestaffs add:staff];
         [staff release];
@@ -763,19 +1121,29 @@ static BOOL isBlank(id x) {
  *              Staff2 for track 0, Staff2 for track1, Staff2 for track2,
  *              ... } 
  */ 
-- (Array*) createStaffs:(Array*) allsymbols withKey:(KeySignature*)key
-     andOptions:(MidiOptions*)options andMeasure:(int)measurelen  {
+- (Array*) createStaffs:(Array*) allsymbols withKeys:(KeyMeasures*)keys
+     andOptions:(MidiOptions*)options andMeasures:(MeasureMap*)measures  {
 
     Array *trackstaffs = [Array new:[allsymbols count]];
     int totaltracks = [allsymbols count];
 
+    /* The staffs of each track are independent, so create them in parallel */
+    Array **staffsbytrack = (Array**) calloc(totaltracks + 1, sizeof(Array*));
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_apply(totaltracks, queue, ^(size_t track) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        Array* symbols = [allsymbols get:(int)track];
+        Array *trackstaff = [self createStaffsForTrack:symbols withKeys:keys 
+                                   andMeasures:measures andOptions:options
+                                  andTrack:(int)track andTotalTracks:totaltracks];
+        staffsbytrack[track] = [trackstaff retain];
+        [pool release];
+    });
     for (int track = 0; track < totaltracks; track++) {
-        Array* symbols = [allsymbols get:track];
-        Array *trackstaff = [self createStaffsForTrack:symbols withKey:key 
-                                   andMeasure:measurelen andOptions:options
-                                  andTrack:track andTotalTracks:totaltracks];
-        [trackstaffs add:trackstaff];
+        [trackstaffs add:staffsbytrack[track]];
+        [staffsbytrack[track] release];
     }
+    free(staffsbytrack);
 
     /* Update the endTime of each Staff. The endTime is used during shading */
     for (int track = 0; track < [trackstaffs count]; track++) {
@@ -14,6 +14,7 @@
 #import <Foundation/NSString.h>
 #import <AppKit/AppKit.h>
 #import <AppKit/NSWindow.h>
+#include <dispatch/dispatch.h>
 
 #import "AccidSymbol.h"
 #import "Array.h"
@@ -53,6 +54,7 @@
     NoteColorDialog *colordialog; /** Dialog for choosing note colors */
     InstrumentDialog *instrumentDialog; /** Dialog for choosing instruments */
     PlayMeasuresDialog *playMeasuresDialog; /** Dialog for playing measures in a loop */
+    dispatch_source_t watcher;  /** Watches the midi file for changes on disk */
 
 
     /* Menu Items */
@@ -75,6 +77,7 @@
     NSMenu* shiftNotesMenu;
     NSMenu* timeSigMenu;
     NSMenu* combineNotesMenu;
+    NSMenu* snapGridMenu;
     NSMenuItem* playMeasuresMenu;
     NSMenuItem* useColorMenu;
 }
@@ -83,6 +86,9 @@
 -(void)setMenuFromMidiOptions;
 -(void)getMidiOptions;
 -(void)redrawSheetMusic;
+-(void)watchMidiFile;
+-(void)midiFileChanged;
+-(void)reloadMidiFile;
 -(void)createMenu;
 -(void)createFileMenu;
 -(void)createRecentFilesMenu:(NSMenu *)filemenu;
@@ -91,6 +97,7 @@
 -(void)createTrackMenu;
 -(void)createTrackDisplayMenu;
 -(void)createTrackMuteMenu;
+-(void)addTrackItems:(NSMenu*)menu action:(SEL)action state:(int)state;
 -(void)createNotesMenu;
 -(void)createShowLettersMenu;
 -(void)createShowLyricsMenu;
@@ -101,6 +108,7 @@
 -(void)createMeasureLengthMenu;
 -(void)createTimeSignatureMenu;
 -(void)createCombineNotesMenu;
+-(void)createSnapGridMenu;
 -(void)createPlayMeasuresMenu;
 -(void)createHelpMenu;
 -(NSString*)getFileName: (NSString*)path;
@@ -137,6 +145,7 @@
 -(IBAction)shiftTime:(id)sender;
 -(IBAction)changeTimeSignature:(id)sender;
 -(IBAction)measureLength:(id)sender;
+-(IBAction)snapToGrid:(id)sender;
 -(IBAction)useColor:(id)sender;
 -(IBAction)chooseColor:(id)sender;
 -(IBAction)chooseInstruments:(id)sender;
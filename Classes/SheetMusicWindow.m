@@ -11,6 +11,8 @@
  */
 
 #import <Foundation/NSFileHandle.h>
+#include <fcntl.h>
+#include <unistd.h>
 #import "SheetMusicWindow.h"
 #import "FlippedView.h"
 #import "SavedMidiOptions.h"
@@ -194,6 +196,7 @@
     [self createMenu];
     [self setMenuFromMidiOptions];
     [self redrawSheetMusic];
+    [self watchMidiFile];
 
     return self;
 }
@@ -322,6 +325,14 @@
         }
     }
 
+    /* Get the grid to snap the note start times to */
+    for (int i = 0; i < [snapGridMenu numberOfItems]; i++) {
+        NSMenuItem *menu = [snapGridMenu itemAtIndex:i];
+        if ([menu state] == NSOnState) {
+            options.snapGrid = [menu tag];
+        }
+    }
+
     /* Get the list of instruments from the Instrument dialog */
     options.instruments = [instrumentDialog instruments];
     options.useDefaultInstruments = [instrumentDialog isDefault];
@@ -466,6 +477,17 @@
         }
     }
 
+    /* Set the snap to grid menu value */
+    for (int i = 0; i < [snapGridMenu numberOfItems]; i++) {
+        menu = [snapGridMenu itemAtIndex:i];
+        if ([menu tag] == options.snapGrid) {
+            [menu setState:NSOnState];
+        }
+        else {
+            [menu setState:NSOffState];
+        }
+    }
+
     /* Set the instruments to use */
     if (!options.useDefaultInstruments) {
         [instrumentDialog setInstruments:options.instruments];
@@ -509,6 +531,106 @@
 }
 
 
+/** Watch the midi file for changes, so that the sheet music is
+ * reloaded when another program (such as a sequencer) saves it.
+ * Many programs save by writing a new file and renaming it over the
+ * old one, so after each change, watch the file at the path again.
+ */
+- (void)watchMidiFile {
+    if (watcher != NULL) {
+        dispatch_source_cancel(watcher);
+        dispatch_release(watcher);
+        watcher = NULL;
+    }
+    if (midifile.filename == nil) {
+        return;
+    }
+    int fd = open([midifile.filename fileSystemRepresentation], O_EVTONLY);
+    if (fd < 0) {
+        return;
+    }
+    watcher = dispatch_source_create(DISPATCH_SOURCE_TYPE_VNODE, fd,
+                  DISPATCH_VNODE_WRITE | DISPATCH_VNODE_EXTEND |
+                  DISPATCH_VNODE_DELETE | DISPATCH_VNODE_RENAME,
+                  dispatch_get_main_queue());
+
+    /* Don't retain the window in the handler.  The watcher is
+     * cancelled before the window is deallocated.
+     */
+    __block SheetMusicWindow *window = self;
+    dispatch_source_set_event_handler(watcher, ^{
+        [window midiFileChanged];
+    });
+    dispatch_source_set_cancel_handler(watcher, ^{
+        close(fd);
+    });
+    dispatch_resume(watcher);
+}
+
+/** The midi file changed on disk.  A save usually changes the file
+ * several times in a row, so wait for the changes to stop before
+ * reloading it.
+ */
+- (void)midiFileChanged {
+    [NSObject cancelPreviousPerformRequestsWithTarget:self
+              selector:@selector(reloadMidiFile) object:nil];
+    [self performSelector:@selector(reloadMidiFile) withObject:nil
+          afterDelay:0.3];
+}
+
+/** Reload the midi file after it changed on disk.  Only the tracks
+ * that changed are parsed again (see MidiFile initWithReader:andPrevious:),
+ * but the sheet music is created again for all the tracks, since the
+ * symbols are aligned across the tracks.  Keep the scroll position,
+ * and if the number of tracks is the same, keep the options selected
+ * in the menus.  If the player is paused, it stays paused at the same
+ * time.
+ *
+ * The file is read into memory, not mapped, since the other program
+ * may write it again while we're using it.  If the file can't be read
+ * (for example, it's only partly written), keep showing the current
+ * sheet music, and keep watching the file.
+ */
+- (void)reloadMidiFile {
+    NSString *path = midifile.filename;
+    MidiFile *newfile = nil;
+    @try {
+        MidiFileReader *file = [[MidiFileReader alloc] initWithFile:path andMap:NO];
+        newfile = [MidiFile alloc];
+        newfile = [newfile initWithReader:file andFilename:path
+                           andPrevious:midifile];
+    }
+    @catch (NSException* e) {
+        /* Free the partly created MidiFile */
+        [newfile release];
+        [self watchMidiFile];
+        return;
+    }
+
+    NSPoint scrollpos = [[scrollView contentView] bounds].origin;
+    BOOL sametracks = ([newfile.tracks count] == [midifile.tracks count]);
+    [player reloadMidiFile:newfile];
+    [midifile release];
+    midifile = newfile;
+
+    if (!sametracks) {
+        [self restoreMidiOptions];
+        [self addTrackItems:trackDisplayMenu action:@selector(trackSelect:)
+              state:NSOnState];
+        [self addTrackItems:trackMuteMenu action:@selector(trackMute:)
+              state:NSOffState];
+        [self setMenuFromMidiOptions];
+        [instrumentDialog release];
+        instrumentDialog = [[InstrumentDialog alloc] initWithMidi:midifile];
+        [playMeasuresDialog release];
+        playMeasuresDialog = [[PlayMeasuresDialog alloc] initWithMidi:midifile];
+    }
+    [self redrawSheetMusic];
+    [sheetmusic scrollPoint:scrollpos];
+    [self watchMidiFile];
+}
+
+
 /** Create the menu items for this SheetMusicWindow */
 - (void)createMenu {
     [self createFileMenu];
@@ -743,29 +865,8 @@
     [trackDisplayMenu addItem:menu];
     [menu release];
 
-
-    for (int i = 0; i < [midifile.tracks count]; i++) {
-        MidiTrack *track = [midifile.tracks get:i];
-        NSString *instrname = [track instrumentName];
-        NSString *title;
-        if (![instrname isEqual:@""] ) {
-            title = [NSString stringWithFormat:@"Track %d   (%@)", i+1, instrname];
-        }
-        else {
-            title = [NSString stringWithFormat:@"Track %d", i+1];
-        }
-        menu = [[NSMenuItem alloc] initWithTitle:title
-                                action:@selector(trackSelect:)
-                                keyEquivalent:@""];
-        [menu setTarget:self];
-        [menu setState:NSOnState];
-        if ([instrname isEqual:@"Percussion"]) {
-            [menu setState:NSOffState]; /* Disable percussion by default */
-        }
-        [menu setTag:i];
-        [trackDisplayMenu addItem:menu];
-        [menu release];
-    }
+    [self addTrackItems:trackDisplayMenu action:@selector(trackSelect:)
+          state:NSOnState];
 }
 
 /* Create the "Select Tracks to Mute" menu. */
@@ -794,7 +895,19 @@
     [trackMuteMenu addItem:menu];
     [menu release];
 
+    [self addTrackItems:trackMuteMenu action:@selector(trackMute:)
+          state:NSOffState];
+}
 
+/* Add a menu item for each track to the given menu, after the
+ * first two items.  Each item has the given state, except that
+ * percussion tracks have the opposite state (they're disabled by
+ * default).  Any previous track items are removed first.
+ */
+- (void)addTrackItems:(NSMenu*)trackmenu action:(SEL)action state:(int)state {
+    while ([trackmenu numberOfItems] > 2) {
+        [trackmenu removeItemAtIndex:2];
+    }
     for (int i = 0; i < [midifile.tracks count]; i++) {
         MidiTrack *track = [midifile.tracks get:i];
         NSString *instrname = [track instrumentName];
@@ -805,16 +918,16 @@
         else {
             title = [NSString stringWithFormat:@"Track %d", i+1];
         }
-        menu = [[NSMenuItem alloc] initWithTitle:title
-                                action:@selector(trackMute:)
+        NSMenuItem *menu = [[NSMenuItem alloc] initWithTitle:title
+                                action:action
                                 keyEquivalent:@""];
         [menu setTarget:self];
-        [menu setState:NSOffState];
+        [menu setState:state];
         if ([instrname isEqual:@"Percussion"]) {
-            [menu setState:NSOnState]; /* Disable percussion by default */
+            [menu setState:(state == NSOnState ? NSOffState : NSOnState)];
         }
         [menu setTag:i];
-        [trackMuteMenu addItem:menu];
+        [trackmenu addItem:menu];
         [menu release];
     }
 }
@@ -891,6 +1004,7 @@
     [self createShiftNoteMenu];
     [self createMeasureLengthMenu];
     [self createCombineNotesMenu];
+    [self createSnapGridMenu];
     [self createShowLettersMenu];
     [self createShowLyricsMenu];
     [self createShowMeasuresMenu];
@@ -1079,8 +1193,7 @@
     int firsttime = midifile.time.measure * 10;
     for (int tracknum = 0; tracknum < [midifile.tracks count]; tracknum++) {
         MidiTrack *track = [midifile.tracks get:tracknum];
-		MidiNote *note = [track.notes get:0];
-        int starttime = note.startTime;
+        int starttime = [track.notes startTime:0];
         if (firsttime > starttime) { 
             firsttime = starttime;
         }
@@ -1114,10 +1227,11 @@
 }
 
 /** Create the Measure Length sub-menu.
- * The method MidiFile guessMeasureLength guesses possible values for the
- * measure length (in pulses). Create a sub-menu for each possible measure
- * length.  The Menu.Tag field contains the measure length (in pulses) for
- * each menu item.
+ * The method MidiFile guessMeasureLengthWithConfidence guesses possible
+ * values for the measure length (in pulses), with the most likely first.
+ * Create a sub-menu for each possible measure length, showing its
+ * confidence.  The Menu.Tag field contains the measure length (in pulses)
+ * for each menu item.
  */
 - (void)createMeasureLengthMenu {
     NSMenuItem* menu;
@@ -1134,10 +1248,12 @@
     [menu release];
     [measureMenu addItem:[NSMenuItem separatorItem]];
 
-    IntArray *lengths = [midifile guessMeasureLength];
+    IntArray *confidence = [IntArray new:30];
+    IntArray *lengths = [midifile guessMeasureLengthWithConfidence:confidence];
     for (int i = 0; i < [lengths count]; i++) {
         int len = [lengths get:i];
-        NSString *title = [NSString stringWithFormat:@"%d pulses ", len];
+        NSString *title = [NSString stringWithFormat:@"%d pulses (%d%%)",
+                            len, [confidence get:i]];
         menu = [[NSMenuItem alloc] initWithTitle:title
                                 action:@selector(measureLength:)
                                 keyEquivalent:@""];
@@ -1255,6 +1371,45 @@
     [result release];
 }
 
+/** Create the Snap Notes To Grid sub-menu.
+ * The method MidiFile.snapStartTimes() moves each note to the nearest
+ * grid line, before the notes are combined into chords.
+ * The Menu.Tag field contains the number of grid lines per quarter
+ * note, or 0 to leave the start times alone.
+ */
+- (void)createSnapGridMenu {
+    NSMenuItem* menu;
+
+    snapGridMenu = [[NSMenu alloc] initWithTitle:@"Snap Notes To Grid"];
+
+    int grids[] = { 0, 2, 3, 4, 8 };
+    NSString *titles[] = { @"Off (default)", @"Eighth Notes", @"Eighth Note Triplets",
+                           @"Sixteenth Notes", @"Thirty-second Notes" };
+    for (int i = 0; i < 5; i++) {
+        menu = [[NSMenuItem alloc] initWithTitle:titles[i]
+                                action:@selector(snapToGrid:)
+                                keyEquivalent:@""];
+        [menu setTarget:self];
+        if (grids[i] == 0) {
+            [menu setState:NSOnState];
+        }
+        else {
+            [menu setState:NSOffState];
+        }
+        [menu setTag:grids[i]];
+        [snapGridMenu addItem:menu];
+        [menu release];
+    }
+
+    NSMenuItem *result = [[NSMenuItem alloc]
+                            initWithTitle:@"Snap Notes To Grid"
+                            action:nil
+                            keyEquivalent:@""];
+    [result setSubmenu:snapGridMenu];
+    [notesMenu addItem:result];
+    [result release];
+}
+
 /** Create the "Play Measures in a Loop" sub-menu. */
 -(void)createPlayMeasuresMenu {
     playMeasuresMenu = [[NSMenuItem alloc] initWithTitle:@"Play Measures in a Loop..."
@@ -1738,6 +1893,20 @@
     [self redrawSheetMusic];
 }
 
+/** The callback function for the "Snap Notes To Grid" menu. */
+- (IBAction)snapToGrid:(id)sender {
+    NSMenuItem* menu = (NSMenuItem*) sender;
+    if ([menu state] == NSOnState)
+        return;
+
+    for (int i = 0; i < [snapGridMenu numberOfItems]; i++) {
+        NSMenuItem *othermenu = [snapGridMenu itemAtIndex:i];
+        [othermenu setState:NSOffState];
+    }
+    [menu setState:NSOnState];
+    [self redrawSheetMusic];
+}
+
 
 /** The callback function for the "Use Color" menu. */
 - (IBAction)useColor:(id)sender {
@@ -1830,6 +1999,10 @@
 
 
 - (void)dealloc {
+    if (watcher != NULL) {
+        dispatch_source_cancel(watcher);
+        dispatch_release(watcher);
+    }
     [player stop:nil];
     [player release];
     [midifile release];
@@ -1857,6 +2030,7 @@
     [shiftNotesMenu release];
     [timeSigMenu release];
     [combineNotesMenu release];
+    [snapGridMenu release];
     [useColorMenu release];
     options.tracks = nil;
     options.instruments = nil;
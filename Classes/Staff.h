@@ -32,7 +32,7 @@
     int totaltracks;            /** The total number of tracks */
     int startTime;              /** The time (in pulses) of first symbol */
     int endTime;                /** The time (in pulses) of last symbol */
-    int measureLength;          /** The time (in pulses) of a measure */
+    MeasureMap *measures;       /** The start time of each measure */
 }
 
 @property (nonatomic, readonly) int tracknum;
@@ -42,8 +42,11 @@
 @property (nonatomic, assign) int endTime;
 
 -(id)initWithSymbols:(Array*)symbols andKey:(KeySignature*)key 
-     andOptions:(MidiOptions*)options 
+     andOptions:(MidiOptions*)options andMeasures:(MeasureMap*)measures
      andTrack:(int)t andTotalTracks:(int)total;
+-(id)initWithLayout:(MidiFileReader*)reader symbols:(Array*)musicsymbols
+     andMeasures:(MeasureMap*)map;
+-(void)appendLayout:(NSMutableData*)data;
 -(int)findClef;
 -(void)calculateHeight;
 -(void)calculateWidth:(BOOL)scrollVert;
@@ -56,6 +59,7 @@
 -(void)drawMeasureNumbers;
 -(void)drawLyrics;
 -(int)tracknum;
+-(Array*)symbols;
 -(void)shadeNotes:(int)currentPulseTime withPrev:(int)prevPulseTime 
        andX:(int*)x_shade andColor:(NSColor*)color ;
 -(int)pulseTimeForPoint:(NSPoint)point;
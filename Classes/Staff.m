@@ -11,6 +11,9 @@
  */
 
 #import "Staff.h"
+#import "MidiFileReader.h"
+#import "MidiFileException.h"
+#import "ScoreCache.h"
 #import "SheetMusic.h"
 #import "ChordSymbol.h"
 #import "AccidSymbol.h"
@@ -43,10 +46,11 @@
  * the clef of the first chord symbol. The track number is used
  * to determine whether to join this left/right vertical sides
  * with the staffs above and below. The MidiOptions are used
- * to check whether to display measure numbers or not.
+ * to check whether to display measure numbers or not, and the
+ * measure map gives the measure number of each bar.
  */
 - (id)initWithSymbols:(Array*)musicsymbols andKey:(KeySignature*)key
-     andOptions:(MidiOptions*)options
+     andOptions:(MidiOptions*)options andMeasures:(MeasureMap*)map
      andTrack:(int)trknum andTotalTracks:(int)total {
 
     keysigWidth = [SheetMusic keySignatureWidth:key];
@@ -54,7 +58,7 @@
     tracknum = trknum;
     totaltracks = total;
     showMeasures = (options.showMeasures && tracknum == 0);
-    measureLength  = options.time.measure;
+    measures = [map retain];
     int clef = [self findClef];
     clefsym = [[ClefSymbol alloc] initWithClef:clef andTime:0 isSmall:NO];
     keys = [[key getSymbols:clef] retain];
@@ -105,6 +109,11 @@
     return tracknum;
 }
 
+/** Return the music symbols in this staff */
+- (Array*)symbols {
+    return symbols;
+}
+
 /** Find the initial clef to use for this staff.  Use the clef of
  * the first ChordSymbol.
  */
@@ -297,7 +306,7 @@
     for (int i = 0; i < [symbols count]; i++) {
         id<MusicSymbol> s = [symbols get:i];
         if ([s isKindOfClass:[BarSymbol class]]) {
-            int measure = 1 + s.startTime / measureLength;
+            int measure = 1 + [measures measureForTime:s.startTime];
             NSPoint point = NSMakePoint(xpos + NoteWidth/2, ypos);
             NSString *num = [NSString stringWithFormat:@"%d", measure];
             [num drawAtPoint:point withAttributes:[SheetMusic fontAttributes]];
@@ -595,6 +604,7 @@
     [clefsym release];
     [keys release];
     [lyrics release];
+    [measures release];
     [super dealloc];
 }
 
@@ -618,6 +628,97 @@
     return s;
 }
 
+/** Append this staff to the layout cache: the track, the geometry,
+ *  the clef, the key signature accidentals, and the lyrics.  The music
+ *  symbols are appended by SheetMusic (see layoutData).
+ */
+- (void)appendLayout:(NSMutableData*)data {
+    appendInt(data, tracknum);
+    appendInt(data, totaltracks);
+    appendInt(data, showMeasures);
+    appendInt(data, keysigWidth);
+    appendInt(data, width);
+    appendInt(data, height);
+    appendInt(data, ytop);
+    appendInt(data, startTime);
+    appendInt(data, endTime);
+    [clefsym appendLayout:data];
+    appendInt(data, [keys count]);
+    for (int i = 0; i < [keys count]; i++) {
+        [[keys get:i] appendLayout:data];
+    }
+    if (lyrics == nil) {
+        appendInt(data, -1);
+        return;
+    }
+    appendInt(data, [lyrics count]);
+    for (int i = 0; i < [lyrics count]; i++) {
+        LyricSymbol *lyric = [lyrics get:i];
+        NSData *text = [lyric.text dataUsingEncoding:NSUTF8StringEncoding];
+        appendInt(data, lyric.startTime);
+        appendInt(data, lyric.x);
+        appendInt(data, (int)[text length]);
+        [data appendData:text];
+    }
+}
+
+/** Create a staff with the given music symbols, from its layout
+ *  (see appendLayout:).
+ */
+- (id)initWithLayout:(MidiFileReader*)reader symbols:(Array*)musicsymbols
+     andMeasures:(MeasureMap*)map {
+    symbols = [musicsymbols retain];
+    measures = [map retain];
+    tracknum = [reader readInt];
+    totaltracks = [reader readInt];
+    showMeasures = [reader readInt] != 0;
+    keysigWidth = [reader readInt];
+    width = [reader readInt];
+    height = [reader readInt];
+    ytop = [reader readInt];
+    startTime = [reader readInt];
+    endTime = [reader readInt];
+    clefsym = [[ClefSymbol alloc] initWithLayout:reader];
+
+    int count = [reader readInt];
+    if (count < 0 || count > 7) {
+        MidiFileException *e = [MidiFileException init:@"Bad layout staff"
+                                                offset:[reader offset]];
+        @throw e;
+    }
+    keys = [[Array new:(count + 1)] retain];
+    for (int i = 0; i < count; i++) {
+        AccidSymbol *a = [[AccidSymbol alloc] initWithLayout:reader];
+        [keys add:a];
+        [a release];
+    }
+
+    count = [reader readInt];
+    if (count < 0) {
+        return self;
+    }
+    lyrics = [[Array new:(count + 1)] retain];
+    for (int i = 0; i < count; i++) {
+        LyricSymbol *lyric = [[LyricSymbol alloc] init];
+        lyric.startTime = [reader readInt];
+        lyric.x = [reader readInt];
+        int len = [reader readInt];
+        if (len < 0) {
+            [lyric release];
+            MidiFileException *e = [MidiFileException init:@"Bad layout lyric"
+                                                    offset:[reader offset]];
+            @throw e;
+        }
+        NSString *text = [[NSString alloc] initWithBytes:[reader readBytesNoCopy:len]
+                                           length:len encoding:NSUTF8StringEncoding];
+        lyric.text = text;
+        [text release];
+        [lyrics add:lyric];
+        [lyric release];
+    }
+    return self;
+}
+
 @end
 
 
@@ -54,6 +54,8 @@
 -(void)drawCurvyStem:(int)ytop topStaff:(WhiteNote*)topstaff;
 -(void)drawBeamStem:(int)ytop topStaff:(WhiteNote*)topstaff;
 -(void)dealloc;
+-(id)initWithLayout:(MidiFileReader*)reader;
+-(void)appendLayout:(NSMutableData*)data;
 
 @end
 
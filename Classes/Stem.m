@@ -30,6 +30,9 @@
  */
 #import "MusicSymbol.h"
 #import "Stem.h"
+#import "MidiFileReader.h"
+#import "MidiFileException.h"
+#import "ScoreCache.h"
 #import "TimeSignature.h"
 
 @implementation Stem
@@ -429,6 +432,42 @@
                notesoverlap, side, width_to_pair, receiver ];
 }
 
+/** Append this stem to the layout cache.  The pair is not included,
+ *  since it belongs to another chord (see SheetMusic layoutData).
+ */
+- (void)appendLayout:(NSMutableData*)data {
+    appendInt(data, duration);
+    appendInt(data, direction);
+    appendInt(data, side);
+    appendInt(data, notesoverlap);
+    [top appendLayout:data];
+    [bottom appendLayout:data];
+    [end appendLayout:data];
+    appendInt(data, width_to_pair);
+    appendInt(data, receiver);
+}
+
+/** Create a stem from its layout (see appendLayout:), without a pair */
+- (id)initWithLayout:(MidiFileReader*)reader {
+    duration = [reader readInt];
+    direction = [reader readInt];
+    side = [reader readInt];
+    notesoverlap = [reader readInt] != 0;
+    if ((direction != StemUp && direction != StemDown) ||
+        (side != LeftSide && side != RightSide)) {
+        MidiFileException *e = [MidiFileException init:@"Bad layout stem"
+                                                offset:[reader offset]];
+        @throw e;
+    }
+    self.top = [WhiteNote readLayout:reader];
+    self.bottom = [WhiteNote readLayout:reader];
+    self.end = [WhiteNote readLayout:reader];
+    self.pair = nil;
+    width_to_pair = [reader readInt];
+    receiver = [reader readInt] != 0;
+    return self;
+}
+
 
 @end
 
@@ -24,10 +24,12 @@
 -(id)initWithCapacity:(int)amount;
 -(void)resize;
 -(void)addKey:(int)key withValue:(int)value;
+-(void)appendKey:(int)key withValue:(int)value;
 -(void)setKey:(int)key withValue:(int)value;
 -(int)get:(int)key;
 -(BOOL)contains:(int)key;
 -(int)getkey:(int)index;
+-(int)getvalue:(int)index;
 -(int)count;
 -(int)capacity;
 -(void)dealloc;
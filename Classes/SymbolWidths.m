@@ -14,6 +14,8 @@
 #import "MusicSymbol.h"
 #import "LyricSymbol.h"
 #import "BarSymbol.h"
+#include <stdlib.h>
+#include <assert.h>
 
 /**@class IntDict
  *  The IntDict class is a dictionary mapping integers to integers. 
@@ -77,6 +79,21 @@
     }
     keys[pos+1] = key;
     values[pos+1] = value;
+    lastpos = pos+1;
+    size++;
+}
+
+/** Add the given key/value pair to the end of this dictionary.
+ * The key must be greater than all the keys in the dictionary.
+ */
+- (void)appendKey:(int)key withValue:(int)value {
+    assert(size == 0 || key > keys[size-1]);
+    if (size == capacity) {
+        [self resize];
+    }
+    keys[size] = key;
+    values[size] = value;
+    lastpos = size;
     size++;
 }
 
@@ -102,10 +119,23 @@
     /* The SymbolWidths class below calls this method many times,
      * passing the keys in sorted order.  To speed up performance,
      * we start searching at the position of the last key (lastpos),
-     * instead of starting at the beginning of the array.
+     * instead of starting at the beginning of the array.  If the
+     * key is before lastpos, binary search for it instead.
      */
-    if (lastpos < 0 || lastpos >= size || key < keys[lastpos])
+    if (lastpos < 0 || lastpos >= size)
         lastpos = 0;
+    if (key < keys[lastpos]) {
+        int low = 0;
+        int high = lastpos;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (keys[mid] < key)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        lastpos = low;
+    }
 
     while (lastpos < size && key > keys[lastpos]) {
         lastpos++;
@@ -139,6 +169,11 @@
     return keys[index];
 }
 
+/** Return the value at the given index */
+- (int)getvalue:(int)index {
+    return values[index];
+}
+
 /** Return the capacity of the dictionary */
 - (int)capacity {
     return capacity;
@@ -146,6 +181,75 @@
 
 @end
 
+/** Move the run at heap[index] down the heap, until its current key
+ *  is no greater than the current keys of its children.
+ */
+static void siftDown(int *heap, int size, int index, const int *current) {
+    int run = heap[index];
+    while (2*index + 1 < size) {
+        int child = 2*index + 1;
+        if (child + 1 < size && current[heap[child+1]] < current[heap[child]]) {
+            child++;
+        }
+        if (current[run] <= current[heap[child]]) {
+            break;
+        }
+        heap[index] = heap[child];
+        index = child;
+    }
+    heap[index] = run;
+}
+
+/** Merge the k dictionaries (each sorted by key) into result, in a
+ *  single pass.  When several dictionaries have the same key, the
+ *  result keeps the maximum value.  A heap of the dictionaries,
+ *  ordered by their current key, finds the next key to merge.
+ */
+static void mergeMaxWidths(IntDict **runs, int k, IntDict *result) {
+    int *heap = (int*) malloc((3*k + 1) * sizeof(int));
+    int *position = heap + k;
+    int *current = position + k;
+    int size = 0;
+    for (int r = 0; r < k; r++) {
+        position[r] = 0;
+        if ([runs[r] count] > 0) {
+            current[r] = [runs[r] getkey:0];
+            heap[size] = r;
+            size++;
+        }
+    }
+    for (int i = size/2 - 1; i >= 0; i--) {
+        siftDown(heap, size, i, current);
+    }
+
+    while (size > 0) {
+        int r = heap[0];
+        int key = current[r];
+        int value = [runs[r] getvalue:position[r]];
+        int last = [result count] - 1;
+        if (last >= 0 && [result getkey:last] == key) {
+            if ([result getvalue:last] < value) {
+                [result setKey:key withValue:value];
+            }
+        }
+        else {
+            [result appendKey:key withValue:value];
+        }
+
+        position[r]++;
+        if (position[r] < [runs[r] count]) {
+            current[r] = [runs[r] getkey:position[r]];
+        }
+        else {
+            size--;
+            heap[0] = heap[size];
+        }
+        siftDown(heap, size, 0, current);
+    }
+    free(heap);
+}
+
+
 /** @class SymbolWidths
  * The SymbolWidths class is used to vertically align notes in different
  * tracks that occur at the same time (that have the same starttime).
@@ -162,10 +266,12 @@
 @implementation SymbolWidths
 
 /** Initialize the symbol width maps, given all the symbols in
- * all the tracks.
+ * all the tracks.  The width tables of the tracks and lyrics are
+ * sorted by start time, so the maximum widths are found with a
+ * single k-way merge of the tables.
  */
 - (id)initWithSymbols:(Array*)tracks andLyrics:(Array*)tracklyrics {
-    int i, tracknum;
+    int tracknum;
     IntDict *dict;
 
     /* Get the symbol widths for all the tracks */
@@ -175,43 +281,46 @@
         [widths add:dict];
     }
 
-    maxwidths = [[IntDict alloc] initWithCapacity:[tracks count]];
-
-    /* Calculate the maximum symbol widths */
-    for (i = 0; i < [widths count]; i++) {
-        dict = [widths get:i];
-        int time;
-
-        for (int k = 0; k < [dict count]; k++) {
-            time = [dict getkey:k];
-            if (!([maxwidths contains:time])  ||
-                ([maxwidths get:time] < [dict get:time])) {
-
-                [maxwidths setKey:time withValue:[dict get:time]];
-            }
-        }
-    }
-
+    /* The lyric widths are merged along with the track widths */
+    Array *lyricwidths = [Array new:1];
     if (tracklyrics != nil) {
         for (int tracknum = 0; tracknum < [tracklyrics count]; tracknum++) {
             Array *lyrics = [tracklyrics get:tracknum];
             if (lyrics == nil || [lyrics count] == 0) {
                 continue;
             }
+            dict = [[IntDict alloc] initWithCapacity:[lyrics count]];
             for (int i = 0; i < [lyrics count]; i++) {
                 LyricSymbol *lyric = [lyrics get:i];
                 int width = lyric.minWidth;
                 int time = lyric.startTime;
 
-                if (!([maxwidths contains:time])  ||
-                    ([maxwidths get:time] < width)) {
+                if (!([dict contains:time])  ||
+                    ([dict get:time] < width)) {
 
-                    [maxwidths setKey:time withValue:width];
+                    [dict setKey:time withValue:width];
                 }
             }
+            [lyricwidths add:dict];
+            [dict release];
         }
     }
 
+    /* Calculate the maximum symbol widths */
+    int numruns = [widths count] + [lyricwidths count];
+    int total = 0;
+    IntDict **runs = (IntDict**) malloc((numruns + 1) * sizeof(IntDict*));
+    for (int i = 0; i < numruns; i++) {
+        if (i < [widths count])
+            runs[i] = [widths get:i];
+        else
+            runs[i] = [lyricwidths get:(i - [widths count])];
+        total += [runs[i] count];
+    }
+    maxwidths = [[IntDict alloc] initWithCapacity:total];
+    mergeMaxWidths(runs, numruns, maxwidths);
+    free(runs);
+
     /* Store all the start times to the starttime array.
      * Since the IntDict keys are sorted, the starttimes array
      * will also be sorted.
@@ -255,6 +364,8 @@
 
 /** Given a track and a start time, return the extra width needed so that
  * the symbols for that start time align with the other tracks.
+ * The dictionaries remember the position of the last lookup, so
+ * calling this with increasing start times takes constant time.
  */
 - (int) getExtraWidth:(int)track forTime:(int)start {
     IntDict *trackwidths = [widths get:track];
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#import <Foundation/NSObject.h>
+#import <Foundation/NSString.h>
+
+#import "Array.h"
+
+@interface TempoMap : NSObject {
+    int count;          /** The number of tempo segments */
+    int quarter;        /** Number of pulses per quarter note */
+    int *pulses;        /** The start time (in pulses) of each segment. pulses[0] is 0 */
+    int *tempos;        /** The tempo (microseconds per quarter note) of each segment */
+    double *micros;     /** The time (in microseconds) at the start of each segment */
+}
+
+@property (nonatomic, readonly) int count;
+@property (nonatomic, readonly) int quarter;
+
+-(id)initWithTempo:(int)tempo andQuarter:(int)q;
+-(id)initWithEvents:(Array*)events andTempo:(int)tempo andQuarter:(int)q;
+-(id)initWithCount:(int)n pulses:(int*)p tempos:(int*)t andQuarter:(int)q;
+-(int)segmentForPulse:(double)pulse;
+-(int)tempoAtPulse:(int)pulse;
+-(double)microsForPulse:(double)pulse;
+-(double)pulseForMicros:(double)us;
+-(int)pulseAtSegment:(int)index;
+-(int)tempoAtSegment:(int)index;
+-(void)dealloc;
+
+@end
+
+
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2007-2012 Madhav Vaidyanathan
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#import "TempoMap.h"
+#import "MidiEventTable.h"
+
+/** A tempo event found while building the map */
+typedef struct TempoChange {
+    int pulse;   /** The start time of the event, in pulses */
+    int order;   /** The position of the event in track order */
+    int tempo;   /** The new tempo, in microseconds per quarter note */
+} TempoChange;
+
+/** Sort tempo changes by start time, then by track order */
+static int sortbypulse(const void* v1, const void* v2) {
+    const TempoChange *t1 = (const TempoChange*) v1;
+    const TempoChange *t2 = (const TempoChange*) v2;
+    if (t1->pulse != t2->pulse) {
+        return t1->pulse - t2->pulse;
+    }
+    return t1->order - t2->order;
+}
+
+
+/** @class TempoMap
+ * The TempoMap converts between pulses and real time (microseconds)
+ * for a midi file whose tempo changes during the song.
+ *
+ * The song is divided into segments with a constant tempo.  For each
+ * segment we store its start pulse, its tempo, and the time (in
+ * microseconds) at which it starts, which is the sum of the lengths
+ * of all the previous segments.  A conversion in either direction
+ * is a binary search for the segment, followed by a multiply.
+ */
+@implementation TempoMap
+
+@synthesize count;
+@synthesize quarter;
+
+/** Allocate room for the given number of segments */
+- (void)allocSegments:(int)n {
+    pulses = (int*)malloc(n * sizeof(int));
+    tempos = (int*)malloc(n * sizeof(int));
+    micros = (double*)malloc(n * sizeof(double));
+}
+
+/** Create a map with a single, constant tempo */
+- (id)initWithTempo:(int)tempo andQuarter:(int)q {
+    assert(tempo > 0 && q > 0);
+    quarter = q;
+    count = 1;
+    [self allocSegments:1];
+    pulses[0] = 0;
+    tempos[0] = tempo;
+    micros[0] = 0;
+    return self;
+}
+
+/** Create a map from the tempo events in the given tracks (an Array
+ *  of MidiEventTable).  The song starts at the earliest tempo change
+ *  at pulse 0, or else at the given tempo, which is the first tempo
+ *  found in the file (or the default 120 bpm).
+ *
+ *  If several tracks change the tempo at the same pulse, the first
+ *  one in track order is used, which matches how MidiFile picks the
+ *  starting tempo.
+ */
+- (id)initWithEvents:(Array*)events andTempo:(int)tempo andQuarter:(int)q {
+    assert(tempo > 0 && q > 0);
+    quarter = q;
+
+    int total = 0;
+    int capacity = 8;
+    TempoChange *changes = (TempoChange*)malloc(capacity * sizeof(TempoChange));
+    for (int tracknum = 0; tracknum < [events count]; tracknum++) {
+        MidiEventTable *table = [events get:tracknum];
+        int n = [table count];
+        for (int i = 0; i < n; i++) {
+            int t = [table tempo:i];
+            if (t <= 0) {
+                continue;
+            }
+            if (total == capacity) {
+                capacity *= 2;
+                changes = (TempoChange*)realloc(changes, capacity * sizeof(TempoChange));
+            }
+            changes[total].pulse = [table startTime:i];
+            changes[total].order = total;
+            changes[total].tempo = t;
+            total++;
+        }
+    }
+    qsort(changes, total, sizeof(TempoChange), sortbypulse);
+
+    [self allocSegments:(total + 1)];
+    pulses[0] = 0;
+    tempos[0] = tempo;
+    micros[0] = 0;
+    count = 1;
+    int lastpulse = -1;
+    for (int i = 0; i < total; i++) {
+        if (changes[i].pulse == lastpulse) {
+            /* Only the first change at each pulse is used */
+            continue;
+        }
+        lastpulse = changes[i].pulse;
+        if (lastpulse == 0) {
+            tempos[0] = changes[i].tempo;
+            continue;
+        }
+        if (changes[i].tempo == tempos[count-1]) {
+            continue;
+        }
+        int prev = count-1;
+        pulses[count] = changes[i].pulse;
+        tempos[count] = changes[i].tempo;
+        micros[count] = micros[prev] +
+            (double)(pulses[count] - pulses[prev]) * tempos[prev] / quarter;
+        count++;
+    }
+    free(changes);
+    return self;
+}
+
+/** Create a map from the given segments (start pulse and tempo),
+ *  which must be sorted by pulse, with the first at pulse 0.  This
+ *  is used to restore a map saved with pulseAtSegment/tempoAtSegment.
+ */
+- (id)initWithCount:(int)n pulses:(int*)p tempos:(int*)t andQuarter:(int)q {
+    assert(n > 0 && p[0] == 0 && q > 0);
+    quarter = q;
+    count = n;
+    [self allocSegments:n];
+    for (int i = 0; i < n; i++) {
+        pulses[i] = p[i];
+        tempos[i] = t[i];
+        if (i == 0) {
+            micros[i] = 0;
+        }
+        else {
+            micros[i] = micros[i-1] +
+                (double)(pulses[i] - pulses[i-1]) * tempos[i-1] / quarter;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    free(pulses);
+    free(tempos);
+    free(micros);
+    [super dealloc];
+}
+
+/** Return the index of the segment containing the given pulse.
+ *  Pulses before the start of the song use the first segment.
+ */
+- (int)segmentForPulse:(double)pulse {
+    int low = 0;
+    int high = count - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (pulses[mid] <= pulse) {
+            low = mid;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+/** Return the index of the segment containing the given time */
+- (int)segmentForMicros:(double)us {
+    int low = 0;
+    int high = count - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (micros[mid] <= us) {
+            low = mid;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+/** Return the tempo (microseconds per quarter note) at the given pulse */
+- (int)tempoAtPulse:(int)pulse {
+    return tempos[[self segmentForPulse:pulse]];
+}
+
+/** Return the time (in microseconds) from the start of the song
+ *  to the given pulse.
+ */
+- (double)microsForPulse:(double)pulse {
+    int i = [self segmentForPulse:pulse];
+    return micros[i] + (pulse - pulses[i]) * tempos[i] / quarter;
+}
+
+/** Return the pulse played at the given time (in microseconds)
+ *  from the start of the song.
+ */
+- (double)pulseForMicros:(double)us {
+    int i = [self segmentForMicros:us];
+    return pulses[i] + (us - micros[i]) * quarter / tempos[i];
+}
+
+/** Return the start pulse of the given segment */
+- (int)pulseAtSegment:(int)index {
+    assert(index >= 0 && index < count);
+    return pulses[index];
+}
+
+/** Return the tempo of the given segment */
+- (int)tempoAtSegment:(int)index {
+    assert(index >= 0 && index < count);
+    return tempos[index];
+}
+
+@end
+
+
@@ -13,15 +13,21 @@
 #import <Foundation/NSObject.h>
 #import "MusicSymbol.h"
 
+@class MidiFileReader;
+
 @interface TimeSigSymbol : NSObject <MusicSymbol> {
     int  numerator;         /** The numerator */
     int  denominator;       /** The denominator */
     int  width;             /** The width in pixels */
     BOOL candraw;           /** True if we can draw the time signature */
+    int  starttime;         /** The start time, or -1 at the beginning of the staff */
 }
 
 -(id)initWithNumer:(int)n andDenom:(int)d;
+-(id)initWithNumer:(int)n andDenom:(int)d andTime:(int)t;
 +(void)loadImages;
+-(id)initWithLayout:(MidiFileReader*)reader;
+-(void)appendLayout:(NSMutableData*)data;
 
 @end
 
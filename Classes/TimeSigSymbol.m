@@ -11,6 +11,8 @@
  */
 
 #import "TimeSigSymbol.h"
+#import "MidiFileReader.h"
+#import "ScoreCache.h"
 #import "WhiteNote.h"
 
 static int images_init = 0;
@@ -18,13 +20,22 @@ static NSImage* images[13];     /** The images for each number */
 
 /** @class TimeSigSymbol
  * A TimeSigSymbol represents the time signature at the beginning
- * of the staff. We use pre-made images for the numbers, instead of
+ * of the staff, or a change of time signature at the start of a
+ * measure. We use pre-made images for the numbers, instead of
  * drawing strings.
  */
 @implementation TimeSigSymbol
 
 /** Create a new TimeSigSymbol */
 - (id)initWithNumer:(int)numer andDenom:(int)denom {
+    return [self initWithNumer:numer andDenom:denom andTime:-1];
+}
+
+/** Create a new TimeSigSymbol for a time signature change at the
+ *  given start time (the start of a measure).
+ */
+- (id)initWithNumer:(int)numer andDenom:(int)denom andTime:(int)t {
+    starttime = t;
     numerator = numer;
     denominator = denom;
     [TimeSigSymbol loadImages];
@@ -81,7 +92,7 @@ static NSImage* images[13];     /** The images for each number */
  * This is used to determine the measure this symbol belongs to.
  */
 - (int)startTime {
-    return -1;
+    return starttime;
 }
 
 /** Get the minimum width (in pixels) needed to draw this symbol */
@@ -163,6 +174,24 @@ static NSImage* images[13];     /** The images for each number */
     return s;
 }
 
+/** Append the time signature, start time and width to the layout cache */
+- (void)appendLayout:(NSMutableData*)data {
+    appendInt(data, numerator);
+    appendInt(data, denominator);
+    appendInt(data, starttime);
+    appendInt(data, width);
+}
+
+/** Create a time signature symbol from its layout (see appendLayout:) */
+- (id)initWithLayout:(MidiFileReader*)reader {
+    int numer = [reader readInt];
+    int denom = [reader readInt];
+    int t = [reader readInt];
+    [self initWithNumer:numer andDenom:denom andTime:t];
+    width = [reader readInt];
+    return self;
+}
+
 @end
 
 
@@ -14,16 +14,24 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <math.h>
 
 #import <Foundation/NSAutoreleasePool.h>
+#import <objc/runtime.h>
 #import "MidiFile.h"
+#import "RadixSort.h"
 #import "KeySignature.h"
+#import "KeyMeasures.h"
 #import "TimeSignature.h"
 #import "SymbolWidths.h"
 #import "AccidSymbol.h"
 #import "ClefSymbol.h"
 #import "ClefMeasures.h"
 #import "ChordSymbol.h"
+#import "RestSymbol.h"
+#import "BarSymbol.h"
+#import "TimeSigSymbol.h"
+#import "KeySigSymbol.h"
 #import "SheetMusic.h"
 #import <SenTestingKit/SenTestingKit.h>
 
@@ -78,6 +86,7 @@ void writeTestFile(u_char* data, int len) {
 - (void)testVarlen;
 - (void)testAscii;
 - (void)testSkip;
+- (void)testStorageModes;
 @end
 
 @implementation MidiFileReaderTest
@@ -258,6 +267,42 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
     unlink(ctestfile);
 }
 
+/* Test that the mapped, malloc'ed, NSData, and caller-owned buffer
+ * readers all return the same data, and that readBytesNoCopy()
+ * returns a pointer into the reader's data instead of a copy.
+ */
+- (void) testStorageModes {
+    u_char data[] = { 65, 66, 67, 0x81, 0x7F, 1, 2, 3, 4 };
+    writeTestFile(data, sizeof(data));
+    NSData *nsdata = [NSData dataWithBytes:data length:sizeof(data)];
+
+    MidiFileReader *readers[4];
+    readers[0] = [[MidiFileReader alloc] initWithFile:testfile andMap:YES];
+    readers[1] = [[MidiFileReader alloc] initWithFile:testfile andMap:NO];
+    readers[2] = [[MidiFileReader alloc] initWithData:nsdata];
+    readers[3] = [[MidiFileReader alloc] initWithBytes:data length:sizeof(data)];
+    unlink(ctestfile);
+
+    STAssertTrue([readers[0] storage] == ReaderMapped, @"");
+    STAssertTrue([readers[1] storage] == ReaderMalloc, @"");
+    STAssertTrue([readers[2] storage] == ReaderData, @"");
+    STAssertTrue([readers[3] storage] == ReaderBorrowed, @"");
+
+    for (int i = 0; i < 4; i++) {
+        MidiFileReader *reader = readers[i];
+        STAssertTrue([reader length] == sizeof(data), @"");
+        STAssertTrue(strncmp([reader readAscii:3], "ABC", 3) == 0, @"");
+        STAssertTrue([reader readVarlen] == 0xFF, @"");
+        u_char *bytes = [reader readBytesNoCopy:4];
+        STAssertTrue(bytes[0] == 1 && bytes[3] == 4, @"");
+        STAssertTrue([reader offset] == 9, @"");
+        if (i == 3) {
+            STAssertTrue(bytes == &data[5], @"");
+        }
+        [reader release];
+    }
+}
+
 @end  /* MidiFileReaderTest */
 
 
@@ -272,6 +317,7 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
 - (void)testMultipleTracks;
 - (void)testTruncatedFile;
 - (void)testChangeSoundTempo;
+- (void)testSoundData;
 - (void)testChangeSoundTranspose;
 - (void)testChangeSoundInstruments;
 - (void)testChangeSoundTracks;
@@ -282,9 +328,24 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
 - (void)testChangeSoundPerChannelTracks;
 - (void)testChangeSoundPerChannelPauseTime;
 - (void)testSplitTrack;
+- (void)testSplitTrackRandom;
 - (void)testCombineToSingleTrack;
+- (void)testCombineManyTracks;
+- (void)testChangeMidiNotes;
 - (void)testRoundStartTimes;
 - (void)testRoundDurations;
+- (void)testSnapStartTimes;
+- (void)testSnapTriplets;
+- (void)testGuessMeasureLength;
+- (void)testMappedRead;
+- (void)testEventTable;
+- (void)testManyTracks;
+- (void)testEventStream;
+- (void)testNoteOffMatching;
+- (void)testScoreCache;
+- (void)testRunningStatus;
+- (void)testSeekCheckpoints;
+- (void)testIncrementalReload;
 
 @end
 
@@ -334,21 +395,21 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
     STAssertTrue(time.measure == quarternote * 4, @"");
 
     MidiTrack *track = [midifile.tracks get:0];
-    Array *notes = track.notes;
+    NoteArray *notes = track.notes;
     STAssertTrue([notes count] == 3, @"");
 
 
-    STAssertTrue([notes getNote:0].startTime == 0, @"");
-    STAssertTrue([notes getNote:0].number == notenum, @"");
-    STAssertTrue([notes getNote:0].duration == 60, @"");
+    STAssertTrue([notes startTime:0] == 0, @"");
+    STAssertTrue([notes number:0] == notenum, @"");
+    STAssertTrue([notes duration:0] == 60, @"");
 
-    STAssertTrue([notes getNote:1].startTime == 60, @"");
-    STAssertTrue([notes getNote:1].number == notenum+1, @"");
-    STAssertTrue([notes getNote:1].duration == 30, @"");
+    STAssertTrue([notes startTime:1] == 60, @"");
+    STAssertTrue([notes number:1] == notenum+1, @"");
+    STAssertTrue([notes duration:1] == 30, @"");
 
-    STAssertTrue([notes getNote:2].startTime == 90, @"");
-    STAssertTrue([notes getNote:2].number == notenum+2, @"");
-    STAssertTrue([notes getNote:2].duration == 90, @"");
+    STAssertTrue([notes startTime:2] == 90, @"");
+    STAssertTrue([notes number:2] == notenum+2, @"");
+    STAssertTrue([notes duration:2] == 90, @"");
 
     [midifile release];
 }
@@ -399,19 +460,19 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
 
     MidiTrack *track = [midifile.tracks get:0];
 
-    Array* notes = track.notes;
+    NoteArray *notes = track.notes;
     STAssertTrue([notes count] == 3, @"");
 
-    STAssertTrue([notes getNote:0].startTime == 0, @"");
-    STAssertTrue([notes getNote:0].number == notenum, @"");
-    STAssertTrue([notes getNote:0].duration == 120, @"");
-    STAssertTrue([notes getNote:1].startTime == 30, @"");
-    STAssertTrue([notes getNote:1].number == notenum+1, @"");
-    STAssertTrue([notes getNote:1].duration == 60, @"");
+    STAssertTrue([notes startTime:0] == 0, @"");
+    STAssertTrue([notes number:0] == notenum, @"");
+    STAssertTrue([notes duration:0] == 120, @"");
+    STAssertTrue([notes startTime:1] == 30, @"");
+    STAssertTrue([notes number:1] == notenum+1, @"");
+    STAssertTrue([notes duration:1] == 60, @"");
 
-    STAssertTrue([notes getNote:2].startTime == 60, @"");
-    STAssertTrue([notes getNote:2].number == notenum+2, @"");
-    STAssertTrue([notes getNote:2].duration == 90, @"");
+    STAssertTrue([notes startTime:2] == 60, @"");
+    STAssertTrue([notes number:2] == notenum+2, @"");
+    STAssertTrue([notes duration:2] == 90, @"");
 
     [midifile release];
 }
@@ -463,20 +524,20 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
 
     MidiTrack *track = [midifile.tracks get:0];
 
-    Array* notes = track.notes;
+    NoteArray *notes = track.notes;
     STAssertTrue([notes count] == 3, @"");
 
-    STAssertTrue([notes getNote:0].startTime == 0, @"");
-    STAssertTrue([notes getNote:0].number == notenum, @"");
-    STAssertTrue([notes getNote:0].duration == 120, @"");
+    STAssertTrue([notes startTime:0] == 0, @"");
+    STAssertTrue([notes number:0] == notenum, @"");
+    STAssertTrue([notes duration:0] == 120, @"");
 
-    STAssertTrue([notes getNote:1].startTime == 30, @"");
-    STAssertTrue([notes getNote:1].number == notenum+1, @"");
-    STAssertTrue([notes getNote:1].duration == 60, @"");
+    STAssertTrue([notes startTime:1] == 30, @"");
+    STAssertTrue([notes number:1] == notenum+1, @"");
+    STAssertTrue([notes duration:1] == 60, @"");
 
-    STAssertTrue([notes getNote:2].startTime == 60, @"");
-    STAssertTrue([notes getNote:2].number == notenum+2, @"");
-    STAssertTrue([notes getNote:2].duration == 90, @"");
+    STAssertTrue([notes startTime:2] == 60, @"");
+    STAssertTrue([notes number:2] == notenum+2, @"");
+    STAssertTrue([notes duration:2] == 90, @"");
 
     [midifile release];
 }
@@ -531,20 +592,20 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
     STAssertTrue(time.measure == quarternote * 4, @"");
 
     MidiTrack *track = [midifile.tracks get:0];
-    Array* notes = track.notes;
+    NoteArray *notes = track.notes;
     STAssertTrue([notes count] == 3, @"");
 
-    STAssertTrue([notes getNote:0].startTime == 0, @"");
-    STAssertTrue([notes getNote:0].number == notenum, @"");
-    STAssertTrue([notes getNote:0].duration == 60, @"");
+    STAssertTrue([notes startTime:0] == 0, @"");
+    STAssertTrue([notes number:0] == notenum, @"");
+    STAssertTrue([notes duration:0] == 60, @"");
 
-    STAssertTrue([notes getNote:1].startTime == 60, @"");
-    STAssertTrue([notes getNote:1].number == notenum+1, @"");
-    STAssertTrue([notes getNote:1].duration == 30, @"");
+    STAssertTrue([notes startTime:1] == 60, @"");
+    STAssertTrue([notes number:1] == notenum+1, @"");
+    STAssertTrue([notes duration:1] == 30, @"");
 
-    STAssertTrue([notes getNote:2].startTime == 90, @"");
-    STAssertTrue([notes getNote:2].number == notenum+2, @"");
-    STAssertTrue([notes getNote:2].duration == 90, @"");
+    STAssertTrue([notes startTime:2] == 90, @"");
+    STAssertTrue([notes number:2] == notenum+2, @"");
+    STAssertTrue([notes duration:2] == 90, @"");
 
     [midifile release];
 }
@@ -594,20 +655,20 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
     STAssertTrue(midifile.time.measure == quarternote * 4, @"");
 
     MidiTrack *track = [midifile.tracks get:0];
-    Array* notes = track.notes;
+    NoteArray *notes = track.notes;
     STAssertTrue([notes count] == 3, @"");
 
-    STAssertTrue([notes getNote:0].startTime == 0, @"");
-    STAssertTrue([notes getNote:0].number == notenum, @"");
-    STAssertTrue([notes getNote:0].duration == 60, @"");
+    STAssertTrue([notes startTime:0] == 0, @"");
+    STAssertTrue([notes number:0] == notenum, @"");
+    STAssertTrue([notes duration:0] == 60, @"");
 
-    STAssertTrue([notes getNote:1].startTime == 60, @"");
-    STAssertTrue([notes getNote:1].number == notenum+1, @"");
-    STAssertTrue([notes getNote:1].duration == 30, @"");
+    STAssertTrue([notes startTime:1] == 60, @"");
+    STAssertTrue([notes number:1] == notenum+1, @"");
+    STAssertTrue([notes duration:1] == 30, @"");
 
-    STAssertTrue([notes getNote:2].startTime == 90, @"");
-    STAssertTrue([notes getNote:2].number == notenum+2, @"");
-    STAssertTrue([notes getNote:2].duration == 90, @"");
+    STAssertTrue([notes startTime:2] == 90, @"");
+    STAssertTrue([notes number:2] == notenum+2, @"");
+    STAssertTrue([notes duration:2] == 90, @"");
 
     [midifile release];
 }
@@ -677,20 +738,20 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
 
     for (int tracknum = 0; tracknum < numtracks; tracknum++) {
         MidiTrack *track = [midifile.tracks get:tracknum];
-        Array* notes = track.notes;
+        NoteArray *notes = track.notes;
         STAssertTrue([notes count] == 3, @"");
 
-        STAssertTrue([notes getNote:0].startTime == 0, @"");
-        STAssertTrue([notes getNote:0].number == notenum + tracknum, @"");
-        STAssertTrue([notes getNote:0].duration == 60, @"");
+        STAssertTrue([notes startTime:0] == 0, @"");
+        STAssertTrue([notes number:0] == notenum + tracknum, @"");
+        STAssertTrue([notes duration:0] == 60, @"");
 
-        STAssertTrue([notes getNote:1].startTime == 60, @"");
-        STAssertTrue([notes getNote:1].number == notenum + tracknum + 1, @"");
-        STAssertTrue([notes getNote:1].duration == 30, @"");
+        STAssertTrue([notes startTime:1] == 60, @"");
+        STAssertTrue([notes number:1] == notenum + tracknum + 1, @"");
+        STAssertTrue([notes duration:1] == 30, @"");
 
-        STAssertTrue([notes getNote:2].startTime == 90, @"");
-        STAssertTrue([notes getNote:2].number == notenum + tracknum + 2, @"");
-        STAssertTrue([notes getNote:2].duration == 90, @"");
+        STAssertTrue([notes startTime:2] == 90, @"");
+        STAssertTrue([notes number:2] == notenum + tracknum + 2, @"");
+        STAssertTrue([notes duration:2] == 90, @"");
     }
 
     [midifile release];
@@ -812,20 +873,20 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
     STAssertTrue(((MidiTrack*)[midifile.tracks get:2]).instrument == 0, @"");
     for (int tracknum = 0; tracknum < 3; tracknum++) {
         MidiTrack *track = [midifile.tracks get:tracknum];
-        Array* notes = track.notes;
+        NoteArray *notes = track.notes;
         STAssertTrue([notes count] == 3, @"");
 
-        STAssertTrue([notes getNote:0].startTime == 0, @"");
-        STAssertTrue([notes getNote:0].number == notenum + 10*tracknum, @"");
-        STAssertTrue([notes getNote:0].duration == 60, @"");
+        STAssertTrue([notes startTime:0] == 0, @"");
+        STAssertTrue([notes number:0] == notenum + 10*tracknum, @"");
+        STAssertTrue([notes duration:0] == 60, @"");
 
-        STAssertTrue([notes getNote:1].startTime == 60, @"");
-        STAssertTrue([notes getNote:1].number == notenum + 10*tracknum + 1, @"");
-        STAssertTrue([notes getNote:1].duration == 30, @"");
+        STAssertTrue([notes startTime:1] == 60, @"");
+        STAssertTrue([notes number:1] == notenum + 10*tracknum + 1, @"");
+        STAssertTrue([notes duration:1] == 30, @"");
 
-        STAssertTrue([notes getNote:2].startTime == 90, @"");
-        STAssertTrue([notes getNote:2].number == notenum + 10*tracknum + 2, @"");
-        STAssertTrue([notes getNote:2].duration == 90, @"");
+        STAssertTrue([notes startTime:2] == 90, @"");
+        STAssertTrue([notes number:2] == notenum + 10*tracknum + 2, @"");
+        STAssertTrue([notes duration:2] == 90, @"");
     }
     return midifile;
 }
@@ -854,10 +915,36 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
     unlink(ctestfile);
 }
 
+/* Test creating the playback sound in memory with soundDataWithOptions().
+ * Verify the data is the same as the midi file written by changeSound(),
+ * and that it parses to the new tempo.
+ */
+- (void) testSoundData {
+    MidiFile *midifile = [self createTestChangeSoundMidiFile];
+    MidiOptions *options = [[MidiOptions alloc] initFromMidi:midifile];
+    options.tempo = 0x405060;
+    options.transpose = 10;
+
+    NSData *data = [midifile soundDataWithOptions:options];
+    BOOL ret = [midifile changeSound:options toFile:testfile];
+    STAssertTrue(ret == YES, @"");
+    NSData *filedata = [NSData dataWithContentsOfFile:testfile];
+    unlink(ctestfile);
+    STAssertTrue([data isEqualToData:filedata], @"");
+
+    MidiFileReader *reader = [[MidiFileReader alloc] initWithData:data];
+    MidiFile *newmidi = [[MidiFile alloc] initWithReader:reader andFilename:testfile];
+    STAssertTrue([newmidi.tracks count] == 3, @"");
+    STAssertTrue(newmidi.time.tempo == 0x405060, @"");
+    [newmidi release];
+    [options release];
+    [midifile release];
+}
+
 /* Test transposing the notes with the changeSound() method.
  * Create a Midi File with 3 tracks, and 3 notes per track. Parse the MidiFile.
  * Call changeSound() with transpose = 10.
- * Parse the new MidiFile, and verify the MidiNote numbers are now 10 notes higher.
+ * Parse the new MidiFile, and verify the note numbers are now 10 notes higher.
  */
 - (void) testChangeSoundTranspose {
     u_char notenum = 60;
@@ -874,20 +961,20 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
 
     for (int tracknum = 0; tracknum < 3; tracknum++) {
         MidiTrack *track = [newmidi.tracks get:tracknum];
-        Array* notes = track.notes;
+        NoteArray *notes = track.notes;
         STAssertTrue([notes count] == 3, @"");
 
-        STAssertTrue([notes getNote:0].startTime == 0, @"");
-        STAssertTrue([notes getNote:0].number == notenum + 10*tracknum + 10, @"");
-        STAssertTrue([notes getNote:0].duration == 60, @"");
+        STAssertTrue([notes startTime:0] == 0, @"");
+        STAssertTrue([notes number:0] == notenum + 10*tracknum + 10, @"");
+        STAssertTrue([notes duration:0] == 60, @"");
 
-        STAssertTrue([notes getNote:1].startTime == 60, @"");
-        STAssertTrue([notes getNote:1].number == notenum + 10*tracknum + 11, @"");
-        STAssertTrue([notes getNote:1].duration == 30, @"");
+        STAssertTrue([notes startTime:1] == 60, @"");
+        STAssertTrue([notes number:1] == notenum + 10*tracknum + 11, @"");
+        STAssertTrue([notes duration:1] == 30, @"");
 
-        STAssertTrue([notes getNote:2].startTime == 90, @"");
-        STAssertTrue([notes getNote:2].number == notenum + 10*tracknum + 12, @"");
-        STAssertTrue([notes getNote:2].duration == 90, @"");
+        STAssertTrue([notes startTime:2] == 90, @"");
+        STAssertTrue([notes number:2] == notenum + 10*tracknum + 12, @"");
+        STAssertTrue([notes duration:2] == 90, @"");
     }
     [newmidi release];
     [midifile release];
@@ -949,8 +1036,7 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
     MidiTrack *track = [newmidi.tracks get:0];
     STAssertTrue(track.instrument == 1, @"");
     for (int i = 0; i < 3; i++) {
-        MidiNote *note = [track.notes get:i];
-        STAssertTrue(note.number == notenum + 10 + i, @"");
+        STAssertTrue([track.notes number:i] == notenum + 10 + i, @"");
     }
 
     [newmidi release];
@@ -982,16 +1068,16 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
 
     for (int tracknum = 0; tracknum < 3; tracknum++) {
         MidiTrack *track = [newmidi.tracks get:tracknum];
-        Array* notes = track.notes;
+        NoteArray *notes = track.notes;
         STAssertTrue([notes count] == 2, @"");
 
-        STAssertTrue([notes getNote:0].startTime == 60 - options.pauseTime, @"");
-        STAssertTrue([notes getNote:0].number == notenum + 10*tracknum + 1, @"");
-        STAssertTrue([notes getNote:0].duration == 30, @"");
+        STAssertTrue([notes startTime:0] == 60 - options.pauseTime, @"");
+        STAssertTrue([notes number:0] == notenum + 10*tracknum + 1, @"");
+        STAssertTrue([notes duration:0] == 30, @"");
 
-        STAssertTrue([notes getNote:1].startTime == 90 - options.pauseTime, @"");
-        STAssertTrue([notes getNote:1].number == notenum + 10*tracknum + 2, @"");
-        STAssertTrue([notes getNote:1].duration == 90, @"");
+        STAssertTrue([notes startTime:1] == 90 - options.pauseTime, @"");
+        STAssertTrue([notes number:1] == notenum + 10*tracknum + 2, @"");
+        STAssertTrue([notes duration:1] == 90, @"");
     }
     [newmidi release];
     [midifile release];
@@ -1064,8 +1150,7 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
         track = [midifile.tracks get:tracknum];
         STAssertTrue([track.notes count] == 3, @"");
         for (int n = 0; n < [track.notes count]; n++) {
-            MidiNote *m = [track.notes get:n];
-            STAssertTrue(m.number == (notenum + 10*tracknum + n), @"");
+            STAssertTrue([track.notes number:n] == (notenum + 10*tracknum + n), @"");
         }
     }
     return midifile;
@@ -1111,8 +1196,7 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
     for (int tracknum = 0; tracknum < 3; tracknum++) {
         MidiTrack *track = [newmidi.tracks get:tracknum];
         for (int i = 0; i < 3; i++) {
-            MidiNote *note = [track.notes get:i];
-            STAssertTrue(note.number == (notenum + tracknum*10 + i + 10), @"");
+            STAssertTrue([track.notes number:i] == (notenum + tracknum*10 + i + 10), @"");
         }
     }
 
@@ -1168,8 +1252,7 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
      
     MidiTrack *track = [newmidi.tracks get:0];
     for (int i = 0; i < 3; i++) {
-        MidiNote *note = [track.notes get:i];
-        STAssertTrue(note.number == notenum + 10 + i, @"");
+        STAssertTrue([track.notes number:i] == notenum + 10 + i, @"");
     }
 
     [newmidi release];
@@ -1198,9 +1281,8 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
         MidiTrack *track = [newmidi.tracks get:tracknum];
         STAssertTrue([track.notes count] == 2, @"");
         for (int i = 0; i < 2; i++) {
-            MidiNote *note = [track.notes get:i];
-            STAssertTrue(note.number == notenum + 10*tracknum + i + 1, @"");
-            STAssertTrue(note.startTime == 60 * (i+1) - 50, @"");
+            STAssertTrue([track.notes number:i] == notenum + 10*tracknum + i + 1, @"");
+            STAssertTrue([track.notes startTime:i] == 60 * (i+1) - 50, @"");
         }
     }
 
@@ -1228,51 +1310,31 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
     for (int i = 0; i < 100; i++) {
         start = i * 10;
         number = 70 + (i % 10);
-        MidiNote *note = [MidiNote alloc];
-        note.startTime = start;
-        note.number = number;
-        note.duration = 10;
-        [track addNote:note];
-        [note release];
+        [track addNote:start channel:0 number:number duration:10];
     }
 
     /* Create notes between 65 and 75 */
     for (int i = 0; i < 100; i++) {
         start = i * 10 + 1;
         number = 65 + (i % 10);
-        MidiNote *note = [MidiNote alloc];
-        note.startTime = start;
-        note.number = number;
-        note.duration = 10;
-        [track addNote:note];
-        [note release];
+        [track addNote:start channel:0 number:number duration:10];
     }
 
     /* Create notes between 50 and 60 */
     for (int i = 0; i < 100; i++) {
         start = i * 10;
         number = 50 + (i % 10);
-        MidiNote *note = [MidiNote alloc];
-        note.startTime = start;
-        note.number = number;
-        note.duration = 10;
-        [track addNote:note];
-        [note release];
+        [track addNote:start channel:0 number:number duration:10];
     }
 
     /* Create notes between 55 and 65 */
     for (int i = 0; i < 100; i++) {
         start = i * 10 + 1;
         number = 55 + (i % 10);
-        MidiNote *note = [MidiNote alloc];
-        note.startTime = start;
-        note.number = number;
-        note.duration = 10;
-        [track addNote:note];
-        [note release];
+        [track addNote:start channel:0 number:number duration:10];
     }
 
-    [track.notes sort:sortbytime];
+    [track.notes sortByTime];
     Array *tracks = [MidiFile splitTrack:track withMeasure:40];
     MidiTrack *track0 = [tracks get:0];
     MidiTrack *track1 = [tracks get:1];
@@ -1280,25 +1342,171 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
     STAssertTrue([track1.notes count] == 200, @"");
 
     for (int i = 0; i < 100; i++) {
-        MidiNote *note1 = [track0.notes get:i*2];
-        MidiNote *note2 = [track0.notes get:(i*2 + 1) ];
-        STAssertTrue(note1.startTime == i*10, @"");
-        STAssertTrue(note2.startTime == i*10 + 1, @"");
-        STAssertTrue(note1.number == 70 + (i % 10), @"");
-        STAssertTrue(note2.number == 65 + (i % 10), @"");
+        STAssertTrue([track0.notes startTime:i*2] == i*10, @"");
+        STAssertTrue([track0.notes startTime:i*2 + 1] == i*10 + 1, @"");
+        STAssertTrue([track0.notes number:i*2] == 70 + (i % 10), @"");
+        STAssertTrue([track0.notes number:i*2 + 1] == 65 + (i % 10), @"");
     }
     for (int i = 0; i < 100; i++) {
-        MidiNote *note1 = [track1.notes get:i*2];
-        MidiNote *note2 = [track1.notes get:(i*2 + 1) ];
-        STAssertTrue(note1.startTime == i*10, @"");
-        STAssertTrue(note2.startTime == i*10 + 1, @"");
-        STAssertTrue(note1.number == 50 + (i % 10), @"");
-        STAssertTrue(note2.number == 55 + (i % 10), @"");
+        STAssertTrue([track1.notes startTime:i*2] == i*10, @"");
+        STAssertTrue([track1.notes startTime:i*2 + 1] == i*10 + 1, @"");
+        STAssertTrue([track1.notes number:i*2] == 50 + (i % 10), @"");
+        STAssertTrue([track1.notes number:i*2 + 1] == 55 + (i % 10), @"");
     }
     [track release];
 }
 
 
+/* Find the highest and lowest notes that overlap this interval
+ * (starttime to endtime), limiting the interval of each note to one
+ * measure.  This rescans the nearby notes for each note, and is the
+ * reference that splitTrack is checked against.
+ */
+static void findHighLowNotes(NoteArray *notearray, int measurelen, int startindex,
+                             int starttime, int endtime, int *high, int *low) {
+    NoteView notes = [notearray view];
+    int i = startindex;
+    if (starttime + measurelen < endtime) {
+        endtime = starttime + measurelen;
+    }
+
+    while (i < notes.count) {
+        int start = notes.starttime[i];
+        int number = notes.number[i];
+        if (start >= endtime) {
+            break;
+        }
+        if (start + notes.duration[i] < starttime) {
+            i++;
+            continue;
+        }
+        if (start + measurelen < starttime) {
+            i++;
+            continue;
+        }
+        if (*high < number) {
+            *high = number;
+        }
+        if (*low > number) {
+            *low = number;
+        }
+        i++;
+    }
+}
+
+/* Find the highest and lowest notes that start at this exact start time */
+static void findExactHighLowNotes(NoteArray *notearray, int startindex,
+                                  int starttime, int *high, int *low) {
+    NoteView notes = [notearray view];
+    int i = startindex;
+    assert(i < notes.count);
+    while (notes.starttime[i] < starttime) {
+        i++;
+        assert(i < notes.count);
+    }
+
+    while (i < notes.count) {
+        if (notes.starttime[i] != starttime) {
+            break;
+        }
+        if (*high < notes.number[i]) {
+            *high = notes.number[i];
+        }
+        if (*low > notes.number[i]) {
+            *low = notes.number[i];
+        }
+        i++;
+    }
+}
+
+/* Split a random track, and verify that each note goes to the same
+ * staff as when the high/low notes are found by rescanning the notes
+ * with findHighLowNotes and findExactHighLowNotes.
+ */
+- (void)testSplitTrackRandom {
+    srandom(17);
+    for (int trial = 0; trial < 50; trial++) {
+        MidiTrack *track = [[MidiTrack alloc] initWithTrack:1];
+        int count = 1 + random() % 300;
+        int timespan = (trial % 2 == 0) ? 100 : 2000;
+        for (int i = 0; i < count; i++) {
+            int duration = (random() % 4 == 0) ? 0 : random() % 400;
+            [track.notes addNote:(random() % timespan) channel:0
+                          number:(30 + random() % 60) duration:duration];
+        }
+        [track.notes sortByTime];
+        int measurelen = 20 + random() % 200;
+        NoteArray *notes = track.notes;
+        NoteView v = [notes view];
+
+        /* Choose the staff for each note the slow way */
+        NoteArray *top = [NoteArray new:count];
+        NoteArray *bottom = [NoteArray new:count];
+        int prevhigh = 76;
+        int prevlow = 45;
+        int startindex = 0;
+        for (int i = 0; i < count; i++) {
+            int number = v.number[i];
+            int starttime = v.starttime[i];
+            int high, low, highExact, lowExact;
+            high = low = highExact = lowExact = number;
+            while (v.starttime[startindex] + v.duration[startindex] < starttime) {
+                startindex++;
+            }
+            findHighLowNotes(notes, measurelen, startindex,
+                             starttime, starttime + v.duration[i], &high, &low);
+            findExactHighLowNotes(notes, startindex, starttime, &highExact, &lowExact);
+
+            BOOL istop;
+            if (highExact - number > 12 || number - lowExact > 12) {
+                istop = (highExact - number <= number - lowExact);
+            }
+            else if (high - number > 12 || number - low > 12) {
+                istop = (high - number <= number - low);
+            }
+            else if (highExact - lowExact > 12) {
+                istop = (highExact - number <= number - lowExact);
+            }
+            else if (high - low > 12) {
+                istop = (high - number <= number - low);
+            }
+            else {
+                istop = (prevhigh - number <= number - prevlow);
+            }
+            if (istop) {
+                [top addNote:i from:notes];
+            }
+            else {
+                [bottom addNote:i from:notes];
+            }
+            if (high - low > 12) {
+                prevhigh = high;
+                prevlow = low;
+            }
+        }
+        [top sortByTime];
+        [bottom sortByTime];
+
+        Array *tracks = [MidiFile splitTrack:track withMeasure:measurelen];
+        MidiTrack *track0 = [tracks get:0];
+        MidiTrack *track1 = [tracks get:1];
+        STAssertTrue([track0.notes count] == [top count], @"");
+        STAssertTrue([track1.notes count] == [bottom count], @"");
+        for (int i = 0; i < [top count]; i++) {
+            STAssertTrue([track0.notes startTime:i] == [top startTime:i], @"");
+            STAssertTrue([track0.notes number:i] == [top number:i], @"");
+            STAssertTrue([track0.notes duration:i] == [top duration:i], @"");
+        }
+        for (int i = 0; i < [bottom count]; i++) {
+            STAssertTrue([track1.notes startTime:i] == [bottom startTime:i], @"");
+            STAssertTrue([track1.notes number:i] == [bottom number:i], @"");
+            STAssertTrue([track1.notes duration:i] == [bottom duration:i], @"");
+        }
+        [track release];
+    }
+}
+
+
 /* Create 3 tracks with the following notes:
  * - Start times 1, 3, 5 ... 99
  * - Start times 2, 4, 6 .... 100
@@ -1319,13 +1527,7 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
     for (int i = 1; i <= 99; i += 2) {
         start = i;
         number = 30 + (i % 10);
-        MidiNote *note = [MidiNote alloc];
-        note.startTime = start;
-        note.channel = 0;
-        note.number = number;
-        note.duration = 10;
-        [track addNote:note];
-        [note release];
+        [track addNote:start channel:0 number:number duration:10];
     }
     [track release];
     track = [[MidiTrack alloc] initWithTrack:2];
@@ -1333,13 +1535,7 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
     for (int i = 0; i <= 100; i += 2) {
         start = i;
         number = 50 + (i % 10);
-        MidiNote *note = [MidiNote alloc];
-        note.startTime = start;
-        note.channel = 0;
-        note.number = number;
-        note.duration = 10;
-        [track addNote:note];
-        [note release];
+        [track addNote:start channel:0 number:number duration:10];
     }
     [track release];
     track = [[MidiTrack alloc] initWithTrack:3];
@@ -1347,37 +1543,115 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
     for (int i = 0; i <= 100; i += 10) {
         start = i;
         number = 50 + (i % 10);
-        MidiNote *note = [MidiNote alloc];
-        note.startTime = start;
-        note.channel = 0;
-        note.number = number;
-        note.duration = 20;
-        [track addNote:note];
-        [note release];
+        [track addNote:start channel:0 number:number duration:20];
     }
     [track release];
 
     MidiTrack *result = [MidiFile combineToSingleTrack:tracks];
     STAssertTrue([result.notes count] == 101, @"");
     for (int i = 0; i <= 100; i++) {
-        MidiNote *note = [result.notes get:i];
-        STAssertTrue(note.startTime == i, @"");
+        STAssertTrue([result.notes startTime:i] == i, @"");
         if (i % 2 == 0) {
-            STAssertTrue(note.number == 50 + (i % 10), @"");
+            STAssertTrue([result.notes number:i] == 50 + (i % 10), @"");
         }
         else {
-            STAssertTrue(note.number == 30 + (i % 10), @"");
+            STAssertTrue([result.notes number:i] == 30 + (i % 10), @"");
         }
         if (i % 10 == 0) {
-            STAssertTrue(note.duration == 20, @"");
+            STAssertTrue([result.notes duration:i] == 20, @"");
         }
         else {
-            STAssertTrue(note.duration == 10, @"");
+            STAssertTrue([result.notes duration:i] == 10, @"");
         }
     }
     [result release];
 }
 
+/* Combine 100 tracks, where track t has notes at start times t, t+100,
+ * t+200, and every track also plays note 60 at start time 1000, with
+ * a duration equal to its track number.  Verify that the notes are
+ * merged in order, and that the duplicate notes at time 1000 become
+ * a single note with the longest duration, and the channel of the
+ * first track.
+ */
+- (void)testCombineManyTracks {
+    Array *tracks = [Array new:100];
+    for (int t = 0; t < 100; t++) {
+        MidiTrack *track = [[MidiTrack alloc] initWithTrack:t];
+        for (int i = 0; i < 3; i++) {
+            [track.notes addNote:(t + i*100) channel:(t % 16) number:(40 + t % 10) duration:5];
+        }
+        [track.notes addNote:1000 channel:(t % 16) number:60 duration:(t+1)];
+        [tracks add:track];
+        [track release];
+    }
+
+    MidiTrack *result = [MidiFile combineToSingleTrack:tracks];
+    NoteArray *notes = result.notes;
+    STAssertTrue([notes count] == 301, @"");
+    for (int i = 0; i < 300; i++) {
+        STAssertTrue([notes startTime:i] == i, @"");
+        STAssertTrue([notes number:i] == 40 + (i % 100) % 10, @"");
+    }
+    STAssertTrue([notes startTime:300] == 1000, @"");
+    STAssertTrue([notes duration:300] == 100, @"");
+    STAssertTrue([notes channel:300] == 0, @"");
+}
+
+
+/* Call changeMidiNotes() twice with the same options, and verify the
+ * same tracks are returned, with their notes locked.  Change the
+ * transpose option, and verify the new tracks are transposed, and
+ * that the original tracks are unchanged.  Combine the tracks using
+ * the track as the channel, and verify the channel of each note.
+ */
+- (void)testChangeMidiNotes {
+    u_char notenum = 60;
+    MidiFile *midifile = [self createTestChangeSoundMidiFile];
+    MidiOptions *options = [[MidiOptions alloc] initFromMidi:midifile];
+    options.twoStaffs = NO;
+
+    Array *tracks1 = [midifile changeMidiNotes:options];
+    STAssertTrue([tracks1 count] == 3, @"");
+    STAssertTrue([midifile changeMidiNotes:options] == tracks1, @"");
+    MidiOptions *copy = [options copy];
+    STAssertTrue([midifile changeMidiNotes:copy] == tracks1, @"");
+
+    /* The tracks are autoreleased, so tracks1 is still valid after
+     * the options change below.  A copy of the notes can be changed.
+     */
+    for (int tracknum = 0; tracknum < 3; tracknum++) {
+        MidiTrack *track = [tracks1 get:tracknum];
+        STAssertTrue([track.notes locked], @"");
+        STAssertTrue(![[track.notes copy] locked], @"");
+    }
+    MidiTrack *single = [MidiFile combineToSingleTrack:tracks1 useTrackAsChannel:YES];
+    STAssertTrue([single.notes count] == 9, @"");
+    for (int i = 0; i < 9; i++) {
+        int number = [single.notes number:i];
+        STAssertTrue([single.notes channel:i] == (number - notenum) / 10, @"");
+    }
+
+    options.transpose = 5;
+    Array *tracks2 = [midifile changeMidiNotes:options];
+    STAssertTrue(tracks2 != tracks1, @"");
+    for (int tracknum = 0; tracknum < 3; tracknum++) {
+        MidiTrack *track = [tracks2 get:tracknum];
+        NoteArray *notes = [(MidiTrack*)[tracks1 get:tracknum] notes];
+        STAssertTrue([track.notes count] == 3, @"");
+        for (int i = 0; i < 3; i++) {
+            STAssertTrue([track.notes startTime:i] == [notes startTime:i], @"");
+            STAssertTrue([track.notes duration:i] == [notes duration:i], @"");
+            STAssertTrue([track.notes number:i] == [notes number:i] + 5, @"");
+        }
+        MidiTrack *orig = [midifile.tracks get:tracknum];
+        for (int i = 0; i < 3; i++) {
+            STAssertTrue([orig.notes number:i] == notenum + 10*tracknum + i, @"");
+        }
+    }
+    [options release];
+    [midifile release];
+}
 
 /* Create a set of notes with the following start times.
  * 0, 2, 3, 10, 15, 20, 22, 35, 36, 62.
@@ -1387,37 +1661,24 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
  */
 - (void) testRoundStartTimes {
     u_char notenum = 20;
-
-    MidiNote *m = [MidiNote alloc];
-    m.channel = 0;
-    m.duration = 60;
+    int duration = 60;
 
     Array* tracks = [Array new:5];
     MidiTrack *track1 = [[MidiTrack alloc] initWithTrack:0];
 
-    m.startTime = 0; m.number = notenum;
-    [track1 addNote:[m copy]];
-    m.startTime = 3; m.number = notenum+1;
-    [track1 addNote:[m copy]];
-    m.startTime = 15; m.number = notenum+2;
-    [track1 addNote:[m copy]];
-    m.startTime = 22; m.number = notenum+3;
-    [track1 addNote:[m copy]];
-    m.startTime = 62; m.number = notenum+4;
-    [track1 addNote:[m copy]];
+    [track1 addNote:0 channel:0 number:notenum duration:duration];
+    [track1 addNote:3 channel:0 number:notenum+1 duration:duration];
+    [track1 addNote:15 channel:0 number:notenum+2 duration:duration];
+    [track1 addNote:22 channel:0 number:notenum+3 duration:duration];
+    [track1 addNote:62 channel:0 number:notenum+4 duration:duration];
 
     MidiTrack *track2 = [[MidiTrack alloc] initWithTrack:1];
 
-    m.startTime = 2; m.number = notenum+10;
-    [track2 addNote:[m copy]];
-    m.startTime = 10; m.number = notenum+11;
-    [track2 addNote:[m copy]];
-    m.startTime = 20; m.number = notenum+12;
-    [track2 addNote:[m copy]];
-    m.startTime = 35; m.number = notenum+13;
-    [track2 addNote:[m copy]];
-    m.startTime = 36; m.number = notenum+14;
-    [track2 addNote:[m copy]];
+    [track2 addNote:2 channel:0 number:notenum+10 duration:duration];
+    [track2 addNote:10 channel:0 number:notenum+11 duration:duration];
+    [track2 addNote:20 channel:0 number:notenum+12 duration:duration];
+    [track2 addNote:35 channel:0 number:notenum+13 duration:duration];
+    [track2 addNote:36 channel:0 number:notenum+14 duration:duration];
 
     [tracks add:track1];
     [tracks add:track2];
@@ -1441,38 +1702,37 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
      * 62              is still 62
      */
     [MidiFile roundStartTimes:tracks toInterval:60 withTime:time];
-    Array* notes1 = ((MidiTrack *)[tracks get:0]).notes;
-    Array* notes2 = ((MidiTrack *)[tracks get:1]).notes;
+    NoteArray *notes1 = ((MidiTrack *)[tracks get:0]).notes;
+    NoteArray *notes2 = ((MidiTrack *)[tracks get:1]).notes;
     STAssertTrue([notes1 count] == 5, @"");
     STAssertTrue([notes2 count] == 5, @"");
 
-    STAssertTrue([notes1 getNote:0].number == notenum, @"");
-    STAssertTrue([notes1 getNote:1].number == notenum+1, @"");
-    STAssertTrue([notes1 getNote:2].number == notenum+2, @"");
-    STAssertTrue([notes1 getNote:3].number == notenum+3, @"");
-    STAssertTrue([notes1 getNote:4].number == notenum+4, @"");
-
-    STAssertTrue([notes2 getNote:0].number == notenum+10, @"");
-    STAssertTrue([notes2 getNote:1].number == notenum+11, @"");
-    STAssertTrue([notes2 getNote:2].number == notenum+12, @"");
-    STAssertTrue([notes2 getNote:3].number == notenum+13, @"");
-    STAssertTrue([notes2 getNote:4].number == notenum+14, @"");
-
-
-    STAssertTrue([notes1 getNote:0].startTime == 0, @"");
-    STAssertTrue([notes1 getNote:1].startTime == 0, @"");
-    STAssertTrue([notes1 getNote:2].startTime == 0, @"");
-    STAssertTrue([notes1 getNote:3].startTime == 20, @"");
-    STAssertTrue([notes1 getNote:3].startTime == 20, @"");
-    STAssertTrue([notes1 getNote:4].startTime == 62, @"");
-
-    STAssertTrue([notes2 getNote:0].startTime == 0, @"");
-    STAssertTrue([notes2 getNote:1].startTime == 0, @"");
-    STAssertTrue([notes2 getNote:2].startTime == 20, @"");
-    STAssertTrue([notes2 getNote:3].startTime == 20, @"");
-    STAssertTrue([notes2 getNote:4].startTime == 36, @"");
-
-    [m release];
+    STAssertTrue([notes1 number:0] == notenum, @"");
+    STAssertTrue([notes1 number:1] == notenum+1, @"");
+    STAssertTrue([notes1 number:2] == notenum+2, @"");
+    STAssertTrue([notes1 number:3] == notenum+3, @"");
+    STAssertTrue([notes1 number:4] == notenum+4, @"");
+
+    STAssertTrue([notes2 number:0] == notenum+10, @"");
+    STAssertTrue([notes2 number:1] == notenum+11, @"");
+    STAssertTrue([notes2 number:2] == notenum+12, @"");
+    STAssertTrue([notes2 number:3] == notenum+13, @"");
+    STAssertTrue([notes2 number:4] == notenum+14, @"");
+
+
+    STAssertTrue([notes1 startTime:0] == 0, @"");
+    STAssertTrue([notes1 startTime:1] == 0, @"");
+    STAssertTrue([notes1 startTime:2] == 0, @"");
+    STAssertTrue([notes1 startTime:3] == 20, @"");
+    STAssertTrue([notes1 startTime:3] == 20, @"");
+    STAssertTrue([notes1 startTime:4] == 62, @"");
+
+    STAssertTrue([notes2 startTime:0] == 0, @"");
+    STAssertTrue([notes2 startTime:1] == 0, @"");
+    STAssertTrue([notes2 startTime:2] == 20, @"");
+    STAssertTrue([notes2 startTime:3] == 20, @"");
+    STAssertTrue([notes2 startTime:4] == 36, @"");
+
     [time release];
 }
 
@@ -1484,22 +1744,12 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
  */
 - (void) testRoundDurations {
     MidiTrack *track = [[MidiTrack alloc] initWithTrack:1];
-    MidiNote *note = [MidiNote alloc];
-    note.startTime = 0;
-    note.number = 55;
-    note.duration = 45;
-    [track addNote:note];
-    [note release];
+    [track addNote:0 channel:0 number:55 duration:45];
 
     int starttimes[] = { 50, 90, 101, 123 };
     for (int i = 0; i < 4; i++) {
         int start = starttimes[i];
-        note = [MidiNote alloc];
-        note.startTime = start;
-        note.number = 55;
-        note.duration = 1;
-        [track addNote:note];
-        [note release];
+        [track addNote:start channel:0 number:55 duration:1];
     }
 
     Array* tracks = [Array new:1];
@@ -1507,18 +1757,1082 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
     int quarternote = 40;
     [MidiFile roundDurations:tracks withQuarter:quarternote];
 
-    STAssertTrue( [track.notes getNote:0].duration == 45, @"");
-    STAssertTrue( [track.notes getNote:1].duration == 40, @"");
-    STAssertTrue( [track.notes getNote:2].duration == 10, @"");
-    STAssertTrue( [track.notes getNote:3].duration == 20, @"");
-    STAssertTrue( [track.notes getNote:4].duration == 1, @"");
+    STAssertTrue( [track.notes duration:0] == 45, @"");
+    STAssertTrue( [track.notes duration:1] == 40, @"");
+    STAssertTrue( [track.notes duration:2] == 10, @"");
+    STAssertTrue( [track.notes duration:3] == 20, @"");
+    STAssertTrue( [track.notes duration:4] == 1, @"");
+
+    [track release];
+}
+
+/* Snap the notes to a grid of 4 lines per quarter note of 40 pulses.
+ * Verify that each start time moves to the nearest multiple of 10,
+ * and that the notes that snap to the same time are sorted by number.
+ */
+- (void) testSnapStartTimes {
+    MidiTrack *track = [[MidiTrack alloc] initWithTrack:1];
+    int starttimes[] = { 0, 4, 5, 14, 16, 18, 31 };
+    int numbers[] =    { 60, 62, 64, 66, 61, 59, 70 };
+    for (int i = 0; i < 7; i++) {
+        [track addNote:starttimes[i] channel:0 number:numbers[i] duration:5];
+    }
+    Array* tracks = [Array new:1];
+    [tracks add:track];
+    [MidiFile snapStartTimes:tracks withQuarter:40 toGrid:4];
+
+    int snapped[] = { 0, 0, 10, 10, 20, 20, 30 };
+    int sorted[] =  { 60, 62, 64, 66, 59, 61, 70 };
+    for (int i = 0; i < 7; i++) {
+        STAssertTrue([track.notes startTime:i] == snapped[i], @"");
+        STAssertTrue([track.notes number:i] == sorted[i], @"");
+    }
+    [track release];
+}
+
+/* Snap the notes to a triplet grid, with 3 lines per quarter note of
+ * 100 pulses.  Verify that the grid lines are rounded one at a time
+ * (0, 33, 67, 100, ...), so a note near measure 2 still lands on 600,
+ * and that the notes with the same number that snap to the same time
+ * are merged, keeping the longest duration.
+ */
+- (void) testSnapTriplets {
+    MidiTrack *track = [[MidiTrack alloc] initWithTrack:1];
+    int starttimes[] = { 17, 34, 34, 66, 98, 599 };
+    int numbers[] =    { 60, 60, 62, 64, 65, 60 };
+    int durations[] =  { 10, 40, 20, 20, 20, 20 };
+    for (int i = 0; i < 6; i++) {
+        [track addNote:starttimes[i] channel:0 number:numbers[i] duration:durations[i]];
+    }
+    Array* tracks = [Array new:1];
+    [tracks add:track];
+    [MidiFile snapStartTimes:tracks withQuarter:100 toGrid:3];
+
+    int snapped[] =  { 33, 33, 67, 100, 600 };
+    int merged[] =   { 60, 62, 64, 65, 60 };
+    int longest[] =  { 40, 20, 20, 20, 20 };
+    STAssertTrue([track.notes count] == 5, @"");
+    for (int i = 0; i < 5; i++) {
+        STAssertTrue([track.notes startTime:i] == snapped[i], @"");
+        STAssertTrue([track.notes number:i] == merged[i], @"");
+        STAssertTrue([track.notes duration:i] == longest[i], @"");
+    }
+    [track release];
+}
+
+/* Create a Midi File in 3/4 time without a time signature event, with
+ * a 3 note chord on the first beat of every measure and single notes
+ * on the other beats.  A quarter note is 120 pulses, so the measure is
+ * 360 pulses.  Verify that 360 is ranked first, with full confidence,
+ * and that a single beat has a lower confidence.
+ */
+- (void) testGuessMeasureLength {
+    int nummeasures = 40;
+    int tracklen = nummeasures * 40 + 4;
+    int len = 22 + tracklen;
+    u_char *data = (u_char*) malloc(len);
+    u_char header[] = {
+        77, 84, 104, 100, 0, 0, 0, 6, 0, 1, 0, 1, 0, 120,
+        77, 84, 114, 107,
+        0, 0, (u_char)(tracklen >> 8), (u_char)(tracklen & 0xFF)
+    };
+    memcpy(data, header, 22);
+    int offset = 22;
+    for (int m = 0; m < nummeasures; m++) {
+        u_char measure[] = {
+            (m == 0) ? 0 : 60, EventNoteOn, 48, 80,
+            0, EventNoteOn, 52, 80,
+            0, EventNoteOn, 55, 80,
+            60, EventNoteOff, 48, 0,
+            0, EventNoteOff, 52, 0,
+            0, EventNoteOff, 55, 0,
+            60, EventNoteOn, 64, 80,
+            60, EventNoteOff, 64, 0,
+            60, EventNoteOn, 67, 80,
+            60, EventNoteOff, 67, 0
+        };
+        memcpy(&data[offset], measure, 40);
+        offset += 40;
+    }
+    u_char endtrack[] = { 0, MetaEvent, MetaEventEndOfTrack, 0 };
+    memcpy(&data[offset], endtrack, 4);
+    offset += 4;
+    assert(offset == len);
+    writeTestFile(data, len);
+    free(data);
+
+    MidiFile *midifile = [[MidiFile alloc] initWithFile:testfile];
+    IntArray *sorted = [midifile guessMeasureLength];
+    IntArray *confidence = [IntArray new:8];
+    IntArray *lengths = [midifile guessMeasureLengthWithConfidence:confidence];
+    STAssertTrue([sorted count] == 8, @"");
+    STAssertTrue([lengths count] == 8, @"");
+    STAssertTrue([confidence count] == 8, @"");
+    for (int i = 0; i < 8; i++) {
+        STAssertTrue([sorted get:i] == 120 * (i+1), @"");
+    }
+    STAssertTrue([lengths get:0] == 360, @"");
+    STAssertTrue([confidence get:0] == 100, @"");
+    STAssertTrue([lengths get:1] == 720, @"");
+    for (int i = 1; i < 8; i++) {
+        STAssertTrue([confidence get:i] <= [confidence get:(i-1)], @"");
+        if ([lengths get:i] == 120) {
+            STAssertTrue([confidence get:i] < 80, @"");
+        }
+    }
+    [midifile release];
+    unlink(ctestfile);
+}
+
+/* Create a large single track Midi file, with the given number of
+ * notes, and a lyric event every 8 notes.  Return the file length.
+ */
+static int writeLargeTestFile(int numnotes) {
+    int tracklen = numnotes * 8 + (numnotes / 8) * 8 + 4;
+    int len = 22 + tracklen;
+    u_char *data = (u_char*) malloc(len);
+    u_char header[] = {
+        77, 84, 104, 100, 0, 0, 0, 6, 0, 1, 0, 1, 0, 120,
+        77, 84, 114, 107,
+        (u_char)(tracklen >> 24), (u_char)(tracklen >> 16),
+        (u_char)(tracklen >> 8), (u_char)tracklen
+    };
+    memcpy(data, header, 22);
+    int offset = 22;
+    for (int i = 0; i < numnotes; i++) {
+        if (i % 8 == 0) {
+            u_char lyric[] = { 0, MetaEvent, MetaEventLyric, 4, 'l', 'a', 'l', 'a' };
+            memcpy(&data[offset], lyric, 8);
+            offset += 8;
+        }
+        u_char notes[] = { 0, EventNoteOn, 40 + i % 40, 80,
+                           10, EventNoteOff, 40 + i % 40, 0 };
+        memcpy(&data[offset], notes, 8);
+        offset += 8;
+    }
+    u_char endtrack[] = { 0, MetaEvent, MetaEventEndOfTrack, 0 };
+    memcpy(&data[offset], endtrack, 4);
+    offset += 4;
+    assert(offset == len);
+    writeTestFile(data, len);
+    free(data);
+    return len;
+}
+
+/* Parse a Midi file that is memory mapped, and one read into
+ * a malloc'ed buffer.  Verify both give the same notes and lyrics,
+ * and that the mapped lyrics point into the mapped data.
+ */
+- (void) testMappedRead {
+    int numnotes = 2000;
+    int filelen = writeLargeTestFile(numnotes);
+
+    MidiFileReader *reader = [[MidiFileReader alloc] initWithFile:testfile andMap:NO];
+    MidiFile *copied = [[MidiFile alloc] initWithReader:reader andFilename:testfile];
+    reader = [[MidiFileReader alloc] initWithFile:testfile andMap:YES];
+    u_char *mapstart = (u_char*)[reader readBytesNoCopy:0];
+    MidiFile *mapped = [[MidiFile alloc] initWithReader:reader andFilename:testfile];
+
+    MidiTrack *track1 = [copied.tracks get:0];
+    MidiTrack *track2 = [mapped.tracks get:0];
+    STAssertTrue([track1.notes count] == numnotes, @"");
+    STAssertTrue([track2.notes count] == numnotes, @"");
+    for (int i = 0; i < numnotes; i++) {
+        STAssertTrue([track1.notes startTime:i] == [track2.notes startTime:i], @"");
+        STAssertTrue([track1.notes number:i] == [track2.notes number:i], @"");
+        STAssertTrue([track1.notes duration:i] == [track2.notes duration:i], @"");
+    }
+    STAssertTrue([track2.lyrics count] == numnotes / 8, @"");
+    MidiEvent *lyric = [track2.lyrics get:0];
+    STAssertTrue(lyric.metalength == 4, @"");
+    STAssertTrue(strncmp((char*)lyric.metavalue, "lala", 4) == 0, @"");
+    STAssertTrue(lyric.metavalue > mapstart &&
+                 lyric.metavalue < mapstart + filelen, @"");
+    [copied release];
+    [mapped release];
+    unlink(ctestfile);
+}
+
+/* Parse a track with channel events, running status, a tempo, and a
+ * sysex event into a MidiEventTable.  Verify the table columns, and
+ * the MidiEvent objects created from the table.  Then compare the
+ * memory used by the table of a large track against one MidiEvent
+ * object per event.
+ */
+- (void) testEventTable {
+    u_char data[] = {
+        77, 84, 114, 107,        /* MTrk ascii header */
+        0, 0, 0, 30,             /* Length of track, in bytes */
+        0,  EventNoteOn + 1, 60, 80,
+        10, 61, 70,              /* running status */
+        0,  EventPitchBend + 2, 0x12, 0x34,
+        0,  EventProgramChange + 3, 5,
+        0,  MetaEvent, MetaEventTempo, 3, 0x07, 0xA1, 0x20,
+        5,  SysexEvent1, 2, 0x7E, 0xF7,
+        0,  MetaEvent, MetaEventEndOfTrack, 0
+    };
+    MidiFile *midifile = [[MidiFile alloc] init];
+    MidiFileReader *reader = [[MidiFileReader alloc] initWithBytes:data length:sizeof(data)];
+    MidiEventTable *table = [midifile readTrack:reader];
+    [reader release];
+
+    STAssertTrue([table count] == 7, @"");
+    STAssertTrue([table eventFlag:0] == EventNoteOn, @"");
+    STAssertTrue([table channel:0] == 1, @"");
+    STAssertTrue([table hasEventflag:0] == YES, @"");
+    STAssertTrue([table eventFlag:1] == EventNoteOn, @"");
+    STAssertTrue([table hasEventflag:1] == NO, @"");
+    STAssertTrue([table startTime:1] == 10, @"");
+    STAssertTrue([table deltaTime:1] == 10, @"");
+    STAssertTrue([table data1:1] == 61 && [table data2:1] == 70, @"");
+    STAssertTrue([table tempo:4] == 500000, @"");
+    STAssertTrue([table metalength:5] == 2, @"");
+    STAssertTrue([table metavalue:5] == &data[32], @"");
+    STAssertTrue([table startTime:5] == 15, @"");
+    STAssertTrue([table metaevent:6] == MetaEventEndOfTrack, @"");
+
+    MidiEvent *mevent = [table get:2];
+    STAssertTrue(mevent.eventFlag == EventPitchBend, @"");
+    STAssertTrue(mevent.channel == 2, @"");
+    STAssertTrue(mevent.pitchBend == 0x1234, @"");
+    mevent = [table get:3];
+    STAssertTrue(mevent.eventFlag == EventProgramChange, @"");
+    STAssertTrue(mevent.instrument == 5, @"");
+    mevent = [table get:4];
+    STAssertTrue(mevent.metaevent == MetaEventTempo, @"");
+    STAssertTrue(mevent.tempo == 500000, @"");
+    mevent = [table get:5];
+    STAssertTrue(mevent.eventFlag == SysexEvent1, @"");
+    STAssertTrue(mevent.deltaTime == 5, @"");
+    STAssertTrue(mevent.metalength == 2 && mevent.metavalue[0] == 0x7E, @"");
+
+    int numnotes = 2000;
+    writeLargeTestFile(numnotes);
+    reader = [[MidiFileReader alloc] initWithFile:testfile];
+    [reader skip:14];
+    table = [midifile readTrack:reader];
+    [reader release];
+    unlink(ctestfile);
+
+    int events = [table count];
+    STAssertTrue(events == numnotes * 2 + numnotes / 8 + 1, @"");
+    long tablebytes = [table memoryUsed];
+    long objectbytes = (long)events * (class_getInstanceSize([MidiEvent class]) + sizeof(id));
+    STAssertTrue(tablebytes * 4 < objectbytes, @"");
+    [midifile release];
+}
+
+/* Create a Midi File with 48 tracks, where track i has 100 notes of
+ * number 20+i.  The tracks are parsed in parallel.  Verify that the
+ * tracks are returned in order, with the correct notes.
+ */
+- (void) testManyTracks {
+    int numtracks = 48;
+    int numnotes = 100;
+    int tracklen = numnotes * 8 + 4;
+    int len = 14 + numtracks * (8 + tracklen);
+    NSMutableData *nsdata = [NSMutableData dataWithLength:len];
+    u_char *data = (u_char*)[nsdata mutableBytes];
+
+    u_char header[] = { 77, 84, 104, 100, 0, 0, 0, 6, 0, 1, 0, numtracks, 0, 120 };
+    memcpy(data, header, 14);
+    int offset = 14;
+    for (int tracknum = 0; tracknum < numtracks; tracknum++) {
+        u_char trackheader[] = { 77, 84, 114, 107,
+                                 0, 0, (u_char)(tracklen >> 8), (u_char)(tracklen & 0xFF) };
+        memcpy(&data[offset], trackheader, 8);
+        offset += 8;
+        for (int i = 0; i < numnotes; i++) {
+            u_char notes[] = { 0, EventNoteOn, 20 + tracknum, 80,
+                               10, EventNoteOff, 20 + tracknum, 0 };
+            memcpy(&data[offset], notes, 8);
+            offset += 8;
+        }
+        u_char endtrack[] = { 0, MetaEvent, MetaEventEndOfTrack, 0 };
+        memcpy(&data[offset], endtrack, 4);
+        offset += 4;
+    }
+    STAssertTrue(offset == len, @"");
+
+    MidiFile *midifile = [[MidiFile alloc] initWithData:nsdata andFilename:testfile];
+    STAssertTrue([midifile.tracks count] == numtracks, @"");
+    for (int tracknum = 0; tracknum < numtracks; tracknum++) {
+        MidiTrack *track = [midifile.tracks get:tracknum];
+        STAssertTrue(track.number == tracknum, @"");
+        STAssertTrue([track.notes count] == numnotes, @"");
+        for (int i = 0; i < numnotes; i++) {
+            STAssertTrue([track.notes number:i] == 20 + tracknum, @"");
+            STAssertTrue([track.notes startTime:i] == i * 10, @"");
+            STAssertTrue([track.notes duration:i] == 10, @"");
+        }
+    }
+    [midifile release];
+}
+
+/* Stream the events and notes of a large Midi file.  Verify that the
+ * streamed notes and guessed key match the parsed MidiFile, and that
+ * setting stop ends the enumeration.
+ */
+- (void) testEventStream {
+    int numnotes = 4000;
+    writeLargeTestFile(numnotes);
+    MidiFile *midifile = [[MidiFile alloc] initWithFile:testfile];
+    MidiEventStream *stream = [[MidiEventStream alloc] initWithFile:testfile];
+    unlink(ctestfile);
+
+    STAssertTrue(stream.numtracks == 1, @"");
+    STAssertTrue(stream.quarternote == 120, @"");
+
+    __block int eventcount = 0;
+    __block int lyriccount = 0;
+    [stream enumerateEvents:^(const MidiRawEvent *event, BOOL *stop) {
+        eventcount++;
+        if (event->metaevent == MetaEventLyric) {
+            STAssertTrue(event->metalength == 4, @"");
+            STAssertTrue(strncmp((char*)event->metavalue, "lala", 4) == 0, @"");
+            lyriccount++;
+        }
+    }];
+    STAssertTrue(eventcount == numnotes * 2 + numnotes / 8 + 1, @"");
+    STAssertTrue(lyriccount == numnotes / 8, @"");
+
+    MidiTrack *track = [midifile.tracks get:0];
+    __block int notecount = 0;
+    [stream enumerateNotes:^(int tracknum, int channel, int number,
+                             int starttime, int duration, BOOL *stop) {
+        STAssertTrue(tracknum == 0, @"");
+        STAssertTrue([track.notes number:notecount] == number, @"");
+        STAssertTrue([track.notes startTime:notecount] == starttime, @"");
+        STAssertTrue([track.notes duration:notecount] == duration, @"");
+        notecount++;
+    }];
+    STAssertTrue(notecount == numnotes, @"");
+
+    IntArray *notenums = [IntArray new:numnotes];
+    for (int i = 0; i < numnotes; i++) {
+        [notenums add:[track.notes number:i]];
+    }
+    KeySignature *key1 = [KeySignature guess:notenums];
+    KeySignature *key2 = [stream guessKey];
+    STAssertTrue([key1 equals:key2], @"");
+
+    __block int stopcount = 0;
+    [stream enumerateEvents:^(const MidiRawEvent *event, BOOL *stop) {
+        stopcount++;
+        if (stopcount == 10) {
+            *stop = YES;
+        }
+    }];
+    STAssertTrue(stopcount == 10, @"");
+
+    [stream release];
+    [midifile release];
+}
+
+/* Verify that each NoteOff matches the most recent unmatched NoteOn
+ * with the same channel and number, including notes that end when
+ * they start.  Then create a track with 20,000 notes, where 1000
+ * notes are held from the start until after all the other notes.
+ * Verify the durations.
+ */
+- (void) testNoteOffMatching {
+    MidiEventTable *table = [MidiEventTable new:10 withReader:nil];
+    [table addEvent:0  status:EventNoteOn  data1:60 data2:80 hasFlag:YES];
+    [table addEvent:10 status:EventNoteOn  data1:60 data2:80 hasFlag:YES];
+    [table addEvent:20 status:EventNoteOff data1:60 data2:0  hasFlag:YES];
+    [table addEvent:30 status:EventNoteOn  data1:60 data2:0  hasFlag:YES];
+    [table addEvent:35 status:EventNoteOn  data1:62 data2:80 hasFlag:YES];
+    [table addEvent:35 status:EventNoteOff data1:62 data2:0  hasFlag:YES];
+    [table addEvent:38 status:EventNoteOff data1:62 data2:0  hasFlag:YES];
+    MidiTrack *track = [[MidiTrack alloc] initWithEvents:table andTrack:0];
+    STAssertTrue([track.notes count] == 3, @"");
+    STAssertTrue([track.notes duration:0] == 30, @"");
+    STAssertTrue([track.notes duration:1] == 10, @"");
+    STAssertTrue([track.notes duration:2] == 3, @"");
+    [track release];
+
+    int held = 1000;
+    int numnotes = 20000;
+    table = [MidiEventTable new:(numnotes * 2) withReader:nil];
+    for (int i = 0; i < held; i++) {
+        [table addEvent:0 status:(EventNoteOn + i % 16) data1:(i / 16)
+                  data2:80 hasFlag:YES];
+    }
+    int time = 0;
+    for (int i = held; i < numnotes; i++) {
+        int channel = i % 16;
+        int notenum = (i / 16) % 128;
+        time++;
+        [table addEvent:time status:(EventNoteOn + channel) data1:notenum
+                  data2:80 hasFlag:YES];
+        [table addEvent:(time+1) status:(EventNoteOff + channel) data1:notenum
+                  data2:0 hasFlag:YES];
+    }
+    int endtime = time + 10;
+    for (int i = 0; i < held; i++) {
+        [table addEvent:endtime status:(EventNoteOff + i % 16) data1:(i / 16)
+                  data2:0 hasFlag:YES];
+    }
 
+    track = [[MidiTrack alloc] initWithEvents:table andTrack:0];
+
+    STAssertTrue([track.notes count] == numnotes, @"");
+    for (int i = 0; i < held; i++) {
+        STAssertTrue([track.notes duration:i] == endtime, @"");
+    }
+    for (int i = held; i < numnotes; i++) {
+        STAssertTrue([track.notes duration:i] == 1, @"");
+    }
     [track release];
 }
 
+/* Create a Midi File with lyrics, and tempo and time signature changes.
+ * Parse it twice with an empty ScoreCache.  Verify that
+ * - The first parse stores an entry in the cache.
+ * - The second parse, loaded from the cache, has the same notes,
+ *   lyrics, time signature, tempo map and measure map.
+ * - The raw midi events are parsed when they're needed.
+ */
+- (void) testScoreCache {
+    u_char data[] = {
+        77, 84, 104, 100,        /* MThd ascii header */
+        0, 0, 0, 6,              /* length of header in bytes */
+        0, 1,                    /* one or more simultaneous tracks */
+        0, 1,                    /* number of tracks */
+        0, 240,                  /* quarter note */
+        77, 84, 114, 107,        /* MTrk ascii header */
+        0, 0, 0, 54,             /* Length of track, in bytes */
+
+        0,  MetaEvent, MetaEventTimeSignature, 4, 3, 2, 24, 8,
+        0,  MetaEvent, MetaEventTempo, 3, 0x07, 0xA1, 0x20,
+        0,  EventNoteOn,  60, 80,
+        0,  MetaEvent, MetaEventLyric, 2, 'L', 'a',
+        0x81, 0x70, EventNoteOff, 60, 0,
+        0,  MetaEvent, MetaEventTempo, 3, 0x0F, 0x42, 0x40,
+        0,  MetaEvent, MetaEventTimeSignature, 4, 2, 2, 24, 8,
+        0,  EventNoteOn,  62, 80,
+        0x85, 0x50, EventNoteOff, 62, 0
+    };
+
+    NSString *dir = [NSTemporaryDirectory() stringByAppendingPathComponent:
+                     [NSString stringWithFormat:@"ScoreCacheTest%d", getpid()]];
+    ScoreCache *cache = [[ScoreCache alloc] initWithDirectory:dir];
+    NSData *nsdata = [NSData dataWithBytes:data length:sizeof(data)];
+    NSString *key = [ScoreCache keyForBytes:data length:sizeof(data)];
+    STAssertTrue([cache readerForKey:key] == nil, @"");
+
+    MidiFileReader *reader = [[MidiFileReader alloc] initWithData:nsdata];
+    MidiFile *cold = [[MidiFile alloc] initWithReader:reader andFilename:testfile
+                                             andCache:cache];
+    MidiFileReader *entry = [cache readerForKey:key];
+    STAssertTrue(entry != nil, @"");
+    [entry release];
+
+    reader = [[MidiFileReader alloc] initWithData:nsdata];
+    MidiFile *warm = [[MidiFile alloc] initWithReader:reader andFilename:testfile
+                                             andCache:cache];
+
+    STAssertTrue(warm.time.numerator == 3, @"");
+    STAssertTrue(warm.time.denominator == 4, @"");
+    STAssertTrue(warm.time.tempo == 500000, @"");
+    STAssertTrue(warm.totalpulses == cold.totalpulses, @"");
+
+    STAssertTrue(warm.tempomap.count == 2, @"");
+    STAssertTrue([warm.tempomap pulseAtSegment:1] == 240, @"");
+    STAssertTrue([warm.tempomap tempoAtSegment:1] == 1000000, @"");
+    STAssertTrue([warm.tempomap microsForPulse:480] ==
+                 [cold.tempomap microsForPulse:480], @"");
+
+    STAssertTrue(warm.measuremap.count == 2, @"");
+    STAssertTrue([warm.measuremap pulseAtSegment:1] == 240, @"");
+    STAssertTrue([warm.measuremap timeAtSegment:1].numerator == 2, @"");
+    STAssertTrue([warm.measuremap startOfMeasure:3] ==
+                 [cold.measuremap startOfMeasure:3], @"");
+
+    STAssertTrue([warm.tracks count] == 1, @"");
+    MidiTrack *track1 = [cold.tracks get:0];
+    MidiTrack *track2 = [warm.tracks get:0];
+    STAssertTrue(track1.number == track2.number, @"");
+    STAssertTrue(track1.instrument == track2.instrument, @"");
+    STAssertTrue([track2.notes count] == 2, @"");
+    for (int i = 0; i < [track1.notes count]; i++) {
+        STAssertTrue([track1.notes startTime:i] == [track2.notes startTime:i], @"");
+        STAssertTrue([track1.notes duration:i] == [track2.notes duration:i], @"");
+        STAssertTrue([track1.notes number:i] == [track2.notes number:i], @"");
+        STAssertTrue([track1.notes channel:i] == [track2.notes channel:i], @"");
+    }
+    STAssertTrue([track2.lyrics count] == 1, @"");
+    MidiEvent *lyric = [track2.lyrics get:0];
+    STAssertTrue(lyric.startTime == 0, @"");
+    STAssertTrue(lyric.metalength == 2, @"");
+    STAssertTrue(strncmp((char*)lyric.metavalue, "La", 2) == 0, @"");
+
+    /* The raw events are parsed on demand */
+    STAssertTrue([[warm events] count] == 1, @"");
+    MidiEventTable *table1 = [[cold events] get:0];
+    MidiEventTable *table2 = [[warm events] get:0];
+    STAssertTrue([table1 count] == [table2 count], @"");
+    STAssertTrue([warm.tracks count] == 1, @"");
+
+    [cold release];
+    [warm release];
+    [cache release];
+    [[NSFileManager defaultManager] removeItemAtPath:dir error:NULL];
+}
+
+/* Create a Midi File with 3 notes, where each note ends with a
+ * NoteOn event with velocity 0.  Write it back with running status.
+ * Verify that
+ * - The repeated NoteOn event codes are left out.
+ * - The new file has the same notes.
+ */
+- (void) testRunningStatus {
+    u_char notenum = 60;
+    u_char velocity = 80;
+
+    u_char data[] = {
+        77, 84, 104, 100,        /* MThd ascii header */
+        0, 0, 0, 6,              /* length of header in bytes */
+        0, 1,                    /* one or more simultaneous tracks */
+        0, 1,                    /* number of tracks */
+        0, 240,                  /* quarter note */
+        77, 84, 114, 107,        /* MTrk ascii header */
+        0, 0, 0, 24,             /* Length of track, in bytes */
+
+        /* time_interval, NoteEvent, note number, velocity */
+        0,  EventNoteOn, notenum,   velocity,
+        60, EventNoteOn, notenum,   0,
+        0,  EventNoteOn, notenum+1, velocity,
+        30, EventNoteOn, notenum+1, 0,
+        0,  EventNoteOn, notenum+2, velocity,
+        90, EventNoteOn, notenum+2, 0
+    };
+
+    writeTestFile(data, sizeof(data));
+    MidiFile *midifile = [[MidiFile alloc] initWithFile:testfile];
+    BOOL ret = [MidiFile writeToFile:testfile withEvents:[midifile events]
+                             andMode:1 andQuarter:240 runningStatus:YES];
+    STAssertTrue(ret == YES, @"");
+
+    MidiFileReader *reader = [[MidiFileReader alloc] initWithFile:testfile];
+    STAssertTrue([reader length] == sizeof(data) - 5, @"");
+    [reader release];
+
+    MidiFile *newmidi = [[MidiFile alloc] initWithFile:testfile];
+    unlink(ctestfile);
+    MidiTrack *track1 = [midifile.tracks get:0];
+    MidiTrack *track2 = [newmidi.tracks get:0];
+    STAssertTrue([track2.notes count] == 3, @"");
+    for (int i = 0; i < 3; i++) {
+        STAssertTrue([track1.notes startTime:i] ==
+                     [track2.notes startTime:i], @"");
+        STAssertTrue([track1.notes number:i] ==
+                     [track2.notes number:i], @"");
+        STAssertTrue([track1.notes duration:i] ==
+                     [track2.notes duration:i], @"");
+    }
+    [midifile release];
+    [newmidi release];
+}
+
+/* Create the seek checkpoints of a track, with a checkpoint every
+ * 2 measures of 100 pulses.  Verify the state of the channels (the
+ * controllers, instrument and pitch bend) and the tempo at several
+ * times, and the index of the first event after each time.
+ */
+- (void) testSeekCheckpoints {
+    MidiEventTable *table = [MidiEventTable new:10 withReader:nil];
+    [table addEvent:0   status:EventControlChange data1:7 data2:100 hasFlag:YES];
+    [table addEvent:50  status:EventProgramChange data1:5 data2:0 hasFlag:YES];
+    [table addEvent:150 status:EventNoteOn data1:60 data2:80 hasFlag:YES];
+    [table addEvent:250 status:EventControlChange data1:7 data2:90 hasFlag:YES];
+    [table addEvent:300 status:(EventPitchBend+1) data1:0x20 data2:0x40 hasFlag:YES];
+    [table addEvent:450 status:EventControlChange data1:7 data2:80 hasFlag:YES];
+    [table addEvent:500 status:EventNoteOn data1:60 data2:0 hasFlag:YES];
+
+    MeasureMap *map = [[MeasureMap alloc] initWithMeasure:100];
+    SeekCheckpoints *seek = [[SeekCheckpoints alloc] initWithEvents:table
+                                andMeasures:map interval:2];
+    STAssertTrue(seek.count == 3, @"");
+    STAssertTrue([seek pulseAtCheckpoint:1] == 200, @"");
+    STAssertTrue([seek pulseAtCheckpoint:2] == 400, @"");
+
+    ChannelState channels[16];
+    int tempo = -1;
+    int index = [seek stateAtTime:0 channels:channels tempo:&tempo];
+    STAssertTrue(index == 0, @"");
+    STAssertTrue(tempo == 0, @"");
+    STAssertTrue(channels[0].controllers[7] == StateUnset, @"");
+    STAssertTrue(channels[0].program == StateUnset, @"");
+
+    index = [seek stateAtTime:260 channels:channels tempo:&tempo];
+    STAssertTrue(index == 4, @"");
+    STAssertTrue(channels[0].controllers[7] == 90, @"");
+    STAssertTrue(channels[0].program == 5, @"");
+    STAssertTrue(channels[1].pitchbend == PitchBendUnset, @"");
+
+    index = [seek stateAtTime:460 channels:channels tempo:&tempo];
+    STAssertTrue(index == 6, @"");
+    STAssertTrue(channels[0].controllers[7] == 80, @"");
+    STAssertTrue(channels[0].program == 5, @"");
+    STAssertTrue(channels[1].pitchbend == 0x2040, @"");
+    STAssertTrue(channels[2].program == StateUnset, @"");
+
+    [seek release];
+    [map release];
+}
+
+/* Reload a midi file where a track was inserted, one track was
+ * changed, and one track was moved but not changed.  The unchanged
+ * track should be copied from the previous MidiFile, with its meta
+ * values pointing into the new data.  The other tracks are parsed.
+ */
+- (void)testIncrementalReload {
+    u_char olddata[] = {
+        77, 84, 104, 100,        /* MThd ascii header */
+        0, 0, 0, 6,              /* length of header in bytes */
+        0, 1,                    /* one or more simultaneous tracks */
+        0, 2,                    /* number of tracks */
+        0, 240,                  /* quarter note */
+
+        77, 84, 114, 107,        /* MTrk ascii header */
+        0, 0, 0, 25,             /* Length of track, in bytes */
+        0,  MetaEvent, MetaEventTempo, 3, 0x07, 0xA1, 0x20,
+        0,  MetaEvent, MetaEventLyric, 2, 'L', 'a',
+        0,  EventNoteOn,  60, 80,
+        60, EventNoteOff, 60, 0,
+        0,  MetaEvent, MetaEventEndOfTrack, 0,
+
+        77, 84, 114, 107,        /* MTrk ascii header */
+        0, 0, 0, 12,             /* Length of track, in bytes */
+        0,  EventNoteOn,  62, 80,
+        60, EventNoteOff, 62, 0,
+        0,  MetaEvent, MetaEventEndOfTrack, 0
+    };
+    u_char newdata[] = {
+        77, 84, 104, 100,        /* MThd ascii header */
+        0, 0, 0, 6,              /* length of header in bytes */
+        0, 1,                    /* one or more simultaneous tracks */
+        0, 3,                    /* number of tracks */
+        0, 240,                  /* quarter note */
+
+        77, 84, 114, 107,        /* MTrk ascii header (inserted) */
+        0, 0, 0, 12,             /* Length of track, in bytes */
+        0,  EventNoteOn,  67, 80,
+        30, EventNoteOff, 67, 0,
+        0,  MetaEvent, MetaEventEndOfTrack, 0,
+
+        77, 84, 114, 107,        /* MTrk ascii header (unchanged) */
+        0, 0, 0, 25,             /* Length of track, in bytes */
+        0,  MetaEvent, MetaEventTempo, 3, 0x07, 0xA1, 0x20,
+        0,  MetaEvent, MetaEventLyric, 2, 'L', 'a',
+        0,  EventNoteOn,  60, 80,
+        60, EventNoteOff, 60, 0,
+        0,  MetaEvent, MetaEventEndOfTrack, 0,
+
+        77, 84, 114, 107,        /* MTrk ascii header (changed) */
+        0, 0, 0, 12,             /* Length of track, in bytes */
+        0,  EventNoteOn,  64, 80,
+        90, EventNoteOff, 64, 0,
+        0,  MetaEvent, MetaEventEndOfTrack, 0
+    };
+
+    NSData *nsdata = [NSData dataWithBytes:olddata length:sizeof(olddata)];
+    MidiFileReader *reader = [[MidiFileReader alloc] initWithData:nsdata];
+    MidiFile *oldfile = [[MidiFile alloc] initWithReader:reader andFilename:testfile];
+    nsdata = [NSData dataWithBytes:newdata length:sizeof(newdata)];
+    reader = [[MidiFileReader alloc] initWithData:nsdata];
+    MidiFile *newfile = [[MidiFile alloc] initWithReader:reader andFilename:testfile
+                                             andPrevious:oldfile];
+    STAssertTrue([[newfile events] count] == 3, @"");
+    STAssertTrue([newfile.tracks count] == 3, @"");
+
+    /* The unchanged track shares its notes with the previous file */
+    MidiTrack *oldtrack = [oldfile.tracks get:0];
+    MidiTrack *track = [newfile.tracks get:1];
+    STAssertTrue(track.number == 1, @"");
+    STAssertTrue(track.notes == oldtrack.notes, @"");
+    STAssertTrue([track.lyrics count] == 1, @"");
+    MidiEvent *lyric = [track.lyrics get:0];
+    STAssertTrue(lyric.metavalue == (u_char*)[nsdata bytes] + 22 + 20 + 11, @"");
+    STAssertTrue(strncmp((char*)lyric.metavalue, "La", 2) == 0, @"");
+
+    MidiEventTable *table = [[newfile events] get:1];
+    STAssertTrue([table count] == 5, @"");
+    STAssertTrue([table tempo:0] == 500000, @"");
+    STAssertTrue([table metavalue:0] == (u_char*)[nsdata bytes] + 22 + 20 + 4, @"");
+    STAssertTrue(newfile.time.tempo == 500000, @"");
+
+    /* The inserted and changed tracks are parsed */
+    track = [newfile.tracks get:0];
+    STAssertTrue(track.number == 0, @"");
+    STAssertTrue([track.notes number:0] == 67, @"");
+    track = [newfile.tracks get:2];
+    STAssertTrue(track.number == 2, @"");
+    STAssertTrue(track.notes != [(MidiTrack*)[oldfile.tracks get:1] notes], @"");
+    STAssertTrue([track.notes number:0] == 64, @"");
+    STAssertTrue([track.notes duration:0] == 90, @"");
+    STAssertTrue(newfile.totalpulses == 90, @"");
+
+    [oldfile release];
+    [newfile release];
+}
+
 @end  /* MidiFileTest */
 
 
+/* Test cases for the NoteArray class */
+@interface NoteArrayTest :SenTestCase {
+}
+- (void)testNoteArray;
+@end
+
+@implementation NoteArrayTest
+
+/* Sort a NoteArray by start time and number, and verify that notes
+ * with the same start time and number keep their order.  Verify that
+ * a copy and a view see the sorted columns, and that changing the
+ * copy doesn't change the original.
+ */
+- (void)testNoteArray {
+    NoteArray *notes = [NoteArray new:2];
+    [notes addNote:20 channel:1 number:60 duration:10];
+    [notes addNote:10 channel:2 number:64 duration:20];
+    [notes addNote:10 channel:3 number:62 duration:30];
+    [notes addNote:20 channel:4 number:60 duration:40];
+    [notes addNote:0  channel:5 number:70 duration:50];
+    [notes sortByTime];
+
+    int starts[]   = { 0, 10, 10, 20, 20 };
+    int numbers[]  = { 70, 62, 64, 60, 60 };
+    int channels[] = { 5, 3, 2, 1, 4 };
+    STAssertTrue([notes count] == 5, @"");
+    for (int i = 0; i < 5; i++) {
+        STAssertTrue([notes startTime:i] == starts[i], @"");
+        STAssertTrue([notes number:i] == numbers[i], @"");
+        STAssertTrue([notes channel:i] == channels[i], @"");
+        STAssertTrue([notes endTime:i] == starts[i] + channels[i] * 10, @"");
+    }
+
+    NoteView chord = [notes viewFrom:1 count:2];
+    STAssertTrue(chord.count == 2, @"");
+    STAssertTrue(chord.starttime[0] == 10 && chord.starttime[1] == 10, @"");
+    STAssertTrue(chord.number[0] == 62 && chord.number[1] == 64, @"");
+
+    NoteArray *copy = [notes copy];
+    [copy setNumber:40 index:0];
+    [copy addNote:30 channel:0 number:50 duration:10];
+    STAssertTrue([copy count] == 6, @"");
+    STAssertTrue([notes count] == 5, @"");
+    STAssertTrue([notes number:0] == 70, @"");
+    STAssertTrue([copy startTime:4] == 20 && [copy channel:4] == 4, @"");
+}
+
+@end  /* NoteArrayTest */
+
+
+/* Test cases for the radix sort functions */
+@interface RadixSortTest :SenTestCase {
+}
+- (void)testRadixSort;
+@end
+
+@implementation RadixSortTest
+
+/* Sort keys that differ in the low, middle, and high bytes, and
+ * verify the order is sorted and stable.  Sort integers that include
+ * negative values.
+ */
+- (void)testRadixSort {
+    int n = 1000;
+    uint64_t *keys = (uint64_t*) malloc(n * sizeof(uint64_t));
+    int *order = (int*) malloc(n * sizeof(int));
+    void *scratch = malloc(radixsort_scratch(n));
+    for (int i = 0; i < n; i++) {
+        keys[i] = ((uint64_t)((i * 7919) % 97) << 32) | ((i * 31) % 5);
+    }
+    radixsort_order(keys, n, order, scratch);
+    for (int i = 1; i < n; i++) {
+        uint64_t prev = keys[order[i-1]];
+        uint64_t cur = keys[order[i]];
+        STAssertTrue(prev <= cur, @"");
+        if (prev == cur) {
+            STAssertTrue(order[i-1] < order[i], @"");
+        }
+    }
+    free(keys);
+    free(order);
+    free(scratch);
+
+    IntArray *values = [IntArray new:n];
+    for (int i = 0; i < n; i++) {
+        [values add:((i * 7919) % 2001) - 1000];
+    }
+    [values add:-100000];
+    [values add:100000];
+    [values sort];
+    STAssertTrue([values get:0] == -100000, @"");
+    STAssertTrue([values get:n+1] == 100000, @"");
+    for (int i = 1; i < [values count]; i++) {
+        STAssertTrue([values get:i-1] <= [values get:i], @"");
+    }
+}
+
+@end  /* RadixSortTest */
+
+
+/* Test cases for the TempoMap class */
+@interface TempoMapTest :SenTestCase {
+}
+- (void)testConstantTempo;
+- (void)testTempoChanges;
+- (void)testTempoAtStart;
+- (void)testRoundStartTimes;
+@end
+
+@implementation TempoMapTest
+
+/* The tempo payloads used by the tests below: 500000, 250000, 1000000 */
+static u_char tempodata[] = { 0x07, 0xA1, 0x20, 0x03, 0xD0, 0x90, 0x0F, 0x42, 0x40 };
+
+/* Create a map for two tracks, with quarter note = 480 pulses.
+ * Track 0 changes the tempo to 500000 at 0, and 250000 at 960.
+ * Track 1 changes the tempo to 1000000 at 960 and 1920.
+ * The change at 960 in track 0 comes first, so the segments are
+ * (0, 500000), (960, 250000), (1920, 1000000).
+ */
+static TempoMap* createTempoMap() {
+    MidiFileReader *reader = [[MidiFileReader alloc]
+                               initWithBytes:tempodata length:sizeof(tempodata)];
+    MidiEventTable *track0 = [MidiEventTable new:4 withReader:reader];
+    MidiEventTable *track1 = [MidiEventTable new:4 withReader:reader];
+    [reader release];
+
+    [track0 addEvent:0 status:MetaEvent data1:MetaEventTempo data2:0 hasFlag:YES];
+    [track0 setPayloadOffset:0 length:3];
+    [track0 addEvent:960 status:MetaEvent data1:MetaEventTempo data2:0 hasFlag:YES];
+    [track0 setPayloadOffset:3 length:3];
+    [track0 addEvent:960 status:EventNoteOn data1:60 data2:80 hasFlag:YES];
+    [track1 addEvent:960 status:MetaEvent data1:MetaEventTempo data2:0 hasFlag:YES];
+    [track1 setPayloadOffset:6 length:3];
+    [track1 addEvent:1920 status:MetaEvent data1:MetaEventTempo data2:0 hasFlag:YES];
+    [track1 setPayloadOffset:6 length:3];
+
+    Array *events = [Array new:2];
+    [events add:track0];
+    [events add:track1];
+    TempoMap *map = [[TempoMap alloc] initWithEvents:events andTempo:500000
+                                          andQuarter:480];
+    return [map autorelease];
+}
+
+/* Test that a map with one tempo converts pulses linearly */
+- (void)testConstantTempo {
+    TempoMap *map = [[TempoMap alloc] initWithTempo:500000 andQuarter:480];
+    STAssertTrue(map.count == 1, @"");
+    STAssertTrue([map tempoAtPulse:100000] == 500000, @"");
+    STAssertTrue([map microsForPulse:0] == 0, @"");
+    STAssertTrue([map microsForPulse:480] == 500000, @"");
+    STAssertTrue([map microsForPulse:4800] == 5000000, @"");
+    STAssertTrue([map pulseForMicros:250000] == 240, @"");
+    STAssertTrue([map pulseForMicros:5000000] == 4800, @"");
+    [map release];
+}
+
+/* Test the conversions across several tempo changes.
+ * The segments start at 0, 1000000, and 1500000 microseconds.
+ */
+- (void)testTempoChanges {
+    TempoMap *map = createTempoMap();
+    STAssertTrue(map.count == 3, @"");
+    STAssertTrue([map pulseAtSegment:1] == 960, @"");
+    STAssertTrue([map pulseAtSegment:2] == 1920, @"");
+    STAssertTrue([map tempoAtPulse:959] == 500000, @"");
+    STAssertTrue([map tempoAtPulse:960] == 250000, @"");
+    STAssertTrue([map tempoAtPulse:5000] == 1000000, @"");
+
+    STAssertTrue([map microsForPulse:480] == 500000, @"");
+    STAssertTrue([map microsForPulse:960] == 1000000, @"");
+    STAssertTrue([map microsForPulse:1440] == 1250000, @"");
+    STAssertTrue([map microsForPulse:2400] == 2500000, @"");
+
+    STAssertTrue([map pulseForMicros:500000] == 480, @"");
+    STAssertTrue([map pulseForMicros:1250000] == 1440, @"");
+    STAssertTrue([map pulseForMicros:2500000] == 2400, @"");
+    for (int pulse = 0; pulse < 4000; pulse += 7) {
+        double us = [map microsForPulse:pulse];
+        STAssertTrue(fabs([map pulseForMicros:us] - pulse) < 0.001, @"");
+    }
+}
+
+/* Test that the earliest tempo change at pulse 0 replaces the
+ * starting tempo.  Track 0 changes the tempo to 250000 at 0, and
+ * track 1 changes it to 1000000 at 0 and 480.
+ */
+- (void)testTempoAtStart {
+    MidiFileReader *reader = [[MidiFileReader alloc]
+                               initWithBytes:tempodata length:sizeof(tempodata)];
+    MidiEventTable *track0 = [MidiEventTable new:4 withReader:reader];
+    MidiEventTable *track1 = [MidiEventTable new:4 withReader:reader];
+    [reader release];
+
+    [track0 addEvent:0 status:MetaEvent data1:MetaEventTempo data2:0 hasFlag:YES];
+    [track0 setPayloadOffset:3 length:3];
+    [track1 addEvent:0 status:MetaEvent data1:MetaEventTempo data2:0 hasFlag:YES];
+    [track1 setPayloadOffset:6 length:3];
+    [track1 addEvent:480 status:MetaEvent data1:MetaEventTempo data2:0 hasFlag:YES];
+    [track1 setPayloadOffset:6 length:3];
+
+    Array *events = [Array new:2];
+    [events add:track0];
+    [events add:track1];
+    TempoMap *map = [[TempoMap alloc] initWithEvents:events andTempo:500000
+                                          andQuarter:480];
+    STAssertTrue(map.count == 2, @"");
+    STAssertTrue([map tempoAtPulse:0] == 250000, @"");
+    STAssertTrue([map pulseAtSegment:1] == 480, @"");
+    STAssertTrue([map tempoAtPulse:480] == 1000000, @"");
+    STAssertTrue([map microsForPulse:480] == 250000, @"");
+    STAssertTrue([map microsForPulse:960] == 1250000, @"");
+    [map release];
+}
+
+/* Test that combining notes uses the tempo at each note.
+ * With 60 millisec, the interval is 57 pulses in the first segment,
+ * 115 pulses in the second, and 28 pulses in the third.
+ */
+- (void)testRoundStartTimes {
+    TempoMap *map = createTempoMap();
+    int starttimes[] = { 0, 50, 1000, 1100, 2000, 2040 };
+    MidiTrack *track = [[MidiTrack alloc] initWithTrack:0];
+    for (int i = 0; i < 6; i++) {
+        [track addNote:starttimes[i] channel:0 number:60 + i duration:10];
+    }
+    Array *tracks = [Array new:1];
+    [tracks add:track];
+    [track release];
+
+    [MidiFile roundStartTimes:tracks toInterval:60 withTempoMap:map];
+    int expected[] = { 0, 0, 1000, 1000, 2000, 2040 };
+    for (int i = 0; i < 6; i++) {
+        STAssertTrue([track.notes startTime:i] == expected[i], @"");
+    }
+}
+
+@end  /* TempoMapTest */
+
+
+/* Test cases for the MeasureMap class */
+@interface MeasureMapTest :SenTestCase {
+}
+- (void)testConstantMeasures;
+- (void)testSignatureChanges;
+- (void)testShiftedMap;
+@end
+
+@implementation MeasureMapTest
+
+/* The time signature payloads used below: 4/4, 3/4, 6/8 */
+static u_char timesigdata[] = { 4, 2, 24, 8,  3, 2, 24, 8,  6, 3, 24, 8 };
+
+/* Create a map with quarter note = 480 pulses.  The song starts in
+ * 4/4 (1920 pulses), changes to 3/4 (1440 pulses) at 1920, and to
+ * 6/8 (1440 pulses) at 3000, in the middle of a 3/4 measure.
+ * The measures start at 0, 1920, 3000, 4440, 5880, ...
+ */
+static MeasureMap* createMeasureMap() {
+    MidiFileReader *reader = [[MidiFileReader alloc]
+                               initWithBytes:timesigdata length:sizeof(timesigdata)];
+    MidiEventTable *track0 = [MidiEventTable new:4 withReader:reader];
+    MidiEventTable *track1 = [MidiEventTable new:4 withReader:reader];
+    [reader release];
+
+    [track0 addEvent:0 status:MetaEvent data1:MetaEventTimeSignature data2:0 hasFlag:YES];
+    [track0 setPayloadOffset:0 length:4];
+    [track0 addEvent:1920 status:MetaEvent data1:MetaEventTimeSignature data2:0 hasFlag:YES];
+    [track0 setPayloadOffset:4 length:4];
+    [track1 addEvent:3000 status:MetaEvent data1:MetaEventTimeSignature data2:0 hasFlag:YES];
+    [track1 setPayloadOffset:8 length:4];
+
+    Array *events = [Array new:2];
+    [events add:track0];
+    [events add:track1];
+    TimeSignature *time = [[TimeSignature alloc] initWithNumerator:4
+                            andDenominator:4 andQuarter:480 andTempo:500000];
+    MeasureMap *map = [[MeasureMap alloc] initWithEvents:events andTime:time];
+    [time release];
+    return [map autorelease];
+}
+
+/* Test that a map with one time signature has equal measures */
+- (void)testConstantMeasures {
+    TimeSignature *time = [[TimeSignature alloc] initWithNumerator:3
+                            andDenominator:4 andQuarter:100 andTempo:500000];
+    MeasureMap *map = [[MeasureMap alloc] initWithTime:time];
+    STAssertTrue(map.count == 1, @"");
+    for (int t = 0; t < 3000; t += 37) {
+        STAssertTrue([map measureForTime:t] == t / 300, @"");
+    }
+    STAssertTrue([map startOfMeasure:7] == 2100, @"");
+    STAssertTrue([map lengthOfMeasure:7] == 300, @"");
+    STAssertTrue([map timeAtTime:5000] == time, @"");
+    [map release];
+    [time release];
+}
+
+/* Test the measures across several time signature changes */
+- (void)testSignatureChanges {
+    MeasureMap *map = createMeasureMap();
+    STAssertTrue(map.count == 3, @"");
+    STAssertTrue([map measureForTime:1919] == 0, @"");
+    STAssertTrue([map measureForTime:1920] == 1, @"");
+    STAssertTrue([map measureForTime:2999] == 1, @"");
+    STAssertTrue([map measureForTime:3000] == 2, @"");
+    STAssertTrue([map measureForTime:4440] == 3, @"");
+
+    STAssertTrue([map startOfMeasure:0] == 0, @"");
+    STAssertTrue([map startOfMeasure:1] == 1920, @"");
+    STAssertTrue([map startOfMeasure:2] == 3000, @"");
+    STAssertTrue([map startOfMeasure:4] == 5880, @"");
+
+    STAssertTrue([map lengthOfMeasure:0] == 1920, @"");
+    STAssertTrue([map lengthOfMeasure:1] == 1080, @"");
+    STAssertTrue([map lengthOfMeasure:5] == 1440, @"");
+
+    STAssertTrue([map timeAtTime:100].numerator == 4, @"");
+    STAssertTrue([map timeAtTime:2000].numerator == 3, @"");
+    STAssertTrue([map timeAtTime:2000].denominator == 4, @"");
+    STAssertTrue([map timeAtTime:9000].numerator == 6, @"");
+    STAssertTrue([map timeAtTime:9000].denominator == 8, @"");
+
+    /* The measures cover the song without gaps */
+    for (int m = 0; m < 10; m++) {
+        STAssertTrue([map startOfMeasure:m] + [map lengthOfMeasure:m] ==
+                     [map startOfMeasure:(m+1)], @"");
+        STAssertTrue([map measureForTime:[map startOfMeasure:m]] == m, @"");
+    }
+}
+
+/* Test that shifting the map moves the time signature changes,
+ * but the song still starts at measure 0.
+ */
+- (void)testShiftedMap {
+    MeasureMap *map = createMeasureMap();
+    MeasureMap *shifted = [[MeasureMap alloc] initWithMap:map shiftedBy:100];
+    STAssertTrue(shifted.count == 3, @"");
+    STAssertTrue([shifted pulseAtSegment:0] == 0, @"");
+    STAssertTrue([shifted pulseAtSegment:1] == 2020, @"");
+    STAssertTrue([shifted pulseAtSegment:2] == 3100, @"");
+    STAssertTrue([shifted startOfMeasure:1] == 1920, @"");
+    STAssertTrue([shifted lengthOfMeasure:1] == 100, @"");
+    STAssertTrue([shifted measureForTime:2020] == 2, @"");
+    STAssertTrue([shifted timeAtTime:2020].numerator == 3, @"");
+    [shifted release];
+}
+
+@end  /* MeasureMapTest */
+
+
 /* Test cases for the KeySignature class */
 @interface KeySignatureTest :SenTestCase {
 }
@@ -1526,6 +2840,7 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
 - (void)testGetAccidental;
 - (void)testGetAccidentalSameMeasure;
 - (void)testGuess;
+- (void)testSpellNotes;
 @end
 
 @implementation KeySignatureTest
@@ -1930,6 +3245,45 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
     STAssertTrue([k num_flats] == 3, @"");
 }
 
+/* Spell random notes in each key with spellNotes, and verify the
+ * white notes and accidentals are the same as calling getWhiteNote
+ * and getAccidentalForNote for each note.  The white notes should
+ * be the shared WhiteNote objects.
+ */
+- (void) testSpellNotes {
+    MeasureMap *measures = [[MeasureMap alloc] initWithMeasure:100];
+    NoteArray *notes = [NoteArray new:500];
+    srandom(7);
+    for (int i = 0; i < 500; i++) {
+        [notes addNote:(i * 13) channel:0 number:(40 + random() % 50) duration:10];
+    }
+    NoteView view = [notes view];
+    WhiteNote *whitenotes[500];
+    int accids[500];
+
+    for (int key = 0; key < 12; key++) {
+        KeySignature *k1 = (key < 7) ?
+            [[KeySignature alloc] initWithSharps:key andFlats:0] :
+            [[KeySignature alloc] initWithSharps:0 andFlats:(key - 6)];
+        KeySignature *k2 = (key < 7) ?
+            [[KeySignature alloc] initWithSharps:key andFlats:0] :
+            [[KeySignature alloc] initWithSharps:0 andFlats:(key - 6)];
+
+        [k1 spellNotes:view withMeasures:measures whiteNotes:whitenotes accidentals:accids];
+        for (int i = 0; i < view.count; i++) {
+            int measure = view.starttime[i] / 100;
+            WhiteNote *w = [k2 getWhiteNote:view.number[i]];
+            int accid = [k2 getAccidentalForNote:view.number[i] andMeasure:measure];
+            STAssertTrue(whitenotes[i] == w, @"");
+            STAssertTrue(accids[i] == accid, @"");
+        }
+        [k1 release];
+        [k2 release];
+    }
+    STAssertTrue([WhiteNote allocWithLetter:WhiteNote_C andOctave:4] == [WhiteNote middleC], @"");
+    [measures release];
+}
+
 @end  /* KeySignature test */
 
 
@@ -1992,6 +3346,7 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
 }
 - (void)testStartTimes;
 - (void)testGetExtraWidth;
+- (void)testManyTracks;
 @end
 
 @implementation SymbolWidthsTest
@@ -2083,6 +3438,68 @@ static int varlen(u_char b1, u_char b2, u_char b3, u_char b4) {
 
 }
 
+/* Create 20 tracks of random symbols, where some tracks have several
+ * symbols at the same start time.  Verify that the start times are
+ * the sorted union of all the tracks' start times, and that
+ * getExtraWidth() matches the widths computed directly.
+ */
+- (void) testManyTracks {
+    int numtracks = 20;
+    int maxtime = 500;
+    int *tracktotal = (int*) calloc(numtracks * maxtime, sizeof(int));
+    int *maxwidth = (int*) calloc(maxtime, sizeof(int));
+    BOOL *used = (BOOL*) calloc(maxtime, sizeof(BOOL));
+
+    srandom(11);
+    Array* tracks = [Array new:numtracks];
+    for (int track = 0; track < numtracks; track++) {
+        Array *symbols = [Array new:100];
+        int time = random() % 20;
+        while (time < maxtime) {
+            int width = random() % 30;
+            TestSymbol *t = [[TestSymbol alloc] initWithTime:time andWidth:width];
+            [symbols add:t];
+            [t release];
+            tracktotal[track*maxtime + time] += width;
+            used[time] = YES;
+            if (random() % 4 != 0) {
+                time += 1 + random() % 20;
+            }
+        }
+        [tracks add:symbols];
+    }
+    for (int track = 0; track < numtracks; track++) {
+        for (int time = 0; time < maxtime; time++) {
+            if (maxwidth[time] < tracktotal[track*maxtime + time]) {
+                maxwidth[time] = tracktotal[track*maxtime + time];
+            }
+        }
+    }
+
+    SymbolWidths *s = [[SymbolWidths alloc] initWithSymbols:tracks andLyrics:nil];
+    IntArray* starttimes = [s startTimes];
+    int index = 0;
+    for (int time = 0; time < maxtime; time++) {
+        if (used[time]) {
+            STAssertTrue([starttimes get:index] == time, @"");
+            index++;
+        }
+    }
+    STAssertTrue([starttimes count] == index, @"");
+
+    for (int track = 0; track < numtracks; track++) {
+        for (int i = 0; i < [starttimes count]; i++) {
+            int time = [starttimes get:i];
+            int extra = [s getExtraWidth:track forTime:time];
+            STAssertTrue(extra == maxwidth[time] - tracktotal[track*maxtime + time], @"");
+        }
+    }
+    [s release];
+    free(tracktotal);
+    free(maxwidth);
+    free(used);
+}
+
 @end  /* SymbolWidthsTest */
 
 
@@ -2105,13 +3522,9 @@ static int F4 = 65;
  * Verify that all the clefs are treble clefs.
  */
 - (void) testAllTreble {
-    Array* notes = [Array new:100];
+    NoteArray *notes = [NoteArray new:100];
     for (int i = 0; i < 100; i++) {
-        MidiNote *note = [MidiNote alloc];
-        note.startTime = i*10;
-        note.number = middleC + (i % 5);
-        [notes add:note];
-        [note release];
+        [notes addNote:i*10 channel:0 number:middleC + (i % 5) duration:0];
     }
     ClefMeasures *clefs = [[ClefMeasures alloc] initWithNotes:notes andMeasure:40 ];
     for (int i = 0; i < 100; i++) {
@@ -2125,13 +3538,9 @@ static int F4 = 65;
  * Verify that all the clefs are bass clefs.
  */
 - (void) testAllBass {
-    Array* notes = [Array new:100];
+    NoteArray *notes = [NoteArray new:100];
     for (int i = 0; i < 100; i++) {
-        MidiNote *note = [MidiNote alloc];
-        note.startTime = i*10;
-        note.number = middleC - (i % 5);
-        [notes add:note];
-        [note release];
+        [notes addNote:i*10 channel:0 number:middleC - (i % 5) duration:0];
     }
     ClefMeasures *clefs = [[ClefMeasures alloc] initWithNotes:notes andMeasure:40 ];
     for (int i = 0; i < 100; i++) {
@@ -2148,27 +3557,15 @@ static int F4 = 65;
  * - notes in between G3 and F4 are treble clef.
  */
 - (void) testMainClefTreble {
-    Array* notes = [Array new:100];
+    NoteArray *notes = [NoteArray new:100];
     for (int i = 0; i < 100; i++) {
-        MidiNote *note = [MidiNote alloc];
-        note.startTime = i*10;
-        note.number = F4 + (i % 20);
-        [notes add:note];
-        [note release];
+        [notes addNote:i*10 channel:0 number:F4 + (i % 20) duration:0];
     }
     for (int i = 100; i < 200; i++) {
-        MidiNote *note = [MidiNote alloc];
-        note.startTime = i*10;
-        note.number = G3 - (i % 2);
-        [notes add:note];
-        [note release];
+        [notes addNote:i*10 channel:0 number:G3 - (i % 2) duration:0];
     }
     for (int i = 200; i < 300; i++) {
-        MidiNote *note = [MidiNote alloc];
-        note.startTime = i*10;
-        note.number = middleC - (i % 2);
-        [notes add:note];
-        [note release];
+        [notes addNote:i*10 channel:0 number:middleC - (i % 2) duration:0];
     }
     ClefMeasures *clefs = [[ClefMeasures alloc] initWithNotes:notes andMeasure:50 ];
     for (int i = 0; i < 100; i++) {
@@ -2193,27 +3590,15 @@ static int F4 = 65;
  * - notes in between G3 and F4 are bass clef.
  */
 - (void) testMainClefBass {
-    Array* notes = [Array new:100];
+    NoteArray *notes = [NoteArray new:100];
     for (int i = 0; i < 100; i++) {
-        MidiNote *note = [MidiNote alloc];
-        note.startTime = i*10;
-        note.number = F4 + (i % 2);
-        [notes add:note];
-        [note release];
+        [notes addNote:i*10 channel:0 number:F4 + (i % 2) duration:0];
     }
     for (int i = 100; i < 200; i++) {
-        MidiNote *note = [MidiNote alloc];
-        note.startTime = i*10;
-        note.number = G3 - (i % 20);
-        [notes add:note];
-        [note release];
+        [notes addNote:i*10 channel:0 number:G3 - (i % 20) duration:0];
     }
     for (int i = 200; i < 300; i++) {
-        MidiNote *note = [MidiNote alloc];
-        note.startTime = i*10;
-        note.number = middleC + (i % 2);
-        [notes add:note];
-        [note release];
+        [notes addNote:i*10 channel:0 number:middleC + (i % 2) duration:0];
     }
     ClefMeasures *clefs = [[ClefMeasures alloc] initWithNotes:notes andMeasure:50 ];
     for (int i = 0; i < 100; i++) {
@@ -2233,6 +3618,464 @@ static int F4 = 65;
 @end  /* ClefMeasuresTest */
 
 
+/* Test cases for the KeyMeasures class */
+@interface KeyMeasuresTest :SenTestCase {
+}
+- (MidiTrack*)createTrack:(int*)keys measures:(int)nummeasures;
+- (void)testSingleKey;
+- (void)testKeyChange;
+@end
+
+@implementation KeyMeasuresTest
+
+/* Create a track with 4 or 6 notes in each measure (400 pulses).
+ * Where keys[m] is 0, the measure has the notes C, D, F, G.
+ * Where keys[m] is 4, the measure has the notes E, F#, G#, B, C#, D#.
+ */
+- (MidiTrack*)createTrack:(int*)keys measures:(int)nummeasures {
+    int cmajor[] = { 60, 62, 65, 67 };
+    int emajor[] = { 64, 66, 68, 71, 73, 75 };
+    MidiTrack *track = [[MidiTrack alloc] initWithTrack:1];
+    for (int m = 0; m < nummeasures; m++) {
+        int *notes = (keys[m] == 0) ? cmajor : emajor;
+        int n = (keys[m] == 0) ? 4 : 6;
+        for (int i = 0; i < n; i++) {
+            [track addNote:(m*400 + i*60) channel:0 number:notes[i] duration:60];
+        }
+    }
+    return [track autorelease];
+}
+
+/* Test that a song in a single key has a single section */
+- (void)testSingleKey {
+    int keys[32];
+    for (int m = 0; m < 32; m++) {
+        keys[m] = 0;
+    }
+    Array *tracks = [Array new:1];
+    [tracks add:[self createTrack:keys measures:32]];
+    MeasureMap *map = [[MeasureMap alloc] initWithMeasure:400];
+    KeyMeasures *keymeasures = [[KeyMeasures alloc] initWithTracks:tracks andMeasures:map];
+
+    STAssertTrue([keymeasures count] == 1, @"");
+    STAssertTrue([keymeasures startOfSection:0] == 0, @"");
+    KeySignature *key = [keymeasures getKey:12345];
+    STAssertTrue([key num_sharps] == 0 && [key num_flats] == 0, @"");
+    [keymeasures release];
+    [map release];
+}
+
+/* Test a song with 16 measures of C major followed by 16 measures
+ * of E major.  The second section should start at measure 16.
+ */
+- (void)testKeyChange {
+    int keys[32];
+    for (int m = 0; m < 32; m++) {
+        keys[m] = (m < 16) ? 0 : 4;
+    }
+    Array *tracks = [Array new:1];
+    [tracks add:[self createTrack:keys measures:32]];
+    MeasureMap *map = [[MeasureMap alloc] initWithMeasure:400];
+    KeyMeasures *keymeasures = [[KeyMeasures alloc] initWithTracks:tracks andMeasures:map];
+
+    STAssertTrue([keymeasures count] == 2, @"");
+    STAssertTrue([keymeasures startOfSection:1] == 16*400, @"");
+    STAssertTrue([keymeasures sectionForTime:(16*400 - 1)] == 0, @"");
+    STAssertTrue([keymeasures sectionForTime:(16*400)] == 1, @"");
+
+    KeySignature *key = [keymeasures getKey:0];
+    STAssertTrue([key num_sharps] == 0 && [key num_flats] == 0, @"");
+    key = [keymeasures getKey:(20*400)];
+    STAssertTrue([key num_sharps] == 4, @"");
+    [keymeasures release];
+    [map release];
+}
+
+@end  /* KeyMeasuresTest */
+
+
+
+/* ClefMeasures that use the treble clef until the given time, and
+ * the bass clef after it.
+ */
+@interface FixedClefs : ClefMeasures {
+    int bassStart;
+}
+-(id)initWithBassAt:(int)starttime;
+@end
+
+@implementation FixedClefs
+- (id)initWithBassAt:(int)starttime {
+    bassStart = starttime;
+    return self;
+}
+- (int)getClef:(int)starttime {
+    return (starttime >= bassStart) ? Clef_Bass : Clef_Treble;
+}
+@end
+
+/* KeyMeasures with two sections: C major, and D major from the
+ * given time on.
+ */
+@interface FixedKeys : KeyMeasures {
+    KeySignature *first;
+    KeySignature *second;
+    int secondStart;
+}
+-(id)initWithSecondAt:(int)starttime;
+@end
+
+@implementation FixedKeys
+- (id)initWithSecondAt:(int)starttime {
+    first = [[KeySignature alloc] initWithSharps:0 andFlats:0];
+    second = [[KeySignature alloc] initWithSharps:2 andFlats:0];
+    secondStart = starttime;
+    return self;
+}
+- (void)dealloc {
+    [first release];
+    [second release];
+    [super dealloc];
+}
+- (int)count {
+    return 2;
+}
+- (KeySignature*)keyAtSection:(int)index {
+    return (index == 0) ? first : second;
+}
+- (int)startOfSection:(int)index {
+    return (index == 0) ? 0 : secondStart;
+}
+@end
+
+
+/* Test cases for the SheetMusic class */
+@interface SheetMusicTest :SenTestCase {
+}
+- (void)testCreateSymbols;
+- (void)testCreateSymbolsAtOneBar;
+- (void)testCreateSymbolChanges;
+- (void)testLayoutCache;
+@end
+
+@implementation SheetMusicTest
+
+/* Create the symbols for two measures of 4/4 time, with a quarter
+ * note at 0 and an eighth note at 1000.  Verify the symbols are
+ * - The time signature and the first bar
+ * - The quarter note, a dotted quarter rest (a quarter and an eighth
+ *   rest), the eighth note, and a quarter rest
+ * - The bar, a whole rest for the empty measure, and the final bar
+ */
+- (void)testCreateSymbols {
+    [SheetMusic setNoteSize:NO];
+    SheetMusic *sheet = [[SheetMusic alloc] initWithFrame:NSMakeRect(0, 0, 100, 100)];
+    TimeSignature *time = [[TimeSignature alloc] initWithNumerator:4
+                            andDenominator:4 andQuarter:400 andTempo:500000];
+    MeasureMap *measures = [[MeasureMap alloc] initWithTime:time];
+    MidiTrack *track = [[MidiTrack alloc] initWithTrack:1];
+    [track addNote:0 channel:0 number:72 duration:400];
+    [track addNote:1000 channel:0 number:74 duration:200];
+
+    KeySignature *key = [[KeySignature alloc] initWithSharps:0 andFlats:0];
+    KeyMeasures *keys = [[KeyMeasures alloc] initWithKey:key andMeasures:measures];
+    ClefMeasures *clefs = [[ClefMeasures alloc] initWithNotes:track.notes andMeasures:measures];
+    Array *chords = [sheet createChords:track.notes withKeys:keys andTime:time
+                           andMeasures:measures andClefs:clefs];
+    Array *symbols = [sheet createSymbols:chords withClefs:clefs andKeys:keys
+                            andTime:time andMeasures:measures andLastTime:3200];
+
+    Class kinds[] = {
+        [TimeSigSymbol class], [BarSymbol class], [ChordSymbol class],
+        [RestSymbol class], [RestSymbol class], [ChordSymbol class],
+        [RestSymbol class], [BarSymbol class], [RestSymbol class], [BarSymbol class]
+    };
+    int starttimes[] = { -1, 0, 0, 400, 800, 1000, 1200, 1600, 1600, 3200 };
+    STAssertTrue([symbols count] == 10, @"");
+    for (int i = 0; i < 10 && i < [symbols count]; i++) {
+        id<MusicSymbol> symbol = [symbols get:i];
+        STAssertTrue([symbol isKindOfClass:kinds[i]], @"");
+        STAssertTrue(symbol.startTime == starttimes[i], @"");
+    }
+    NoteDuration rests[] = { Quarter, Eighth, Quarter, Whole };
+    int restindex[] = { 3, 4, 6, 8 };
+    for (int i = 0; i < 4 && restindex[i] < [symbols count]; i++) {
+        NSString *s = [[symbols get:restindex[i]] description];
+        NSString *dur = [NSString stringWithFormat:@"duration=%d ", rests[i]];
+        STAssertTrue([s rangeOfString:dur].location != NSNotFound, @"");
+    }
+
+    [key release];
+    [keys release];
+    [clefs release];
+    [track release];
+    [measures release];
+    [time release];
+    [sheet release];
+}
+
+/* Create the symbols for a song in 4/4 time that changes to 3/4 time
+ * at 3200, where the clef also changes to bass and a new key section
+ * starts.  The notes are quarter notes at 0, 2000 and 3200.  Verify
+ * the symbols are
+ * - The rests from 400 to the bar at 1600 (a half and a quarter rest),
+ *   and a quarter rest from the bar to the note at 2000.
+ * - A half rest, then at 3200 the small clef, the bar, the key
+ *   signature and the time signature, in that order.
+ * - The note at 3200, a half rest, and the final bar at 4400.
+ */
+- (void)testCreateSymbolsAtOneBar {
+    [SheetMusic setNoteSize:NO];
+    SheetMusic *sheet = [[SheetMusic alloc] initWithFrame:NSMakeRect(0, 0, 100, 100)];
+    TimeSignature *time = [[TimeSignature alloc] initWithNumerator:4
+                            andDenominator:4 andQuarter:400 andTempo:500000];
+    TimeSignature *time2 = [[TimeSignature alloc] initWithNumerator:3
+                            andDenominator:4 andQuarter:400 andTempo:500000];
+    int pulses[] = { 0, 3200 };
+    Array *sigs = [Array new:2];
+    [sigs add:time];
+    [sigs add:time2];
+    MeasureMap *measures = [[MeasureMap alloc] initWithCount:2 pulses:pulses signatures:sigs];
+    STAssertTrue([measures startOfMeasure:3] == 4400, @"");
+
+    MidiTrack *track = [[MidiTrack alloc] initWithTrack:1];
+    [track addNote:0 channel:0 number:72 duration:400];
+    [track addNote:2000 channel:0 number:74 duration:400];
+    [track addNote:3200 channel:0 number:48 duration:400];
+
+    KeySignature *key = [[KeySignature alloc] initWithSharps:0 andFlats:0];
+    KeyMeasures *chordkeys = [[KeyMeasures alloc] initWithKey:key andMeasures:measures];
+    ClefMeasures *chordclefs = [[ClefMeasures alloc] initWithNotes:track.notes
+                                                     andMeasures:measures];
+    Array *chords = [sheet createChords:track.notes withKeys:chordkeys andTime:time
+                           andMeasures:measures andClefs:chordclefs];
+
+    FixedClefs *clefs = [[FixedClefs alloc] initWithBassAt:3200];
+    FixedKeys *keys = [[FixedKeys alloc] initWithSecondAt:3200];
+    Array *symbols = [sheet createSymbols:chords withClefs:clefs andKeys:keys
+                            andTime:time andMeasures:measures andLastTime:4400];
+
+    Class kinds[] = {
+        [TimeSigSymbol class], [BarSymbol class], [ChordSymbol class],
+        [RestSymbol class], [RestSymbol class], [BarSymbol class],
+        [RestSymbol class], [ChordSymbol class], [RestSymbol class],
+        [ClefSymbol class], [BarSymbol class], [KeySigSymbol class],
+        [TimeSigSymbol class], [ChordSymbol class], [RestSymbol class],
+        [BarSymbol class]
+    };
+    int starttimes[] = {
+        -1, 0, 0, 400, 1200, 1600, 1600, 2000, 2400,
+        3199, 3200, 3200, 3200, 3200, 3600, 4400
+    };
+    STAssertTrue([symbols count] == 16, @"");
+    for (int i = 0; i < 16 && i < [symbols count]; i++) {
+        id<MusicSymbol> symbol = [symbols get:i];
+        STAssertTrue([symbol isKindOfClass:kinds[i]], @"");
+        STAssertTrue(symbol.startTime == starttimes[i], @"");
+    }
+    NoteDuration rests[] = { Half, Quarter, Quarter, Half, Half };
+    int restindex[] = { 3, 4, 6, 8, 14 };
+    for (int i = 0; i < 5 && restindex[i] < [symbols count]; i++) {
+        NSString *s = [[symbols get:restindex[i]] description];
+        NSString *dur = [NSString stringWithFormat:@"duration=%d ", rests[i]];
+        STAssertTrue([s rangeOfString:dur].location != NSNotFound, @"");
+    }
+    if ([symbols count] == 16) {
+        ClefSymbol *clefsym = [symbols get:9];
+        STAssertTrue([[clefsym description] rangeOfString:@"small=1"].location != NSNotFound, @"");
+        TimeSigSymbol *sigsym = [symbols get:12];
+        STAssertEqualObjects([sigsym description],
+                             @"TimeSigSymbol numerator=3 denominator=4", @"");
+    }
+
+    [clefs release];
+    [keys release];
+    [key release];
+    [chordkeys release];
+    [chordclefs release];
+    [track release];
+    [measures release];
+    [time release];
+    [time2 release];
+    [sheet release];
+}
+
+/* Create the symbols for a track with rests, clef changes, a time
+ * signature change and a key change.  Verify that
+ * - There is a bar at the start of every measure, and a final bar.
+ * - A small clef comes just before each bar where the clef changes.
+ * - A key signature comes just after each bar where a key section
+ *   starts, and a time signature at the measure where the time
+ *   signature changes.
+ * - The start times never decrease.
+ */
+- (void)testCreateSymbolChanges {
+    [SheetMusic setNoteSize:NO];
+    SheetMusic *sheet = [[SheetMusic alloc] initWithFrame:NSMakeRect(0, 0, 100, 100)];
+    TimeSignature *time = [[TimeSignature alloc] initWithNumerator:4
+                            andDenominator:4 andQuarter:400 andTempo:500000];
+    TimeSignature *time2 = [[TimeSignature alloc] initWithNumerator:3
+                            andDenominator:4 andQuarter:400 andTempo:500000];
+    int pulses[] = { 0, 20*1600 };
+    Array *sigs = [Array new:2];
+    [sigs add:time];
+    [sigs add:time2];
+    MeasureMap *measures = [[MeasureMap alloc] initWithCount:2 pulses:pulses signatures:sigs];
+
+    int cmajor[] = { 60, 62, 65, 67 };
+    int emajor[] = { 66, 68, 73, 75 };
+    int offsets[] = { 0, 400, 1000, 1200 };
+    int durations[] = { 400, 200, 100, 400 };
+    MidiTrack *track = [[MidiTrack alloc] initWithTrack:1];
+    for (int m = 0; m < 32; m++) {
+        int *notes = (m < 16) ? cmajor : emajor;
+        int octave = (m % 4 < 2) ? 12 : -24;
+        for (int i = 0; i < 4; i++) {
+            if ((m % 3 == 0 && i == 2) || (m >= 20 && i == 3)) {
+                continue;
+            }
+            int start = [measures startOfMeasure:m] + offsets[i] * ((m < 20) ? 1 : 3) / 4;
+            [track addNote:start channel:0 number:(notes[i] + octave)
+                  duration:durations[i]];
+        }
+    }
+    Array *tracks = [Array new:1];
+    [tracks add:track];
+
+    KeyMeasures *keys = [[KeyMeasures alloc] initWithTracks:tracks andMeasures:measures];
+    ClefMeasures *clefs = [[ClefMeasures alloc] initWithNotes:track.notes andMeasures:measures];
+    Array *chords = [sheet createChords:track.notes withKeys:keys andTime:time
+                           andMeasures:measures andClefs:clefs];
+    int lastStartTime = [measures startOfMeasure:34];
+    Array *symbols = [sheet createSymbols:chords withClefs:clefs andKeys:keys
+                            andTime:time andMeasures:measures andLastTime:lastStartTime];
+    STAssertTrue([keys count] > 1, @"");
+
+    int bars = 0;
+    int clefchanges = 0;
+    int keychanges = 0;
+    int prevclef = [clefs getClef:0];
+    int section = 1;
+    int count = [symbols count];
+    for (int i = 0; i < count; i++) {
+        id<MusicSymbol> symbol = [symbols get:i];
+        if (i > 0) {
+            id<MusicSymbol> prev = [symbols get:i-1];
+            STAssertTrue(symbol.startTime >= prev.startTime, @"");
+        }
+        if ([symbol isKindOfClass:[ClefSymbol class]]) {
+            clefchanges++;
+        }
+        else if ([symbol isKindOfClass:[KeySigSymbol class]]) {
+            keychanges++;
+        }
+        if (![symbol isKindOfClass:[BarSymbol class]]) {
+            continue;
+        }
+        int starttime = symbol.startTime;
+        STAssertTrue(starttime == [measures startOfMeasure:bars], @"");
+        bars++;
+
+        int clef = [clefs getClef:starttime];
+        ClefSymbol *clefsym = (i > 0) ? [symbols get:i-1] : nil;
+        BOOL hasclef = [clefsym isKindOfClass:[ClefSymbol class]];
+        STAssertTrue(hasclef == (clef != prevclef), @"");
+        if (hasclef) {
+            STAssertTrue(clefsym.startTime == starttime - 1, @"");
+        }
+        prevclef = clef;
+
+        int next = i+1;
+        if (section < [keys count] && [keys startOfSection:section] == starttime) {
+            STAssertTrue(next < count && [[symbols get:next] isKindOfClass:[KeySigSymbol class]], @"");
+            section++;
+            next++;
+        }
+        if (starttime == 20*1600) {
+            STAssertTrue(next < count && [[symbols get:next] isKindOfClass:[TimeSigSymbol class]], @"");
+        }
+    }
+    STAssertTrue(bars == 35, @"");
+    STAssertTrue(clefchanges > 0, @"");
+    STAssertTrue(keychanges == [keys count] - 1, @"");
+
+    [keys release];
+    [clefs release];
+    [track release];
+    [measures release];
+    [time release];
+    [time2 release];
+    [sheet release];
+}
+
+/* Create the sheet music for a song with beamed eighth notes and a
+ * lyric, from a MidiFile with an empty ScoreCache.  Verify that
+ * - The layout is stored in the cache, next to the parsed song.
+ * - The second SheetMusic, loaded from the cache, has the same layout.
+ * - Reading the layout back gives the same layout, with the same
+ *   stem pairs.
+ * - A truncated layout is rejected.
+ */
+- (void)testLayoutCache {
+    u_char data[] = {
+        77, 84, 104, 100, 0, 0, 0, 6, 0, 1, 0, 1, 0, 240,
+        77, 84, 114, 107, 0, 0, 0, 74,
+        0,  MetaEvent, MetaEventLyric, 2, 'L', 'a',
+        0,  EventNoteOn, 60, 80,  120, EventNoteOff, 60, 0,
+        0,  EventNoteOn, 62, 80,  120, EventNoteOff, 62, 0,
+        0,  EventNoteOn, 64, 80,  120, EventNoteOff, 64, 0,
+        0,  EventNoteOn, 65, 80,  120, EventNoteOff, 65, 0,
+        0,  EventNoteOn, 67, 80,  120, EventNoteOff, 67, 0,
+        0,  EventNoteOn, 69, 80,  120, EventNoteOff, 69, 0,
+        0,  EventNoteOn, 71, 80,  120, EventNoteOff, 71, 0,
+        0,  EventNoteOn, 72, 80,  120, EventNoteOff, 72, 0,
+        0,  MetaEvent, MetaEventEndOfTrack, 0
+    };
+
+    NSString *dir = [NSTemporaryDirectory() stringByAppendingPathComponent:
+                     [NSString stringWithFormat:@"LayoutCacheTest%d", getpid()]];
+    ScoreCache *cache = [[ScoreCache alloc] initWithDirectory:dir];
+    NSData *nsdata = [NSData dataWithBytes:data length:sizeof(data)];
+    MidiFileReader *reader = [[MidiFileReader alloc] initWithData:nsdata];
+    MidiFile *midifile = [[MidiFile alloc] initWithReader:reader andFilename:testfile
+                                                 andCache:cache];
+    MidiOptions *options = [[MidiOptions alloc] initFromMidi:midifile];
+    options.showLyrics = YES;
+
+    SheetMusic *cold = [[SheetMusic alloc] initWithFile:midifile andOptions:options];
+    NSData *layout = [cold layoutData];
+    STAssertTrue(layout != nil, @"");
+    NSArray *entries = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:dir
+                                                                          error:NULL];
+    STAssertTrue([entries count] == 2, @"");
+
+    SheetMusic *warm = [[SheetMusic alloc] initWithFile:midifile andOptions:options];
+    STAssertEqualObjects([warm layoutData], layout, @"");
+
+    SheetMusic *sheet = [[SheetMusic alloc] initWithFrame:NSMakeRect(0, 0, 100, 100)];
+    reader = [[MidiFileReader alloc] initWithData:layout];
+    STAssertTrue([sheet readLayout:reader withMeasures:midifile.measuremap], @"");
+    STAssertEqualObjects([sheet layoutData], layout, @"");
+    [reader release];
+    [sheet release];
+
+    sheet = [[SheetMusic alloc] initWithFrame:NSMakeRect(0, 0, 100, 100)];
+    reader = [[MidiFileReader alloc] initWithData:
+              [layout subdataWithRange:NSMakeRange(0, [layout length] / 2)]];
+    STAssertTrue(![sheet readLayout:reader withMeasures:midifile.measuremap], @"");
+    [reader release];
+    [sheet release];
+
+    [cold release];
+    [warm release];
+    [options release];
+    [midifile release];
+    [cache release];
+    [[NSFileManager defaultManager] removeItemAtPath:dir error:NULL];
+}
+
+@end  /* SheetMusicTest */
+
 
 /* Test cases for the ChordSymbol class */
 @interface ChordSymbolTest :SenTestCase {
@@ -2268,23 +4111,13 @@ static int F4 = 65;
 
     int num1 = [WhiteNote bottomTreble].number;
     int num2 = num1 + 2;
-    MidiNote *note1 = [MidiNote alloc];
-    note1.startTime = 0; 
-    note1.number = num1;
-    note1.duration = quarter;
-    MidiNote *note2 = [MidiNote alloc];
-    note2.startTime = 0; 
-    note2.number = num2;
-    note2.duration = quarter;
-
-    Array *notes = [Array new:2];
-    [notes add:note1];
-    [notes add:note2];
-    [note1 release];
-    [note2 release];
+
+    NoteArray *notes = [NoteArray new:2];
+    [notes addNote:0 channel:0 number:num1 duration:quarter];
+    [notes addNote:0 channel:0 number:num2 duration:quarter];
 
     ChordSymbol *chord = [[ChordSymbol alloc]
-                          initWithNotes:notes andKey:key
+                          initWithNotes:[notes view] andKey:key
                           andTime:time  andClef:Clef_Treble andSheet:nil];
     STAssertEqualObjects([chord description], 
                     @"ChordSymbol clef=Treble start=0 end=400 width=16 hasTwoStems=0 Note whitenote=F4 duration=Quarter leftside=1 Note whitenote=G4 duration=Quarter leftside=0 Stem duration=Quarter direction=1 top=G4 bottom=F4 end=F5 overlap=1 side=2 width_to_pair=0 receiver=0 ", @"");
@@ -2310,23 +4143,13 @@ static int F4 = 65;
                              andQuarter:quarter  andTempo:60000];
     int num2 = [WhiteNote topTreble].number;
     int num1 = num2 - 2;
-    MidiNote *note1 = [MidiNote alloc];
-    note1.startTime = 0; 
-    note1.number = num1;
-    note1.duration = quarter;
-    MidiNote *note2 = [MidiNote alloc];
-    note2.startTime = 0; 
-    note2.number = num2;
-    note2.duration = quarter;
-
-    Array *notes = [Array new:2];
-    [notes add:note1];
-    [notes add:note2];
-    [note1 release];
-    [note2 release];
+
+    NoteArray *notes = [NoteArray new:2];
+    [notes addNote:0 channel:0 number:num1 duration:quarter];
+    [notes addNote:0 channel:0 number:num2 duration:quarter];
 
     ChordSymbol *chord = [[ChordSymbol alloc]
-                          initWithNotes:notes andKey:key
+                          initWithNotes:[notes view] andKey:key
                           andTime:time  andClef:Clef_Treble andSheet:nil];
     STAssertEqualObjects([chord description],
                     @"ChordSymbol clef=Treble start=0 end=400 width=16 hasTwoStems=0 Note whitenote=D5 duration=Quarter leftside=1 Note whitenote=E5 duration=Quarter leftside=0 Stem duration=Quarter direction=2 top=E5 bottom=D5 end=E4 overlap=1 side=2 width_to_pair=0 receiver=0 ", @"");
@@ -2352,23 +4175,13 @@ static int F4 = 65;
                              andQuarter:quarter  andTempo:60000];
     int num1 = [WhiteNote bottomBass].number;
     int num2 = num1 + 2;
-    MidiNote *note1 = [MidiNote alloc];
-    note1.startTime = 0; 
-    note1.number = num1;
-    note1.duration = quarter;
-    MidiNote *note2 = [MidiNote alloc];
-    note2.startTime = 0; 
-    note2.number = num2;
-    note2.duration = quarter;
-
-    Array *notes = [Array new:2];
-    [notes add:note1];
-    [notes add:note2];
-    [note1 release];
-    [note2 release];
+
+    NoteArray *notes = [NoteArray new:2];
+    [notes addNote:0 channel:0 number:num1 duration:quarter];
+    [notes addNote:0 channel:0 number:num2 duration:quarter];
 
     ChordSymbol *chord = [[ChordSymbol alloc]
-                          initWithNotes:notes andKey:key
+                          initWithNotes:[notes view] andKey:key
                           andTime:time  andClef:Clef_Bass andSheet:nil];
     STAssertEqualObjects([chord description],
                     @"ChordSymbol clef=Bass start=0 end=400 width=16 hasTwoStems=0 Note whitenote=A3 duration=Quarter leftside=1 Note whitenote=B3 duration=Quarter leftside=0 Stem duration=Quarter direction=1 top=B3 bottom=A3 end=A4 overlap=1 side=2 width_to_pair=0 receiver=0 ", @"");
@@ -2394,24 +4207,14 @@ static int F4 = 65;
                              andQuarter:quarter  andTempo:60000];
     int num2 = [WhiteNote topBass].number;
     int num1 = num2 - 2;
-    MidiNote *note1 = [MidiNote alloc];
-    note1.startTime = 0; 
-    note1.number = num1;
-    note1.duration = quarter;
-    MidiNote *note2 = [MidiNote alloc];
-    note2.startTime = 0; 
-    note2.number = num2;
-    note2.duration = quarter;
-
-    Array *notes = [Array new:2];
-    [notes add:note1];
-    [notes add:note2];
-    [note1 release];
-    [note2 release];
+
+    NoteArray *notes = [NoteArray new:2];
+    [notes addNote:0 channel:0 number:num1 duration:quarter];
+    [notes addNote:0 channel:0 number:num2 duration:quarter];
 
 
     ChordSymbol *chord = [[ChordSymbol alloc]
-                          initWithNotes:notes andKey:key
+                          initWithNotes:[notes view] andKey:key
                           andTime:time  andClef:Clef_Bass andSheet:nil];
 
     STAssertEqualObjects([chord description],
@@ -2438,17 +4241,12 @@ static int F4 = 65;
                              initWithNumerator:4 andDenominator:4
                              andQuarter:quarter  andTempo:60000];
     int num1 = [WhiteNote bottomTreble].number;
-    MidiNote *note1 = [MidiNote alloc];
-    note1.startTime = 0; 
-    note1.number = num1;
-    note1.duration = quarter/4;
 
-    Array *notes = [Array new:1];
-    [notes add:note1];
-    [note1 release];
+    NoteArray *notes = [NoteArray new:1];
+    [notes addNote:0 channel:0 number:num1 duration:quarter/4];
 
     ChordSymbol *chord = [[ChordSymbol alloc]
-                          initWithNotes:notes andKey:key
+                          initWithNotes:[notes view] andKey:key
                           andTime:time  andClef:Clef_Treble andSheet:nil];
     STAssertEqualObjects([chord description],
                     @"ChordSymbol clef=Treble start=0 end=100 width=16 hasTwoStems=0 Note whitenote=F4 duration=Sixteenth leftside=1 Stem duration=Sixteenth direction=1 top=F4 bottom=F4 end=G5 overlap=0 side=2 width_to_pair=0 receiver=0 ", @"");
@@ -2474,17 +4272,12 @@ static int F4 = 65;
                              initWithNumerator:4 andDenominator:4
                              andQuarter:quarter  andTempo:60000];
     int num1 = [WhiteNote bottomTreble].number;
-    MidiNote *note1 = [MidiNote alloc];
-    note1.startTime = 0; 
-    note1.number = num1;
-    note1.duration = quarter*4;
 
-    Array *notes = [Array new:1];
-    [notes add:note1];
-    [note1 release];
+    NoteArray *notes = [NoteArray new:1];
+    [notes addNote:0 channel:0 number:num1 duration:quarter*4];
 
     ChordSymbol *chord = [[ChordSymbol alloc]
-                          initWithNotes:notes andKey:key
+                          initWithNotes:[notes view] andKey:key
                           andTime:time  andClef:Clef_Treble andSheet:nil];
     STAssertEqualObjects([chord description],
                     @"ChordSymbol clef=Treble start=0 end=1600 width=16 hasTwoStems=0 Note whitenote=F4 duration=Whole leftside=1 ", @"");
@@ -2510,23 +4303,13 @@ static int F4 = 65;
                              andQuarter:quarter  andTempo:60000];
     int num1 = [WhiteNote bottomTreble].number;
     int num2 = num1 + 1;
-    MidiNote *note1 = [MidiNote alloc];
-    note1.startTime = 0; 
-    note1.number = num1;
-    note1.duration = quarter;
-    MidiNote *note2 = [MidiNote alloc];
-    note2.startTime = 0; 
-    note2.number = num2;
-    note2.duration = quarter;
-
-    Array *notes = [Array new:2];
-    [notes add:note1];
-    [notes add:note2];
-    [note1 release];
-    [note2 release];
+
+    NoteArray *notes = [NoteArray new:2];
+    [notes addNote:0 channel:0 number:num1 duration:quarter];
+    [notes addNote:0 channel:0 number:num2 duration:quarter];
 
     ChordSymbol *chord = [[ChordSymbol alloc]
-                          initWithNotes:notes andKey:key
+                          initWithNotes:[notes view] andKey:key
                           andTime:time  andClef:Clef_Treble andSheet:nil];
     STAssertEqualObjects([chord description],
                     @"ChordSymbol clef=Treble start=0 end=400 width=25 hasTwoStems=0 AccidSymbol accid=Sharp whitenote=F4 clef=Treble width=9 Note whitenote=F4 duration=Quarter leftside=1 Note whitenote=F4 duration=Quarter leftside=1 Stem duration=Quarter direction=1 top=F4 bottom=F4 end=E5 overlap=0 side=2 width_to_pair=0 receiver=0 ", @"");
@@ -2553,23 +4336,13 @@ static int F4 = 65;
                              andQuarter:quarter  andTempo:60000];
     int num1 = [WhiteNote topTreble].number;
     int num2 = num1 + 1;
-    MidiNote *note1 = [MidiNote alloc];
-    note1.startTime = 0; 
-    note1.number = num1;
-    note1.duration = quarter;
-    MidiNote *note2 = [MidiNote alloc];
-    note2.startTime = 0; 
-    note2.number = num2;
-    note2.duration = quarter;
-
-    Array *notes = [Array new:2];
-    [notes add:note1];
-    [notes add:note2];
-    [note1 release];
-    [note2 release];
+
+    NoteArray *notes = [NoteArray new:2];
+    [notes addNote:0 channel:0 number:num1 duration:quarter];
+    [notes addNote:0 channel:0 number:num2 duration:quarter];
 
     ChordSymbol *chord = [[ChordSymbol alloc]
-                          initWithNotes:notes andKey:key
+                          initWithNotes:[notes view] andKey:key
                           andTime:time  andClef:Clef_Treble andSheet:nil];
     STAssertEqualObjects([chord description],
                     @"ChordSymbol clef=Treble start=0 end=400 width=16 hasTwoStems=0 Note whitenote=E5 duration=Quarter leftside=1 Note whitenote=F5 duration=Quarter leftside=0 Stem duration=Quarter direction=2 top=F5 bottom=E5 end=F4 overlap=1 side=2 width_to_pair=0 receiver=0 ", @"");
@@ -2596,23 +4369,13 @@ static int F4 = 65;
                              andQuarter:quarter  andTempo:60000];
     int num1 = [WhiteNote bottomTreble].number;
     int num2 = num1 + 2;
-    MidiNote *note1 = [MidiNote alloc];
-    note1.startTime = 0; 
-    note1.number = num1;
-    note1.duration = quarter;
-    MidiNote *note2 = [MidiNote alloc];
-    note2.startTime = 0; 
-    note2.number = num2;
-    note2.duration = quarter/2;
-
-    Array *notes = [Array new:2];
-    [notes add:note1];
-    [notes add:note2];
-    [note1 release];
-    [note2 release];
+
+    NoteArray *notes = [NoteArray new:2];
+    [notes addNote:0 channel:0 number:num1 duration:quarter];
+    [notes addNote:0 channel:0 number:num2 duration:quarter/2];
 
     ChordSymbol *chord = [[ChordSymbol alloc]
-                          initWithNotes:notes andKey:key
+                          initWithNotes:[notes view] andKey:key
                           andTime:time  andClef:Clef_Treble andSheet:nil];
     STAssertEqualObjects([chord description],
                     @"ChordSymbol clef=Treble start=0 end=400 width=16 hasTwoStems=1 Note whitenote=F4 duration=Quarter leftside=1 Note whitenote=G4 duration=Eighth leftside=0 Stem duration=Quarter direction=2 top=F4 bottom=F4 end=G3 overlap=0 side=1 width_to_pair=0 receiver=0 Stem duration=Eighth direction=1 top=G4 bottom=G4 end=F5 overlap=1 side=2 width_to_pair=0 receiver=0 ", @"");
@@ -2639,23 +4402,13 @@ static int F4 = 65;
                              andQuarter:quarter  andTempo:60000];
     int num1 = [WhiteNote bottomTreble].number + 1;
     int num2 = num1 + 2;
-    MidiNote *note1 = [MidiNote alloc];
-    note1.startTime = 0; 
-    note1.number = num1;
-    note1.duration = quarter;
-    MidiNote *note2 = [MidiNote alloc];
-    note2.startTime = 0; 
-    note2.number = num2;
-    note2.duration = quarter;
-
-    Array *notes = [Array new:2];
-    [notes add:note1];
-    [notes add:note2];
-    [note1 release];
-    [note2 release];
+
+    NoteArray *notes = [NoteArray new:2];
+    [notes addNote:0 channel:0 number:num1 duration:quarter];
+    [notes addNote:0 channel:0 number:num2 duration:quarter];
 
     ChordSymbol *chord = [[ChordSymbol alloc]
-                          initWithNotes:notes andKey:key
+                          initWithNotes:[notes view] andKey:key
                           andTime:time  andClef:Clef_Treble andSheet:nil];
     STAssertEqualObjects([chord description],
                    @"ChordSymbol clef=Treble start=0 end=400 width=34 hasTwoStems=0 AccidSymbol accid=Sharp whitenote=F4 clef=Treble width=9 AccidSymbol accid=Sharp whitenote=G4 clef=Treble width=9 Note whitenote=F4 duration=Quarter leftside=1 Note whitenote=G4 duration=Quarter leftside=0 Stem duration=Quarter direction=1 top=G4 bottom=F4 end=F5 overlap=1 side=2 width_to_pair=0 receiver=0 ", @"");
@@ -11,6 +11,9 @@
  */
 #import <Foundation/NSObject.h>
 #import <Foundation/NSString.h>
+#import <Foundation/NSData.h>
+
+@class MidiFileReader;
 
 
 /** Enumeration of the notes in a scale (A, A#, ... G#) */
@@ -70,10 +73,12 @@ BOOL notescale_is_black_key(int notescale);
 +(WhiteNote*)bottom:(int)c;
 +(WhiteNote*)max:(WhiteNote*)x and:(WhiteNote*)y;
 +(WhiteNote*)min:(WhiteNote*)x and:(WhiteNote*)y;
++(WhiteNote*)readLayout:(MidiFileReader*)reader;
 -(id)initWithLetter:(int)a andOctave:(int)o;
 -(int)dist:(WhiteNote*)w;
 -(WhiteNote*)add:(int)amount;
 +(int)compare:(WhiteNote*)x and:(WhiteNote*)y;
+-(void)appendLayout:(NSMutableData*)data;
 
 @end
 
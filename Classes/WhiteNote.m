@@ -15,6 +15,9 @@
 #import "WhiteNote.h"
 #import "ClefSymbol.h"
 #import "KeySignature.h"
+#import "MidiFileReader.h"
+#import "MidiFileException.h"
+#import "ScoreCache.h"
 #include <assert.h>
 
 
@@ -52,6 +55,12 @@ static WhiteNote* _bottomTreble = nil;
 static WhiteNote* _bottomBass = nil;
 static WhiteNote* _middleC = nil;
 
+/* The number of octaves in the table of shared white notes */
+#define WhiteNoteOctaves 14
+
+/** The shared white notes, indexed by octave*7 + letter */
+static WhiteNote* whitenotes[7 * WhiteNoteOctaves];
+
 /** @class WhiteNote
  * The WhiteNote class represents a white key note, a non-sharp,
  * non-flat note.  To display midi notes as sheet music, the notes
@@ -61,12 +70,40 @@ static WhiteNote* _middleC = nil;
  * The octave changes from G to A.  After G2 comes A3.  Middle-C is C4.
  *
  * The main operations are calculating distances between notes, and comparing notes.
+ *
+ * White notes are immutable, so a single WhiteNote is created for each
+ * letter and octave, and shared by every chord and accidental.
  */
 
 @implementation WhiteNote
 
-/** Create a new note with the given letter and octave. */
+/** Create the table of shared white notes */
++ (void)initialize {
+    if (self != [WhiteNote class]) {
+        return;
+    }
+    for (int octave = 0; octave < WhiteNoteOctaves; octave++) {
+        for (int letter = 0; letter < 7; letter++) {
+            whitenotes[octave*7 + letter] =
+                [[WhiteNote alloc] initWithLetter:letter andOctave:octave];
+        }
+    }
+    /* Set the common notes now, since chords are created on several threads */
+    [WhiteNote topTreble];
+    [WhiteNote bottomTreble];
+    [WhiteNote topBass];
+    [WhiteNote bottomBass];
+    [WhiteNote middleC];
+}
+
+/** Return the note with the given letter and octave.  Notes in the
+ * table are shared, so no new object is created.
+ */
 +(id)allocWithLetter:(int)a andOctave:(int)o {
+    assert(a >= 0 && a <= 6);
+    if (o >= 0 && o < WhiteNoteOctaves) {
+        return whitenotes[o*7 + a];
+    }
     WhiteNote *w = [WhiteNote alloc];
     [w initWithLetter:a andOctave:o];
     return [w autorelease];
@@ -219,6 +256,22 @@ static WhiteNote* _middleC = nil;
         return y;
 }
 
+/** Append this note to the layout cache data, as octave*7 + letter */
+- (void)appendLayout:(NSMutableData*)data {
+    appendInt(data, octave * 7 + letter);
+}
+
+/** Read a note appended by appendLayout: from the layout cache */
++(WhiteNote*)readLayout:(MidiFileReader*)reader {
+    int num = [reader readInt];
+    if (num < 0 || num >= 7 * WhiteNoteOctaves) {
+        MidiFileException *e = [MidiFileException init:@"Bad layout note"
+                                                offset:[reader offset]];
+        @throw e;
+    }
+    return whitenotes[num];
+}
+
 /** Return the string <letter><octave> for this note. */
 - (NSString*) description {
     NSArray* letters = [NSArray arrayWithObjects: